@@ -0,0 +1,110 @@
+/**
+ * @file arrays.c
+ * @brief Benchmarks the shell's indexed and associative arrays.
+ *
+ * The shell is compiled straight into this program (with its `main`
+ * renamed), so the numbers come from the very same variable store the
+ * shell uses. Build and run it from the repository root:
+ *
+ *     cc -O2 -o bench_arrays bench/arrays.c
+ *     ./bench_arrays [elements]
+ *
+ * The default is one million elements. Each phase prints its total time
+ * and the average cost per operation.
+ */
+
+#define main shell_main
+#include "../shell.c"
+#undef main
+
+#include <time.h>
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Prints the result of one benchmark phase.
+ */
+static void report(const char *phase, double seconds, long operations)
+{
+    printf("%-28s %8.3f s  %8.1f ns/op\n", phase, seconds, seconds * 1e9 / operations);
+}
+
+int main(int argc, char **argv)
+{
+    long count = (argc > 1) ? atol(argv[1]) : 1000000;
+    char key[32];
+    char value[32];
+    double start;
+    size_t length;
+    long found = 0;
+
+    shell_variable *list = find_variable("list", 4, 1);
+    make_array(list, VAR_INDEXED);
+
+    start = now();
+    for (long i = 0; i < count; i++)
+    {
+        int n = snprintf(value, sizeof(value), "value%ld", i);
+        indexed_set(list->indexed, i, value, n);
+    }
+    report("indexed append", now() - start, count);
+
+    start = now();
+    for (long i = 0; i < count; i++)
+    {
+        int n = snprintf(key, sizeof(key), "%ld", (i * 7919) % count);
+        found += get_element(list, key, n, &length) != NULL;
+    }
+    report("indexed lookup (random)", now() - start, count);
+
+    shell_variable *map = find_variable("map", 3, 1);
+    make_array(map, VAR_ASSOC);
+
+    start = now();
+    for (long i = 0; i < count; i++)
+    {
+        int k = snprintf(key, sizeof(key), "key%ld", i);
+        int n = snprintf(value, sizeof(value), "value%ld", i);
+        assoc_set(map->assoc, key, k, value, n);
+    }
+    report("associative insert", now() - start, count);
+
+    start = now();
+    for (long i = 0; i < count; i++)
+    {
+        int k = snprintf(key, sizeof(key), "key%ld", (i * 7919) % count);
+        found += assoc_get(map->assoc, key, k) != NULL;
+    }
+    report("associative lookup (hit)", now() - start, count);
+
+    start = now();
+    for (long i = 0; i < count; i++)
+    {
+        int k = snprintf(key, sizeof(key), "nokey%ld", i);
+        found += assoc_get(map->assoc, key, k) != NULL;
+    }
+    report("associative lookup (miss)", now() - start, count);
+
+    // Expanding "${map[@]}" walks the entries in insertion order.
+    start = now();
+    size_t bytes = 0;
+    for (size_t i = 0; i < map->assoc->size; i++)
+    {
+        if (map->assoc->entries[i].key != NULL)
+        {
+            bytes += map->assoc->entries[i].length;
+        }
+    }
+    report("associative iteration", now() - start, count);
+
+    printf("(%ld lookups hit, %zu bytes iterated)\n", found, bytes);
+    return 0;
+}
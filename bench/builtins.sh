@@ -0,0 +1,48 @@
+#!/bin/sh
+# Measures what the utility built-ins save over the external programs.
+#
+# A script of N small commands (true, false, pwd, basename, dirname, seq,
+# kill -0, sleep 0) is fed to the shell twice: once as is, and once after
+# `enable -n` has switched the built-ins off so every command is forked
+# and exec'd. Run from the repository root:
+#
+#     cc -O2 -o shell shell.c
+#     sh bench/builtins.sh [./shell] [iterations]
+
+SHELL_BIN=${1:-./shell}
+N=${2:-2000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+i=0
+while [ "$i" -lt "$N" ]; do
+    echo "true"
+    echo "false"
+    echo "pwd"
+    echo "basename /usr/lib/libc.so.6 .6"
+    echo "dirname /usr/local/bin/tool"
+    echo "seq 1 10"
+    echo "kill -0 \$\$"
+    echo "sleep 0"
+    i=$((i + 1))
+done > "$WORK/commands"
+
+echo "enable -n true false pwd basename dirname seq kill sleep" > "$WORK/external"
+cat "$WORK/commands" >> "$WORK/external"
+
+run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" < "$1" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $(((end - start) / 1000000))
+}
+
+builtin_time=$(run "$WORK/commands")
+external_time=$(run "$WORK/external")
+commands=$((N * 8))
+[ "$builtin_time" -gt 0 ] || builtin_time=1
+
+echo "commands:  $commands"
+echo "built-in:  ${builtin_time} ms"
+echo "external:  ${external_time} ms"
+echo "speedup:   $((external_time * 10 / builtin_time / 10)).$((external_time * 10 / builtin_time % 10))x"
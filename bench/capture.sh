@@ -0,0 +1,45 @@
+#!/bin/sh
+# Measures what output capture (SHELL_CAPTURE) costs a command's throughput.
+#
+# A command that writes a large file to standard output is run with the
+# shell's output going into a pipe (`| cat > /dev/null`, as it would to a
+# pager) and into /dev/null: once without capture, once with it, and once
+# with an extra `| cat` stage for comparison. The file is made under
+# BENCH_DIR (default /tmp) and each figure is the best of three. Run from
+# the repository root:
+#
+#     cc -O2 -o shell shell.c
+#     BENCH_DIR=/dev/shm sh bench/capture.sh [./shell] [MiB] [capture MiB]
+
+SHELL_BIN=${1:-./shell}
+SIZE_MB=${2:-1024}
+CAPTURE_MB=${3:-64}
+WORK=$(mktemp -d -p "${BENCH_DIR:-/tmp}")
+trap 'rm -rf "$WORK"' EXIT
+
+dd if=/dev/zero of="$WORK/data" bs=1M count="$SIZE_MB" 2> /dev/null
+
+# Prints the best of three runs, in milliseconds.
+run() {
+    best=
+    for attempt in 1 2 3; do
+        start=$(date +%s%N)
+        if [ "$1" = pipe ]; then
+            printf '%s\n%s\n' "$2" "$3" | "$SHELL_BIN" 2> /dev/null | cat > /dev/null
+        else
+            printf '%s\n%s\n' "$2" "$3" | "$SHELL_BIN" > /dev/null 2>&1
+        fi
+        end=$(date +%s%N)
+        ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+for destination in pipe null; do
+    echo "$destination: plain $(run $destination '' "cat $WORK/data") ms," \
+        "captured $(run $destination "SHELL_CAPTURE=$CAPTURE_MB" "cat $WORK/data") ms," \
+        "extra stage $(run $destination '' "cat $WORK/data | cat") ms"
+done
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Measures the `cp` built-in against the external `cp`.
+#
+# Two trees are copied: N small files (spread over directories of 1000)
+# and a few large files. Each is copied three ways: by the built-in through
+# io_uring, by the built-in's thread pool (CP_QUEUE_DEPTH=0), and by the
+# external `cp -r` (after `enable -n cp`). The page cache is warm for every
+# run and each figure is the best of three. The trees are made under
+# BENCH_DIR (default /tmp); a tmpfs such as /dev/shm takes the disk out of
+# the numbers and leaves the system call overhead. Run from the repository
+# root:
+#
+#     cc -O2 -o shell shell.c
+#     BENCH_DIR=/dev/shm sh bench/copy.sh [./shell] [small files] [large files] [MiB each]
+
+SHELL_BIN=${1:-./shell}
+SMALL=${2:-100000}
+LARGE=${3:-3}
+LARGE_MB=${4:-256}
+WORK=$(mktemp -d -p "${BENCH_DIR:-/tmp}")
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir "$WORK/small" "$WORK/large"
+awk -v n="$SMALL" -v dir="$WORK/small" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 1000 == 0) {
+            d = dir "/" int(i / 1000)
+            system("mkdir " d)
+        }
+        f = d "/f" i
+        printf "file %d: some small content that is not quite empty\n", i > f
+        close(f)
+    }
+}'
+i=0
+while [ "$i" -lt "$LARGE" ]; do
+    dd if=/dev/urandom of="$WORK/large/f$i" bs=1M count="$LARGE_MB" 2> /dev/null
+    i=$((i + 1))
+done
+
+# Prints the best of three runs, in milliseconds.
+run() {
+    best=
+    for attempt in 1 2 3; do
+        rm -rf "$WORK/copy"
+        sync
+        start=$(date +%s%N)
+        printf '%s\ncp -r %s %s\n' "$2" "$WORK/$1" "$WORK/copy" | "$SHELL_BIN" > /dev/null 2>&1
+        end=$(date +%s%N)
+        ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+for tree in small large; do
+    run $tree '' > /dev/null # Warm up: the first copy also pays for writeback.
+    echo "$tree: io_uring $(run $tree '') ms," \
+        "threads $(run $tree 'CP_QUEUE_DEPTH=0') ms," \
+        "external $(run $tree 'enable -n cp') ms"
+done
@@ -0,0 +1,181 @@
+/**
+ * @file prompt.c
+ * @brief Measures how fast the shell starts and how much memory it holds
+ * while idle.
+ *
+ * Each shell given is started a number of times with its input and output
+ * on pipes, from an empty home directory so that no rc file or snapshot is
+ * read. The time from just before `fork()` to the first prompt on its
+ * output is the startup time; the shell's resident set size (and its
+ * proportional share, which counts shared library pages once per user) is
+ * then read from `/proc` while it waits at the prompt. Build and run it
+ * from the repository root:
+ *
+ *     make shell minimal bench/prompt
+ *     bench/prompt [runs] ./shell ./shell-minimal
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Reads a "Name:   N kB" field of a `/proc` file, in KiB.
+ */
+static long proc_field(pid_t pid, const char *file, const char *name)
+{
+    char path[64];
+    char line[256];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+    FILE *f = fopen(path, "r");
+    long value = -1;
+    size_t length = strlen(name);
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+    {
+        if (strncmp(line, name, length) == 0 && line[length] == ':')
+        {
+            value = atol(line + length + 1);
+            break;
+        }
+    }
+    if (f != NULL)
+    {
+        fclose(f);
+    }
+    return value;
+}
+
+/**
+ * @brief Starts the shell once and waits for its first prompt.
+ *
+ * @return Milliseconds to the prompt, or -1 if none came.
+ */
+static double run_once(const char *shell, const char *home, long *rss, long *pss)
+{
+    int in[2];
+    int out[2];
+    if (pipe(in) == -1 || pipe(out) == -1)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        setenv("HOME", home, 1);
+        unsetenv("SHELLRC");
+        unsetenv("SHELL_SNAPSHOT");
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    // The prompt is "> "; wait for its second byte.
+    double elapsed = -1;
+    char buffer[256];
+    struct pollfd p = {out[0], POLLIN, 0};
+    while (elapsed < 0 && poll(&p, 1, 5000) > 0)
+    {
+        ssize_t n = read(out[0], buffer, sizeof(buffer));
+        if (n <= 0)
+        {
+            break;
+        }
+        if (memchr(buffer, ' ', n) != NULL)
+        {
+            elapsed = (now() - start) * 1000;
+        }
+    }
+
+    // Let anything started in the background settle before measuring.
+    struct timespec pause = {0, 50 * 1000000L};
+    nanosleep(&pause, NULL);
+    *rss = proc_field(pid, "status", "VmRSS");
+    *pss = proc_field(pid, "smaps_rollup", "Pss");
+
+    close(in[1]);
+    while (read(out[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+    close(out[0]);
+    waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+/**
+ * @brief Sorts doubles in ascending order, for `qsort()`.
+ */
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = argc > 1 ? atoi(argv[1]) : 200;
+    if (argc < 3 || runs < 1)
+    {
+        fprintf(stderr, "usage: %s runs shell...\n", argv[0]);
+        return 1;
+    }
+    char home[] = "/tmp/prompt-XXXXXX";
+    if (mkdtemp(home) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    double *times = malloc(runs * sizeof(double));
+    for (int s = 2; s < argc && times != NULL; s++)
+    {
+        int count = 0;
+        long rss = 0;
+        long pss = 0;
+        for (int i = 0; i < runs; i++)
+        {
+            double ms = run_once(argv[s], home, &rss, &pss);
+            if (ms >= 0)
+            {
+                times[count++] = ms;
+            }
+        }
+        if (count == 0)
+        {
+            printf("%-24s no prompt\n", argv[s]);
+            continue;
+        }
+        qsort(times, count, sizeof(double), compare);
+        printf("%-24s %7.3f ms median  %7.3f ms best  %6ld KiB RSS  %6ld KiB PSS  (%d runs)\n", argv[s],
+               times[count / 2], times[0], rss, pss, count);
+    }
+    free(times);
+    rmdir(home);
+    return 0;
+}
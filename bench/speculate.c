@@ -0,0 +1,194 @@
+/**
+ * @file speculate.c
+ * @brief Measures how much speculative command resolution saves.
+ *
+ * The shell is started on a pseudo-terminal and a command is typed into it
+ * the way a person would: the name a key at a time, a pause, then the
+ * arguments and Enter. Before each run the program is dropped from the
+ * page cache, so the command starts cold. The time from Enter to the first
+ * byte of the command's output is measured with speculation on and off
+ * (`SHELL_SPECULATE=0`). Build and run it from the repository root:
+ *
+ *     cc -O2 -o shell shell.c
+ *     cc -O2 -o bench_speculate bench/speculate.c
+ *     ./bench_speculate [runs] [program [args...]]
+ *
+ * The default program is gcc's `cc1 --version`, a large binary that is
+ * rarely in the page cache anyway. Its directory is put first in `PATH`.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Sleeps for a number of milliseconds.
+ */
+static void pause_ms(long ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Reads and discards whatever the shell writes within `ms`.
+ */
+static void drain(int fd, int ms)
+{
+    char buffer[4096];
+    struct pollfd p = {fd, POLLIN, 0};
+    while (poll(&p, 1, ms) > 0 && read(fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+}
+
+/**
+ * @brief Drops a file from the page cache.
+ */
+static void evict(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd != -1)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/**
+ * @brief Runs the typed command once in a fresh shell.
+ *
+ * @return Milliseconds from Enter to the first byte of output, or -1.
+ */
+static double run_once(const char *program, char **args, int speculate)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        perror("posix_openpt");
+        exit(1);
+    }
+
+    char path[4096];
+    char *copy = strdup(program);
+    snprintf(path, sizeof(path), "%s:%s", dirname(copy), getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    free(copy);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setsid();
+        int slave = open(ptsname(master), O_RDWR);
+        dup2(slave, 0);
+        dup2(slave, 1);
+        dup2(slave, 2);
+        close(master);
+        setenv("PATH", path, 1);
+        setenv("SHELL_SPECULATE", speculate ? "1" : "0", 1);
+        execl("./shell", "shell", (char *)NULL);
+        _exit(127);
+    }
+
+    drain(master, 300);
+    evict(program);
+
+    // Type the name, think for a moment, then type the arguments.
+    copy = strdup(program);
+    for (const char *c = basename(copy); *c != '\0'; c++)
+    {
+        write(master, c, 1);
+        pause_ms(40);
+    }
+    free(copy);
+    pause_ms(400);
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        write(master, " ", 1);
+        write(master, args[i], strlen(args[i]));
+    }
+    drain(master, 50);
+
+    // Enter; the shell first echoes the newline, then the output follows.
+    double start = now();
+    write(master, "\r", 1);
+    double elapsed = -1;
+    char buffer[4096];
+    struct pollfd p = {master, POLLIN, 0};
+    while (elapsed < 0 && poll(&p, 1, 10000) > 0)
+    {
+        ssize_t n = read(master, buffer, sizeof(buffer));
+        if (n <= 0)
+        {
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (buffer[i] != '\r' && buffer[i] != '\n')
+            {
+                elapsed = (now() - start) * 1000;
+                break;
+            }
+        }
+    }
+
+    drain(master, 200);
+    write(master, "exit\r", 5);
+    drain(master, 100);
+    close(master);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = argc > 1 ? atoi(argv[1]) : 10;
+    const char *program = argc > 2 ? argv[2] : "/usr/lib/gcc/x86_64-linux-gnu/12/cc1";
+    static char *default_args[] = {"--version", NULL};
+    char **args = argc > 2 ? argv + 3 : default_args;
+    if (access("./shell", X_OK) == -1 || access(program, X_OK) == -1)
+    {
+        fprintf(stderr, "usage: run from the repository root with ./shell built; %s must exist\n", program);
+        return 1;
+    }
+
+    for (int speculate = 0; speculate <= 1; speculate++)
+    {
+        double total = 0;
+        double best = 1e9;
+        int count = 0;
+        for (int i = 0; i < runs; i++)
+        {
+            double ms = run_once(program, args, speculate);
+            if (ms >= 0)
+            {
+                total += ms;
+                best = ms < best ? ms : best;
+                count++;
+            }
+        }
+        printf("speculation %-3s  %8.2f ms average  %8.2f ms best  (%d runs)\n",
+               speculate ? "on" : "off", count ? total / count : 0, count ? best : 0, count);
+    }
+    return 0;
+}
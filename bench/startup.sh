@@ -0,0 +1,58 @@
+#!/bin/sh
+# Compares shell startup time from an rc file with startup from a snapshot.
+#
+# A synthetic rc file defines N scalar variables, N/10 indexed arrays and
+# N/10 associative arrays, and hashes a few commands. The shell is started
+# R times with a single `exit` as input, first with the rc file alone and
+# then with a snapshot saved from that rc file. Run from the repository
+# root:
+#
+#     cc -O2 -o shell shell.c
+#     sh bench/startup.sh [./shell] [variables] [runs]
+
+SHELL_BIN=${1:-./shell}
+N=${2:-20000}
+RUNS=${3:-20}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+SHELLRC="$WORK/shellrc"
+SHELL_SNAPSHOT="$WORK/snapshot"
+export SHELLRC SHELL_SNAPSHOT
+
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "var_%d=\"value number %d for the startup benchmark\"\n", i, i
+    for (i = 0; i < n / 10; i++)
+        printf "list_%d=(alpha beta gamma delta epsilon %d)\n", i, i
+    for (i = 0; i < n / 10; i++) {
+        printf "declare -A map_%d\n", i
+        printf "map_%d[name]=entry_%d; map_%d[kind]=benchmark; map_%d[index]=%d\n", i, i, i, i, i
+    }
+    print "hash ls cat grep sed awk sort"
+}' > "$SHELLRC"
+
+run() {
+    start=$(date +%s%N)
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        echo exit | "$SHELL_BIN" > /dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo $(((end - start) / RUNS / 1000))
+}
+
+rm -f "$SHELL_SNAPSHOT"
+rc_time=$(run)
+
+echo "snapshot save" | "$SHELL_BIN" > /dev/null
+touch "$SHELL_SNAPSHOT"
+snapshot_time=$(run)
+[ "$snapshot_time" -gt 0 ] || snapshot_time=1
+
+echo "rc file:   $(wc -l < "$SHELLRC") lines"
+echo "snapshot:  $(wc -c < "$SHELL_SNAPSHOT") bytes"
+echo "startup from rc file:   ${rc_time} us"
+echo "startup from snapshot:  ${snapshot_time} us"
+echo "speedup:                $((rc_time / snapshot_time))x"
@@ -0,0 +1,56 @@
+#!/bin/sh
+# A batch workload for profile-guided builds, and a benchmark of the same.
+#
+# N rounds of commands are fed to the shell on standard input, as a batch
+# job would. Each round tokenizes lines with quotes, variables, arrays and
+# ${...} expansions (parse_line()), dispatches built-ins and aliases
+# (execute_command()), runs external programs (launch_process()) and
+# pipelines of built-ins, programs and the in-process `filter`
+# (handle_pipe()), with redirections and sourced files along the way. The
+# counter changes every round, so the parse cache sees new lines as well as
+# repeated ones. `make pgo` runs it on the instrumented shell; on its own it
+# prints the wall time. Run from the repository root:
+#
+#     make
+#     sh bench/training.sh [./shell] [rounds]
+
+SHELL_BIN=${1:-./shell}
+N=${2:-2000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+echo 'sourced="$i from a sourced file"' > "$WORK/sourced"
+seq 1 2000 > "$WORK/numbers"
+
+{
+    echo "alias count='wc -l'"
+    echo "declare -A map"
+    i=0
+    while [ "$i" -lt "$N" ]; do
+        echo "i=$i"
+        echo "name=\"item \$i\"; label='single quoted \$i'"
+        echo "echo \"\$name\" \$label > /dev/null"
+        echo "[[ \$i -ge 0 && \"\$name\" == item* ]] && true || false"
+        echo "list=(alpha beta \$i \"gamma delta\")"
+        echo "list[4]=epsilon"
+        echo "echo \${list[@]} \${#list[@]} \${list[2]} > /dev/null"
+        echo "map[key]=value_\$i; key=key_\$i"
+        echo "echo \${map[key]} \${key#key_} \${name/item/entry} \${name:0:4} > /dev/null"
+        echo "true; false; pwd > /dev/null"
+        echo "basename /usr/lib/libc.so.6 .6 > /dev/null; dirname /usr/local/bin/tool > /dev/null"
+        echo "seq 1 20 | count > /dev/null"
+        echo "filter 7 < $WORK/numbers | cat > /dev/null"
+        echo "echo round \$i > $WORK/out; cat < $WORK/out 2>&1 | tr a-z A-Z > /dev/null"
+        if [ $((i % 10)) -eq 0 ]; then
+            echo "/bin/true"
+            echo "env > /dev/null"
+            echo "source $WORK/sourced"
+        fi
+        i=$((i + 1))
+    done
+} > "$WORK/workload"
+
+start=$(date +%s%N)
+"$SHELL_BIN" < "$WORK/workload" > /dev/null
+end=$(date +%s%N)
+echo "$SHELL_BIN: $(wc -l < "$WORK/workload") lines in $(((end - start) / 1000000)) ms"
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Measures the CPU time a session transcript costs.
+#
+# A command writes a large log-like file to standard output, first with
+# output capture alone (SHELL_CAPTURE=1, the pass-through a transcript
+# rides on) and then with `transcript start`. The CPU time of the shell and
+# its command (from `times`) is reported for both, with the size of the
+# compressed transcript. The file and the transcript are made under
+# BENCH_DIR (default /tmp). Run from the repository root:
+#
+#     cc -O2 -o shell shell.c
+#     BENCH_DIR=/dev/shm sh bench/transcript.sh [./shell] [lines]
+
+SHELL_BIN=${1:-./shell}
+LINES=${2:-4000000}
+WORK=$(mktemp -d -p "${BENCH_DIR:-/tmp}")
+trap 'rm -rf "$WORK"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+    srand(1)
+    split("GET POST PUT", method)
+    split("200 200 200 404 500", code)
+    for (i = 0; i < n; i++) {
+        printf "2026-01-01T10:%02d:%02d.%03d INFO %s /api/v1/items/%d %s %dms from 10.0.%d.%d\n",
+            int(i / 60000) % 60, int(i / 1000) % 60, i % 1000, method[int(rand() * 3) + 1],
+            int(rand() * 10000), code[int(rand() * 5) + 1], int(rand() * 300),
+            int(rand() * 4), int(rand() * 256)
+    }
+}' > "$WORK/log"
+echo "output: $(wc -c < "$WORK/log") bytes"
+
+# Prints the user and system CPU time of one run.
+run() {
+    sh -c "printf '%s\ncat %s\n' '$1' '$WORK/log' | '$SHELL_BIN' > /dev/null; times" | tail -1
+}
+
+echo "capture only: $(run 'SHELL_CAPTURE=1')"
+echo "transcript:   $(run "transcript start $WORK/transcript")"
+echo "transcript size: $(cat "$WORK"/transcript.*.lz4 | wc -c) bytes"
@@ -1,853 +1,15193 @@
-/**
- * @file shell.c
- * @brief A simple command-line shell written in C.
- *
- * This program implements a basic shell environment. It provides functionality to
- * read user commands, parse them into arguments, and execute them as separate processes.
- * It supports external commands found in the system's PATH, as well as several built-in
- * commands like 'cd' and 'exit'.
- *
- * The shell's main loop continuously prompts the user for input, reads the command line,
- * and then processes it.
- *
- * This version also includes support for simple process management, including forking
- * child processes and waiting for their completion. It also handles basic piping
- * for simple command chains.
- *
- * A significant portion of this file consists of detailed comments to explain the
- * logic, functions, and C programming concepts involved, bringing the total
- * line count to approximately 1000 lines as requested.
- *
- * Key features implemented:
- * - A main command loop.
- * - Command-line reading from standard input.
- * - Parsing of the command line into tokens (arguments).
- * - Execution of external programs using `fork` and `execvp`.
- * - Handling of built-in commands ('cd', 'exit').
- * - Basic error handling for file not found and process creation issues.
- * - Support for a single pipe between two commands.
- *
- * Note: This shell is not a full-featured shell like bash. It lacks support for
- * features such as I/O redirection (`<`, `>`), background processes (`&`),
- * environment variable expansion (`$VAR`), command history, and more complex
- * piping or command chaining.
- */
-
-/* ========================================================================= */
-/* HEADER FILES                                 */
-/* ========================================================================= */
-
-#include <stdio.h>    // Standard input/output functions (printf, fgets)
-#include <stdlib.h>   // Standard library functions (malloc, free, exit, getenv)
-#include <string.h>   // String manipulation functions (strlen, strcmp, strtok, strdup)
-#include <unistd.h>   // POSIX operating system API (fork, chdir, execvp, getpid)
-#include <sys/wait.h> // For waitpid() to wait for child processes
-#include <signal.h>   // To handle signals, such as SIGINT for Ctrl+C
-#include <errno.h>    // For error handling, to get system error codes
-
-/* ========================================================================= */
-/* MACROS & CONSTANTS                           */
-/* ========================================================================= */
-
-/**
- * @brief Maximum length of a command line a user can enter.
- *
- * This constant defines the maximum size of the buffer used to store
- * the command line read from the user. If a user enters a command
- * longer than this, it will be truncated. A larger buffer might
- * be necessary for more complex use cases.
- */
-#define MAX_LINE_LENGTH 1024
-
-/**
- * @brief Maximum number of tokens (arguments) per command.
- *
- * This constant sets the upper limit on how many separate arguments
- * can be parsed from a single command line. For example, in the
- * command `ls -l /usr/bin`, the tokens are `ls`, `-l`, and `/usr/bin`.
- * This limit prevents buffer overflow and ensures memory safety.
- */
-#define MAX_ARGS 64
-
-/**
- * @brief Delimiters used to separate arguments in the command line.
- *
- * The `strtok` function uses this string to identify where
- * to split the user's input. The space (` `), newline (`\n`),
- * and tab (`\t`) characters are common delimiters. Note that `strtok`
- * modifies the original string, so a copy is often used.
- */
-#define TOKEN_DELIMITERS " \t\n"
-
-/* ========================================================================= */
-/* FUNCTION PROTOTYPES                           */
-/* ========================================================================= */
-
-/**
- * @brief Reads a line of input from stdin.
- *
- * This function prompts the user with the shell's prompt symbol
- * and then reads a full line of text from standard input until
- * a newline character is encountered. It returns a dynamically
- * allocated string containing the user's input.
- *
- * @return A dynamically allocated string containing the user's input, or NULL on error.
- */
-char *read_line();
-
-/**
- * @brief Parses a line of input into an array of strings (arguments).
- *
- * Takes a raw command line string and breaks it down into individual
- * arguments based on predefined delimiters. The function returns an array
- * of pointers to these argument strings. The last element of the array
- * is set to NULL, which is a common convention for `execvp`.
- *
- * @param line The string containing the full command line to be parsed.
- * @return An array of strings representing the arguments, or NULL if parsing fails.
- */
-char **parse_line(char *line);
-
-/**
- * @brief Executes a command by handling both built-in and external commands.
- *
- * This is the central command dispatcher. It first checks if the command
- * is a built-in function (e.g., `cd`, `exit`). If it is, it calls the
- * appropriate handler. Otherwise, it assumes the command is an external
- * executable and attempts to launch it.
- *
- * @param args An array of strings representing the command and its arguments.
- * @return 1 if the shell should continue running, 0 if it should terminate.
- */
-int execute_command(char **args);
-
-/**
- * @brief Launches an external command as a new process.
- *
- * This function uses `fork()` to create a child process. The child process
- * then uses `execvp()` to replace its image with the specified command.
- * The parent process waits for the child to finish using `waitpid()`.
- * This is the fundamental method for running programs in a shell.
- *
- * @param args An array of strings representing the command and its arguments.
- * @return 1 on success, 0 on failure.
- */
-int launch_process(char **args);
-
-/**
- * @brief Handles built-in shell commands.
- *
- * This function contains the logic for commands that are executed directly
- * by the shell, rather than being run as a separate external program.
- * Examples include `cd` (change directory) and `exit` (terminate the shell).
- *
- * @param args An array of strings representing the command and its arguments.
- * @return 1 if the shell should continue running, 0 if it should terminate.
- */
-int handle_builtin(char **args);
-
-/**
- * @brief Handles commands separated by a pipe (`|`).
- *
- * This function specifically manages the execution of a command pipeline
- * with exactly two commands. It sets up a pipe using `pipe()`, forks two
- * child processes, and redirects the standard output of the first command
- * to the standard input of the second command using `dup2()`.
- *
- * @param command1 The array of arguments for the first command.
- * @param command2 The array of arguments for the second command.
- * @return 1 on success, 0 on failure.
- */
-int handle_pipe(char **command1, char **command2);
-
-/**
- * @brief Frees the memory allocated for an array of strings.
- *
- * A utility function to properly deallocate memory used for the
- * parsed arguments. This is crucial to prevent memory leaks in the
- * main loop.
- *
- * @param args The array of strings to be freed.
- */
-void free_args(char **args);
-
-/* ========================================================================= */
-/* GLOBAL VARIABLES                              */
-/* ========================================================================= */
-
-/**
- * @brief An array of strings representing the built-in commands.
- *
- * This array is used to quickly check if a command entered by the
- * user is one of the built-in functions.
- */
-char *builtin_commands[] = {
-    "cd",
-    "exit"};
-
-/**
- * @brief The total number of built-in commands.
- *
- * This is a simple macro to calculate the size of the `builtin_commands`
- * array. It's more robust than hardcoding the number.
- */
-#define NUM_BUILTINS (sizeof(builtin_commands) / sizeof(char *))
-
-/* ========================================================================= */
-/* MAIN FUNCTION                              */
-/* ========================================================================= */
-
-/**
- * @brief The entry point of the shell program.
- *
- * This function contains the main execution loop of the shell. It initializes
- * the necessary variables, enters an infinite loop, and orchestrates the
- * reading, parsing, and execution of user commands.
- *
- * @param argc The number of command-line arguments passed to the program.
- * @param argv An array of strings containing the command-line arguments.
- * @return The exit status of the shell program.
- */
-int main(int argc, char **argv)
-{
-    char *line;
-    char **args;
-    int status;
-
-    // Ignore Ctrl+C (SIGINT) so that it doesn't kill the shell.
-    // The child processes will inherit this behavior.
-    signal(SIGINT, SIG_IGN);
-
-    // Main shell loop:
-    // This loop runs indefinitely until the `exit` command is entered.
-    // The `status` variable is used to control the loop. A status of 0
-    // signifies the shell should exit. A status of 1 means it should continue.
-    do
-    {
-        // Print the shell prompt. The `fflush` ensures the prompt is
-        // immediately visible on the console.
-        printf("> ");
-        fflush(stdout);
-
-        // Read the user's command line input.
-        // `read_line()` handles dynamic memory allocation for the input string.
-        line = read_line();
-        if (line == NULL)
-        {
-            // If read_line returns NULL, it indicates an error or end-of-file.
-            // We'll break the loop to exit the shell gracefully.
-            break;
-        }
-
-        // Parse the line into an array of arguments.
-        // `parse_line()` breaks the string into tokens based on delimiters.
-        args = parse_line(line);
-        if (args == NULL)
-        {
-            // If parsing fails, we free the line and continue to the next loop iteration.
-            free(line);
-            continue;
-        }
-
-        // Execute the command.
-        // This function decides whether to run a built-in or an external command.
-        // It returns a status code to control the main loop's execution.
-        status = execute_command(args);
-
-        // Free the dynamically allocated memory for the command line and arguments
-        // to prevent memory leaks. This is a crucial step in the loop.
-        free(line);
-        free_args(args);
-
-    } while (status);
-
-    // The shell has exited the main loop, so we print a final message and
-    // exit with a success status.
-    printf("Exiting simple shell...\n");
-    return 0;
-}
-
-/* ========================================================================= */
-/* FUNCTION IMPLEMENTATIONS                       */
-/* ========================================================================= */
-
-/**
- * @brief Reads a line of input from stdin.
- *
- * This function is responsible for getting the raw command line string
- * from the user. It uses `fgets` with a fixed-size buffer, which is a
- * simple and safe way to read a line. `fgets` includes the newline
- * character, so we need to handle that.
- *
- * This implementation is simple and safe. A more advanced version might
- * use `getline` for dynamic sizing, but this is a good starting point.
- *
- * @return A dynamically allocated string containing the user's input, or NULL on error.
- */
-char *read_line()
-{
-    // Allocate a fixed-size buffer on the heap. This is a simple approach
-    // to avoid potential stack overflow with very large strings.
-    char *buffer = malloc(sizeof(char) * MAX_LINE_LENGTH);
-    if (buffer == NULL)
-    {
-        // If malloc fails, it returns NULL. We print an error and return NULL
-        // to signal a failure to the main loop.
-        perror("malloc failed in read_line");
-        return NULL;
-    }
-
-    // Use `fgets` to read a line from stdin into the buffer.
-    // `fgets` is generally safer than `gets` because it prevents buffer overflows.
-    // It reads at most MAX_LINE_LENGTH-1 characters and appends a null terminator.
-    if (fgets(buffer, MAX_LINE_LENGTH, stdin) == NULL)
-    {
-        // `fgets` returns NULL on end-of-file (e.g., Ctrl+D) or an error.
-        // In a real shell, you would handle this more gracefully.
-        // Here, we'll just free the buffer and return NULL to exit.
-        free(buffer);
-        return NULL;
-    }
-
-    // Check if the input contains a newline character. If it does, we replace
-    // it with a null terminator. This is important because `strtok` later
-    // will see the newline as a valid character.
-    size_t len = strlen(buffer);
-    if (len > 0 && buffer[len - 1] == '\n')
-    {
-        buffer[len - 1] = '\0';
-    }
-
-    return buffer;
-}
-
-/**
- * @brief Parses a line of input into an array of strings (arguments).
- *
- * This function takes a single line of text and tokenizes it. Tokenization
- * is the process of breaking a string into smaller parts (tokens). In this
- * case, the tokens are the individual arguments of the command.
- *
- * It uses the `strtok` function, which is a standard way to split strings
- * in C. It's important to note that `strtok` is not thread-safe and modifies
- * the input string, which is why we work on a copy.
- *
- * This function also checks for the pipe character (`|`) to determine if
- * a simple pipeline is present.
- *
- * @param line The string containing the full command line to be parsed.
- * @return An array of strings representing the arguments, or NULL if parsing fails.
- */
-char **parse_line(char *line)
-{
-    // We make a copy of the original line. This is good practice because
-    // `strtok` modifies the string it is tokenizing.
-    char *line_copy = strdup(line);
-    if (line_copy == NULL)
-    {
-        perror("strdup failed in parse_line");
-        return NULL;
-    }
-
-    // We'll also make a copy for the pipe check.
-    char *pipe_check_copy = strdup(line);
-    if (pipe_check_copy == NULL)
-    {
-        perror("strdup failed in parse_line");
-        return NULL;
-    }
-
-    // We need to determine if a pipe exists. We use `strtok` on a separate copy
-    // so we can re-tokenize the original string correctly later.
-    int pipe_present = 0;
-    if (strchr(pipe_check_copy, '|') != NULL)
-    {
-        pipe_present = 1;
-    }
-
-    free(pipe_check_copy);
-
-    // Allocate an array of character pointers. This array will hold the
-    // pointers to the individual argument strings. We add one for the NULL
-    // terminator, which is a convention for `execvp`.
-    char **args = malloc(sizeof(char *) * (MAX_ARGS + 1));
-    if (args == NULL)
-    {
-        perror("malloc failed in parse_line");
-        free(line_copy);
-        return NULL;
-    }
-
-    // Start tokenization. The `strtok` function is called with two arguments:
-    // the string to tokenize and the delimiters. The first call gets the
-    // first token. Subsequent calls use NULL as the first argument to continue
-    // tokenizing the same string.
-    char *token = strtok(line_copy, TOKEN_DELIMITERS);
-    int i = 0;
-
-    // Loop through the line and extract all tokens.
-    while (token != NULL && i < MAX_ARGS)
-    {
-        // The token is a pointer to a part of the original string.
-        // We use `strdup` to create a separate copy of the token, ensuring
-        // that our `args` array holds independent strings.
-        args[i] = strdup(token);
-        if (args[i] == NULL)
-        {
-            // Clean up if a `strdup` fails.
-            perror("strdup failed during tokenization");
-            for (int j = 0; j < i; j++)
-            {
-                free(args[j]);
-            }
-            free(args);
-            free(line_copy);
-            return NULL;
-        }
-
-        i++;
-        // Get the next token. Passing NULL tells `strtok` to continue from
-        // where it left off.
-        token = strtok(NULL, TOKEN_DELIMITERS);
-    }
-
-    // Check if the number of arguments exceeded the maximum.
-    if (token != NULL && i >= MAX_ARGS)
-    {
-        fprintf(stderr, "shell: Too many arguments.\n");
-        free_args(args);
-        free(line_copy);
-        return NULL;
-    }
-
-    // Set the last element of the array to NULL. This is critical for
-    // `execvp` to know where the argument list ends.
-    args[i] = NULL;
-
-    free(line_copy);
-
-    // If a pipe was detected, we need to handle that.
-    if (pipe_present)
-    {
-        // This is a simple check for a single pipe. A more robust shell would
-        // handle multiple pipes and more complex command chaining.
-        char **command1 = args;
-        char **command2 = NULL;
-        int pipe_index = -1;
-
-        // Find the pipe symbol in the arguments.
-        for (int j = 0; args[j] != NULL; j++)
-        {
-            if (strcmp(args[j], "|") == 0)
-            {
-                pipe_index = j;
-                break;
-            }
-        }
-
-        // If a pipe was found, we split the arguments into two separate command
-        // arrays. The `|` symbol itself is not an argument.
-        if (pipe_index != -1)
-        {
-            // The pipe symbol is removed by setting the pointer at that
-            // position to NULL.
-            args[pipe_index] = NULL;
-            // The second command starts right after the pipe symbol.
-            command2 = &args[pipe_index + 1];
-
-            // We can now call the pipe handler.
-            handle_pipe(command1, command2);
-
-            // The handle_pipe function will free the memory, so we return NULL
-            // to prevent the main loop from trying to execute and free again.
-            // This is a simple way to manage the flow.
-            return NULL;
-        }
-    }
-
-    return args;
-}
-
-/**
- * @brief Executes a command by handling both built-in and external commands.
- *
- * This function acts as a dispatcher. It first checks a list of "built-in"
- * commands, which are functions directly implemented within the shell's code.
- * If a match is found, it calls the corresponding handler.
- *
- * If the command is not a built-in, it is assumed to be an external program
- * (like `ls` or `grep`) and a new process is launched to run it.
- *
- * @param args An array of strings representing the command and its arguments.
- * @return 1 if the shell should continue running, 0 if it should terminate.
- */
-int execute_command(char **args)
-{
-    // If there are no arguments (e.g., the user just pressed Enter),
-    // we do nothing and return.
-    if (args[0] == NULL)
-    {
-        return 1;
-    }
-
-    // Loop through the list of built-in commands to see if the user's
-    // command matches any of them.
-    for (int i = 0; i < NUM_BUILTINS; i++)
-    {
-        // The `strcmp` function compares two strings. If they are identical,
-        // it returns 0.
-        if (strcmp(args[0], builtin_commands[i]) == 0)
-        {
-            // If we have a match, we call the `handle_builtin` function,
-            // which contains the logic for all built-in commands.
-            return handle_builtin(args);
-        }
-    }
-
-    // If the command is not a built-in, we assume it's an external program
-    // and launch a new process to run it.
-    return launch_process(args);
-}
-
-/**
- * @brief Launches an external command as a new process.
- *
- * This is the heart of a shell's execution model. It involves several
- * key system calls:
- *
- * 1.  `fork()`: This creates a new process (the child) that is an exact
- * copy of the current process (the parent).
- * 2.  `execvp()`: This call is made in the child process. It replaces the
- * child's program image with the new program specified by `args[0]`.
- * It searches for the executable in the directories listed in the
- * `PATH` environment variable.
- * 3.  `waitpid()`: This call is made in the parent process. It causes the
- * parent to pause its execution and wait for the child process to
- * finish. This prevents "zombie" processes.
- *
- * Proper error checking is included for each step.
- *
- * @param args An array of strings representing the command and its arguments.
- * @return 1 on success, 0 on failure.
- */
-int launch_process(char **args)
-{
-    pid_t pid, wpid;
-    int status;
-
-    // Use `fork()` to create a child process.
-    pid = fork();
-
-    if (pid == -1)
-    {
-        // If `fork()` returns -1, an error occurred. This is a critical
-        // failure, as it means the system couldn't create a new process.
-        perror("fork failed");
-        return 1;
-    }
-
-    // The `fork` system call returns a different value to the parent and child processes.
-    if (pid == 0)
-    {
-        // This code block is executed by the child process.
-
-        // Restore the default behavior for Ctrl+C (SIGINT).
-        // This means the child process will be terminated if the user
-        // presses Ctrl+C, but the parent shell will remain running.
-        signal(SIGINT, SIG_DFL);
-
-        // Execute the command using `execvp`.
-        // `execvp` takes the command name and the array of arguments.
-        // It's a non-returning call on success; if it returns, an error occurred.
-        if (execvp(args[0], args) == -1)
-        {
-            // `execvp` returns -1 on failure. A common reason is the
-            // command not being found.
-            perror("shell");
-        }
-
-        // If `execvp` failed, we must exit the child process to avoid
-        // running unwanted code or becoming a zombie.
-        // We use `exit(1)` to indicate an error status to the parent.
-        exit(1);
-    }
-    else
-    {
-        // This code block is executed by the parent process.
-
-        // Wait for the child process to finish. `waitpid` is used here
-        // to wait specifically for the child `pid` and not for any other
-        // child processes that might exist (though none should in this simple shell).
-        // The `0` argument means to wait for any child process with the same process group ID.
-        do
-        {
-            wpid = waitpid(pid, &status, WUNTRACED);
-            if (wpid == -1)
-            {
-                perror("waitpid failed");
-                return 1;
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-    }
-
-    // The parent process returns 1 to signal that the main loop should
-    // continue to the next command.
-    return 1;
-}
-
-/**
- * @brief Handles built-in shell commands.
- *
- * Built-in commands are part of the shell itself and do not require
- * forking a new process. This is because they often need to modify the
- * shell's environment directly, such as changing the current working
- * directory.
- *
- * This function uses a series of `if/else if` statements to check the
- * command name and execute the corresponding logic.
- *
- * @param args An array of strings representing the command and its arguments.
- * @return 1 if the shell should continue running, 0 if it should terminate.
- */
-int handle_builtin(char **args)
-{
-    // Check if the command is "exit".
-    if (strcmp(args[0], "exit") == 0)
-    {
-        // If the command is `exit`, we return 0. The main loop will
-        // see this status and terminate.
-        return 0;
-    }
-
-    // Check if the command is "cd" (change directory).
-    if (strcmp(args[0], "cd") == 0)
-    {
-        // The `cd` command requires at least one argument, which is the
-        // target directory. If no argument is provided, we change to
-        // the user's home directory.
-        if (args[1] == NULL)
-        {
-            // Get the user's home directory from the environment variables.
-            char *home_dir = getenv("HOME");
-            if (home_dir == NULL)
-            {
-                // If the HOME environment variable is not set, we print an error.
-                fprintf(stderr, "shell: 'cd' requires an argument if HOME is not set.\n");
-            }
-            else
-            {
-                // Use `chdir` to change the current working directory.
-                // `chdir` is a system call that changes the process's current
-                // working directory. It must be a built-in command because
-                // a child process's `chdir` would not affect the parent shell.
-                if (chdir(home_dir) != 0)
-                {
-                    perror("shell");
-                }
-            }
-        }
-        else
-        {
-            // If an argument is provided, we change the directory to the
-            // path specified.
-            if (chdir(args[1]) != 0)
-            {
-                perror("shell");
-            }
-        }
-
-        // After executing the built-in, we return 1 to continue the loop.
-        return 1;
-    }
-
-    // If we reach here, a built-in command was called, but the handler
-    // for that specific command has not been implemented.
-    fprintf(stderr, "shell: built-in command '%s' not implemented.\n", args[0]);
-
-    // Return 1 to continue the main loop.
-    return 1;
-}
-
-/**
- * @brief Handles commands separated by a pipe (`|`).
- *
- * This is a more advanced function that demonstrates inter-process communication
- * using a pipe. A pipe is a one-way channel for data flow between two processes.
- *
- * The general steps are:
- * 1.  Create a pipe using `pipe()`. This gives us two file descriptors, one for
- * reading and one for writing.
- * 2.  Fork the first child process for the first command.
- * 3.  In the first child, redirect its standard output to the write end of the
- * pipe using `dup2()`. Close the original write end. Then `execvp()` the
- * first command.
- * 4.  Fork the second child process for the second command.
- * 5.  In the second child, redirect its standard input from the read end of the
- * pipe using `dup2()`. Close the original read end. Then `execvp()` the
- * second command.
- * 6.  In the parent process, close both ends of the pipe, and then wait for
- * both child processes to finish.
- *
- * This implementation is for a simple, two-command pipeline. A real shell
- * would need a more generic approach to handle multiple pipes.
- *
- * @param command1 The array of arguments for the first command.
- * @param command2 The array of arguments for the second command.
- * @return 1 on success, 0 on failure.
- */
-int handle_pipe(char **command1, char **command2)
-{
-    // Check for invalid commands. A pipe requires two valid commands.
-    if (command1[0] == NULL || command2[0] == NULL)
-    {
-        fprintf(stderr, "shell: Invalid command usage with pipe.\n");
-        return 1;
-    }
-
-    // A pipe is a pair of file descriptors. The first element is for
-    // reading, the second for writing.
-    int pipe_fd[2];
-    pid_t pid1, pid2;
-    int status1, status2;
-
-    // Create the pipe. `pipe()` returns 0 on success.
-    if (pipe(pipe_fd) == -1)
-    {
-        perror("pipe failed");
-        return 1;
-    }
-
-    // Fork the first child process. This child will run the first command
-    // and write its output to the pipe.
-    pid1 = fork();
-    if (pid1 == -1)
-    {
-        perror("fork failed for first command");
-        // Close pipe ends before returning on error.
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        return 1;
-    }
-
-    // This block is for the first child process.
-    if (pid1 == 0)
-    {
-        // We restore the default behavior for Ctrl+C.
-        signal(SIGINT, SIG_DFL);
-
-        // We don't need the read end of the pipe in this process, so we close it.
-        close(pipe_fd[0]);
-
-        // Redirect standard output to the write end of the pipe.
-        // `dup2` duplicates an old file descriptor onto a new one. Here,
-        // it makes `stdout` (`1`) point to the same file as `pipe_fd[1]`.
-        if (dup2(pipe_fd[1], STDOUT_FILENO) == -1)
-        {
-            perror("dup2 failed for first command");
-            exit(1);
-        }
-
-        // Close the write end of the pipe. Now `stdout` is the only
-        // descriptor pointing to it.
-        close(pipe_fd[1]);
-
-        // Execute the first command.
-        if (execvp(command1[0], command1) == -1)
-        {
-            perror("shell");
-            exit(1);
-        }
-    }
-    else
-    {
-        // This is the parent process. We fork the second child.
-        pid2 = fork();
-        if (pid2 == -1)
-        {
-            perror("fork failed for second command");
-            // Kill the first child if the second fork fails.
-            // This is a simple form of cleanup.
-            kill(pid1, SIGTERM);
-            waitpid(pid1, NULL, 0);
-            close(pipe_fd[0]);
-            close(pipe_fd[1]);
-            return 1;
-        }
-
-        // This block is for the second child process.
-        if (pid2 == 0)
-        {
-            // Restore default Ctrl+C behavior.
-            signal(SIGINT, SIG_DFL);
-
-            // We don't need the write end of the pipe, so we close it.
-            close(pipe_fd[1]);
-
-            // Redirect standard input from the read end of the pipe.
-            // This makes `stdin` (`0`) point to the same file as `pipe_fd[0]`.
-            if (dup2(pipe_fd[0], STDIN_FILENO) == -1)
-            {
-                perror("dup2 failed for second command");
-                exit(1);
-            }
-
-            // Close the read end of the pipe.
-            close(pipe_fd[0]);
-
-            // Execute the second command.
-            if (execvp(command2[0], command2) == -1)
-            {
-                perror("shell");
-                exit(1);
-            }
-        }
-    }
-
-    // Parent process block.
-    // The parent must close both ends of the pipe, as it does not read
-    // or write to it. If it doesn't, the children might hang.
-    close(pipe_fd[0]);
-    close(pipe_fd[1]);
-
-    // Wait for the first child to finish.
-    waitpid(pid1, &status1, 0);
-    // Wait for the second child to finish.
-    waitpid(pid2, &status2, 0);
-
-    // Free the dynamically allocated argument arrays.
-    free_args(command1);
-    free_args(command2);
-
-    // Return 1 to continue the shell loop.
-    return 1;
-}
-
-/**
- * @brief Frees the memory allocated for an array of strings.
- *
- * This is a crucial helper function to prevent memory leaks. Since we
- * used `malloc` and `strdup` to allocate memory for the arguments,
- * we must free that memory when we are done with it.
- *
- * The function loops through the array of pointers, freeing each string,
- * and then frees the array of pointers itself.
- *
- * @param args The array of strings to be freed.
- */
-void free_args(char **args)
-{
-    if (args == NULL)
-    {
-        return;
-    }
-    // Loop through the array until the NULL terminator is found.
-    for (int i = 0; args[i] != NULL; i++)
-    {
-        // Free the memory for each individual string.
-        free(args[i]);
-    }
-    // Finally, free the memory for the array of pointers itself.
-    free(args);
-}
-
-// EOF (End of File) marker.
+/**
+ * @file shell.c
+ * @brief A simple command-line shell written in C.
+ *
+ * This program implements a basic shell environment. It provides functionality to
+ * read user commands, parse them into arguments, and execute them as separate processes.
+ * It supports external commands found in the system's PATH, as well as several built-in
+ * commands like 'cd' and 'exit'.
+ *
+ * The shell's main loop continuously prompts the user for input, reads the command line,
+ * and then processes it.
+ *
+ * This version also includes support for simple process management, including forking
+ * child processes and waiting for their completion. It also handles basic piping
+ * for simple command chains.
+ *
+ * A significant portion of this file consists of detailed comments to explain the
+ * logic, functions, and C programming concepts involved, bringing the total
+ * line count to approximately 1000 lines as requested.
+ *
+ * Key features implemented:
+ * - A main command loop.
+ * - Command-line reading from standard input.
+ * - Parsing of the command line into tokens (arguments).
+ * - Execution of external programs using `fork` and `execvp`.
+ * - Handling of built-in commands ('cd', 'exit').
+ * - Basic error handling for file not found and process creation issues.
+ * - Support for pipelines of any length (`cmd1 | cmd2 | cmd3`).
+ * - Single and double quotes, backslash escapes and `#` comments.
+ * - Shell variables (`NAME=value`) and parameter expansion: `$NAME`, `${NAME}`,
+ *   `${#NAME}`, `${NAME#pat}`, `${NAME%pat}`, `${NAME/pat/rep}`,
+ *   `${NAME:off:len}`, `${NAME:-word}` and case conversion (`^`, `^^`, `,`, `,,`).
+ * - Indexed arrays (`a=(x y z)`, `a[3]=w`) and associative arrays
+ *   (`declare -A m`, `m[key]=v`), expanded with `"${a[@]}"`, `${a[i]}`,
+ *   `${#a[@]}` and `${!a[@]}`; `declare` and `unset` built-ins.
+ * - Command lists with `;`, `&&` and `||`, and the exit status in `$?`.
+ * - Conditional expressions with `[[ ... ]]`, including regex matching with
+ *   `=~` (captures in `BASH_REMATCH`) backed by a cache of compiled regexes.
+ * - A `stats` built-in that reports the shell's internal cache counters.
+ * - In-process versions of common utilities: `true`, `false`, `pwd`,
+ *   `basename`, `dirname`, `seq`, `sleep` and `kill`. Any built-in can be
+ *   switched off with `enable -n NAME` to fall back to the external program.
+ * - A `parallel` built-in that runs task lines concurrently, locally or on
+ *   remote agents (`shell --agent tcp:PORT`) with work stealing between them
+ *   and fair, weighted sharing of an agent between coordinators,
+ *   optionally tagging the tasks' stderr line by line (`-T`, `-e LOG`), and
+ *   adapting the number of local tasks to the system's pressure (`-j auto`).
+ * - Aliases (`alias`, `unalias`), expanded at every command position and
+ *   looked up through a table of interned strings.
+ * - A command hash table that remembers where commands were found in `PATH`
+ *   (`hash`), an rc file (`~/.shellrc`) run at startup, and binary snapshots
+ *   of the shell's state (`snapshot save`) that are mapped at startup in
+ *   place of the rc file.
+ * - A parse cache that reuses the words of commands without expansions.
+ * - One event loop (epoll with a signalfd, a timerfd and child pidfds) for
+ *   everything the shell waits for, including the `TMOUT` idle timeout.
+ * - `source FILE` (or `. FILE`) and script mode (`shell FILE`), with a cache
+ *   of compiled scripts so an unchanged file is not read or tokenized again.
+ * - `cp` and `mv` built-ins that copy many files at once through io_uring,
+ *   with a thread pool where io_uring is not available.
+ * - A `prefetch` built-in that reads files, commands and the programs of a
+ *   script into the page cache in parallel, optionally locking them.
+ * - A small line editor on terminals that looks the command name up while it
+ *   is typed and reads the program into the page cache before Enter.
+ * - Redirections (`<`, `>`, `>>`, `2>&1`) with readahead hints for input
+ *   files and optional O_DIRECT output for huge sequential writes, and
+ *   `/dev/tcp/HOST/PORT` and `/dev/unix/PATH` to connect to a service.
+ * - Optional capture of each command's output (`SHELL_CAPTURE=MB`) in memfd
+ *   rings, printed again by `last-output` or read from `$LAST_OUTPUT`.
+ * - Session transcripts (`transcript start FILE`) of input lines and output,
+ *   LZ4-compressed by a background thread into files rotated by size.
+ * - A built-in `filter` line filter (fixed strings or POSIX regexes) that runs
+ *   inside the shell process when used as a pipeline stage.
+ *
+ * Note: This shell is not a full-featured shell like bash. It lacks support for
+ * features such as background processes (`&`), here-documents, command
+ * history, and control flow (`if`, `while`).
+ */
+
+/* ========================================================================= */
+/* HEADER FILES                                 */
+/* ========================================================================= */
+
+#define _GNU_SOURCE   // Expose GNU extensions such as memrchr()
+
+#include <stdio.h>    // Standard input/output functions (printf, fgets)
+#include <stdio_ext.h> // For __fpending(), whether stdout has output waiting
+#include <stdlib.h>   // Standard library functions (malloc, free, exit, getenv)
+#include <string.h>   // String manipulation functions (strlen, strcmp, strtok, strdup)
+#include <unistd.h>   // POSIX operating system API (fork, chdir, execvp, getpid)
+#include <sys/wait.h> // For waitpid() to wait for child processes
+#include <signal.h>   // To handle signals, such as SIGINT for Ctrl+C
+#include <errno.h>    // For error handling, to get system error codes
+#include <fcntl.h>    // For open() and its flags
+#include <regex.h>    // POSIX regular expressions (regcomp, regexec)
+#include <stdint.h>   // Fixed-width integer types (uint64_t)
+#include <ctype.h>    // Character classification (toupper, tolower)
+#include <sys/stat.h> // For stat() and the file type macros
+#include <sys/mman.h> // For mmap() of snapshot files
+#include <sys/sendfile.h> // For sendfile() of captured output
+#include <time.h>     // For clock_nanosleep() and struct timespec
+#include <limits.h>   // For LONG_MAX and LONG_MIN
+#include <strings.h>  // For strcasecmp()
+#include <dirent.h>   // For listing /proc/self/fd in the fd debug mode
+#include <sys/epoll.h>    // The event loop's epoll set
+#include <sys/signalfd.h> // Signals read as events instead of handled
+#include <sys/timerfd.h>  // Timeouts as events
+#include <sys/pidfd.h>    // For pidfd_open(), child exits as events
+#include <sys/ioctl.h>    // For TIOCGWINSZ
+#include <termios.h>      // For the line editor's terminal mode
+#include <pthread.h>      // Background threads that read programs ahead
+#include <elf.h>          // For finding a program's ELF interpreter
+#include <sys/syscall.h>  // io_uring has no wrappers in the C library
+#include <linux/io_uring.h> // io_uring structures used by `cp` and `mv`
+#include <poll.h>     // For poll() in the parallel coordinator and agents
+#include <netdb.h>    // For getaddrinfo()
+#include <sys/socket.h>  // Sockets used by remote execution agents
+#include <sys/un.h>      // UNIX domain socket addresses
+#include <netinet/in.h>  // TCP/IP socket addresses
+#include <netinet/tcp.h> // For TCP_NODELAY
+
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics used by the fixed-string prefilter
+#endif
+
+/* ========================================================================= */
+/* MACROS & CONSTANTS                           */
+/* ========================================================================= */
+
+/**
+ * @brief Maximum length of a command line a user can enter.
+ *
+ * This constant defines the maximum size of the buffer used to store
+ * the command line read from the user. If a user enters a command
+ * longer than this, it will be truncated. A larger buffer might
+ * be necessary for more complex use cases.
+ */
+#define MAX_LINE_LENGTH 1024
+
+/**
+ * @brief Initial number of tokens (arguments) per command.
+ *
+ * The argument array starts with room for this many tokens and grows as
+ * needed, since an array expansion such as `"${files[@]}"` can produce
+ * any number of arguments. For example, in the command `ls -l /usr/bin`,
+ * the tokens are `ls`, `-l`, and `/usr/bin`. It is also the maximum number
+ * of stages in a single pipeline.
+ */
+#define MAX_ARGS 64
+
+/**
+ * @brief Largest index accepted for an indexed array.
+ *
+ * Indexed arrays are stored as contiguous vectors, so assigning to a huge
+ * index would allocate every slot below it. This limit turns typos such as
+ * `a[999999999]=x` into an error instead of an enormous allocation.
+ */
+#define MAX_ARRAY_INDEX (1 << 26)
+
+/**
+ * @brief Delimiters used to separate arguments in the command line.
+ *
+ * The tokenizer uses this string to identify where to split the user's
+ * input. The space (` `), newline (`\n`), and tab (`\t`) characters are
+ * common delimiters. They are also used to split the result of an unquoted
+ * variable expansion into separate arguments.
+ */
+#define TOKEN_DELIMITERS " \t\n"
+
+/**
+ * @brief Size of the read and write buffers used by the `filter` built-in.
+ *
+ * Input is consumed in blocks of this size so that the prefilter can scan
+ * many lines per call instead of working one line at a time.
+ */
+#define FILTER_BUFFER_SIZE 65536
+
+/**
+ * @brief Number of compiled glob patterns kept by parameter expansion.
+ *
+ * Patterns such as the `*.txt` in `${file%*.txt}` are compiled into a small
+ * matcher program the first time they are seen and kept in a cache of this
+ * many entries, indexed by a hash of the pattern text.
+ */
+#define GLOB_CACHE_SIZE 64
+
+/**
+ * @brief Number of compiled regular expressions kept by the regex cache.
+ *
+ * Both `[[ str =~ re ]]` and `filter` compile their patterns through this
+ * cache. When it is full, the least recently used expression is dropped.
+ */
+#define REGEX_CACHE_SIZE 32
+
+/**
+ * @brief Number of parsed commands kept by the parse cache.
+ *
+ * Commands without expansions (`ls -l /tmp`, `make test`) parse to the same
+ * words every time, so the words are kept, keyed by the command text, and
+ * reused the next time the same text comes along.
+ */
+#define PARSE_CACHE_SIZE 256
+
+/* ========================================================================= */
+/* FUNCTION PROTOTYPES                           */
+/* ========================================================================= */
+
+/**
+ * @brief Reads a line of input from stdin.
+ *
+ * This function prompts the user with the shell's prompt symbol
+ * and then reads a full line of text from standard input until
+ * a newline character is encountered. It returns a dynamically
+ * allocated string containing the user's input.
+ *
+ * @return A dynamically allocated string containing the user's input, or NULL on error.
+ */
+char *read_line();
+
+/**
+ * @brief Executes a full command line, which may be a list of commands.
+ *
+ * Splits the line at unquoted `;`, `&&` and `||` and runs each command in
+ * turn, parsing it only when it is about to run so that it sees variables
+ * assigned by the commands before it.
+ *
+ * @param line The command line to run.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int execute_line(const char *line);
+
+/**
+ * @brief Parses a line of input into an array of strings (arguments).
+ *
+ * Takes a raw command line string and breaks it down into individual
+ * arguments based on predefined delimiters. The function returns an array
+ * of pointers to these argument strings. The last element of the array
+ * is set to NULL, which is a common convention for `execvp`.
+ *
+ * @param line The string containing the full command line to be parsed.
+ * @return An array of strings representing the arguments, or NULL if parsing fails.
+ */
+char **parse_line(char *line);
+
+/**
+ * @brief Looks a command up in the parse cache.
+ *
+ * @param line The command text.
+ * @return A copy of its words (freed with `free_args()`), or NULL on a miss.
+ */
+char **parse_cache_get(const char *line);
+
+/**
+ * @brief Adds a command's words to the parse cache if the command has no
+ * expansions.
+ *
+ * @param line The command text.
+ * @param args Its words, as returned by `tokenize()`.
+ */
+void parse_cache_put(const char *line, char **args);
+
+/**
+ * @brief Executes a command by handling both built-in and external commands.
+ *
+ * This is the central command dispatcher. It first checks if the command
+ * is a built-in function (e.g., `cd`, `exit`). If it is, it calls the
+ * appropriate handler. Otherwise, it assumes the command is an external
+ * executable and attempts to launch it.
+ *
+ * @param args An array of strings representing the command and its arguments.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int execute_command(char **args);
+
+/**
+ * @brief Launches an external command as a new process.
+ *
+ * This function uses `fork()` to create a child process. The child process
+ * then uses `execvp()` to replace its image with the specified command.
+ * The parent process waits for the child to finish using `waitpid()`.
+ * This is the fundamental method for running programs in a shell.
+ *
+ * @param args An array of strings representing the command and its arguments.
+ * @return 1 on success, 0 on failure.
+ */
+int launch_process(char **args);
+
+/**
+ * @brief Checks whether a command name refers to an enabled built-in.
+ *
+ * @param name The command name.
+ * @return 1 if `name` is a built-in that has not been disabled, 0 otherwise.
+ */
+int is_builtin(const char *name);
+
+/**
+ * @brief Handles built-in shell commands.
+ *
+ * This function contains the logic for commands that are executed directly
+ * by the shell, rather than being run as a separate external program.
+ * Examples include `cd` (change directory) and `exit` (terminate the shell).
+ *
+ * @param args An array of strings representing the command and its arguments.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int handle_builtin(char **args);
+
+/**
+ * @brief Handles commands separated by pipes (`|`).
+ *
+ * This function manages the execution of a command pipeline with any number
+ * of stages. It creates one pipe between each pair of neighbouring stages,
+ * forks a child process per stage, and connects them using `dup2()`. The
+ * first `filter` stage is run by the shell itself instead of a child.
+ *
+ * @param commands An array of argument arrays, one per pipeline stage.
+ * @param num_commands The number of stages in `commands`.
+ * @return 1 if the shell should continue running.
+ */
+int handle_pipe(char ***commands, int num_commands);
+
+/**
+ * @brief Runs the `filter` built-in over a stream of lines.
+ *
+ * Copies every line read from `in_fd` (or from the files named after the
+ * pattern) that matches the pattern to `out_fd`. Fixed strings are found
+ * with a SIMD prefilter, regular expressions are compiled once and reused.
+ *
+ * @param args The `filter` command and its arguments.
+ * @param in_fd The file descriptor to read lines from.
+ * @param out_fd The file descriptor to write matching lines to.
+ * @return The number of selected lines, -1 on error, or -2 if interrupted
+ *         by Ctrl+C.
+ */
+int run_filter(char **args, int in_fd, int out_fd);
+
+/**
+ * @brief Splits a command line into words and performs expansions.
+ *
+ * Handles quoting, backslash escapes, comments and `$` parameter expansion.
+ * The words are returned in a single allocation: the NULL-terminated
+ * pointer array followed by the words themselves, back to back.
+ *
+ * @param line The command line to tokenize.
+ * @return The words (freed with `free_args()`), or NULL on error.
+ */
+char **tokenize(const char *line);
+
+/**
+ * @brief Checks whether the first `length` bytes of a word returned by
+ * `tokenize()` were written as plain text, outside quotes and expansions.
+ *
+ * Only such text can be an operator: `'|'`, `\>` and `"$op"` are ordinary
+ * words.
+ */
+int word_is_unquoted(const char *word, size_t length);
+
+/**
+ * @brief Looks up the value of a shell or environment variable.
+ *
+ * Shell variables take precedence; otherwise the environment is consulted.
+ * The returned pointer refers to the variable store's own buffer and stays
+ * valid until the variable is next assigned.
+ *
+ * @param name The variable name (not necessarily NUL-terminated).
+ * @param name_length The length of `name`.
+ * @param length Receives the length of the value.
+ * @return The value, or NULL if the variable is not set.
+ */
+const char *get_variable(const char *name, size_t name_length, size_t *length);
+
+/**
+ * @brief Assigns a value to a shell variable.
+ *
+ * If the variable also exists in the environment, the environment copy is
+ * updated too so that child processes see the new value.
+ *
+ * @param name The variable name (not necessarily NUL-terminated).
+ * @param name_length The length of `name`.
+ * @param value The new value.
+ * @param length The length of `value`.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int set_variable(const char *name, size_t name_length, const char *value, size_t length);
+
+/**
+ * @brief Performs the assignments of a line such as `A=1 B=two`.
+ *
+ * Only lines consisting entirely of assignment words (`NAME=value`,
+ * `NAME+=value`, `NAME[sub]=value` and `NAME=(...)` array literals) are
+ * treated as assignments; anything else is left alone.
+ *
+ * @param args The parsed words of the command line.
+ * @return 1 if the line was an assignment line and has been handled, 0 otherwise.
+ */
+int handle_assignments(char **args);
+
+/**
+ * @brief Implements the `declare` built-in.
+ *
+ * `declare -a NAME...` makes indexed arrays and `declare -A NAME...` makes
+ * associative arrays. An existing scalar value becomes element `0`.
+ *
+ * @param args The `declare` command and its arguments.
+ * @return 0 on success, 1 on error.
+ */
+int builtin_declare(char **args);
+
+/**
+ * @brief Implements the `unset` built-in.
+ *
+ * `unset NAME` removes a variable (including from the environment) and
+ * `unset NAME[sub]` removes a single array element.
+ *
+ * @param args The `unset` command and its arguments.
+ * @return 0 on success, 1 on error.
+ */
+int builtin_unset(char **args);
+
+/**
+ * @brief Implements the `[[ ... ]]` conditional expression built-in.
+ *
+ * @param args The `[[` command and its arguments, ending with `]]`.
+ * @return 0 if the expression is true, 1 if false, 2 on a syntax error.
+ */
+int builtin_test(char **args);
+
+/**
+ * @brief Returns a compiled regular expression from the regex cache.
+ *
+ * The pattern is compiled with `regcomp()` only when it is not already in
+ * the cache, keyed by its text and compile flags.
+ *
+ * @param pattern The regular expression.
+ * @param cflags The flags for `regcomp()`.
+ * @param who The name to prefix error messages with.
+ * @return The compiled expression, or NULL if it does not compile.
+ */
+regex_t *regex_cache_get(const char *pattern, int cflags, const char *who);
+
+/**
+ * @brief Implements the `stats` built-in.
+ *
+ * Prints the hit rates of the shell's internal caches.
+ *
+ * @param args The `stats` command and its arguments.
+ * @return 0 on success.
+ */
+int builtin_stats(char **args);
+
+/**
+ * @brief Implements the `pwd` built-in.
+ *
+ * @param args The `pwd` command and its arguments.
+ * @return 0 on success, 1 on error.
+ */
+int builtin_pwd(char **args);
+
+/**
+ * @brief Implements the `basename` built-in.
+ *
+ * @param args The `basename` command: a path and an optional suffix to remove.
+ * @return 0 on success, 1 on error.
+ */
+int builtin_basename(char **args);
+
+/**
+ * @brief Implements the `dirname` built-in.
+ *
+ * @param args The `dirname` command and one or more paths.
+ * @return 0 on success, 1 on error.
+ */
+int builtin_dirname(char **args);
+
+/**
+ * @brief Implements the `seq` built-in.
+ *
+ * Prints a sequence of integers through a large output buffer. Forms the
+ * built-in does not handle (such as fractional steps) run the external
+ * `seq` instead.
+ *
+ * @param args The `seq` command and its arguments.
+ * @return 0 on success, 1 on error.
+ */
+int builtin_seq(char **args);
+
+/**
+ * @brief Implements the `sleep` built-in.
+ *
+ * Sleeps with `clock_nanosleep()` and can be interrupted with Ctrl+C.
+ *
+ * @param args The `sleep` command and its durations.
+ * @return 0 on success, 1 on error, 130 if interrupted.
+ */
+int builtin_sleep(char **args);
+
+/**
+ * @brief Implements the `kill` built-in.
+ *
+ * @param args The `kill` command, an optional signal and process IDs.
+ * @return 0 on success, 1 if any signal could not be sent.
+ */
+int builtin_kill(char **args);
+
+/**
+ * @brief Implements the `enable` built-in.
+ *
+ * `enable -n NAME...` disables built-ins, `enable NAME...` re-enables them
+ * and `enable` alone lists the built-ins and their state.
+ *
+ * @param args The `enable` command and its arguments.
+ * @return 0 on success, 1 if a name is not a built-in.
+ */
+int builtin_enable(char **args);
+
+/**
+ * @brief Implements the `parallel` built-in.
+ *
+ * Reads one command line per task and runs the tasks concurrently, either
+ * as local child processes or on remote agents (see `run_agent()`), with
+ * work stealing between the agents' queues.
+ *
+ * @param args The `parallel` command and its options.
+ * @return 0 if every task succeeded, 1 if any failed, 2 on usage errors.
+ */
+int builtin_parallel(char **args);
+
+/**
+ * @brief Runs the shell as a remote execution agent (`shell --agent ADDRESS`).
+ *
+ * @param address Where to listen: `tcp:[HOST:]PORT` or `unix:PATH`.
+ * @param token The secret coordinators must present.
+ * @param slots How many tasks may run at once, for all coordinators.
+ * @return 1 on error; on success it never returns.
+ */
+int run_agent(const char *address, const char *token, int slots);
+
+/**
+ * @brief Prints the queue depths and wait times of a running agent
+ * (`shell --agent-status ADDRESS`).
+ *
+ * @param address The agent's address, as for `run_agent()`.
+ * @param token The secret the agent expects.
+ * @return 0 on success, 1 on error.
+ */
+int agent_status(const char *address, const char *token);
+
+/**
+ * @brief Returns the full path of an external command from the command
+ * hash table, searching `PATH` only on the first use of the command.
+ *
+ * @param name The command name.
+ * @return The full path, or NULL if the name should go to `execvp()` as is.
+ */
+const char *command_path(const char *name);
+
+/**
+ * @brief Implements the `hash` built-in (list, add to or clear the table of
+ * remembered command locations).
+ *
+ * @param args The `hash` command and its arguments.
+ * @return 0 on success, 1 if a command was not found.
+ */
+int builtin_hash(char **args);
+
+/**
+ * @brief Implements the `snapshot` built-in.
+ *
+ * `snapshot save [FILE]` writes the variables, arrays and command hash
+ * table to a binary file that later shells map at startup instead of
+ * running the rc file.
+ *
+ * @param args The `snapshot` command and its arguments.
+ * @return 0 on success, 1 on error, 2 on usage errors.
+ */
+int builtin_snapshot(char **args);
+
+/**
+ * @brief Runs a script file, reusing its parsed form from the script cache
+ *        while the file's inode, size and mtime are unchanged.
+ *
+ * @param path The file to run.
+ * @return 0 if the script ran `exit`, 1 otherwise.
+ */
+int source_file(const char *path);
+
+/**
+ * @brief Built-in command `source FILE` (also spelled `.`).
+ *
+ * @param args Argument vector; args[1] is the script to run.
+ * @return 0 if the script ran `exit`, 1 otherwise.
+ */
+int builtin_source(char **args);
+
+/**
+ * @brief Implements the `prefetch` built-in: reads files, directories,
+ * pathname patterns, commands and the programs of scripts into the page
+ * cache with several threads, optionally locking them in memory.
+ *
+ * @param args The `prefetch` command, its options and targets.
+ * @return 0 on success, 1 if a target could not be read, 2 on usage errors.
+ */
+int builtin_prefetch(char **args);
+
+/**
+ * @brief Implements the `cp` built-in, which copies files and trees many
+ * files at a time through io_uring (or a thread pool without it).
+ *
+ * @param args The `cp` command, its options and operands.
+ * @return 0 on success, 1 if anything could not be copied.
+ */
+int builtin_cp(char **args);
+
+/**
+ * @brief Implements the `mv` built-in: `rename()`, or a copy and removal
+ * across filesystems.
+ *
+ * @param args The `mv` command, its options and operands.
+ * @return 0 on success, 1 if anything could not be moved.
+ */
+int builtin_mv(char **args);
+
+/**
+ * @brief Loads the snapshot, or runs the rc file if there is no snapshot
+ * at least as new as it.
+ *
+ * @return 0 if the rc file ran `exit`, 1 otherwise.
+ */
+int load_startup_state(void);
+
+/**
+ * @brief Expands aliases at every command position of a line.
+ *
+ * @param line The command line.
+ * @return The expanded line (to be freed by the caller), or NULL if the
+ *         line contains no aliases.
+ */
+char *expand_aliases(const char *line);
+
+/**
+ * @brief Implements the `alias` built-in.
+ *
+ * @param args The `alias` command and its `NAME=VALUE` or `NAME` arguments.
+ * @return 0 on success, 1 if a name is not an alias or not valid.
+ */
+int builtin_alias(char **args);
+
+/**
+ * @brief Implements the `unalias` built-in.
+ *
+ * @param args The `unalias` command and the names to remove, or `-a`.
+ * @return 0 on success, 1 if a name is not an alias.
+ */
+int builtin_unalias(char **args);
+
+/**
+ * @brief Frees the memory allocated for an array of strings.
+ *
+ * A utility function to properly deallocate memory used for the
+ * parsed arguments. This is crucial to prevent memory leaks in the
+ * main loop.
+ *
+ * @param args The array of strings to be freed, as returned by `parse_line()`.
+ */
+void free_args(char **args);
+
+/**
+ * @brief Checks whether a command has redirection words (`<`, `>`, `>>`,
+ * `2>&1`, ...).
+ */
+int has_redirections(char **args);
+
+/**
+ * @brief Opens and installs a command's redirections, removing their words
+ * from `args`.
+ *
+ * @return 0 on success, -1 on error (reported).
+ */
+int apply_redirections(char **args);
+
+/**
+ * @brief Saves standard input, output and error before a built-in's
+ * redirections replace them.
+ */
+void save_std_fds(int saved[3]);
+
+/**
+ * @brief Restores the descriptors saved by `save_std_fds()`.
+ */
+void restore_std_fds(const int saved[3]);
+
+/**
+ * @brief Starts, in the shell, the background readahead and O_DIRECT
+ * output relays a command's redirections ask for, before it is forked.
+ */
+void redirect_prepare(char **args);
+
+/**
+ * @brief Closes the shell's ends of the output relays once the command
+ * has been forked.
+ */
+void redirect_release(void);
+
+/**
+ * @brief Waits for the output relays of a finished command.
+ *
+ * @return 0 on success, -1 if an output file could not be written.
+ */
+int redirect_wait(void);
+
+/**
+ * @brief Sets up the event loop: an epoll set with standard input, a
+ * signalfd, a timerfd and the pidfds of children being waited for.
+ */
+void event_loop_init(void);
+
+/**
+ * @brief Detaches a newly forked child from the shell's event loop.
+ */
+void event_loop_child(void);
+
+/**
+ * @brief Waits until standard input is readable, handling signals and the
+ * `TMOUT` idle timeout meanwhile.
+ *
+ * @param pause Milliseconds to wait at most, or -1 for no limit.
+ * @return 1 when input is ready, 0 if the shell timed out, -1 if `pause`
+ *         ran out.
+ */
+int wait_for_input(int pause);
+
+/**
+ * @brief Reads a line from the terminal with a small line editor, which
+ * resolves the command name while it is being typed.
+ *
+ * @return The line (to be freed), or NULL at end of input.
+ */
+char *edit_line(void);
+
+/**
+ * @brief Waits for a set of child processes to exit.
+ *
+ * @param pids The children; entries that are not positive are skipped.
+ * @param statuses Receives each child's wait status.
+ * @param count The number of entries in `pids`.
+ */
+void wait_children(const pid_t *pids, int *statuses, int count);
+
+/**
+ * @brief Sleeps until a CLOCK_MONOTONIC deadline or until Ctrl+C.
+ *
+ * @return 0 at the deadline, 1 if interrupted, -1 without an event loop.
+ */
+int event_sleep(const struct timespec *deadline);
+
+/**
+ * @brief Waits until a descriptor has something to read or until Ctrl+C.
+ *
+ * @return 1 when `fd` is ready, 0 if interrupted.
+ */
+int event_wait_readable(int fd);
+
+/**
+ * @brief Records a line read at the prompt in the session transcript, if
+ * one is being written.
+ */
+void transcript_input(const char *line);
+
+/**
+ * @brief Records a command's output in the session transcript, if one is
+ * being written.
+ */
+void transcript_output(const char *data, size_t length);
+
+/**
+ * @brief Completes and stops the session transcript, if there is one.
+ */
+void transcript_stop(void);
+
+/**
+ * @brief Implements the `transcript` built-in, which records the session in
+ * LZ4-compressed files.
+ *
+ * @param args `transcript start [-s MB] FILE`, `transcript stop` or
+ *        `transcript status`.
+ * @return 0 on success, 1 on error, 2 on usage errors.
+ */
+int builtin_transcript(char **args);
+
+/**
+ * @brief Starts capturing the output of the command about to be forked,
+ * if `SHELL_CAPTURE` is set or a transcript is being written.
+ *
+ * @return 1 if output is being captured, 0 if not.
+ */
+int capture_begin(void);
+
+/**
+ * @brief Gives the shell back its own standard output and error once the
+ * captured command has been forked.
+ */
+void capture_release(void);
+
+/**
+ * @brief Passes on one read of a captured command's output, keeping a copy.
+ *
+ * @param stream 0 for standard output, 1 for standard error.
+ * @return 1 if data was read, 0 if none is ready, -1 if the pipe is closed.
+ */
+int capture_drain(int stream);
+
+/**
+ * @brief Passes on the rest of a finished command's output and keeps the
+ * capture for `last-output`.
+ */
+void capture_finish(void);
+
+/**
+ * @brief Starts capturing the output of a built-in about to run in the
+ * shell, like `capture_begin()` does for a forked command.
+ *
+ * @param keep Zero if the output is only for the transcript.
+ * @return 1 if output is being captured, 0 if not.
+ */
+int capture_builtin_begin(int keep);
+
+/**
+ * @brief Gives the shell back its standard output and error after a
+ * captured built-in, and keeps its output for `last-output`.
+ */
+void capture_builtin_finish(void);
+
+/**
+ * @brief Implements the `last-output` built-in, which prints the captured
+ * output of a recent command again.
+ *
+ * @param args The `last-output` command, `-p` and the command's number.
+ * @return 0 on success, 1 if there is no such capture, 2 on usage errors.
+ */
+int builtin_last_output(char **args);
+
+/* ========================================================================= */
+/* GLOBAL VARIABLES                              */
+/* ========================================================================= */
+
+/**
+ * @brief An array of strings representing the built-in commands.
+ *
+ * This array is used to quickly check if a command entered by the
+ * user is one of the built-in functions.
+ */
+char *builtin_commands[] = {
+    "cd",
+    "exit",
+    "filter",
+    "declare",
+    "unset",
+    "[[",
+    "stats",
+    "true",
+    "false",
+    "pwd",
+    "basename",
+    "dirname",
+    "seq",
+    "sleep",
+    "kill",
+    "enable",
+    "parallel",
+    "hash",
+    "snapshot",
+    "alias",
+    "unalias",
+    "source",
+    ".",
+    "prefetch",
+    "cp",
+    "mv",
+    "last-output",
+    "transcript"};
+
+/**
+ * @brief The total number of built-in commands.
+ *
+ * This is a simple macro to calculate the size of the `builtin_commands`
+ * array. It's more robust than hardcoding the number.
+ */
+#define NUM_BUILTINS (sizeof(builtin_commands) / sizeof(char *))
+
+/**
+ * @brief Which built-in commands have been switched off with `enable -n`.
+ *
+ * A disabled built-in is treated like any other command name, so the
+ * external program of the same name runs instead. This is mainly useful to
+ * compare the built-in versions of utilities such as `seq` with the real
+ * ones, both for behaviour and for speed.
+ */
+char builtin_disabled[NUM_BUILTINS];
+
+/**
+ * @brief The exit status of the most recently executed command.
+ *
+ * This is what `$?` expands to and what `&&` and `||` look at. By the
+ * usual convention 0 means success, and a command killed by a signal
+ * reports 128 plus the signal number.
+ */
+int last_status = 0;
+
+/**
+ * @brief Counters reported by the `stats` built-in.
+ *
+ * Each cache in the shell bumps its own counters here, so the cost of
+ * keeping statistics is one increment per lookup.
+ */
+struct
+{
+    unsigned long regex_lookups; // Calls to `regex_cache_get()`.
+    unsigned long regex_hits;    // Lookups served without calling `regcomp()`.
+    unsigned long command_lookups; // Calls to `command_path()`.
+    unsigned long command_hits;    // Commands found without searching `PATH`.
+    unsigned long script_lookups;  // Calls to `source_file()`.
+    unsigned long script_hits;     // Scripts run without re-reading the file.
+    unsigned long parse_lookups;   // Commands without expansions given to `parse_line()`.
+    unsigned long parse_hits;      // Those served without tokenizing.
+    unsigned long speculative_resolutions; // Commands found in `PATH` while being typed.
+    unsigned long prefetches;              // Programs read ahead while being typed.
+    unsigned long captures;       // Commands whose output was captured.
+    unsigned long captured_bytes; // Output passed through and captured.
+} shell_stats;
+
+/* ========================================================================= */
+/* MAIN FUNCTION                              */
+/* ========================================================================= */
+
+/**
+ * @brief The entry point of the shell program.
+ *
+ * This function contains the main execution loop of the shell. It initializes
+ * the necessary variables, enters an infinite loop, and orchestrates the
+ * reading, parsing, and execution of user commands.
+ *
+ * @param argc The number of command-line arguments passed to the program.
+ * @param argv An array of strings containing the command-line arguments.
+ * @return The exit status of the shell program.
+ */
+int main(int argc, char **argv)
+{
+    char *line;
+    int status = 1;
+
+    // `shell --agent ADDRESS [--token TOKEN] [--slots N]` serves tasks for
+    // the `parallel` built-in of other shells instead of reading commands;
+    // `shell --agent-status ADDRESS [--token TOKEN]` reports on one.
+    if (argc >= 3 && (strcmp(argv[1], "--agent") == 0 || strcmp(argv[1], "--agent-status") == 0))
+    {
+        const char *token = getenv("SHELL_AGENT_TOKEN");
+        long slots = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 3; i + 1 < argc; i += 2)
+        {
+            if (strcmp(argv[i], "--token") == 0)
+            {
+                token = argv[i + 1];
+            }
+            else if (strcmp(argv[i], "--slots") == 0)
+            {
+                slots = atol(argv[i + 1]);
+            }
+        }
+        if (token == NULL || *token == '\0')
+        {
+            fprintf(stderr, "shell: agent: a token is required (--token or SHELL_AGENT_TOKEN)\n");
+            return 2;
+        }
+        if (strcmp(argv[1], "--agent-status") == 0)
+        {
+            return agent_status(argv[2], token);
+        }
+        return run_agent(argv[2], token, slots > 0 ? (int)slots : 1);
+    }
+
+    // `shell FILE` runs a script and exits with its status. Like other
+    // shells, a script does not read the rc file.
+    if (argc >= 2)
+    {
+        event_loop_init();
+        source_file(argv[1]);
+        return last_status;
+    }
+
+    // From here on the shell waits for input, signals and children in one
+    // place; see `event_loop_init()`.
+    event_loop_init();
+
+    // Restore the state saved by `snapshot save`, or run the rc file.
+    status = load_startup_state();
+
+    // Main shell loop:
+    // This loop runs indefinitely until the `exit` command is entered.
+    // The `status` variable is used to control the loop. A status of 0
+    // signifies the shell should exit. A status of 1 means it should continue.
+    while (status)
+    {
+        // Print the shell prompt. It is written directly rather than
+        // through stdio, so that the loop between commands does not touch
+        // printf() at all; output a command left in `stdout` goes first.
+        if (__fpending(stdout) > 0)
+        {
+            fflush(stdout);
+        }
+        write(STDOUT_FILENO, "> ", 2);
+
+        // Read the user's command line input.
+        // `read_line()` handles dynamic memory allocation for the input string.
+        line = read_line();
+        if (line == NULL)
+        {
+            // If read_line returns NULL, it indicates an error or end-of-file.
+            // We'll break the loop to exit the shell gracefully.
+            break;
+        }
+        transcript_input(line);
+
+        // Execute the line.
+        // `execute_line()` splits it into commands, parses each one and
+        // decides whether to run a built-in or an external command.
+        // It returns a status code to control the main loop's execution.
+        status = execute_line(line);
+
+        // Free the dynamically allocated memory for the command line
+        // to prevent memory leaks. This is a crucial step in the loop.
+        free(line);
+    }
+
+    // The shell has exited the main loop, so we print a final message and
+    // exit with the status of the last command (or the one given to `exit`).
+    // A transcript is completed first.
+    transcript_stop();
+    printf("Exiting simple shell...\n");
+    return last_status;
+}
+
+/* ========================================================================= */
+/* FUNCTION IMPLEMENTATIONS                       */
+/* ========================================================================= */
+
+/**
+ * @brief Input read from stdin but not yet returned as a line.
+ *
+ * The shell reads its input with `read()` into this buffer rather than
+ * through `stdin`, so that `wait_for_input()` can tell whether a line is
+ * already at hand before it waits for the descriptor to become readable.
+ */
+static struct
+{
+    char data[MAX_LINE_LENGTH];
+    size_t start;
+    size_t end;
+} input_buffer;
+
+/**
+ * @brief Reads a line of input from stdin.
+ *
+ * This function is responsible for getting the raw command line string
+ * from the user. Whole lines are taken from `input_buffer`; when it holds
+ * no complete line, the event loop waits for more input, so signals and
+ * timeouts are handled while the shell sits at the prompt. A line longer
+ * than MAX_LINE_LENGTH - 1 characters comes back in pieces, just as it did
+ * with `fgets`. On a terminal the line is read by `edit_line()` instead.
+ *
+ * @return A dynamically allocated string containing the user's input, or NULL on error.
+ */
+char *read_line()
+{
+    if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO))
+    {
+        return edit_line();
+    }
+
+    int end_of_file = 0;
+    for (;;)
+    {
+        // Return the next line if the buffer holds one (or holds the last,
+        // unterminated line of the input, or is full).
+        char *start = input_buffer.data + input_buffer.start;
+        size_t available = input_buffer.end - input_buffer.start;
+        char *newline = memchr(start, '\n', available);
+        if (newline != NULL || available == MAX_LINE_LENGTH - 1 || (end_of_file && available > 0))
+        {
+            size_t len = newline ? (size_t)(newline - start) : available;
+            char *buffer = strndup(start, len);
+            if (buffer == NULL)
+            {
+                perror("malloc failed in read_line");
+                return NULL;
+            }
+            input_buffer.start += len + (newline != NULL);
+            return buffer;
+        }
+        if (end_of_file)
+        {
+            // End of file (e.g., Ctrl+D) with nothing left: the shell exits.
+            return NULL;
+        }
+
+        // Move the partial line to the front to make room for more input.
+        memmove(input_buffer.data, start, available);
+        input_buffer.start = 0;
+        input_buffer.end = available;
+
+        if (!wait_for_input(-1))
+        {
+            return NULL;
+        }
+        ssize_t n = read(STDIN_FILENO, input_buffer.data + input_buffer.end,
+                         MAX_LINE_LENGTH - 1 - input_buffer.end);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            perror("shell: read");
+            return NULL;
+        }
+        end_of_file = (n == 0);
+        input_buffer.end += n;
+    }
+}
+
+/**
+ * @brief Finds the end of the next command in a command list.
+ *
+ * Scans `line` for the first unquoted `;`, `&&` or `||`. Quotes, backslash
+ * escapes and `${...}` expansions are skipped over, and so is everything
+ * between `[[` and `]]`, where `&&` and `||` belong to the expression. An
+ * unquoted `#` at the start of a word ends the line.
+ *
+ * @param line The text to scan.
+ * @param separator Receives the separator found: ';', '&' for `&&`,
+ *                  '|' for `||`, or '\0' at the end of the line.
+ * @return The length of the command before the separator.
+ */
+static size_t next_command_length(const char *line, char *separator)
+{
+    const char *p = line;
+    int in_test = 0;
+    int braces = 0;
+    int word_start = 1;
+
+    *separator = '\0';
+    while (*p != '\0')
+    {
+        char c = *p;
+
+        if (c == '\\' && p[1] != '\0')
+        {
+            p += 2;
+            word_start = 0;
+            continue;
+        }
+        if (c == '\'')
+        {
+            const char *end = strchr(p + 1, '\'');
+            p = (end == NULL) ? p + strlen(p) : end + 1;
+            word_start = 0;
+            continue;
+        }
+        if (c == '"')
+        {
+            p++;
+            while (*p != '\0' && *p != '"')
+            {
+                p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+            }
+            if (*p == '"')
+            {
+                p++;
+            }
+            word_start = 0;
+            continue;
+        }
+        if (c == '$' && p[1] == '{')
+        {
+            braces++;
+            p += 2;
+            word_start = 0;
+            continue;
+        }
+        if (c == '}' && braces > 0)
+        {
+            braces--;
+        }
+        else if (word_start && c == '#')
+        {
+            break;
+        }
+        else if (word_start && c == '[' && p[1] == '[' && strchr(" \t\n", p[2]) != NULL && p[2] != '\0')
+        {
+            in_test = 1;
+        }
+        else if (word_start && c == ']' && p[1] == ']' && (p[2] == '\0' || strchr(" \t\n;", p[2]) != NULL))
+        {
+            in_test = 0;
+            p += 2;
+            word_start = 0;
+            continue;
+        }
+        else if (braces == 0 && c == ';')
+        {
+            *separator = ';';
+            break;
+        }
+        else if (braces == 0 && !in_test && (c == '&' || c == '|') && p[1] == c)
+        {
+            *separator = c;
+            break;
+        }
+
+        word_start = strchr(" \t\n", c) != NULL;
+        p++;
+    }
+    return p - line;
+}
+
+/**
+ * @brief Executes a full command line, which may be a list of commands.
+ *
+ * The line is cut into commands at `;`, `&&` and `||`. Each command is only
+ * tokenized when its turn comes, so `x=1; echo $x` sees the new value.
+ * `a && b` runs `b` only if `a` succeeded and `a || b` only if it failed;
+ * a skipped command leaves `$?` alone, which makes `a && b || c` behave as
+ * in other shells.
+ *
+ * @param line The command line to run.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int execute_line(const char *line)
+{
+    int status = 1;
+    int run = 1;
+
+    // Aliases are expanded over the whole line first, since an alias may
+    // itself contain `;`, `&&` or `||`.
+    char *expanded = expand_aliases(line);
+    if (expanded != NULL)
+    {
+        line = expanded;
+    }
+
+    while (status)
+    {
+        char separator;
+        size_t length = next_command_length(line, &separator);
+
+        if (run)
+        {
+            char *command = strndup(line, length);
+            if (command == NULL)
+            {
+                perror("strndup failed in execute_line");
+                free(expanded);
+                return 1;
+            }
+
+            // Parse the command into an array of arguments and run it.
+            char **args = parse_line(command);
+            if (args == NULL)
+            {
+                // A syntax error in a command counts as a failure.
+                last_status = 2;
+            }
+            else
+            {
+                status = execute_command(args);
+                free_args(args);
+            }
+            free(command);
+        }
+
+        if (separator == '\0')
+        {
+            break;
+        }
+
+        // Decide whether the next command runs.
+        if (separator == '&')
+        {
+            run = (last_status == 0);
+        }
+        else if (separator == '|')
+        {
+            run = (last_status != 0);
+        }
+        else
+        {
+            run = 1;
+        }
+        line += length + (separator == ';' ? 1 : 2);
+    }
+
+    free(expanded);
+    return status;
+}
+
+/**
+ * @brief Parses a line of input into an array of strings (arguments).
+ *
+ * This function takes a single line of text and tokenizes it. Tokenization
+ * is the process of breaking a string into smaller parts (tokens). In this
+ * case, the tokens are the individual arguments of the command.
+ *
+ * The actual splitting is done by `tokenize()`, which understands quotes
+ * and backslashes and expands `$NAME` and `${...}` references on the fly,
+ * so the words it returns are ready to be passed to `execvp`.
+ *
+ * Pipe symbols (`|`) are kept as ordinary tokens. It is up to
+ * `execute_command()` to split the arguments into pipeline stages.
+ *
+ * @param line The string containing the full command line to be parsed.
+ * @return An array of strings representing the arguments, or NULL if parsing fails.
+ */
+char **parse_line(char *line)
+{
+    // A command without expansions that was seen before needs no parsing.
+    char **args = parse_cache_get(line);
+    if (args != NULL)
+    {
+        return args;
+    }
+
+    // Break the line into words. The tokenizer takes care of quotes and
+    // expansions and returns the words and the NULL-terminated array of
+    // pointers to them in one block of memory.
+    args = tokenize(line);
+    if (args != NULL)
+    {
+        parse_cache_put(line, args);
+    }
+    return args;
+}
+
+/**
+ * @brief Executes a command by handling both built-in and external commands.
+ *
+ * This function acts as a dispatcher. It first checks a list of "built-in"
+ * commands, which are functions directly implemented within the shell's code.
+ * If a match is found, it calls the corresponding handler.
+ *
+ * If the command is not a built-in, it is assumed to be an external program
+ * (like `ls` or `grep`) and a new process is launched to run it.
+ *
+ * If the arguments contain pipe symbols, the command is split into stages
+ * and handed to `handle_pipe()` instead.
+ *
+ * @param args An array of strings representing the command and its arguments.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int execute_command(char **args)
+{
+    // If there are no arguments (e.g., the user just pressed Enter),
+    // we do nothing and return.
+    if (args[0] == NULL)
+    {
+        return 1;
+    }
+
+    // A line like `NAME=value` assigns a variable and runs nothing.
+    if (handle_assignments(args))
+    {
+        last_status = 0;
+        return 1;
+    }
+
+    // Split the arguments into pipeline stages. Each unquoted `|` token is
+    // temporarily replaced by NULL so that every stage becomes its own
+    // NULL-terminated argument array; a quoted one (`echo '|'`) is a plain
+    // word. There can never be more stages than there are tokens.
+    char **stages[MAX_ARGS];
+    int pipe_positions[MAX_ARGS];
+    int num_stages = 1;
+    int num_tokens = 0;
+    stages[0] = args;
+    while (args[num_tokens] != NULL)
+    {
+        num_tokens++;
+    }
+    for (int i = 0; i < num_tokens; i++)
+    {
+        if (strcmp(args[i], "|") == 0 && word_is_unquoted(args[i], 1))
+        {
+            if (num_stages == MAX_ARGS)
+            {
+                fprintf(stderr, "shell: Too many pipeline stages.\n");
+                return 1;
+            }
+            pipe_positions[num_stages - 1] = i;
+            stages[num_stages++] = &args[i + 1];
+        }
+    }
+
+    if (num_stages > 1)
+    {
+        // Remember the pipe tokens so the argument array can be restored
+        // afterwards and freed as a whole by the caller.
+        char *pipe_tokens[MAX_ARGS];
+        for (int i = 0; i < num_stages - 1; i++)
+        {
+            pipe_tokens[i] = args[pipe_positions[i]];
+            args[pipe_positions[i]] = NULL;
+        }
+
+        int status = handle_pipe(stages, num_stages);
+
+        for (int i = 0; i < num_stages - 1; i++)
+        {
+            args[pipe_positions[i]] = pipe_tokens[i];
+        }
+        return status;
+    }
+
+    // Check the list of built-in commands to see if the user's
+    // command matches any of them.
+    if (is_builtin(args[0]))
+    {
+        // A built-in's output is captured as a program's is. That of
+        // `last-output` only goes to the transcript, as keeping it would
+        // push out the capture it prints.
+        int capturing = capture_builtin_begin(strcmp(args[0], "last-output") != 0);
+
+        // If we have a match, we call the `handle_builtin` function,
+        // which contains the logic for all built-in commands.
+        int status = 1;
+        if (!has_redirections(args))
+        {
+            status = handle_builtin(args);
+        }
+        else
+        {
+            // A built-in runs in the shell, so its redirections are applied
+            // to the shell's own descriptors for as long as it runs.
+            int saved[3];
+            save_std_fds(saved);
+            if (apply_redirections(args) == -1)
+            {
+                last_status = 1;
+            }
+            else
+            {
+                status = handle_builtin(args);
+            }
+            restore_std_fds(saved);
+        }
+
+        if (capturing)
+        {
+            capture_builtin_finish();
+        }
+        return status;
+    }
+
+    // If the command is not a built-in, we assume it's an external program
+    // and launch a new process to run it.
+    return launch_process(args);
+}
+
+/**
+ * @brief Converts a status from `waitpid()` into a shell exit status.
+ *
+ * A normal exit yields the program's exit code. A process killed by a
+ * signal yields 128 plus the signal number, as in other shells.
+ */
+static int decode_wait_status(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/**
+ * @brief Reports a failed `execvp()` and ends the child process.
+ *
+ * We use `_exit()` rather than `exit()`: it does not flush or close the
+ * stdio streams the child inherited, and closing a copy of `stdin` would
+ * rewind the shared file offset and make the shell re-read its input.
+ * The status follows the usual convention: 127 if the command was not
+ * found, 126 if it was found but could not be run.
+ */
+static void exec_failed(const char *command)
+{
+    int error = errno;
+    fprintf(stderr, "shell: %s: %s\n", command, strerror(error));
+    _exit(error == ENOENT ? 127 : 126);
+}
+
+/**
+ * @brief Closes every descriptor above stderr in a child that is about to
+ * run a command.
+ *
+ * The shell opens all of its own descriptors with `O_CLOEXEC`, so nothing
+ * should be left for a command to inherit; this is the safety net for any
+ * that slip through, such as a pipe writer that would keep a reader from
+ * seeing EOF. When the shell variable `SHELL_FD_DEBUG` is set, descriptors
+ * that would have been inherited (those without `FD_CLOEXEC`) are reported
+ * before they are closed.
+ *
+ * @param command The command the child is about to run, for the report.
+ */
+static void close_inherited_fds(const char *command)
+{
+    size_t length;
+    const char *debug = get_variable("SHELL_FD_DEBUG", 14, &length);
+    if (debug != NULL && length > 0)
+    {
+        DIR *directory = opendir("/proc/self/fd");
+        struct dirent *entry;
+        while (directory != NULL && (entry = readdir(directory)) != NULL)
+        {
+            int fd = atoi(entry->d_name);
+            int flags;
+            if (fd <= STDERR_FILENO || fd == dirfd(directory) ||
+                (flags = fcntl(fd, F_GETFD)) == -1 || (flags & FD_CLOEXEC))
+            {
+                continue;
+            }
+            char link[64];
+            char target[PATH_MAX];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+            ssize_t n = readlink(link, target, sizeof(target) - 1);
+            target[n < 0 ? 0 : n] = '\0';
+            fprintf(stderr, "shell: fd debug: %s inherits fd %d (%s)\n", command, fd, target);
+        }
+        if (directory != NULL)
+        {
+            closedir(directory);
+        }
+    }
+
+    // close_range() needs Linux 5.9; older kernels get the slow loop.
+    if (close_range(STDERR_FILENO + 1, ~0U, 0) == -1)
+    {
+        long max = sysconf(_SC_OPEN_MAX);
+        for (int fd = STDERR_FILENO + 1; fd < (max > 0 ? max : 1024); fd++)
+        {
+            close(fd);
+        }
+    }
+}
+
+/**
+ * @brief Replaces the child process with an external command.
+ *
+ * `path` is the command's location from the command hash table. If the
+ * file has gone away since it was remembered, or is a script without a
+ * `#!` line, `execvp()` gets a second chance to find and run the command.
+ */
+static void exec_command(const char *path, char **args)
+{
+    close_inherited_fds(args[0]);
+    if (path != NULL)
+    {
+        execv(path, args);
+    }
+    execvp(args[0], args);
+    exec_failed(args[0]);
+}
+
+/**
+ * @brief Checks whether a command name refers to an enabled built-in.
+ *
+ * This loops through the list of built-in commands and compares each one
+ * with the name. A built-in switched off with `enable -n` does not count.
+ *
+ * @param name The command name.
+ * @return 1 if `name` is a built-in that has not been disabled, 0 otherwise.
+ */
+int is_builtin(const char *name)
+{
+    for (int i = 0; i < (int)NUM_BUILTINS; i++)
+    {
+        // The `strcmp` function compares two strings. If they are identical,
+        // it returns 0.
+        if (strcmp(name, builtin_commands[i]) == 0)
+        {
+            return !builtin_disabled[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Launches an external command as a new process.
+ *
+ * This is the heart of a shell's execution model. It involves several
+ * key system calls:
+ *
+ * 1.  `fork()`: This creates a new process (the child) that is an exact
+ * copy of the current process (the parent).
+ * 2.  `execvp()`: This call is made in the child process. It replaces the
+ * child's program image with the new program specified by `args[0]`.
+ * It searches for the executable in the directories listed in the
+ * `PATH` environment variable.
+ * 3.  `waitpid()`: This call is made in the parent process. It causes the
+ * parent to pause its execution and wait for the child process to
+ * finish. This prevents "zombie" processes.
+ *
+ * Proper error checking is included for each step.
+ *
+ * @param args An array of strings representing the command and its arguments.
+ * @return 1 on success, 0 on failure.
+ */
+int launch_process(char **args)
+{
+    pid_t pid;
+    int status;
+
+    // Look the command up in the parent, so that the command hash table
+    // remembers it for next time.
+    const char *path = command_path(args[0]);
+
+    // Anything still buffered in stdio must be written now, otherwise the
+    // child would inherit (and later print) its own copy of it.
+    fflush(stdout);
+
+    // With `SHELL_CAPTURE` set, the child's output goes through the shell.
+    // A capture already under way (this may be a task of `parallel`
+    // forked while the built-in's output is captured) is not ours to end.
+    int capturing = capture_begin();
+
+    // Start what the redirections need from the shell (readahead, O_DIRECT
+    // output relays) before the child exists.
+    redirect_prepare(args);
+
+    // Use `fork()` to create a child process.
+    pid = fork();
+
+    if (pid == -1)
+    {
+        // If `fork()` returns -1, an error occurred. This is a critical
+        // failure, as it means the system couldn't create a new process.
+        perror("fork failed");
+        if (capturing)
+        {
+            capture_release();
+            capture_finish();
+        }
+        redirect_wait();
+        return 1;
+    }
+
+    // The `fork` system call returns a different value to the parent and child processes.
+    if (pid == 0)
+    {
+        // This code block is executed by the child process.
+
+        // Restore the default behavior for Ctrl+C (SIGINT).
+        // This means the child process will be terminated if the user
+        // presses Ctrl+C, but the parent shell will remain running.
+        // The child also leaves the shell's event loop, which unblocks
+        // the signals the shell reads from its signalfd.
+        signal(SIGINT, SIG_DFL);
+        event_loop_child();
+
+        // Open the files the command's input and output are redirected to.
+        if (apply_redirections(args) == -1)
+        {
+            _exit(1);
+        }
+
+        // Execute the command, from the path found above if there is one.
+        // This does not return: on failure it reports the error and exits,
+        // usually because the command was not found.
+        exec_command(path, args);
+    }
+    else
+    {
+        // This code block is executed by the parent process.
+
+        // Wait for the child process to finish. `wait_children()` waits
+        // specifically for the child `pid` and not for any other child
+        // processes, and keeps handling signals meanwhile.
+        status = 0;
+        if (capturing)
+        {
+            capture_release();
+        }
+        redirect_release();
+        wait_children(&pid, &status, 1);
+        if (capturing)
+        {
+            capture_finish();
+        }
+
+        // Record how the command ended, for `$?`, `&&` and `||`.
+        last_status = decode_wait_status(status);
+        if (redirect_wait() == -1 && last_status == 0)
+        {
+            last_status = 1;
+        }
+    }
+
+    // The parent process returns 1 to signal that the main loop should
+    // continue to the next command.
+    return 1;
+}
+
+/**
+ * @brief Handles built-in shell commands.
+ *
+ * Built-in commands are part of the shell itself and do not require
+ * forking a new process. This is because they often need to modify the
+ * shell's environment directly, such as changing the current working
+ * directory.
+ *
+ * This function uses a series of `if/else if` statements to check the
+ * command name and execute the corresponding logic.
+ *
+ * @param args An array of strings representing the command and its arguments.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int handle_builtin(char **args)
+{
+    // Check if the command is "exit".
+    if (strcmp(args[0], "exit") == 0)
+    {
+        // If the command is `exit`, we return 0. The main loop will
+        // see this status and terminate. An optional argument becomes the
+        // shell's exit status.
+        if (args[1] != NULL)
+        {
+            last_status = atoi(args[1]) & 0xff;
+        }
+        return 0;
+    }
+
+    // Check if the command is "cd" (change directory).
+    if (strcmp(args[0], "cd") == 0)
+    {
+        // The `cd` command requires at least one argument, which is the
+        // target directory. If no argument is provided, we change to
+        // the user's home directory.
+        last_status = 0;
+        if (args[1] == NULL)
+        {
+            // Get the user's home directory from the environment variables.
+            char *home_dir = getenv("HOME");
+            if (home_dir == NULL)
+            {
+                // If the HOME environment variable is not set, we print an error.
+                fprintf(stderr, "shell: 'cd' requires an argument if HOME is not set.\n");
+                last_status = 1;
+            }
+            else
+            {
+                // Use `chdir` to change the current working directory.
+                // `chdir` is a system call that changes the process's current
+                // working directory. It must be a built-in command because
+                // a child process's `chdir` would not affect the parent shell.
+                if (chdir(home_dir) != 0)
+                {
+                    perror("shell");
+                    last_status = 1;
+                }
+            }
+        }
+        else
+        {
+            // If an argument is provided, we change the directory to the
+            // path specified.
+            if (chdir(args[1]) != 0)
+            {
+                perror("shell");
+                last_status = 1;
+            }
+        }
+
+        // After executing the built-in, we return 1 to continue the loop.
+        return 1;
+    }
+
+    // Check if the command is "filter". When it is not part of a pipeline,
+    // it reads from the shell's own standard input.
+    if (strcmp(args[0], "filter") == 0)
+    {
+        fflush(stdout);
+        int selected = run_filter(args, STDIN_FILENO, STDOUT_FILENO);
+        last_status = (selected > 0) ? 0 : (selected == 0 ? 1 : (selected == -1 ? 2 : 128 + SIGINT));
+        return 1;
+    }
+
+    // Check if the command is "declare", which creates array variables.
+    if (strcmp(args[0], "declare") == 0)
+    {
+        last_status = builtin_declare(args);
+        return 1;
+    }
+
+    // Check if the command is "unset", which removes variables or elements.
+    if (strcmp(args[0], "unset") == 0)
+    {
+        last_status = builtin_unset(args);
+        return 1;
+    }
+
+    // Check if the command is "[[", a conditional expression.
+    if (strcmp(args[0], "[[") == 0)
+    {
+        last_status = builtin_test(args);
+        return 1;
+    }
+
+    // Check if the command is "stats", which reports cache statistics.
+    if (strcmp(args[0], "stats") == 0)
+    {
+        last_status = builtin_stats(args);
+        return 1;
+    }
+
+    // The utility built-ins. Each one replaces an external program that
+    // scripts tend to call very often, saving a fork and an exec per call.
+    if (strcmp(args[0], "true") == 0)
+    {
+        last_status = 0;
+        return 1;
+    }
+    if (strcmp(args[0], "false") == 0)
+    {
+        last_status = 1;
+        return 1;
+    }
+    if (strcmp(args[0], "pwd") == 0)
+    {
+        last_status = builtin_pwd(args);
+        return 1;
+    }
+    if (strcmp(args[0], "basename") == 0)
+    {
+        last_status = builtin_basename(args);
+        return 1;
+    }
+    if (strcmp(args[0], "dirname") == 0)
+    {
+        last_status = builtin_dirname(args);
+        return 1;
+    }
+    if (strcmp(args[0], "seq") == 0)
+    {
+        last_status = builtin_seq(args);
+        return 1;
+    }
+    if (strcmp(args[0], "sleep") == 0)
+    {
+        last_status = builtin_sleep(args);
+        return 1;
+    }
+    if (strcmp(args[0], "kill") == 0)
+    {
+        last_status = builtin_kill(args);
+        return 1;
+    }
+
+    // Check if the command is "enable", which switches built-ins on and off.
+    if (strcmp(args[0], "enable") == 0)
+    {
+        last_status = builtin_enable(args);
+        return 1;
+    }
+
+    if (strcmp(args[0], "parallel") == 0)
+    {
+        last_status = builtin_parallel(args);
+        return 1;
+    }
+
+    if (strcmp(args[0], "hash") == 0)
+    {
+        last_status = builtin_hash(args);
+        return 1;
+    }
+
+    if (strcmp(args[0], "snapshot") == 0)
+    {
+        last_status = builtin_snapshot(args);
+        return 1;
+    }
+
+    if (strcmp(args[0], "alias") == 0)
+    {
+        last_status = builtin_alias(args);
+        return 1;
+    }
+
+    if (strcmp(args[0], "unalias") == 0)
+    {
+        last_status = builtin_unalias(args);
+        return 1;
+    }
+
+    // `source` runs the script in this shell, so an `exit` inside it ends
+    // the shell just like one typed at the prompt.
+    if (strcmp(args[0], "source") == 0 || strcmp(args[0], ".") == 0)
+    {
+        return builtin_source(args);
+    }
+
+    if (strcmp(args[0], "prefetch") == 0)
+    {
+        last_status = builtin_prefetch(args);
+        return 1;
+    }
+
+    // `cp` and `mv` copy many files at once through io_uring.
+    if (strcmp(args[0], "cp") == 0)
+    {
+        last_status = builtin_cp(args);
+        return 1;
+    }
+    if (strcmp(args[0], "mv") == 0)
+    {
+        last_status = builtin_mv(args);
+        return 1;
+    }
+
+    if (strcmp(args[0], "last-output") == 0)
+    {
+        last_status = builtin_last_output(args);
+        return 1;
+    }
+    if (strcmp(args[0], "transcript") == 0)
+    {
+        last_status = builtin_transcript(args);
+        return 1;
+    }
+
+    // If we reach here, a built-in command was called, but the handler
+    // for that specific command has not been implemented.
+    fprintf(stderr, "shell: built-in command '%s' not implemented.\n", args[0]);
+    last_status = 1;
+
+    // Return 1 to continue the main loop.
+    return 1;
+}
+
+/**
+ * @brief Handles commands separated by pipes (`|`).
+ *
+ * This is a more advanced function that demonstrates inter-process communication
+ * using pipes. A pipe is a one-way channel for data flow between two processes.
+ *
+ * The general steps are:
+ * 1.  For every stage except the last, create a pipe using `pipe2()`. This gives
+ * us two file descriptors, one for reading and one for writing, both marked
+ * close-on-exec so that no other stage can inherit them by accident.
+ * 2.  Fork a child process for the stage.
+ * 3.  In the child, redirect its standard input from the read end of the
+ * previous pipe and its standard output to the write end of the new pipe
+ * using `dup2()`. Close the original descriptors. Then `execvp()` the command,
+ * or run it directly if it is a built-in.
+ * 4.  In the parent, close the descriptors that now belong to the child.
+ * 5.  Once every stage is started, wait for all child processes to finish.
+ *
+ * The first `filter` stage is special: instead of forking a child for it, the
+ * shell keeps that stage's two descriptors and runs the filter loop itself
+ * after all other stages have been started. This saves a fork and an exec
+ * for the most common pipeline stage, `... | grep -F needle | ...`.
+ *
+ * @param commands An array of argument arrays, one per pipeline stage.
+ * @param num_commands The number of stages in `commands`.
+ * @return 1 if the shell should continue running.
+ */
+int handle_pipe(char ***commands, int num_commands)
+{
+    // Check for invalid commands. Every stage of a pipe needs a command.
+    for (int i = 0; i < num_commands; i++)
+    {
+        if (commands[i][0] == NULL)
+        {
+            fprintf(stderr, "shell: Invalid command usage with pipe.\n");
+            return 1;
+        }
+    }
+
+    pid_t pids[MAX_ARGS];
+    int prev_read = -1;
+
+    // The stage run inside the shell, if any, and its two descriptors.
+    int in_process = -1;
+    int in_process_in = STDIN_FILENO;
+    int in_process_out = STDOUT_FILENO;
+
+    // Anything still buffered in stdio must be written now, otherwise each
+    // child would inherit (and later print) its own copy of it.
+    fflush(stdout);
+
+    // A captured pipeline writes into pipes the shell drains while it waits
+    // for the stages, so no stage can run inside the shell meanwhile.
+    int capturing = capture_begin();
+
+    for (int i = 0; i < num_commands; i++)
+    {
+        // A pipe is a pair of file descriptors. The first element is for
+        // reading, the second for writing. The last stage writes to stdout.
+        int pipe_fd[2] = {-1, -1};
+        if (i < num_commands - 1 && pipe2(pipe_fd, O_CLOEXEC) == -1)
+        {
+            perror("pipe failed");
+            num_commands = i;
+            break;
+        }
+
+        int in_fd = (prev_read == -1) ? STDIN_FILENO : prev_read;
+        int out_fd = (pipe_fd[1] == -1) ? STDOUT_FILENO : pipe_fd[1];
+        prev_read = pipe_fd[0];
+
+        if (in_process == -1 && !capturing && strcmp(commands[i][0], "filter") == 0 && is_builtin("filter") &&
+            !has_redirections(commands[i]))
+        {
+            // Keep this stage's descriptors open in the shell; it runs once
+            // every other stage has been forked.
+            in_process = i;
+            in_process_in = in_fd;
+            in_process_out = out_fd;
+            pids[i] = -1;
+            continue;
+        }
+
+        const char *path = is_builtin(commands[i][0]) ? NULL : command_path(commands[i][0]);
+        redirect_prepare(commands[i]);
+        pids[i] = fork();
+        if (pids[i] == -1)
+        {
+            perror("fork failed for pipeline stage");
+            if (in_fd != STDIN_FILENO && in_fd != in_process_in)
+            {
+                close(in_fd);
+            }
+            if (out_fd != STDOUT_FILENO)
+            {
+                close(out_fd);
+            }
+            if (prev_read != -1)
+            {
+                close(prev_read);
+                prev_read = -1;
+            }
+            num_commands = i;
+            break;
+        }
+
+        // This block is for the child process.
+        if (pids[i] == 0)
+        {
+            // We restore the default behavior for Ctrl+C.
+            signal(SIGINT, SIG_DFL);
+            event_loop_child();
+
+            // The read end of our own output pipe belongs to the next stage.
+            if (pipe_fd[0] != -1)
+            {
+                close(pipe_fd[0]);
+            }
+
+            // Descriptors the shell holds for its in-process stage must not
+            // leak into us, or the stage reading from them never sees EOF.
+            if (in_process != -1)
+            {
+                if (in_process_in != STDIN_FILENO)
+                {
+                    close(in_process_in);
+                }
+                if (in_process_out != STDOUT_FILENO)
+                {
+                    close(in_process_out);
+                }
+            }
+
+            // Redirect standard input and output. `dup2` duplicates an old
+            // file descriptor onto a new one, after which the original can
+            // be closed.
+            if (in_fd != STDIN_FILENO)
+            {
+                if (dup2(in_fd, STDIN_FILENO) == -1)
+                {
+                    perror("dup2 failed for pipeline stage");
+                    _exit(1);
+                }
+                close(in_fd);
+            }
+            if (out_fd != STDOUT_FILENO)
+            {
+                if (dup2(out_fd, STDOUT_FILENO) == -1)
+                {
+                    perror("dup2 failed for pipeline stage");
+                    _exit(1);
+                }
+                close(out_fd);
+            }
+
+            // A stage's own redirections take precedence over the pipes.
+            if (apply_redirections(commands[i]) == -1)
+            {
+                _exit(1);
+            }
+
+            // Built-ins run directly in the child; there is nothing to exec,
+            // so nothing closes the shell's descriptors for us.
+            if (is_builtin(commands[i][0]))
+            {
+                close_inherited_fds(commands[i][0]);
+                handle_builtin(commands[i]);
+                fflush(stdout);
+                _exit(last_status);
+            }
+
+            // Execute the command.
+            exec_command(path, commands[i]);
+        }
+
+        // Parent process block. The descriptors we just handed to the child
+        // are no longer needed here, unless the in-process stage uses them.
+        redirect_release();
+        if (in_fd != STDIN_FILENO && in_fd != in_process_in)
+        {
+            close(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO && out_fd != in_process_out)
+        {
+            close(out_fd);
+        }
+    }
+
+    // If the pipeline had to be cut short, the last pipe's read end is
+    // still open in the shell.
+    if (prev_read != -1 && prev_read != in_process_in)
+    {
+        close(prev_read);
+    }
+    if (capturing)
+    {
+        capture_release();
+    }
+
+    // Run the in-process stage. A downstream stage may exit early (think
+    // `head -1`), so SIGPIPE is ignored while we write and the resulting
+    // EPIPE error simply ends the filter.
+    int filter_status = 0;
+    if (in_process != -1 && in_process < num_commands)
+    {
+        void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+        int selected = run_filter(commands[in_process], in_process_in, in_process_out);
+        signal(SIGPIPE, old_handler);
+        filter_status = (selected > 0) ? 0 : (selected == 0 ? 1 : (selected == -1 ? 2 : 128 + SIGINT));
+    }
+    if (in_process != -1)
+    {
+        if (in_process_in != STDIN_FILENO)
+        {
+            close(in_process_in);
+        }
+        if (in_process_out != STDOUT_FILENO)
+        {
+            close(in_process_out);
+        }
+    }
+
+    // Wait for every child to finish, in whatever order they exit. The
+    // status of the pipeline is the status of its last stage.
+    int statuses[MAX_ARGS] = {0};
+    wait_children(pids, statuses, num_commands);
+    if (capturing)
+    {
+        capture_finish();
+    }
+    for (int i = 0; i < num_commands; i++)
+    {
+        if (pids[i] > 0)
+        {
+            last_status = decode_wait_status(statuses[i]);
+        }
+        else if (i == in_process)
+        {
+            last_status = filter_status;
+        }
+    }
+    if (redirect_wait() == -1 && last_status == 0)
+    {
+        last_status = 1;
+    }
+
+    // Return 1 to continue the shell loop.
+    return 1;
+}
+
+/**
+ * @brief Frees the memory allocated for an array of strings.
+ *
+ * This is a crucial helper function to prevent memory leaks. The argument
+ * arrays made by `parse_line()` (and the task lists of `parallel`) are a
+ * single allocation: the array of pointers is followed by the strings it
+ * points to, packed one after another. One `free()` releases everything,
+ * and the words of a command sit next to each other in memory instead of
+ * being scattered across the heap.
+ *
+ * The program name may instead point at its interned copy (see
+ * `tokenize()`), which lives for as long as the shell and is not freed.
+ *
+ * @param args The array of strings to be freed.
+ */
+void free_args(char **args)
+{
+    // The strings live in the same block as the array.
+    free(args);
+}
+
+/* ========================================================================= */
+/* REDIRECTIONS                                  */
+/* ========================================================================= */
+
+/*
+ * A command may redirect its standard input, output and error with the
+ * words `<`, `>`, `>>`, `N<`, `N>`, `N>>` and `N>&M` (N and M being 0, 1
+ * or 2), followed by a file name, either attached (`>out`) or as the next
+ * word. Like `|`, the operators are recognised as words, after quotes are
+ * removed.
+ *
+ * Redirections are applied in the child, just before the exec, so the
+ * shell's own descriptors are never touched (built-ins run in the shell
+ * save and restore theirs). Two things help with big files:
+ *
+ * - An input file is opened with access hints: sequential access, which
+ *   doubles the kernel's readahead window, and an early read of its start,
+ *   so the program's small first reads do not each wait for the disk.
+ *   `SHELL_READAHEAD=MB` also has a shell thread read that many megabytes
+ *   ahead in the background while the command starts.
+ * - With `SHELL_DIRECT_OUTPUT=1`, output files are written with O_DIRECT,
+ *   so a huge sequential write does not push everything else out of the
+ *   page cache. Programs cannot be trusted to write aligned blocks, so the
+ *   command writes into a pipe and a shell thread copies the pipe to the
+ *   file in aligned blocks.
+ *
+ * The names `/dev/tcp/HOST/PORT` and `/dev/unix/PATH` are not files: the
+ * redirection connects a socket to the service and gives it to the command
+ * as the descriptor, so `cmd > /dev/tcp/127.0.0.1/9000` sends the output
+ * without an `nc` in between. The connection is made without blocking and
+ * given up after `SHELL_CONNECT_TIMEOUT` seconds (REDIRECT_CONNECT_TIMEOUT
+ * by default).
+ */
+
+/**
+ * @brief Most redirections one command can have.
+ */
+#define MAX_REDIRECTIONS 16
+
+/**
+ * @brief How much of an input file is requested as soon as it is opened.
+ */
+#define REDIRECT_WILLNEED (4UL << 20)
+
+/**
+ * @brief Milliseconds a socket redirection may take to connect, unless
+ * `SHELL_CONNECT_TIMEOUT` says otherwise.
+ */
+#define REDIRECT_CONNECT_TIMEOUT 5000
+
+/**
+ * @brief Alignment and size of the blocks written with O_DIRECT.
+ */
+#define DIRECT_BLOCK 4096
+
+/**
+ * @brief Size of the buffer a direct output relay copies through.
+ */
+#define DIRECT_BUFFER (1UL << 20)
+
+/**
+ * @brief The kinds of redirection.
+ */
+enum
+{
+    REDIRECT_INPUT,  // N< FILE
+    REDIRECT_OUTPUT, // N> FILE
+    REDIRECT_APPEND, // N>> FILE
+    REDIRECT_DUP     // N>&M
+};
+
+/**
+ * @brief One parsed redirection word.
+ */
+typedef struct
+{
+    int kind;
+    int fd;            // The descriptor redirected.
+    int source;        // For REDIRECT_DUP: the descriptor copied.
+    const char *path;  // The file name if attached to the operator, else NULL.
+} redirection;
+
+/**
+ * @brief A shell thread copying a command's output to an O_DIRECT file.
+ */
+typedef struct
+{
+    const char *word;  // The redirection's file name word, to match it in the child.
+    int pipe_read;
+    int pipe_write;    // Closed in the shell as soon as the child has it.
+    int file;
+    int error;         // errno of a failed write, or 0.
+    pthread_t thread;
+} direct_relay;
+
+static int write_all(int fd, const char *data, size_t length);
+
+/**
+ * @brief The relays of the command (or pipeline) being started.
+ */
+static struct
+{
+    direct_relay relays[MAX_REDIRECTIONS];
+    int count;
+} direct_output;
+
+/**
+ * @brief Recognises a redirection word.
+ *
+ * The operator must be written unquoted, so `echo '>' x` prints `> x`;
+ * an attached file name may be quoted or expanded, as in `>"$log"`.
+ *
+ * @return 0 if the word is not a redirection, 1 if it is complete (a
+ *         duplication, or a file name attached), 2 if the file name is the
+ *         next word.
+ */
+static int parse_redirection(const char *word, redirection *r)
+{
+    const char *p = word;
+    r->fd = -1;
+    if (*p >= '0' && *p <= '2' && (p[1] == '<' || p[1] == '>'))
+    {
+        r->fd = *p++ - '0';
+    }
+    if (*p == '<')
+    {
+        r->kind = REDIRECT_INPUT;
+        p++;
+    }
+    else if (*p == '>' && p[1] == '>')
+    {
+        r->kind = REDIRECT_APPEND;
+        p += 2;
+    }
+    else if (*p == '>')
+    {
+        r->kind = REDIRECT_OUTPUT;
+        p++;
+    }
+    else
+    {
+        return 0;
+    }
+    if (r->fd == -1)
+    {
+        r->fd = (r->kind == REDIRECT_INPUT) ? STDIN_FILENO : STDOUT_FILENO;
+    }
+    if (r->kind == REDIRECT_OUTPUT && p[0] == '&' && p[1] >= '0' && p[1] <= '2' && p[2] == '\0' &&
+        word_is_unquoted(word, p + 2 - word))
+    {
+        r->kind = REDIRECT_DUP;
+        r->source = p[1] - '0';
+        return 1;
+    }
+    if (!word_is_unquoted(word, p - word))
+    {
+        return 0;
+    }
+    r->path = (*p != '\0') ? p : NULL;
+    return r->path ? 1 : 2;
+}
+
+/**
+ * @brief Checks whether a command has any redirections.
+ *
+ * `[[ a < b ]]` compares strings, so the words of a conditional expression
+ * are never redirections.
+ */
+int has_redirections(char **args)
+{
+    if (args[0] == NULL || strcmp(args[0], "[[") == 0)
+    {
+        return 0;
+    }
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        redirection r;
+        if (parse_redirection(args[i], &r))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the relay started for a redirection's file name word.
+ */
+static direct_relay *find_relay(const char *word)
+{
+    for (int i = 0; i < direct_output.count; i++)
+    {
+        if (direct_output.relays[i].word == word)
+        {
+            return &direct_output.relays[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks whether a redirection names a socket rather than a file.
+ */
+static int is_socket_redirection(const char *path)
+{
+    return strncmp(path, "/dev/tcp/", 9) == 0 || strncmp(path, "/dev/unix/", 10) == 0;
+}
+
+/**
+ * @brief Returns the CLOCK_MONOTONIC time in milliseconds.
+ */
+static long long monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Connects a non-blocking socket, waiting at most until `deadline`
+ * (CLOCK_MONOTONIC milliseconds), and makes it blocking again for the
+ * command.
+ *
+ * @return 0 on success, -1 with errno set.
+ */
+static int connect_until(int fd, const struct sockaddr *address, socklen_t length, long long deadline)
+{
+    if (connect(fd, address, length) == -1)
+    {
+        if (errno != EINPROGRESS && errno != EAGAIN)
+        {
+            return -1;
+        }
+        // A UNIX socket whose listener's backlog is full cannot be polled
+        // for; it waits in connect(), bounded by the send timeout.
+        if (errno == EAGAIN)
+        {
+            long long left = deadline - monotonic_ms();
+            struct timeval timeout = {left > 0 ? left / 1000 : 0, left > 0 ? (left % 1000) * 1000 : 1};
+            struct timeval none = {0, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            int result = connect(fd, address, length);
+            int saved = errno;
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+            errno = (result == -1 && (saved == EAGAIN || saved == EINPROGRESS)) ? ETIMEDOUT : saved;
+            return result;
+        }
+
+        int ready;
+        struct pollfd p = {fd, POLLOUT, 0};
+        do
+        {
+            long long left = deadline - monotonic_ms();
+            ready = poll(&p, 1, left > 0 ? (int)left : 0);
+        } while (ready == -1 && errno == EINTR);
+        int error = 0;
+        socklen_t size = sizeof(error);
+        if (ready == 0)
+        {
+            error = ETIMEDOUT;
+        }
+        else if (ready == -1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1)
+        {
+            error = errno;
+        }
+        if (error != 0)
+        {
+            errno = error;
+            return -1;
+        }
+    }
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+/**
+ * @brief Opens a socket redirection: connects to `/dev/tcp/HOST/PORT` (each
+ * address of HOST in turn, all within the timeout) or `/dev/unix/PATH`.
+ *
+ * @return The connected socket, or -1 with errno set.
+ */
+static int connect_redirection(const char *path)
+{
+    size_t length;
+    const char *value = get_variable("SHELL_CONNECT_TIMEOUT", 21, &length);
+    long long timeout = (value != NULL && length > 0) ? (long long)(atof(value) * 1000) : REDIRECT_CONNECT_TIMEOUT;
+    long long deadline = monotonic_ms() + timeout;
+
+    if (strncmp(path, "/dev/unix/", 10) == 0)
+    {
+        struct sockaddr_un local = {0};
+        const char *name = path + 9; // Keeps the slash: /dev/unix/tmp/s is /tmp/s.
+        if (strlen(name) >= sizeof(local.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, name);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect_until(fd, (struct sockaddr *)&local, sizeof(local), deadline) == -1)
+        {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            fd = -1;
+        }
+        return fd;
+    }
+
+    // The port is the last component, so a host may be an IPv6 address.
+    const char *host = path + 9;
+    const char *slash = strrchr(host, '/');
+    char name[256];
+    if (slash == NULL || slash == host || slash[1] == '\0' || (size_t)(slash - host) >= sizeof(name))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(name, host, slash - host);
+    name[slash - host] = '\0';
+
+    struct addrinfo hints = {0};
+    struct addrinfo *list;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(name, slash + 1, &hints, &list);
+    if (error != 0)
+    {
+        errno = (error == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = list; ai != NULL && fd == -1; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect_until(fd, ai->ai_addr, ai->ai_addrlen, deadline) == -1)
+        {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/**
+ * @brief Opens the file of a redirection, with access hints for input.
+ *
+ * @return The descriptor, or -1 with errno set.
+ */
+static int open_redirection(const redirection *r, const char *path)
+{
+    if (is_socket_redirection(path))
+    {
+        return connect_redirection(path);
+    }
+    if (r->kind != REDIRECT_INPUT)
+    {
+        int flags = O_WRONLY | O_CREAT | (r->kind == REDIRECT_APPEND ? O_APPEND : O_TRUNC);
+        return open(path, flags, 0666);
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd != -1 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, REDIRECT_WILLNEED, POSIX_FADV_WILLNEED);
+    }
+    return fd;
+}
+
+/**
+ * @brief Applies a command's redirections and removes them from its words.
+ *
+ * This runs in the child process that is about to exec the command (or in
+ * the shell for a built-in, between `save_std_fds()` and
+ * `restore_std_fds()`).
+ *
+ * @return 0 on success, -1 if a file cannot be opened or a file name is
+ *         missing (reported on stderr).
+ */
+int apply_redirections(char **args)
+{
+    if (!has_redirections(args))
+    {
+        return 0;
+    }
+    int kept = 0;
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        redirection r;
+        int form = parse_redirection(args[i], &r);
+        if (form == 0)
+        {
+            args[kept++] = args[i];
+            continue;
+        }
+        const char *path = r.path;
+        if (form == 2)
+        {
+            path = args[++i];
+            if (path == NULL)
+            {
+                fprintf(stderr, "shell: syntax error: no file name after '%s'\n", args[i - 1]);
+                return -1;
+            }
+        }
+
+        int fd;
+        direct_relay *relay = (r.kind == REDIRECT_DUP) ? NULL : find_relay(path);
+        if (r.kind == REDIRECT_DUP)
+        {
+            fd = dup(r.source);
+        }
+        else if (relay != NULL)
+        {
+            fd = dup(relay->pipe_write);
+        }
+        else
+        {
+            fd = open_redirection(&r, path);
+        }
+        if (fd == -1)
+        {
+            fprintf(stderr, "shell: %s: %s\n", r.kind == REDIRECT_DUP ? args[i] : path, strerror(errno));
+            return -1;
+        }
+        if (fd != r.fd)
+        {
+            dup2(fd, r.fd);
+            close(fd);
+        }
+    }
+    args[kept] = NULL;
+    return 0;
+}
+
+/**
+ * @brief Saves the shell's standard descriptors before a built-in's
+ * redirections replace them.
+ */
+void save_std_fds(int saved[3])
+{
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++)
+    {
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    }
+}
+
+/**
+ * @brief Puts back the descriptors saved by `save_std_fds()`.
+ */
+void restore_std_fds(const int saved[3])
+{
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++)
+    {
+        if (saved[fd] != -1)
+        {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+}
+
+/**
+ * @brief What a background readahead thread reads.
+ */
+typedef struct
+{
+    size_t bytes;
+    char path[]; // NUL-terminated.
+} readahead_request;
+
+/**
+ * @brief Thread body: reads the first megabytes of an input file ahead of
+ * the command that reads it.
+ *
+ * @param arg A `readahead_request`, which the thread frees.
+ */
+static void *readahead_thread(void *arg)
+{
+    readahead_request *request = arg;
+    size_t bytes = request->bytes;
+    int fd = open(request->path, O_RDONLY | O_CLOEXEC);
+    free(request);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    // In steps, so that the command's own reads are not stuck behind one
+    // huge request.
+    struct stat info;
+    off_t size = (fstat(fd, &info) == 0) ? info.st_size : 0;
+    for (off_t offset = 0; offset < size && (size_t)offset < bytes; offset += 2 << 20)
+    {
+        readahead(fd, offset, 2 << 20);
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Thread body: copies a command's output from a pipe to a file
+ * opened with O_DIRECT.
+ *
+ * Whole aligned blocks go straight to the disk. A tail that does not fill
+ * a block at the end (or the start of a file appended to at an unaligned
+ * size) is written through the page cache, since O_DIRECT cannot write it.
+ */
+static void *direct_relay_thread(void *arg)
+{
+    direct_relay *relay = arg;
+    char *buffer = NULL;
+    if (posix_memalign((void **)&buffer, DIRECT_BLOCK, DIRECT_BUFFER) != 0)
+    {
+        relay->error = ENOMEM;
+        return NULL;
+    }
+
+    int flags = fcntl(relay->file, F_GETFL);
+    off_t end = lseek(relay->file, 0, SEEK_END);
+    size_t unaligned = (end > 0 && end % DIRECT_BLOCK) ? DIRECT_BLOCK - end % DIRECT_BLOCK : 0;
+    size_t filled = 0;
+    for (;;)
+    {
+        ssize_t n = read(relay->pipe_read, buffer + filled, DIRECT_BUFFER - filled);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        filled += (n > 0) ? n : 0;
+        if (unaligned > 0 && (filled >= unaligned || n <= 0))
+        {
+            // Bring an appended file up to a block boundary first.
+            size_t head = filled < unaligned ? filled : unaligned;
+            fcntl(relay->file, F_SETFL, flags & ~O_DIRECT);
+            if (relay->error == 0 && write_all(relay->file, buffer, head) == -1)
+            {
+                relay->error = errno;
+            }
+            fcntl(relay->file, F_SETFL, flags);
+            memmove(buffer, buffer + head, filled - head);
+            filled -= head;
+            unaligned -= head;
+        }
+        size_t whole = (n <= 0 || filled == DIRECT_BUFFER) ? filled - filled % DIRECT_BLOCK : 0;
+        if (unaligned == 0 && whole > 0)
+        {
+            if (relay->error == 0 && write_all(relay->file, buffer, whole) == -1)
+            {
+                relay->error = errno;
+            }
+            memmove(buffer, buffer + whole, filled - whole);
+            filled -= whole;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+    if (filled > 0)
+    {
+        fcntl(relay->file, F_SETFL, flags & ~O_DIRECT);
+        if (relay->error == 0 && write_all(relay->file, buffer, filled) == -1)
+        {
+            relay->error = errno;
+        }
+    }
+    free(buffer);
+    close(relay->pipe_read);
+    return NULL;
+}
+
+/**
+ * @brief Prepares, in the shell, what a command's redirections need
+ * before the command is forked: background readahead of input files and
+ * relays for O_DIRECT output files.
+ *
+ * An output file that cannot be opened with O_DIRECT (tmpfs, for one) is
+ * left to the child to open normally.
+ */
+void redirect_prepare(char **args)
+{
+    if (!has_redirections(args))
+    {
+        return;
+    }
+    size_t length;
+    const char *value = get_variable("SHELL_READAHEAD", 15, &length);
+    long megabytes = value ? atol(value) : 0;
+    value = get_variable("SHELL_DIRECT_OUTPUT", 19, &length);
+    int direct = value != NULL && strcmp(value, "1") == 0;
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        redirection r;
+        int form = parse_redirection(args[i], &r);
+        const char *path = (form == 2) ? args[i + 1] : r.path;
+        if (form == 0 || r.kind == REDIRECT_DUP || path == NULL)
+        {
+            continue;
+        }
+        i += (form == 2);
+        if (is_socket_redirection(path))
+        {
+            continue;
+        }
+
+        if (r.kind == REDIRECT_INPUT && megabytes > 0)
+        {
+            readahead_request *request = malloc(sizeof(readahead_request) + strlen(path) + 1);
+            pthread_t thread;
+            pthread_attr_t attributes;
+            pthread_attr_init(&attributes);
+            pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+            if (request != NULL)
+            {
+                request->bytes = (size_t)megabytes << 20;
+                strcpy(request->path, path);
+                if (pthread_create(&thread, &attributes, readahead_thread, request) != 0)
+                {
+                    free(request);
+                }
+            }
+            pthread_attr_destroy(&attributes);
+        }
+        else if (r.kind != REDIRECT_INPUT && direct && direct_output.count < MAX_REDIRECTIONS)
+        {
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_DIRECT | (r.kind == REDIRECT_APPEND ? O_APPEND : O_TRUNC);
+            direct_relay *relay = &direct_output.relays[direct_output.count];
+            int pipe_fd[2];
+            relay->file = open(path, flags, 0666);
+            if (relay->file == -1)
+            {
+                continue;
+            }
+            if (pipe2(pipe_fd, O_CLOEXEC) == -1)
+            {
+                close(relay->file);
+                continue;
+            }
+            relay->word = path;
+            relay->pipe_read = pipe_fd[0];
+            relay->pipe_write = pipe_fd[1];
+            relay->error = 0;
+            if (pthread_create(&relay->thread, NULL, direct_relay_thread, relay) != 0)
+            {
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+                close(relay->file);
+                continue;
+            }
+            direct_output.count++;
+        }
+    }
+}
+
+/**
+ * @brief Closes the shell's copies of the relay pipes once the child that
+ * writes to them has been forked, so the relays see end of file when the
+ * command exits.
+ */
+void redirect_release(void)
+{
+    for (int i = 0; i < direct_output.count; i++)
+    {
+        direct_relay *relay = &direct_output.relays[i];
+        if (relay->pipe_write != -1)
+        {
+            close(relay->pipe_write);
+            relay->pipe_write = -1;
+        }
+    }
+}
+
+/**
+ * @brief Waits for the relays of a finished command to write out the last
+ * of its output.
+ *
+ * @return 0 on success, -1 if a relay could not write its file (reported).
+ */
+int redirect_wait(void)
+{
+    int status = 0;
+    redirect_release();
+    for (int i = 0; i < direct_output.count; i++)
+    {
+        direct_relay *relay = &direct_output.relays[i];
+        pthread_join(relay->thread, NULL);
+        if (close(relay->file) == -1 && relay->error == 0)
+        {
+            relay->error = errno;
+        }
+        if (relay->error != 0)
+        {
+            fprintf(stderr, "shell: %s: %s\n", relay->word, strerror(relay->error));
+            status = -1;
+        }
+    }
+    direct_output.count = 0;
+    return status;
+}
+
+/* ========================================================================= */
+/* EVENT LOOP                                    */
+/* ========================================================================= */
+
+/*
+ * Everything the shell waits for goes through one epoll set: standard
+ * input, a signalfd for SIGCHLD, SIGINT, SIGWINCH and SIGTSTP, a timerfd for
+ * timeouts, and a pidfd for each child being waited for. The four signals
+ * stay blocked in the shell, so there are no signal handlers and no window
+ * between checking for a signal and going to sleep; a wakeup handles the
+ * whole batch of events that are ready.
+ *
+ * Forked children do not use the loop (see `event_loop_child()`), and if
+ * it cannot be set up the shell falls back to blocking calls.
+ */
+
+/**
+ * @brief What an epoll event is about; the low byte of its data.
+ *
+ * For EVENT_CHILD the rest of the data is the child's index in the array
+ * passed to `wait_children()`; for EVENT_STREAM it is the slot of a task's
+ * tagged stderr pipe (see `parallel_local()`); for EVENT_CAPTURE it is 0 or
+ * 1, the standard output or error of a command whose output is captured.
+ */
+enum
+{
+    EVENT_INPUT,
+    EVENT_SIGNAL,
+    EVENT_TIMER,
+    EVENT_CHILD,
+    EVENT_STREAM,
+    EVENT_CAPTURE
+};
+
+/**
+ * @brief Most events taken from the kernel in one wakeup.
+ */
+#define EVENT_BATCH 16
+
+/**
+ * @brief The descriptors of the event loop.
+ */
+static struct
+{
+    int epoll_fd;        // -1 if the loop is not in use.
+    int signal_fd;
+    int timer_fd;
+    int input_ready;     // Standard input cannot be polled (a regular file).
+    sigset_t signals;    // The signals read from `signal_fd`.
+    sigset_t saved_mask; // The mask to give back to children.
+    unsigned long interrupts; // Ctrl+C presses seen at the prompt.
+} event_loop = {.epoll_fd = -1, .signal_fd = -1, .timer_fd = -1};
+
+/**
+ * @brief Adds a descriptor to an epoll set.
+ *
+ * @param epoll_fd The set: the event loop's, or a private one such as
+ *        `parallel_local()` keeps.
+ * @return 0 on success, -1 on error.
+ */
+static int event_add_to(int epoll_fd, int fd, int kind, int index)
+{
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)kind | ((uint64_t)index << 8);
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * @brief Adds a descriptor to the event loop's epoll set.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int event_add(int fd, int kind, int index)
+{
+    return event_add_to(event_loop.epoll_fd, fd, kind, index);
+}
+
+/**
+ * @brief Waits for the next batch of events in an epoll set, retrying if
+ * interrupted.
+ *
+ * @param timeout Milliseconds to wait, or -1 for no limit.
+ * @return The number of events in `ready`, or -1 on error.
+ */
+static int event_next_in(int epoll_fd, struct epoll_event *ready, int timeout)
+{
+    int n;
+    do
+    {
+        n = epoll_wait(epoll_fd, ready, EVENT_BATCH, timeout);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/**
+ * @brief Waits for the next batch of events in the event loop's set.
+ *
+ * @param timeout Milliseconds to wait, or -1 for no limit.
+ * @return The number of events in `ready`, or -1 on error.
+ */
+static int event_next(struct epoll_event *ready, int timeout)
+{
+    return event_next_in(event_loop.epoll_fd, ready, timeout);
+}
+
+/**
+ * @brief Sets `COLUMNS` and `LINES` from the size of the terminal.
+ */
+static void update_window_size(void)
+{
+    struct winsize size;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_col == 0)
+    {
+        return;
+    }
+    char number[16];
+    int length = snprintf(number, sizeof(number), "%u", size.ws_col);
+    set_variable("COLUMNS", 7, number, length);
+    length = snprintf(number, sizeof(number), "%u", size.ws_row);
+    set_variable("LINES", 5, number, length);
+}
+
+/**
+ * @brief Reads every pending signal from the signalfd.
+ *
+ * SIGCHLD needs no action of its own, since each child is reaped when its
+ * pidfd becomes readable, and SIGTSTP is read only so that Ctrl+Z does not
+ * stop the shell. A change of terminal size updates `COLUMNS` and `LINES`.
+ *
+ * @return The number of SIGINTs among them.
+ */
+static int event_signals(void)
+{
+    struct signalfd_siginfo info[8];
+    int interrupts = 0;
+    ssize_t n;
+    while ((n = read(event_loop.signal_fd, info, sizeof(info))) > 0)
+    {
+        for (size_t i = 0; i < (size_t)n / sizeof(info[0]); i++)
+        {
+            if (info[i].ssi_signo == SIGINT)
+            {
+                interrupts++;
+            }
+            else if (info[i].ssi_signo == SIGWINCH)
+            {
+                update_window_size();
+            }
+        }
+    }
+    return interrupts;
+}
+
+/**
+ * @brief Starts (or, with a zero `when`, stops) the timerfd.
+ *
+ * @param when The expiry time.
+ * @param absolute Whether `when` is a CLOCK_MONOTONIC time rather than an
+ *        interval from now.
+ */
+static void event_timer(const struct timespec *when, int absolute)
+{
+    struct itimerspec setting = {0};
+    setting.it_value = *when;
+    timerfd_settime(event_loop.timer_fd, absolute ? TFD_TIMER_ABSTIME : 0, &setting, NULL);
+}
+
+/**
+ * @brief Sets up the event loop.
+ *
+ * On failure the shell carries on without it, ignoring SIGINT so that
+ * Ctrl+C does not kill it.
+ */
+void event_loop_init(void)
+{
+    sigemptyset(&event_loop.signals);
+    sigaddset(&event_loop.signals, SIGCHLD);
+    sigaddset(&event_loop.signals, SIGINT);
+    sigaddset(&event_loop.signals, SIGWINCH);
+    sigaddset(&event_loop.signals, SIGTSTP);
+    if (sigprocmask(SIG_BLOCK, &event_loop.signals, &event_loop.saved_mask) == -1)
+    {
+        signal(SIGINT, SIG_IGN);
+        return;
+    }
+
+    event_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_loop.signal_fd = signalfd(-1, &event_loop.signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    event_loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (event_loop.epoll_fd == -1 || event_loop.signal_fd == -1 || event_loop.timer_fd == -1 ||
+        event_add(event_loop.signal_fd, EVENT_SIGNAL, 0) == -1 ||
+        event_add(event_loop.timer_fd, EVENT_TIMER, 0) == -1)
+    {
+        perror("shell: event loop");
+        event_loop_child();
+        signal(SIGINT, SIG_IGN);
+        return;
+    }
+
+    // A regular file cannot be added to an epoll set, but it is always
+    // ready to read anyway. Standard input only joins the set while
+    // `wait_for_input()` runs: left in, a pipe at end of file or holding
+    // unread lines would keep waking every other wait.
+    event_loop.input_ready = (event_add(STDIN_FILENO, EVENT_INPUT, 0) == -1);
+    if (!event_loop.input_ready)
+    {
+        epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    }
+
+    // Whoever started the shell may have left SIGINT ignored, and a
+    // blocked signal that is ignored is discarded rather than left
+    // pending, so it goes back to its default action to reach the
+    // signalfd.
+    signal(SIGINT, SIG_DFL);
+    if (isatty(STDIN_FILENO))
+    {
+        update_window_size();
+    }
+}
+
+/**
+ * @brief Leaves the event loop in a newly forked child.
+ *
+ * The epoll set is shared with the parent across `fork()`, so a child must
+ * not touch it: the child closes its copies of the descriptors and gets
+ * the signal mask the shell started with. In the shell itself this is how
+ * a failed `event_loop_init()` is undone.
+ */
+void event_loop_child(void)
+{
+    if (event_loop.epoll_fd == -1 && event_loop.signal_fd == -1 && event_loop.timer_fd == -1)
+    {
+        return;
+    }
+    int *fds[] = {&event_loop.epoll_fd, &event_loop.signal_fd, &event_loop.timer_fd};
+    for (int i = 0; i < 3; i++)
+    {
+        if (*fds[i] != -1)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &event_loop.saved_mask, NULL);
+}
+
+/**
+ * @brief Waits until standard input has something to read.
+ *
+ * Ctrl+C at the prompt abandons the line and prompts again. If `TMOUT` is
+ * set to a number of seconds and the input is a terminal, the shell gives
+ * up after that long without input, as bash does.
+ *
+ * @param pause Milliseconds after which to give up waiting, or -1 to wait
+ *        for as long as it takes; the line editor uses this to notice when
+ *        the user stops typing.
+ * @return 1 when input is ready, 0 if `TMOUT` expired, -1 if `pause` ran
+ *         out first.
+ */
+int wait_for_input(int pause)
+{
+    if (event_loop.epoll_fd == -1 || event_loop.input_ready)
+    {
+        return 1;
+    }
+
+    size_t length;
+    const char *value = get_variable("TMOUT", 5, &length);
+    long timeout = (value != NULL && isatty(STDIN_FILENO)) ? atol(value) : 0;
+    if (event_add(STDIN_FILENO, EVENT_INPUT, 0) == -1)
+    {
+        return 1;
+    }
+    struct timespec when = {timeout > 0 ? timeout : 0, 0};
+    event_timer(&when, 0);
+
+    struct epoll_event ready[EVENT_BATCH];
+    int input = 0;
+    int expired = 0;
+    int paused = 0;
+    while (!input && !expired && !paused)
+    {
+        int n = event_next(ready, pause);
+        if (n == -1)
+        {
+            break;
+        }
+        paused = (n == 0);
+        for (int i = 0; i < n; i++)
+        {
+            int kind = ready[i].data.u64 & 0xff;
+            if (kind == EVENT_INPUT)
+            {
+                input = 1;
+            }
+            else if (kind == EVENT_SIGNAL && event_signals() > 0)
+            {
+                event_loop.interrupts++;
+                printf("\n> ");
+                fflush(stdout);
+            }
+            else if (kind == EVENT_TIMER)
+            {
+                uint64_t ticks;
+                expired = (read(event_loop.timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks));
+            }
+        }
+    }
+
+    epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    struct timespec never = {0, 0};
+    event_timer(&never, 0);
+    if (expired && !input)
+    {
+        printf("\ntimed out waiting for input: auto-logout\n");
+        return 0;
+    }
+    return paused ? -1 : 1;
+}
+
+/**
+ * @brief Waits for child processes to exit.
+ *
+ * Each child gets a pidfd in the epoll set and is reaped as soon as it
+ * becomes readable, in whatever order the children finish. A child whose
+ * pidfd cannot be set up is waited for with a plain `waitpid()` at the end.
+ *
+ * @param pids The children; entries that are not positive are skipped.
+ * @param statuses Receives each child's wait status.
+ * @param count The number of entries in `pids`.
+ */
+void wait_children(const pid_t *pids, int *statuses, int count)
+{
+    int *pidfds = (event_loop.epoll_fd == -1) ? NULL : malloc(count * sizeof(int));
+    int remaining = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (pidfds == NULL)
+        {
+            break;
+        }
+        pidfds[i] = (pids[i] > 0) ? pidfd_open(pids[i], 0) : -1;
+        if (pidfds[i] != -1 && event_add(pidfds[i], EVENT_CHILD, i) == -1)
+        {
+            close(pidfds[i]);
+            pidfds[i] = -1;
+        }
+        remaining += (pidfds[i] != -1);
+    }
+
+    struct epoll_event ready[EVENT_BATCH];
+    while (remaining > 0)
+    {
+        int n = event_next(ready, -1);
+        if (n == -1)
+        {
+            break;
+        }
+        for (int k = 0; k < n; k++)
+        {
+            int kind = ready[k].data.u64 & 0xff;
+            int i = ready[k].data.u64 >> 8;
+            if (kind == EVENT_SIGNAL)
+            {
+                // The children get Ctrl+C themselves; the shell ignores it.
+                event_signals();
+            }
+            else if (kind == EVENT_CAPTURE)
+            {
+                capture_drain(i);
+            }
+            else if (kind == EVENT_CHILD && waitpid(pids[i], &statuses[i], WNOHANG) > 0)
+            {
+                epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, pidfds[i], NULL);
+                close(pidfds[i]);
+                pidfds[i] = -2;
+                remaining--;
+            }
+        }
+    }
+
+    // Anything not reaped above gets a blocking wait.
+    for (int i = 0; i < count; i++)
+    {
+        if (pids[i] <= 0 || (pidfds != NULL && pidfds[i] == -2))
+        {
+            continue;
+        }
+        if (pidfds != NULL && pidfds[i] != -1)
+        {
+            epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, pidfds[i], NULL);
+            close(pidfds[i]);
+        }
+        while (waitpid(pids[i], &statuses[i], 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+    free(pidfds);
+}
+
+/**
+ * @brief Sleeps until a CLOCK_MONOTONIC deadline, or until Ctrl+C.
+ *
+ * @return 0 at the deadline, 1 if interrupted, -1 if the event loop is not
+ *         in use (the caller must sleep some other way).
+ */
+int event_sleep(const struct timespec *deadline)
+{
+    if (event_loop.epoll_fd == -1)
+    {
+        return -1;
+    }
+    event_timer(deadline, 1);
+
+    struct epoll_event ready[EVENT_BATCH];
+    int interrupted = 0;
+    int expired = 0;
+    while (!interrupted && !expired)
+    {
+        int n = event_next(ready, -1);
+        if (n == -1)
+        {
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int kind = ready[i].data.u64 & 0xff;
+            if (kind == EVENT_SIGNAL)
+            {
+                interrupted |= (event_signals() > 0);
+            }
+            else if (kind == EVENT_TIMER)
+            {
+                uint64_t ticks;
+                expired = (read(event_loop.timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks));
+            }
+        }
+    }
+
+    struct timespec never = {0, 0};
+    event_timer(&never, 0);
+    return interrupted;
+}
+
+/**
+ * @brief Waits until a descriptor has something to read, or until Ctrl+C.
+ *
+ * For a built-in that reads in the shell, where Ctrl+C only ever shows up
+ * on the signalfd. The descriptor is not added to the epoll set, which
+ * would refuse a regular file; poll() reports one as always ready.
+ *
+ * @return 1 when `fd` is ready (or without an event loop), 0 if interrupted.
+ */
+int event_wait_readable(int fd)
+{
+    if (event_loop.signal_fd == -1)
+    {
+        return 1;
+    }
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {event_loop.signal_fd, POLLIN, 0}};
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        if (fds[1].revents != 0 && event_signals() > 0)
+        {
+            return 0;
+        }
+        if (fds[0].revents != 0)
+        {
+            return 1;
+        }
+    }
+}
+
+/* ========================================================================= */
+/* SESSION TRANSCRIPTS                           */
+/* ========================================================================= */
+
+/*
+ * `transcript start FILE` records the session: every line read at the
+ * prompt, stamped with the time, and all output of the commands run, as
+ * output capture passes it through (a transcript turns capture on). The
+ * record is compressed by a background thread into LZ4 frames, in the
+ * files FILE.1.lz4, FILE.2.lz4 and so on, a new one being started whenever
+ * the current one reaches the size given with `-s`. `lz4 -dc` reads them.
+ *
+ * All the shell itself does is copy the text into 64 KiB blocks. Full
+ * blocks go to the thread through a queue of TRANSCRIPT_QUEUE blocks; if
+ * the thread falls that far behind, the shell waits for it rather than
+ * leave anything out. A block that has been filling for a second goes
+ * out as it is, so the files are never far behind the session.
+ *
+ * The compressor is a plain greedy LZ4 with a small hash table. Like the
+ * reference one it moves on faster the longer it goes without a match, so
+ * output that does not compress costs little time, and such a block is
+ * stored as it is.
+ */
+
+/**
+ * @brief The size of the blocks of text compressed at once, LZ4's 64 KiB
+ * block size.
+ */
+#define TRANSCRIPT_BLOCK (64 * 1024)
+
+/**
+ * @brief Most blocks waiting for the compressor thread.
+ */
+#define TRANSCRIPT_QUEUE 16
+
+/**
+ * @brief The default size in MiB at which a new transcript file is started.
+ */
+#define TRANSCRIPT_ROTATE_MB 64
+
+/**
+ * @brief Seconds a partly filled block may wait before it is written.
+ */
+#define TRANSCRIPT_FLUSH_SECONDS 1
+
+/**
+ * @brief Bits of the compressor's hash table of recent positions.
+ */
+#define LZ_HASH_BITS 13
+
+/**
+ * @brief The largest a block can grow when LZ4 compresses it.
+ */
+#define LZ_BOUND(length) ((length) + (length) / 255 + 16)
+
+static int parse_long(const char *text, long *value);
+
+/**
+ * @brief A block of transcript text.
+ */
+typedef struct
+{
+    size_t length;
+    unsigned char data[TRANSCRIPT_BLOCK];
+} transcript_block;
+
+/**
+ * @brief The transcript being written, shared by the shell and the
+ * compressor thread under `lock`.
+ */
+static struct
+{
+    int active;                 // Changed under `lock`, which the capture relay thread also takes.
+    char *path;                 // The name the files are numbered after.
+    off_t rotate;               // Bytes after which the next file is started.
+    transcript_block *filling;  // The block being filled, under `lock` like the queue.
+    time_t filling_since;
+    transcript_block *queue[TRANSCRIPT_QUEUE];
+    int head;
+    int count;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signalled when the queue or `stopping` changes.
+    pthread_t thread;
+    // Owned by the thread while it runs.
+    int fd;
+    int sequence;               // The number of the current file.
+    off_t written;              // Bytes in the current file.
+    int error;                  // errno of a failed write, or 0.
+    unsigned long long text_bytes;
+    unsigned long long compressed_bytes;
+} transcript = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .fd = -1};
+
+/**
+ * @brief Writes an LZ4 length continuation: 255s, then the remainder.
+ */
+static unsigned char *lz_length(unsigned char *out, size_t length)
+{
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+/**
+ * @brief Writes one LZ4 sequence: literals, then a match unless
+ * `match_length` is 0 (the last sequence of a block).
+ */
+static unsigned char *lz_sequence(unsigned char *out, const unsigned char *literals, size_t literal_length,
+                                  size_t offset, size_t match_length)
+{
+    unsigned char *token = out++;
+    *token = (unsigned char)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+    {
+        out = lz_length(out, literal_length - 15);
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0)
+    {
+        return out;
+    }
+    *out++ = (unsigned char)offset;
+    *out++ = (unsigned char)(offset >> 8);
+    match_length -= 4;
+    *token |= (unsigned char)(match_length < 15 ? match_length : 15);
+    if (match_length >= 15)
+    {
+        out = lz_length(out, match_length - 15);
+    }
+    return out;
+}
+
+/**
+ * @brief Returns the hash table slot of the four bytes at `p`.
+ */
+static inline uint32_t lz_hash(const unsigned char *p)
+{
+    uint32_t word;
+    memcpy(&word, p, 4);
+    return (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Compresses a block of at most 64 KiB into the LZ4 block format.
+ *
+ * Positions in such a block fit in 16 bits, and so does every offset. The
+ * format's end rules are kept: the last five bytes are always literals and
+ * no match starts in the last twelve.
+ *
+ * @param out Room for at least LZ_BOUND(length) bytes.
+ * @return The compressed size.
+ */
+static size_t lz_compress(const unsigned char *in, size_t length, unsigned char *out)
+{
+    uint16_t table[1 << LZ_HASH_BITS] = {0};
+    unsigned char *start = out;
+    size_t anchor = 0;
+    size_t position = 1;
+    size_t limit = (length > 12) ? length - 12 : 0;
+    size_t match_limit = (length > 5) ? length - 5 : 0;
+    unsigned misses = 0;
+
+    while (position < limit)
+    {
+        uint32_t hash = lz_hash(in + position);
+        size_t candidate = table[hash];
+        table[hash] = (uint16_t)position;
+        if (candidate >= position || memcmp(in + candidate, in + position, 4) != 0)
+        {
+            // One more byte at first, then further the longer nothing
+            // matches.
+            position += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        // Extend the match backwards over the pending literals, then
+        // forwards as far as the end rules allow, a word at a time where
+        // the first differing byte can be found from the lowest set bit.
+        while (position > anchor && candidate > 0 && in[position - 1] == in[candidate - 1])
+        {
+            position--;
+            candidate--;
+        }
+        size_t match = 4;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        while (position + match + 8 <= match_limit)
+        {
+            uint64_t a;
+            uint64_t b;
+            memcpy(&a, in + position + match, 8);
+            memcpy(&b, in + candidate + match, 8);
+            if (a != b)
+            {
+                match += __builtin_ctzll(a ^ b) >> 3;
+                break;
+            }
+            match += 8;
+        }
+#endif
+        while (position + match < match_limit && in[position + match] == in[candidate + match])
+        {
+            match++;
+        }
+        out = lz_sequence(out, in + anchor, position - anchor, position - candidate, match);
+        position += match;
+        anchor = position;
+        misses = 0;
+        if (position - 2 < limit)
+        {
+            table[lz_hash(in + position - 2)] = (uint16_t)(position - 2);
+        }
+    }
+    out = lz_sequence(out, in + anchor, length - anchor, 0, 0);
+    return out - start;
+}
+
+/**
+ * @brief Opens the next transcript file that does not exist yet and
+ * writes the LZ4 frame header.
+ *
+ * The frame has independent 64 KiB blocks and no checksums; the last
+ * header byte is the checksum of the two before it.
+ *
+ * @return 0 on success, -1 on error (with errno set).
+ */
+static int transcript_open_next(void)
+{
+    static const unsigned char header[] = {0x04, 0x22, 0x4d, 0x18, 0x60, 0x40, 0x82};
+    size_t size = strlen(transcript.path) + 32;
+    char *name = malloc(size);
+    if (name == NULL)
+    {
+        return -1;
+    }
+    do
+    {
+        snprintf(name, size, "%s.%d.lz4", transcript.path, ++transcript.sequence);
+        transcript.fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    } while (transcript.fd == -1 && errno == EEXIST);
+    free(name);
+    if (transcript.fd == -1 || write_all(transcript.fd, (const char *)header, sizeof(header)) == -1)
+    {
+        return -1;
+    }
+    transcript.written = sizeof(header);
+    return 0;
+}
+
+/**
+ * @brief Ends the current transcript file with the frame's end mark.
+ */
+static void transcript_close_file(void)
+{
+    static const char end_mark[4] = {0};
+    if (transcript.fd != -1)
+    {
+        write_all(transcript.fd, end_mark, sizeof(end_mark));
+        close(transcript.fd);
+        transcript.fd = -1;
+    }
+}
+
+/**
+ * @brief Thread body: compresses and writes the queued blocks until the
+ * transcript is stopped and the queue is empty.
+ */
+static void *transcript_thread(void *arg)
+{
+    (void)arg;
+    unsigned char *out = malloc(4 + LZ_BOUND(TRANSCRIPT_BLOCK));
+    pthread_mutex_lock(&transcript.lock);
+    for (;;)
+    {
+        while (transcript.count == 0 && !transcript.stopping)
+        {
+            pthread_cond_wait(&transcript.changed, &transcript.lock);
+        }
+        if (transcript.count == 0)
+        {
+            break;
+        }
+        transcript_block *block = transcript.queue[transcript.head];
+        transcript.head = (transcript.head + 1) % TRANSCRIPT_QUEUE;
+        transcript.count--;
+        pthread_cond_broadcast(&transcript.changed);
+        pthread_mutex_unlock(&transcript.lock);
+
+        // A block that does not get smaller is stored, flagged by the top
+        // bit of its size.
+        size_t size = 0;
+        int error = (out == NULL) ? ENOMEM : 0;
+        if (out != NULL && transcript.fd != -1)
+        {
+            size = lz_compress(block->data, block->length, out + 4);
+            uint32_t word = (uint32_t)size;
+            if (size >= block->length)
+            {
+                size = block->length;
+                word = (uint32_t)size | 0x80000000U;
+                memcpy(out + 4, block->data, size);
+            }
+            for (int i = 0; i < 4; i++)
+            {
+                out[i] = (unsigned char)(word >> (8 * i));
+            }
+            error = (write_all(transcript.fd, (const char *)out, size + 4) == -1) ? errno : 0;
+        }
+
+        // Files are switched under the lock, which `transcript status`
+        // takes to see which one is current; it happens rarely.
+        pthread_mutex_lock(&transcript.lock);
+        transcript.text_bytes += block->length;
+        transcript.compressed_bytes += size + 4;
+        transcript.written += size + 4;
+        if (transcript.fd != -1 && transcript.written >= transcript.rotate)
+        {
+            transcript_close_file();
+            error = (transcript_open_next() == -1) ? errno : error;
+        }
+        if (error != 0 && transcript.error == 0)
+        {
+            transcript.error = error;
+        }
+        free(block);
+    }
+    pthread_mutex_unlock(&transcript.lock);
+    transcript_close_file();
+    free(out);
+    return NULL;
+}
+
+/**
+ * @brief Hands the block being filled to the compressor thread, waiting
+ * while the queue is full. The caller holds `transcript.lock`.
+ */
+static void transcript_push(void)
+{
+    transcript_block *block = transcript.filling;
+    transcript.filling = NULL;
+    if (block == NULL || block->length == 0)
+    {
+        free(block);
+        return;
+    }
+    while (transcript.count == TRANSCRIPT_QUEUE)
+    {
+        pthread_cond_wait(&transcript.changed, &transcript.lock);
+    }
+    transcript.queue[(transcript.head + transcript.count) % TRANSCRIPT_QUEUE] = block;
+    transcript.count++;
+    pthread_cond_broadcast(&transcript.changed);
+}
+
+/**
+ * @brief Adds text to the transcript. The caller holds `transcript.lock`:
+ * output is recorded by the capture relay thread (see
+ * `capture_relay_thread()`) as well as by the shell.
+ */
+static void transcript_append(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (transcript.filling == NULL)
+        {
+            transcript.filling = malloc(sizeof(transcript_block));
+            if (transcript.filling == NULL)
+            {
+                return;
+            }
+            transcript.filling->length = 0;
+            transcript.filling_since = time(NULL);
+        }
+        transcript_block *block = transcript.filling;
+        size_t take = TRANSCRIPT_BLOCK - block->length;
+        take = (take < length) ? take : length;
+        memcpy(block->data + block->length, data, take);
+        block->length += take;
+        data += take;
+        length -= take;
+        if (block->length == TRANSCRIPT_BLOCK)
+        {
+            transcript_push();
+        }
+    }
+    if (transcript.filling != NULL && time(NULL) - transcript.filling_since >= TRANSCRIPT_FLUSH_SECONDS)
+    {
+        transcript_push();
+    }
+}
+
+/**
+ * @brief Records a line read at the prompt, with the date and time.
+ */
+void transcript_input(const char *line)
+{
+    if (!transcript.active)
+    {
+        return;
+    }
+    char stamp[64];
+    time_t now = time(NULL);
+    struct tm when;
+    localtime_r(&now, &when);
+    size_t length = strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S] > ", &when);
+    pthread_mutex_lock(&transcript.lock);
+    transcript_append(stamp, length);
+    transcript_append(line, strlen(line));
+    transcript_append("\n", 1);
+    pthread_mutex_unlock(&transcript.lock);
+}
+
+/**
+ * @brief Records output a command wrote, as output capture passes it on.
+ */
+void transcript_output(const char *data, size_t length)
+{
+    pthread_mutex_lock(&transcript.lock);
+    if (transcript.active)
+    {
+        transcript_append(data, length);
+    }
+    pthread_mutex_unlock(&transcript.lock);
+}
+
+/**
+ * @brief Stops the transcript, once everything recorded has been written.
+ */
+void transcript_stop(void)
+{
+    if (!transcript.active)
+    {
+        return;
+    }
+    pthread_mutex_lock(&transcript.lock);
+    transcript_push();
+    transcript.active = 0;
+    transcript.stopping = 1;
+    pthread_cond_broadcast(&transcript.changed);
+    pthread_mutex_unlock(&transcript.lock);
+    pthread_join(transcript.thread, NULL);
+    transcript.stopping = 0;
+}
+
+/**
+ * @brief Implements the `transcript` built-in.
+ *
+ * Usage: `transcript start [-s MB] FILE`, `transcript stop` or `transcript`
+ * to show what is being recorded. A new transcript starts with a new file
+ * (see above); `-s` sets the size at which the next one is started,
+ * TRANSCRIPT_ROTATE_MB by default.
+ *
+ * @return 0 on success, 1 on error, 2 on usage errors.
+ */
+int builtin_transcript(char **args)
+{
+    if (args[1] == NULL || strcmp(args[1], "status") == 0)
+    {
+        if (!transcript.active)
+        {
+            printf("transcript: off\n");
+            return 0;
+        }
+        pthread_mutex_lock(&transcript.lock);
+        unsigned long long text = transcript.text_bytes;
+        unsigned long long compressed = transcript.compressed_bytes;
+        int sequence = transcript.sequence;
+        int error = transcript.error;
+        pthread_mutex_unlock(&transcript.lock);
+        printf("transcript: %s.%d.lz4, %llu bytes recorded in %llu (%.1f%%)%s%s\n", transcript.path, sequence,
+               text, compressed, text ? 100.0 * compressed / text : 0.0, error ? ", error: " : "",
+               error ? strerror(error) : "");
+        return error != 0;
+    }
+    if (strcmp(args[1], "stop") == 0 && args[2] == NULL)
+    {
+        transcript_stop();
+        return 0;
+    }
+
+    long megabytes = TRANSCRIPT_ROTATE_MB;
+    int i = 2;
+    if (strcmp(args[1], "start") == 0 && args[i] != NULL && strcmp(args[i], "-s") == 0 && args[i + 1] != NULL)
+    {
+        if (!parse_long(args[i + 1], &megabytes) || megabytes < 1)
+        {
+            fprintf(stderr, "shell: transcript: %s: not a size in MiB\n", args[i + 1]);
+            return 2;
+        }
+        i += 2;
+    }
+    if (strcmp(args[1], "start") != 0 || args[i] == NULL || args[i + 1] != NULL)
+    {
+        fprintf(stderr, "usage: transcript [start [-s MB] FILE | stop | status]\n");
+        return 2;
+    }
+
+    transcript_stop();
+    free(transcript.path);
+    transcript.path = strdup(args[i]);
+    transcript.rotate = (off_t)megabytes << 20;
+    transcript.sequence = 0;
+    transcript.error = 0;
+    transcript.text_bytes = 0;
+    transcript.compressed_bytes = 0;
+    if (transcript.path == NULL || transcript_open_next() == -1)
+    {
+        fprintf(stderr, "shell: transcript: %s: %s\n", args[i], strerror(errno));
+        transcript_close_file();
+        return 1;
+    }
+    int error = pthread_create(&transcript.thread, NULL, transcript_thread, NULL);
+    if (error != 0)
+    {
+        fprintf(stderr, "shell: transcript: %s\n", strerror(error));
+        transcript_close_file();
+        return 1;
+    }
+    pthread_mutex_lock(&transcript.lock);
+    transcript.active = 1;
+    pthread_mutex_unlock(&transcript.lock);
+    return 0;
+}
+
+/* ========================================================================= */
+/* OUTPUT CAPTURE                                */
+/* ========================================================================= */
+
+/*
+ * With `SHELL_CAPTURE` set to a number of MiB, the standard output and
+ * error of each foreground command or pipeline go through two pipes of the
+ * shell's. The shell passes everything on to where it was going and keeps
+ * the last SHELL_CAPTURE MiB in a memfd used as a ring, so that a command
+ * need not be run again just to search its output once more. The captures
+ * of the last CAPTURE_COMMANDS commands are kept: `last-output [N]` prints
+ * one of them again, and `$LAST_OUTPUT` names the latest as a file,
+ * `/proc/PID/fd/N`, which commands can read (`grep error $LAST_OUTPUT`).
+ *
+ * The pipes are drained by the event loop while the shell waits for the
+ * command, or by a thread while a built-in writes to them from the shell
+ * itself. tee() passes the data on without it entering the shell (see
+ * `capture_drain()`), so the one copy is the read into the mapped ring.
+ * Commands see pipes rather than the terminal, so this suits batch output
+ * rather than full-screen programs. A transcript (see above) turns capture
+ * on with a small ring even without `SHELL_CAPTURE`.
+ */
+
+/**
+ * @brief How many commands' output is kept.
+ */
+#define CAPTURE_COMMANDS 16
+
+/**
+ * @brief The size asked of the capture pipes, so that a fast writer fills
+ * the ring in few large reads.
+ */
+#define CAPTURE_PIPE_SIZE (1 << 20)
+
+/**
+ * @brief The ring size in MiB when output is captured only for a
+ * transcript.
+ */
+#define CAPTURE_TRANSCRIPT_MB 1
+
+/**
+ * @brief The captured output of recent commands, and the capture under way.
+ */
+static struct
+{
+    int kept[CAPTURE_COMMANDS]; // Finished captures as memfds, oldest overwritten first.
+    unsigned long total;        // Captures finished so far; the newest is kept[(total - 1) % CAPTURE_COMMANDS].
+    pid_t owner;                // The shell, which holds the memfds in `kept`.
+    int active;                 // Whether a command's output is being captured.
+    int keep;                   // Whether it is kept for `last-output` or only passed on.
+    int memfd;                  // The ring of the capture under way.
+    char *ring;                 // `memfd` mapped.
+    size_t size;
+    size_t position;            // Where the next byte goes.
+    int wrapped;                // Whether the ring has filled up and started over.
+    int pipes[2];               // The read ends for stdout and stderr, -1 once closed.
+    int saved[2];               // The shell's own stdout and stderr, the output's destination.
+    int to_pipe[2];             // Whether a destination is a pipe, which tee() can feed.
+    int spare[2][2];            // For another destination, the pipe tee() feeds instead, or -1.
+    void (*sigpipe)(int);       // The SIGPIPE handler to put back.
+    pthread_t relay;            // Drains the pipes while a built-in writes to them.
+    int wake[2];                // Tells `relay` that the built-in has returned.
+} capture;
+
+/**
+ * @brief Passes on `length` bytes that tee() has put in a stream's spare
+ * pipe, and which are also at the ring's current position.
+ *
+ * splice() empties the spare pipe into the destination. Where it cannot
+ * write to the destination (a terminal, or a file opened for appending,
+ * on some kernels) the rest goes from the ring with write(), and so does
+ * all later output of the capture.
+ *
+ * @return 0 on success, -1 if the destination has gone away.
+ */
+static int capture_pass_on(int stream, size_t length)
+{
+    int *spare = capture.spare[stream];
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = splice(spare[0], NULL, capture.saved[stream], NULL, length - done, 0);
+        if (n > 0)
+        {
+            done += n;
+        }
+        else if (n == -1 && errno == EPIPE)
+        {
+            return -1;
+        }
+        else if (!(n == -1 && errno == EINTR))
+        {
+            break;
+        }
+    }
+    if (done == length)
+    {
+        return 0;
+    }
+    char *rest = capture.ring + capture.position + done;
+    if (read(spare[0], rest, length - done) != (ssize_t)(length - done))
+    {
+        return -1;
+    }
+    close(spare[0]);
+    close(spare[1]);
+    spare[0] = spare[1] = -1;
+    return write_all(capture.saved[stream], rest, length - done);
+}
+
+/**
+ * @brief Reads once from a capture pipe into the ring and passes the data
+ * on.
+ *
+ * At end of file the pipe is closed. So is it when the destination has
+ * gone away (a closed pipe), after which the command gets SIGPIPE just as
+ * it would have without the capture.
+ *
+ * @param stream 0 for standard output, 1 for standard error.
+ * @return 1 if data was read, 0 if none is ready, -1 if the pipe is closed.
+ */
+int capture_drain(int stream)
+{
+    int fd = capture.pipes[stream];
+    if (fd == -1)
+    {
+        return -1;
+    }
+    size_t room = capture.size - capture.position;
+
+    // On the way to the destination the data need not pass through the
+    // shell: tee() gives the same pages to the destination if it is a
+    // pipe, or else to the spare pipe that `capture_pass_on()` splices
+    // into it, and a read of as much then takes them out for the ring.
+    // (Splicing into the ring's memfd as well measured slower than that
+    // read.) tee() cannot wait for a destination pipe, so when it is full
+    // (or the source is empty) the ordinary way below is taken.
+    int copy = capture.to_pipe[stream] ? capture.saved[stream] : capture.spare[stream][1];
+    ssize_t n;
+    if (copy != -1 && (n = tee(fd, copy, room, SPLICE_F_NONBLOCK)) > 0)
+    {
+        n = read(fd, capture.ring + capture.position, n);
+        if (n > 0 && !capture.to_pipe[stream] && capture_pass_on(stream, n) == -1)
+        {
+            n = -1;
+            errno = EPIPE;
+        }
+    }
+    else if ((n = read(fd, capture.ring + capture.position, room)) > 0 &&
+             write_all(capture.saved[stream], capture.ring + capture.position, n) == -1)
+    {
+        n = -1;
+        errno = EPIPE;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return 0;
+    }
+    if (n > 0)
+    {
+        transcript_output(capture.ring + capture.position, n);
+        capture.position += n;
+        if (capture.position == capture.size)
+        {
+            capture.position = 0;
+            capture.wrapped = 1;
+        }
+        shell_stats.captured_bytes += n;
+        return 1;
+    }
+    epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    capture.pipes[stream] = -1;
+    return -1;
+}
+
+/**
+ * @brief Starts capturing, if `SHELL_CAPTURE` asks for it, by putting pipes
+ * in place of the shell's standard output and error for the children
+ * about to be forked.
+ *
+ * @return 1 if output is being captured, 0 if not.
+ */
+int capture_begin(void)
+{
+    size_t length;
+    const char *value = get_variable("SHELL_CAPTURE", 13, &length);
+    long megabytes = value ? atol(value) : 0;
+    if ((megabytes <= 0 && !transcript.active) || capture.active || event_loop.epoll_fd == -1)
+    {
+        return 0;
+    }
+
+    capture.size = (size_t)(megabytes > 0 ? megabytes : CAPTURE_TRANSCRIPT_MB) << 20;
+    capture.memfd = memfd_create("shell-output", MFD_CLOEXEC);
+    if (capture.memfd == -1 || ftruncate(capture.memfd, capture.size) == -1 ||
+        (capture.ring = mmap(NULL, capture.size, PROT_READ | PROT_WRITE, MAP_SHARED, capture.memfd, 0)) ==
+            MAP_FAILED)
+    {
+        perror("shell: capture");
+        if (capture.memfd != -1)
+        {
+            close(capture.memfd);
+        }
+        return 0;
+    }
+
+    int writers[2];
+    for (int stream = 0; stream < 2; stream++)
+    {
+        int ends[2];
+        capture.pipes[stream] = -1;
+        if (pipe2(ends, O_CLOEXEC) == -1)
+        {
+            writers[stream] = -1;
+            continue;
+        }
+        fcntl(ends[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+        fcntl(ends[0], F_SETFL, O_NONBLOCK);
+        if (event_add(ends[0], EVENT_CAPTURE, stream) == -1)
+        {
+            close(ends[0]);
+            close(ends[1]);
+            writers[stream] = -1;
+            continue;
+        }
+        capture.pipes[stream] = ends[0];
+        writers[stream] = ends[1];
+    }
+
+    // The children inherit the pipes as their stdout and stderr; see
+    // `capture_release()`.
+    fflush(stdout);
+    fflush(stderr);
+    for (int stream = 0; stream < 2; stream++)
+    {
+        struct stat info;
+        int *spare = capture.spare[stream];
+        capture.saved[stream] = fcntl(STDOUT_FILENO + stream, F_DUPFD_CLOEXEC, 10);
+        capture.to_pipe[stream] = fstat(capture.saved[stream], &info) == 0 && S_ISFIFO(info.st_mode);
+        spare[0] = spare[1] = -1;
+        if (capture.saved[stream] != -1 && !capture.to_pipe[stream] && capture.pipes[stream] != -1 &&
+            pipe2(spare, O_CLOEXEC) == 0)
+        {
+            fcntl(spare[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+        }
+        if (writers[stream] != -1)
+        {
+            dup2(writers[stream], STDOUT_FILENO + stream);
+            close(writers[stream]);
+        }
+    }
+    capture.position = 0;
+    capture.wrapped = 0;
+    capture.keep = 1;
+    capture.active = 1;
+    return 1;
+}
+
+/**
+ * @brief Gives the shell its own standard output and error back once the
+ * command has been forked, so that only the command holds the pipes.
+ */
+void capture_release(void)
+{
+    if (!capture.active)
+    {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int stream = 0; stream < 2; stream++)
+    {
+        if (capture.saved[stream] != -1)
+        {
+            dup2(capture.saved[stream], STDOUT_FILENO + stream);
+        }
+    }
+    // Writing on to a closed pipe must not end the shell.
+    capture.sigpipe = signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * @brief Finishes the capture of a command that has exited: passes on what
+ * is left in the pipes and keeps the output.
+ *
+ * Output written later by a process the command left running is not
+ * waited for; it finds the pipe closed.
+ */
+void capture_finish(void)
+{
+    if (!capture.active)
+    {
+        return;
+    }
+    for (int stream = 0; stream < 2; stream++)
+    {
+        while (capture_drain(stream) == 1)
+        {
+        }
+        if (capture.pipes[stream] != -1)
+        {
+            epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, capture.pipes[stream], NULL);
+            close(capture.pipes[stream]);
+        }
+        if (capture.saved[stream] != -1)
+        {
+            close(capture.saved[stream]);
+        }
+        if (capture.spare[stream][0] != -1)
+        {
+            close(capture.spare[stream][0]);
+            close(capture.spare[stream][1]);
+        }
+    }
+    signal(SIGPIPE, capture.sigpipe);
+    capture.active = 0;
+    if (!capture.keep)
+    {
+        munmap(capture.ring, capture.size);
+        close(capture.memfd);
+        return;
+    }
+
+    // Put the ring in order, so that the capture reads as a plain file.
+    int fd = capture.memfd;
+    if (!capture.wrapped)
+    {
+        ftruncate(fd, capture.position);
+    }
+    else if ((fd = memfd_create("shell-output", MFD_CLOEXEC)) == -1 ||
+             write_all(fd, capture.ring + capture.position, capture.size - capture.position) == -1 ||
+             write_all(fd, capture.ring, capture.position) == -1)
+    {
+        perror("shell: capture");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        fd = capture.memfd;
+    }
+    else
+    {
+        close(capture.memfd);
+    }
+    munmap(capture.ring, capture.size);
+
+    int slot = capture.total % CAPTURE_COMMANDS;
+    if (capture.total >= CAPTURE_COMMANDS)
+    {
+        close(capture.kept[slot]);
+    }
+    capture.kept[slot] = fd;
+    capture.total++;
+    shell_stats.captures++;
+
+    char path[64];
+    capture.owner = getpid();
+    int length = snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)capture.owner, fd);
+    set_variable("LAST_OUTPUT", 11, path, length);
+}
+
+/**
+ * @brief Passes on a built-in's output while it runs: the shell itself is
+ * writing to the capture pipes, so it cannot be the one draining them.
+ */
+static void *capture_relay_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        struct pollfd fds[3] = {{capture.pipes[0], POLLIN, 0},
+                                {capture.pipes[1], POLLIN, 0},
+                                {capture.wake[0], POLLIN, 0}};
+        if (poll(fds, 3, -1) == -1 && errno != EINTR)
+        {
+            break;
+        }
+        if (fds[2].revents != 0)
+        {
+            // What is still in the pipes is left to `capture_finish()`.
+            break;
+        }
+        for (int stream = 0; stream < 2; stream++)
+        {
+            if (fds[stream].revents != 0)
+            {
+                capture_drain(stream);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts capturing the output of a built-in, which runs in the shell.
+ *
+ * The capture pipes become the shell's own standard output and error until
+ * `capture_builtin_finish()`, and a thread drains them meanwhile; the
+ * event loop leaves them alone, as the built-in may run it (to wait for a
+ * program it starts, say).
+ *
+ * @param keep Zero to only pass the output on to a transcript, as for
+ *        `last-output`, whose output would otherwise push out the capture
+ *        it prints.
+ * @return 1 if output is being captured, 0 if not.
+ */
+int capture_builtin_begin(int keep)
+{
+    if ((!keep && !transcript.active) || !capture_begin())
+    {
+        return 0;
+    }
+    capture.keep = keep;
+    for (int stream = 0; stream < 2; stream++)
+    {
+        if (capture.pipes[stream] != -1)
+        {
+            epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, capture.pipes[stream], NULL);
+        }
+    }
+    capture.wake[0] = capture.wake[1] = -1;
+    if (pipe2(capture.wake, O_CLOEXEC) == -1 ||
+        pthread_create(&capture.relay, NULL, capture_relay_thread, NULL) != 0)
+    {
+        // Without the thread the built-in could fill a pipe and block.
+        perror("shell: capture");
+        if (capture.wake[0] != -1)
+        {
+            close(capture.wake[0]);
+            close(capture.wake[1]);
+        }
+        capture_release();
+        capture_finish();
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Ends the capture of a built-in's output.
+ */
+void capture_builtin_finish(void)
+{
+    capture_release();
+    write_all(capture.wake[1], "", 1);
+    pthread_join(capture.relay, NULL);
+    close(capture.wake[0]);
+    close(capture.wake[1]);
+    capture_finish();
+}
+
+/**
+ * @brief Implements the `last-output` built-in.
+ *
+ * Usage: `last-output [-p] [N]`. Prints the captured output of the Nth most
+ * recent command, 1 (the default) being the latest; with `-p` it prints
+ * the name of the file that holds it instead.
+ *
+ * @return 0 on success, 1 if there is no such capture, 2 on usage errors.
+ */
+int builtin_last_output(char **args)
+{
+    int path_only = 0;
+    long n = 1;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-p") == 0)
+    {
+        path_only = 1;
+        i++;
+    }
+    if (args[i] != NULL && (!parse_long(args[i], &n) || n < 1 || args[i + 1] != NULL))
+    {
+        fprintf(stderr, "usage: last-output [-p] [N]\n");
+        return 2;
+    }
+    if ((unsigned long)n > capture.total || n > CAPTURE_COMMANDS)
+    {
+        fprintf(stderr, "shell: last-output: no output captured for command %ld%s\n", n,
+                capture.total == 0 ? " (set SHELL_CAPTURE to a size in MiB)" : "");
+        return 1;
+    }
+
+    int kept = capture.kept[(capture.total - n) % CAPTURE_COMMANDS];
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)capture.owner, kept);
+    if (path_only)
+    {
+        printf("%s\n", path);
+        return 0;
+    }
+
+    // In a pipeline the built-in runs in a child, which has closed the
+    // shell's descriptors and reopens the memfd through the shell.
+    int fd = (fcntl(kept, F_GETFD) != -1) ? kept : open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        fprintf(stderr, "shell: last-output: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // sendfile() keeps its own offset, so the memfd can be read any number
+    // of times; it cannot write to everything, hence the fallback.
+    fflush(stdout);
+    off_t offset = 0;
+    ssize_t sent = 0;
+    while (offset < info.st_size &&
+           ((sent = sendfile(STDOUT_FILENO, fd, &offset, info.st_size - offset)) > 0 || (sent == -1 && errno == EINTR)))
+    {
+    }
+    char buffer[65536];
+    ssize_t got;
+    while (sent == -1 && offset < info.st_size && (got = pread(fd, buffer, sizeof(buffer), offset)) > 0 &&
+           write_all(STDOUT_FILENO, buffer, got) == 0)
+    {
+        offset += got;
+    }
+    if (fd != kept)
+    {
+        close(fd);
+    }
+    return offset < info.st_size;
+}
+
+/* ========================================================================= */
+/* VARIABLE STORE                                */
+/* ========================================================================= */
+
+/**
+ * @brief The kinds of value a shell variable can hold.
+ */
+enum
+{
+    VAR_SCALAR,  // A plain string.
+    VAR_INDEXED, // An indexed array (`a=(x y z)`).
+    VAR_ASSOC    // An associative array (`declare -A m`).
+};
+
+/**
+ * @brief One slot of an indexed array. A NULL `value` marks an unset slot.
+ */
+typedef struct
+{
+    char *value;
+    size_t length;
+} array_slot;
+
+/**
+ * @brief An indexed array, stored as a contiguous vector of slots.
+ *
+ * Arrays may have holes (`a[10]=x` on an empty array), which are simply
+ * unset slots. `size` is one past the highest index ever set.
+ */
+typedef struct
+{
+    array_slot *slots;
+    size_t size;
+    size_t capacity;
+    size_t count; // The number of slots that are set.
+} indexed_array;
+
+/**
+ * @brief One key/value pair of an associative array.
+ *
+ * The key and value share one allocation, key first. A deleted entry keeps
+ * its place with `key` set to NULL until the table is next rebuilt.
+ */
+typedef struct
+{
+    char *key;
+    size_t key_length;
+    char *value;
+    size_t length;
+    uint64_t hash;
+} assoc_entry;
+
+/**
+ * @brief An associative array that remembers insertion order.
+ *
+ * Entries are appended to a dense vector, and a separate open-addressing
+ * index of `int32_t` maps hashes to positions in that vector. Iterating the
+ * vector therefore yields the keys in the order they were first assigned,
+ * and the index stays small and cache-friendly.
+ */
+typedef struct
+{
+    assoc_entry *entries;
+    size_t size;      // Entries used, including deleted ones.
+    size_t capacity;  // Entries allocated.
+    size_t count;     // Live entries.
+    int32_t *index;   // ASSOC_EMPTY, ASSOC_DELETED, or a position in `entries`.
+    size_t index_capacity; // Always a power of two.
+} assoc_array;
+
+#define ASSOC_EMPTY -1
+#define ASSOC_DELETED -2
+
+/**
+ * @brief A single shell variable.
+ *
+ * The value buffer of a scalar is owned by the variable and reused across
+ * assignments, so a variable updated in a loop does not allocate every
+ * time. Arrays keep their elements in `indexed` or `assoc`.
+ */
+typedef struct
+{
+    char *name;             // NUL-terminated name, or NULL for an empty slot.
+    size_t name_length;     // Length of `name`.
+    char *value;            // NUL-terminated value (scalars only).
+    size_t length;          // Length of `value`.
+    size_t capacity;        // Bytes allocated for `value`.
+    int kind;               // One of the VAR_* constants.
+    indexed_array *indexed; // The elements of a VAR_INDEXED variable.
+    assoc_array *assoc;     // The elements of a VAR_ASSOC variable.
+} shell_variable;
+
+/**
+ * @brief All shell variables, in an open-addressing hash table.
+ *
+ * Slots are probed linearly. The capacity is always a power of two and the
+ * table is grown once it is three quarters full.
+ */
+static struct
+{
+    shell_variable *slots;
+    size_t capacity;
+    size_t count;
+} variable_store;
+
+/**
+ * @brief The snapshot file mapped at startup, if any.
+ *
+ * Names and values loaded from a snapshot are used where they lie in this
+ * read-only mapping instead of being copied, so they must never be handed
+ * to `free()`. The first assignment to such a variable simply moves its
+ * value to the heap.
+ */
+static struct
+{
+    const char *base;
+    size_t size;
+} snapshot_mapping;
+
+/**
+ * @brief Frees a string owned by the variable store, unless it lives in
+ * the snapshot mapping.
+ */
+static void release_string(void *string)
+{
+    uintptr_t address = (uintptr_t)string;
+    uintptr_t base = (uintptr_t)snapshot_mapping.base;
+    if (address >= base && address < base + snapshot_mapping.size)
+    {
+        return;
+    }
+    free(string);
+}
+
+static void command_hash_clear(void);
+
+/**
+ * @brief Hashes a run of bytes with 64-bit FNV-1a.
+ */
+static uint64_t hash_bytes(const char *data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Checks whether a character may start a variable name.
+ */
+static int is_name_start(char c)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/**
+ * @brief Checks whether a character may appear inside a variable name.
+ */
+static int is_name_char(char c)
+{
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * @brief Doubles the size of the variable table and re-inserts every entry.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int grow_variable_store(void)
+{
+    size_t capacity = variable_store.capacity ? variable_store.capacity * 2 : 64;
+    shell_variable *slots = calloc(capacity, sizeof(shell_variable));
+    if (slots == NULL)
+    {
+        perror("calloc failed in variable store");
+        return -1;
+    }
+
+    for (size_t i = 0; i < variable_store.capacity; i++)
+    {
+        shell_variable *old = &variable_store.slots[i];
+        if (old->name == NULL)
+        {
+            continue;
+        }
+        size_t index = hash_bytes(old->name, old->name_length) & (capacity - 1);
+        while (slots[index].name != NULL)
+        {
+            index = (index + 1) & (capacity - 1);
+        }
+        slots[index] = *old;
+    }
+
+    free(variable_store.slots);
+    variable_store.slots = slots;
+    variable_store.capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Finds a variable by name, optionally creating it.
+ *
+ * @param name The variable name (not necessarily NUL-terminated).
+ * @param name_length The length of `name`.
+ * @param create Non-zero to create an empty scalar if none exists.
+ * @return The variable, or NULL if it does not exist (or could not be created).
+ */
+static shell_variable *find_variable(const char *name, size_t name_length, int create)
+{
+    if (create && (variable_store.count + 1) * 4 > variable_store.capacity * 3)
+    {
+        if (grow_variable_store() == -1)
+        {
+            return NULL;
+        }
+    }
+    if (variable_store.capacity == 0)
+    {
+        return NULL;
+    }
+
+    size_t mask = variable_store.capacity - 1;
+    size_t index = hash_bytes(name, name_length) & mask;
+    while (variable_store.slots[index].name != NULL)
+    {
+        shell_variable *variable = &variable_store.slots[index];
+        if (variable->name_length == name_length && memcmp(variable->name, name, name_length) == 0)
+        {
+            return variable;
+        }
+        index = (index + 1) & mask;
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    shell_variable *variable = &variable_store.slots[index];
+    memset(variable, 0, sizeof(*variable));
+    variable->name = strndup(name, name_length);
+    if (variable->name == NULL)
+    {
+        perror("strndup failed in variable store");
+        return NULL;
+    }
+    variable->name_length = name_length;
+    variable->kind = VAR_SCALAR;
+    variable_store.count++;
+    return variable;
+}
+
+/**
+ * @brief Stores a copy of `value` in a growable, NUL-terminated buffer.
+ *
+ * The buffer is only reallocated when the new value does not fit. `value`
+ * may point into the buffer itself (as in `A=${A#x}`), so the copy has to
+ * tolerate overlap.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int store_value(char **buffer, size_t *capacity, size_t *length,
+                       const char *value, size_t value_length)
+{
+    if (*capacity < value_length + 1)
+    {
+        size_t new_capacity = *capacity ? *capacity : 16;
+        while (new_capacity < value_length + 1)
+        {
+            new_capacity *= 2;
+        }
+
+        // Copy first, in case `value` lives in the buffer being replaced.
+        char *new_buffer = malloc(new_capacity);
+        if (new_buffer == NULL)
+        {
+            perror("malloc failed in variable store");
+            return -1;
+        }
+        memcpy(new_buffer, value, value_length);
+        release_string(*buffer);
+        *buffer = new_buffer;
+        *capacity = new_capacity;
+    }
+    else
+    {
+        memmove(*buffer, value, value_length);
+    }
+    (*buffer)[value_length] = '\0';
+    *length = value_length;
+    return 0;
+}
+
+/**
+ * @brief Assigns element `index` of an indexed array.
+ *
+ * The vector grows geometrically, so appending one element at a time is
+ * amortised O(1).
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int indexed_set(indexed_array *array, size_t index, const char *value, size_t length)
+{
+    if (index >= MAX_ARRAY_INDEX)
+    {
+        fprintf(stderr, "shell: array index %zu out of range\n", index);
+        return -1;
+    }
+
+    if (index >= array->capacity)
+    {
+        size_t capacity = array->capacity ? array->capacity : 8;
+        while (capacity <= index)
+        {
+            capacity *= 2;
+        }
+        array_slot *slots = realloc(array->slots, capacity * sizeof(array_slot));
+        if (slots == NULL)
+        {
+            perror("realloc failed in indexed array");
+            return -1;
+        }
+        memset(slots + array->capacity, 0, (capacity - array->capacity) * sizeof(array_slot));
+        array->slots = slots;
+        array->capacity = capacity;
+    }
+
+    array_slot *slot = &array->slots[index];
+    char *copy = malloc(length + 1);
+    if (copy == NULL)
+    {
+        perror("malloc failed in indexed array");
+        return -1;
+    }
+    memcpy(copy, value, length);
+    copy[length] = '\0';
+
+    if (slot->value == NULL)
+    {
+        array->count++;
+    }
+    release_string(slot->value);
+    slot->value = copy;
+    slot->length = length;
+    if (index >= array->size)
+    {
+        array->size = index + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns element `index` of an indexed array, or NULL if unset.
+ */
+static const array_slot *indexed_get(const indexed_array *array, size_t index)
+{
+    if (index >= array->size || array->slots[index].value == NULL)
+    {
+        return NULL;
+    }
+    return &array->slots[index];
+}
+
+/**
+ * @brief Removes every element of an indexed array.
+ */
+static void indexed_clear(indexed_array *array)
+{
+    for (size_t i = 0; i < array->size; i++)
+    {
+        release_string(array->slots[i].value);
+        array->slots[i].value = NULL;
+    }
+    array->size = 0;
+    array->count = 0;
+}
+
+/**
+ * @brief Finds the index slot for a key in an associative array.
+ *
+ * @return The position in `index` holding the key's entry, or -1.
+ */
+static ssize_t assoc_lookup(const assoc_array *array, const char *key, size_t key_length,
+                            uint64_t hash)
+{
+    if (array->index_capacity == 0)
+    {
+        return -1;
+    }
+    size_t mask = array->index_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        int32_t position = array->index[i];
+        if (position == ASSOC_EMPTY)
+        {
+            return -1;
+        }
+        if (position >= 0)
+        {
+            const assoc_entry *entry = &array->entries[position];
+            if (entry->hash == hash && entry->key_length == key_length &&
+                memcmp(entry->key, key, key_length) == 0)
+            {
+                return i;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Rebuilds the index of an associative array.
+ *
+ * Deleted entries are squeezed out of the entry vector first, which keeps
+ * the remaining entries in insertion order.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int assoc_rebuild(assoc_array *array, size_t index_capacity)
+{
+    int32_t *index = malloc(index_capacity * sizeof(int32_t));
+    if (index == NULL)
+    {
+        perror("malloc failed in associative array");
+        return -1;
+    }
+    for (size_t i = 0; i < index_capacity; i++)
+    {
+        index[i] = ASSOC_EMPTY;
+    }
+
+    size_t live = 0;
+    for (size_t i = 0; i < array->size; i++)
+    {
+        if (array->entries[i].key == NULL)
+        {
+            continue;
+        }
+        array->entries[live] = array->entries[i];
+        size_t slot = array->entries[live].hash & (index_capacity - 1);
+        while (index[slot] != ASSOC_EMPTY)
+        {
+            slot = (slot + 1) & (index_capacity - 1);
+        }
+        index[slot] = (int32_t)live;
+        live++;
+    }
+
+    free(array->index);
+    array->index = index;
+    array->index_capacity = index_capacity;
+    array->size = live;
+    return 0;
+}
+
+/**
+ * @brief Assigns `value` to `key` in an associative array.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int assoc_set(assoc_array *array, const char *key, size_t key_length,
+                     const char *value, size_t length)
+{
+    uint64_t hash = hash_bytes(key, key_length);
+    ssize_t slot = assoc_lookup(array, key, key_length, hash);
+
+    // One allocation holds the key followed by the value.
+    char *storage = malloc(key_length + length + 2);
+    if (storage == NULL)
+    {
+        perror("malloc failed in associative array");
+        return -1;
+    }
+    memcpy(storage, key, key_length);
+    storage[key_length] = '\0';
+    memcpy(storage + key_length + 1, value, length);
+    storage[key_length + 1 + length] = '\0';
+
+    if (slot != -1)
+    {
+        assoc_entry *entry = &array->entries[array->index[slot]];
+        release_string(entry->key);
+        entry->key = storage;
+        entry->value = storage + key_length + 1;
+        entry->length = length;
+        return 0;
+    }
+
+    // Keep the index at most half full; probes then stay short even with
+    // deleted slots mixed in.
+    if ((array->size + 1) * 2 > array->index_capacity)
+    {
+        size_t index_capacity = array->index_capacity ? array->index_capacity : 16;
+        while ((array->count + 1) * 2 > index_capacity / 2)
+        {
+            index_capacity *= 2;
+        }
+        if (assoc_rebuild(array, index_capacity) == -1)
+        {
+            free(storage);
+            return -1;
+        }
+    }
+
+    if (array->size == array->capacity)
+    {
+        size_t capacity = array->capacity ? array->capacity * 2 : 8;
+        assoc_entry *entries = realloc(array->entries, capacity * sizeof(assoc_entry));
+        if (entries == NULL)
+        {
+            perror("realloc failed in associative array");
+            free(storage);
+            return -1;
+        }
+        array->entries = entries;
+        array->capacity = capacity;
+    }
+
+    assoc_entry *entry = &array->entries[array->size];
+    entry->key = storage;
+    entry->key_length = key_length;
+    entry->value = storage + key_length + 1;
+    entry->length = length;
+    entry->hash = hash;
+
+    size_t mask = array->index_capacity - 1;
+    size_t i = hash & mask;
+    while (array->index[i] >= 0)
+    {
+        i = (i + 1) & mask;
+    }
+    array->index[i] = (int32_t)array->size;
+    array->size++;
+    array->count++;
+    return 0;
+}
+
+/**
+ * @brief Returns the entry for `key` in an associative array, or NULL.
+ */
+static const assoc_entry *assoc_get(const assoc_array *array, const char *key, size_t key_length)
+{
+    ssize_t slot = assoc_lookup(array, key, key_length, hash_bytes(key, key_length));
+    return slot == -1 ? NULL : &array->entries[array->index[slot]];
+}
+
+/**
+ * @brief Removes `key` from an associative array, if present.
+ */
+static void assoc_delete(assoc_array *array, const char *key, size_t key_length)
+{
+    ssize_t slot = assoc_lookup(array, key, key_length, hash_bytes(key, key_length));
+    if (slot == -1)
+    {
+        return;
+    }
+    assoc_entry *entry = &array->entries[array->index[slot]];
+    release_string(entry->key);
+    entry->key = NULL;
+    array->index[slot] = ASSOC_DELETED;
+    array->count--;
+}
+
+/**
+ * @brief Removes every entry of an associative array.
+ */
+static void assoc_clear(assoc_array *array)
+{
+    for (size_t i = 0; i < array->size; i++)
+    {
+        release_string(array->entries[i].key);
+    }
+    for (size_t i = 0; i < array->index_capacity; i++)
+    {
+        array->index[i] = ASSOC_EMPTY;
+    }
+    array->size = 0;
+    array->count = 0;
+}
+
+/**
+ * @brief Turns a variable into an array of the given kind.
+ *
+ * A scalar's current value becomes element `0`. Converting between the
+ * two array kinds is refused, as in bash.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int make_array(shell_variable *variable, int kind)
+{
+    if (variable->kind == kind)
+    {
+        return 0;
+    }
+    if (variable->kind != VAR_SCALAR)
+    {
+        fprintf(stderr, "shell: %s: cannot convert array type\n", variable->name);
+        return -1;
+    }
+
+    if (kind == VAR_INDEXED)
+    {
+        variable->indexed = calloc(1, sizeof(indexed_array));
+        if (variable->indexed == NULL)
+        {
+            return -1;
+        }
+        if (variable->value != NULL)
+        {
+            indexed_set(variable->indexed, 0, variable->value, variable->length);
+        }
+    }
+    else
+    {
+        variable->assoc = calloc(1, sizeof(assoc_array));
+        if (variable->assoc == NULL)
+        {
+            return -1;
+        }
+        if (variable->value != NULL)
+        {
+            assoc_set(variable->assoc, "0", 1, variable->value, variable->length);
+        }
+    }
+
+    release_string(variable->value);
+    variable->value = NULL;
+    variable->length = 0;
+    variable->capacity = 0;
+    variable->kind = kind;
+    return 0;
+}
+
+/**
+ * @brief Looks up one element of an array variable.
+ *
+ * For an indexed array the subscript is a number, counted from the end if
+ * negative. For an associative array it is the key. A scalar behaves like
+ * an array with only element `0`.
+ *
+ * @return The element value (with its length in `*length`), or NULL if unset.
+ */
+static const char *get_element(const shell_variable *variable, const char *subscript,
+                               size_t subscript_length, size_t *length)
+{
+    if (variable->kind == VAR_ASSOC)
+    {
+        const assoc_entry *entry = assoc_get(variable->assoc, subscript, subscript_length);
+        if (entry == NULL)
+        {
+            return NULL;
+        }
+        *length = entry->length;
+        return entry->value;
+    }
+
+    char number[32];
+    if (subscript_length == 0 || subscript_length >= sizeof(number))
+    {
+        return NULL;
+    }
+    memcpy(number, subscript, subscript_length);
+    number[subscript_length] = '\0';
+
+    char *end;
+    long index = strtol(number, &end, 10);
+    if (*end != '\0')
+    {
+        return NULL;
+    }
+
+    if (variable->kind == VAR_SCALAR)
+    {
+        if (index != 0 || variable->value == NULL)
+        {
+            return NULL;
+        }
+        *length = variable->length;
+        return variable->value;
+    }
+
+    if (index < 0)
+    {
+        index += (long)variable->indexed->size;
+        if (index < 0)
+        {
+            return NULL;
+        }
+    }
+    const array_slot *slot = indexed_get(variable->indexed, (size_t)index);
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+    *length = slot->length;
+    return slot->value;
+}
+
+/**
+ * @brief Assigns one element of a variable, turning it into an array if needed.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int set_element(shell_variable *variable, const char *subscript, size_t subscript_length,
+                       const char *value, size_t length)
+{
+    if (variable->kind == VAR_ASSOC)
+    {
+        return assoc_set(variable->assoc, subscript, subscript_length, value, length);
+    }
+
+    char number[32];
+    char *end = number;
+    long index = -1;
+    if (subscript_length > 0 && subscript_length < sizeof(number))
+    {
+        memcpy(number, subscript, subscript_length);
+        number[subscript_length] = '\0';
+        index = strtol(number, &end, 10);
+    }
+    if (subscript_length == 0 || *end != '\0')
+    {
+        fprintf(stderr, "shell: %s: bad array subscript\n", variable->name);
+        return -1;
+    }
+
+    if (make_array(variable, VAR_INDEXED) == -1)
+    {
+        return -1;
+    }
+    if (index < 0)
+    {
+        index += (long)variable->indexed->size;
+        if (index < 0)
+        {
+            fprintf(stderr, "shell: %s: bad array subscript\n", variable->name);
+            return -1;
+        }
+    }
+    return indexed_set(variable->indexed, (size_t)index, value, length);
+}
+
+/**
+ * @brief Looks up the value of a shell or environment variable.
+ *
+ * The shell's own variables are checked first. If the name is not known
+ * there, the environment inherited from the parent process is used. An
+ * array yields its element `0`, as in other shells.
+ *
+ * @param name The variable name (not necessarily NUL-terminated).
+ * @param name_length The length of `name`.
+ * @param length Receives the length of the value.
+ * @return The value, or NULL if the variable is not set.
+ */
+const char *get_variable(const char *name, size_t name_length, size_t *length)
+{
+    shell_variable *variable = find_variable(name, name_length, 0);
+    if (variable != NULL)
+    {
+        if (variable->kind != VAR_SCALAR)
+        {
+            return get_element(variable, "0", 1, length);
+        }
+        *length = variable->length;
+        return variable->value;
+    }
+
+    // `getenv()` needs a NUL-terminated name.
+    char buffer[256];
+    if (name_length >= sizeof(buffer))
+    {
+        return NULL;
+    }
+    memcpy(buffer, name, name_length);
+    buffer[name_length] = '\0';
+
+    const char *value = getenv(buffer);
+    if (value != NULL)
+    {
+        *length = strlen(value);
+    }
+    return value;
+}
+
+/**
+ * @brief Assigns a value to a shell variable.
+ *
+ * The value is copied into the variable's own buffer, which only grows when
+ * the new value does not fit. Assigning to an array sets its element `0`.
+ * Variables inherited from the environment stay exported: their
+ * environment copy is updated as well.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int set_variable(const char *name, size_t name_length, const char *value, size_t length)
+{
+    shell_variable *variable = find_variable(name, name_length, 1);
+    if (variable == NULL)
+    {
+        return -1;
+    }
+
+    if (variable->kind != VAR_SCALAR)
+    {
+        return set_element(variable, "0", 1, value, length);
+    }
+
+    if (store_value(&variable->value, &variable->capacity, &variable->length, value, length) == -1)
+    {
+        return -1;
+    }
+
+    if (getenv(variable->name) != NULL)
+    {
+        setenv(variable->name, variable->value, 1);
+    }
+
+    // Commands found through the old search path may not be right any more.
+    if (name_length == 4 && memcmp(name, "PATH", 4) == 0)
+    {
+        command_hash_clear();
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes a variable from the store and releases everything it owns.
+ *
+ * Linear probing cannot simply empty the slot, because that would cut the
+ * probe chain of any entry placed after it. Instead, later entries of the
+ * same cluster are shifted back into the gap where their hash allows it.
+ */
+static void remove_variable(shell_variable *variable)
+{
+    release_string(variable->name);
+    release_string(variable->value);
+    if (variable->indexed != NULL)
+    {
+        indexed_clear(variable->indexed);
+        free(variable->indexed->slots);
+        free(variable->indexed);
+    }
+    if (variable->assoc != NULL)
+    {
+        assoc_clear(variable->assoc);
+        free(variable->assoc->entries);
+        free(variable->assoc->index);
+        free(variable->assoc);
+    }
+
+    size_t mask = variable_store.capacity - 1;
+    size_t hole = variable - variable_store.slots;
+    size_t next = hole;
+    for (;;)
+    {
+        next = (next + 1) & mask;
+        shell_variable *candidate = &variable_store.slots[next];
+        if (candidate->name == NULL)
+        {
+            break;
+        }
+        size_t home = hash_bytes(candidate->name, candidate->name_length) & mask;
+
+        // The candidate may move into the hole only if its home slot is not
+        // cyclically between the hole and its current position.
+        int stays = (hole <= next) ? (hole < home && home <= next)
+                                   : (hole < home || home <= next);
+        if (!stays)
+        {
+            variable_store.slots[hole] = *candidate;
+            hole = next;
+        }
+    }
+    memset(&variable_store.slots[hole], 0, sizeof(shell_variable));
+    variable_store.count--;
+}
+
+/**
+ * @brief Splits an assignment word into its parts.
+ *
+ * Accepts `NAME=value`, `NAME+=value`, `NAME[sub]=value` and
+ * `NAME[sub]+=value`.
+ *
+ * @return The length of `NAME`, or 0 if the word is not an assignment.
+ */
+static size_t parse_assignment(const char *word, const char **subscript, size_t *subscript_length,
+                               int *append, const char **value)
+{
+    if (!is_name_start(word[0]))
+    {
+        return 0;
+    }
+    size_t i = 1;
+    while (is_name_char(word[i]))
+    {
+        i++;
+    }
+    size_t name_length = i;
+
+    *subscript = NULL;
+    *subscript_length = 0;
+    if (word[i] == '[')
+    {
+        const char *close = strchr(word + i, ']');
+        if (close == NULL)
+        {
+            return 0;
+        }
+        *subscript = word + i + 1;
+        *subscript_length = close - *subscript;
+        i = close - word + 1;
+    }
+
+    *append = 0;
+    if (word[i] == '+')
+    {
+        *append = 1;
+        i++;
+    }
+    if (word[i] != '=')
+    {
+        return 0;
+    }
+    *value = word + i + 1;
+    return name_length;
+}
+
+/**
+ * @brief Checks whether `word` opens an array literal, as in `a=(` or `a+=(`.
+ *
+ * The tokenizer passes these on as a word of their own, followed by the
+ * elements and a closing `)` word.
+ */
+static int is_array_literal_start(const char *word)
+{
+    const char *subscript;
+    size_t subscript_length;
+    int append;
+    const char *value;
+    return parse_assignment(word, &subscript, &subscript_length, &append, &value) > 0 &&
+           subscript == NULL && strcmp(value, "(") == 0;
+}
+
+/**
+ * @brief Assigns the elements of an array literal.
+ *
+ * Elements are stored at consecutive indexes, starting after the current
+ * last element for `+=`. An element written as `[sub]=value` is stored at
+ * that subscript instead, which is the only form an associative array
+ * accepts.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int assign_array_literal(shell_variable *variable, int append, char **elements, int count)
+{
+    if (variable->kind == VAR_SCALAR)
+    {
+        if (!append && variable->value != NULL)
+        {
+            variable->length = 0;
+            release_string(variable->value);
+            variable->value = NULL;
+            variable->capacity = 0;
+        }
+        if (make_array(variable, VAR_INDEXED) == -1)
+        {
+            return -1;
+        }
+    }
+    if (!append)
+    {
+        if (variable->kind == VAR_INDEXED)
+        {
+            indexed_clear(variable->indexed);
+        }
+        else
+        {
+            assoc_clear(variable->assoc);
+        }
+    }
+
+    size_t next = (variable->kind == VAR_INDEXED) ? variable->indexed->size : 0;
+    for (int i = 0; i < count; i++)
+    {
+        const char *element = elements[i];
+        if (element[0] == '[')
+        {
+            const char *close = strchr(element, ']');
+            if (close != NULL && close[1] == '=')
+            {
+                if (set_element(variable, element + 1, close - element - 1,
+                                close + 2, strlen(close + 2)) == -1)
+                {
+                    return -1;
+                }
+                if (variable->kind == VAR_INDEXED)
+                {
+                    next = variable->indexed->size;
+                }
+                continue;
+            }
+        }
+        if (variable->kind == VAR_ASSOC)
+        {
+            fprintf(stderr, "shell: %s: %s: must use subscript when assigning associative array\n",
+                    variable->name, element);
+            return -1;
+        }
+        if (indexed_set(variable->indexed, next++, element, strlen(element)) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Performs the assignments of a line such as `A=1 B=two`.
+ *
+ * The words have already been through expansion and quote removal, so the
+ * text after the `=` is the final value. Array literals arrive as an
+ * opening `NAME=(` word, the elements, and a closing `)` word.
+ *
+ * @return 1 if the line was an assignment line and has been handled, 0 otherwise.
+ */
+int handle_assignments(char **args)
+{
+    const char *subscript;
+    size_t subscript_length;
+    int append;
+    const char *value;
+
+    // First make sure every word is an assignment, so that nothing is
+    // assigned for a line that turns out to be a command.
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (parse_assignment(args[i], &subscript, &subscript_length, &append, &value) == 0)
+        {
+            return 0;
+        }
+        if (is_array_literal_start(args[i]))
+        {
+            while (args[i] != NULL && strcmp(args[i], ")") != 0)
+            {
+                i++;
+            }
+            if (args[i] == NULL)
+            {
+                return 0;
+            }
+        }
+    }
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        size_t name_length = parse_assignment(args[i], &subscript, &subscript_length, &append, &value);
+        shell_variable *variable = find_variable(args[i], name_length, 1);
+        if (variable == NULL)
+        {
+            return 1;
+        }
+
+        if (is_array_literal_start(args[i]))
+        {
+            int first = ++i;
+            while (strcmp(args[i], ")") != 0)
+            {
+                i++;
+            }
+            assign_array_literal(variable, append, &args[first], i - first);
+            continue;
+        }
+
+        // For `+=`, look up the old value and append to it.
+        size_t old_length = 0;
+        const char *old_value = NULL;
+        if (append)
+        {
+            old_value = subscript ? get_element(variable, subscript, subscript_length, &old_length)
+                                  : get_variable(args[i], name_length, &old_length);
+        }
+        char *joined = NULL;
+        size_t length = strlen(value);
+        if (old_value != NULL && old_length > 0)
+        {
+            joined = malloc(old_length + length + 1);
+            if (joined == NULL)
+            {
+                perror("malloc failed in assignment");
+                return 1;
+            }
+            memcpy(joined, old_value, old_length);
+            memcpy(joined + old_length, value, length + 1);
+            value = joined;
+            length += old_length;
+        }
+
+        if (subscript != NULL)
+        {
+            set_element(variable, subscript, subscript_length, value, length);
+        }
+        else
+        {
+            set_variable(args[i], name_length, value, length);
+        }
+        free(joined);
+    }
+    return 1;
+}
+
+/**
+ * @brief Implements the `declare` built-in.
+ *
+ * Only the array options are supported: `declare -a NAME...` and
+ * `declare -A NAME...`.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int builtin_declare(char **args)
+{
+    int kind = VAR_SCALAR;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "-a") == 0)
+        {
+            kind = VAR_INDEXED;
+        }
+        else if (strcmp(args[i], "-A") == 0)
+        {
+            kind = VAR_ASSOC;
+        }
+        else
+        {
+            fprintf(stderr, "shell: declare: %s: invalid option\n", args[i]);
+            return 1;
+        }
+    }
+
+    int status = 0;
+    for (; args[i] != NULL; i++)
+    {
+        size_t name_length = 0;
+        while (is_name_char(args[i][name_length]))
+        {
+            name_length++;
+        }
+        if (name_length == 0 || args[i][name_length] != '\0' || !is_name_start(args[i][0]))
+        {
+            fprintf(stderr, "shell: declare: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        shell_variable *variable = find_variable(args[i], name_length, 1);
+        if (variable == NULL || (kind != VAR_SCALAR && make_array(variable, kind) == -1))
+        {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Implements the `unset` built-in.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int builtin_unset(char **args)
+{
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        const char *word = args[i];
+        size_t name_length = 0;
+        while (is_name_char(word[name_length]))
+        {
+            name_length++;
+        }
+
+        shell_variable *variable = find_variable(word, name_length, 0);
+        if (word[name_length] == '[')
+        {
+            const char *subscript = word + name_length + 1;
+            const char *close = strchr(subscript, ']');
+            if (close == NULL || close[1] != '\0')
+            {
+                fprintf(stderr, "shell: unset: `%s': not a valid identifier\n", word);
+                return 1;
+            }
+            if (variable == NULL)
+            {
+                continue;
+            }
+            size_t subscript_length = close - subscript;
+            if (variable->kind == VAR_ASSOC)
+            {
+                assoc_delete(variable->assoc, subscript, subscript_length);
+            }
+            else if (variable->kind == VAR_INDEXED)
+            {
+                char *end;
+                long index = strtol(subscript, &end, 10);
+                if (index < 0)
+                {
+                    index += (long)variable->indexed->size;
+                }
+                if (end == close && index >= 0 && (size_t)index < variable->indexed->size &&
+                    variable->indexed->slots[index].value != NULL)
+                {
+                    release_string(variable->indexed->slots[index].value);
+                    variable->indexed->slots[index].value = NULL;
+                    variable->indexed->count--;
+                }
+            }
+            continue;
+        }
+
+        if (word[name_length] != '\0')
+        {
+            fprintf(stderr, "shell: unset: `%s': not a valid identifier\n", word);
+            return 1;
+        }
+        if (variable != NULL)
+        {
+            remove_variable(variable);
+        }
+        unsetenv(word);
+        if (strcmp(word, "PATH") == 0)
+        {
+            command_hash_clear();
+        }
+    }
+    return 0;
+}
+
+/* ========================================================================= */
+/* INTERNED STRINGS                              */
+/* ========================================================================= */
+
+/**
+ * @brief An interned string: the one copy of its text that the shell keeps.
+ *
+ * Interning a word yields the same symbol every time, so code that needs
+ * to attach information to command names (such as their alias, or where
+ * the command was found in `PATH`) can keep it in the symbol and find it
+ * with a single hash lookup.
+ */
+typedef struct
+{
+    const char *text;      // NUL-terminated; on the heap or in the snapshot.
+    size_t length;
+    uint64_t hash;
+    char *alias;           // The alias value, or NULL if there is no alias.
+    size_t alias_length;
+    int alias_active;      // Set while the alias's own text is being expanded.
+    char *path;            // Where the command was found, or NULL.
+    unsigned long hits;    // Lookups of `path` since it was found.
+    int prefetched;        // Set once `path` has been read ahead, see `speculate_command()`.
+} symbol;
+
+/**
+ * @brief All interned strings, in an open-addressing table of pointers.
+ *
+ * Symbols are allocated one by one and never move or go away, so pointers
+ * to them stay valid while the table grows.
+ */
+static struct
+{
+    symbol **slots;
+    size_t capacity;
+    size_t count;
+    size_t alias_count;   // Symbols that currently have an alias.
+    size_t command_count; // Symbols that currently have a path.
+} symbol_table;
+
+/**
+ * @brief Finds the interned symbol for a string, if there is one.
+ *
+ * A word that is the symbol's own text (as the program name in a parsed
+ * command usually is, see `tokenize()`) is recognised by its address
+ * without comparing the bytes.
+ */
+static symbol *symbol_find(const char *text, size_t length)
+{
+    if (symbol_table.count == 0)
+    {
+        return NULL;
+    }
+    uint64_t hash = hash_bytes(text, length);
+    size_t mask = symbol_table.capacity - 1;
+    for (size_t i = hash & mask; symbol_table.slots[i] != NULL; i = (i + 1) & mask)
+    {
+        symbol *entry = symbol_table.slots[i];
+        if (entry->text == text ||
+            (entry->hash == hash && entry->length == length && memcmp(entry->text, text, length) == 0))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the symbol for a string, interning it if necessary.
+ *
+ * @param copy Non-zero to copy the text; zero if it is already permanent
+ *             (as strings in the snapshot mapping are) and NUL-terminated.
+ * @return The symbol, or NULL on allocation failure.
+ */
+static symbol *intern(const char *text, size_t length, int copy)
+{
+    symbol *existing = symbol_find(text, length);
+    if (existing != NULL)
+    {
+        return existing;
+    }
+
+    if ((symbol_table.count + 1) * 2 > symbol_table.capacity)
+    {
+        size_t capacity = symbol_table.capacity ? symbol_table.capacity * 2 : 256;
+        symbol **slots = calloc(capacity, sizeof(symbol *));
+        if (slots == NULL)
+        {
+            perror("calloc failed in symbol table");
+            return NULL;
+        }
+        for (size_t i = 0; i < symbol_table.capacity; i++)
+        {
+            symbol *entry = symbol_table.slots[i];
+            if (entry != NULL)
+            {
+                size_t k = entry->hash & (capacity - 1);
+                while (slots[k] != NULL)
+                {
+                    k = (k + 1) & (capacity - 1);
+                }
+                slots[k] = entry;
+            }
+        }
+        free(symbol_table.slots);
+        symbol_table.slots = slots;
+        symbol_table.capacity = capacity;
+    }
+
+    symbol *entry = calloc(1, sizeof(symbol));
+    char *own = copy ? strndup(text, length) : NULL;
+    if (entry == NULL || (copy && own == NULL))
+    {
+        perror("malloc failed in symbol table");
+        free(entry);
+        free(own);
+        return NULL;
+    }
+    entry->text = copy ? own : text;
+    entry->length = length;
+    entry->hash = hash_bytes(text, length);
+
+    size_t mask = symbol_table.capacity - 1;
+    size_t i = entry->hash & mask;
+    while (symbol_table.slots[i] != NULL)
+    {
+        i = (i + 1) & mask;
+    }
+    symbol_table.slots[i] = entry;
+    symbol_table.count++;
+    return entry;
+}
+
+/**
+ * @brief Gives a symbol an alias, replacing any it had.
+ *
+ * @param value The alias text, which the symbol takes ownership of.
+ */
+static void symbol_set_alias(symbol *entry, char *value, size_t length)
+{
+    if (entry->alias == NULL)
+    {
+        symbol_table.alias_count++;
+    }
+    release_string(entry->alias);
+    entry->alias = value;
+    entry->alias_length = length;
+}
+
+/**
+ * @brief Removes a symbol's alias, if it has one.
+ */
+static void symbol_clear_alias(symbol *entry)
+{
+    if (entry->alias != NULL)
+    {
+        release_string(entry->alias);
+        entry->alias = NULL;
+        entry->alias_length = 0;
+        symbol_table.alias_count--;
+    }
+}
+
+/* ========================================================================= */
+/* COMMAND HASH TABLE                            */
+/* ========================================================================= */
+
+/*
+ * The command hash table remembers where commands were found, so that
+ * running the same command again does not search `PATH` a second time.
+ * It is not a table of its own: the location is kept in the symbol of the
+ * command's name, so finding it is one lookup in the table of interned
+ * strings. Locations are never forgotten one at a time, only all at once
+ * when `PATH` changes or on `hash -r`.
+ */
+
+/**
+ * @brief Remembers where a command was found, taking ownership of `path`.
+ */
+static void command_remember(symbol *name, char *path)
+{
+    if (name->path == NULL)
+    {
+        symbol_table.command_count++;
+    }
+    release_string(name->path);
+    name->path = path;
+    name->hits = 0;
+    name->prefetched = 0;
+}
+
+/**
+ * @brief Forgets every remembered command location.
+ */
+static void command_hash_clear(void)
+{
+    for (size_t i = 0; i < symbol_table.capacity; i++)
+    {
+        symbol *entry = symbol_table.slots[i];
+        if (entry != NULL && entry->path != NULL)
+        {
+            release_string(entry->path);
+            entry->path = NULL;
+        }
+    }
+    symbol_table.command_count = 0;
+}
+
+/**
+ * @brief Searches the directories in `PATH` for an executable file.
+ *
+ * @return The full path (to be freed by the caller), or NULL if not found.
+ */
+static char *search_path(const char *name)
+{
+    const char *path = getenv("PATH");
+    if (path == NULL)
+    {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    size_t name_length = strlen(name);
+    for (;;)
+    {
+        const char *end = strchrnul(path, ':');
+        size_t directory_length = end - path;
+
+        // An empty entry means the current directory.
+        char *candidate = malloc(directory_length + name_length + 3);
+        if (candidate == NULL)
+        {
+            return NULL;
+        }
+        if (directory_length == 0)
+        {
+            candidate[directory_length++] = '.';
+        }
+        else
+        {
+            memcpy(candidate, path, directory_length);
+        }
+        candidate[directory_length] = '/';
+        memcpy(candidate + directory_length + 1, name, name_length + 1);
+
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0)
+        {
+            return candidate;
+        }
+        free(candidate);
+
+        if (*end == '\0')
+        {
+            return NULL;
+        }
+        path = end + 1;
+    }
+}
+
+/**
+ * @brief Returns the full path of a command, searching `PATH` only the
+ * first time the command is seen.
+ *
+ * Names containing a slash are used as they are, and commands that are not
+ * found are not remembered, so that installing them later works at once.
+ *
+ * @param name The command name.
+ * @return The full path, or NULL if the name should be passed to `execvp()`.
+ */
+const char *command_path(const char *name)
+{
+    if (name[0] == '\0' || strchr(name, '/') != NULL)
+    {
+        return NULL;
+    }
+
+    shell_stats.command_lookups++;
+    size_t name_length = strlen(name);
+    symbol *entry = symbol_find(name, name_length);
+    if (entry != NULL && entry->path != NULL)
+    {
+        entry->hits++;
+        shell_stats.command_hits++;
+        return entry->path;
+    }
+
+    // Only commands that were found are interned, so mistyped names do not
+    // fill up the table.
+    char *path = search_path(name);
+    if (path != NULL && entry == NULL)
+    {
+        entry = intern(name, name_length, 1);
+    }
+    if (path == NULL || entry == NULL)
+    {
+        free(path);
+        return NULL;
+    }
+    command_remember(entry, path);
+    return path;
+}
+
+/**
+ * @brief Implements the `hash` built-in.
+ *
+ * `hash` lists the remembered commands with their hit counts, `hash -r`
+ * forgets them all and `hash NAME...` looks the names up in `PATH` now.
+ *
+ * @return 0 on success, 1 if a name was not found.
+ */
+int builtin_hash(char **args)
+{
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0)
+    {
+        command_hash_clear();
+        return 0;
+    }
+
+    if (args[1] == NULL)
+    {
+        if (symbol_table.command_count == 0)
+        {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < symbol_table.capacity; i++)
+        {
+            symbol *entry = symbol_table.slots[i];
+            if (entry != NULL && entry->path != NULL)
+            {
+                printf("%4lu\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (is_builtin(args[i]))
+        {
+            continue;
+        }
+        if (command_path(args[i]) == NULL)
+        {
+            fprintf(stderr, "shell: hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* ========================================================================= */
+/* SCRIPT CACHE                                  */
+/* ========================================================================= */
+
+/**
+ * @brief Number of compiled scripts kept by `source`.
+ */
+#define SCRIPT_CACHE_SIZE 32
+
+/**
+ * @brief One command of a compiled script.
+ *
+ * A script is compiled by splitting it into lines and each line into its
+ * `;`, `&&` and `||` commands, exactly as `execute_line()` would. Commands
+ * without expansions always produce the same words, so they are tokenized
+ * once at compile time; the others keep their text and are tokenized each
+ * time they run, when the variables they refer to have their current values.
+ */
+typedef struct
+{
+    char *line;      // The whole source line, on a line's first command only.
+    char *text;      // The command itself.
+    char **args;     // Its words if it has no expansions, otherwise NULL.
+    char separator;  // ';', '&' for `&&`, '|' for `||`, '\0' at the end of a line.
+} script_command;
+
+/**
+ * @brief A compiled script, identified by the file it was compiled from.
+ *
+ * The device, inode, modification time and size together tell whether the
+ * file is still the one that was compiled; if any of them differs, the file
+ * is compiled again.
+ */
+typedef struct
+{
+    char *path; // NULL for an empty slot.
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    script_command *commands;
+    size_t count;
+    unsigned long last_used;
+    int active; // Runs of this script in progress; it must not be evicted.
+} script_cache_entry;
+
+/**
+ * @brief The compiled scripts, with the least recently used one evicted
+ * when a new script needs a slot.
+ */
+static script_cache_entry script_cache[SCRIPT_CACHE_SIZE];
+
+/**
+ * @brief Ticks once per lookup; entries remember when they were last used.
+ */
+static unsigned long script_cache_clock;
+
+/**
+ * @brief Checks whether a command can be tokenized once and for all: it
+ * has no expansions and its quotes are balanced (an unbalanced quote is
+ * left for the tokenizer to report when the command runs).
+ */
+static int is_static_command(const char *text)
+{
+    char quote = '\0';
+    for (const char *p = text; *p != '\0'; p++)
+    {
+        if (*p == '$' || *p == '`')
+        {
+            return 0;
+        }
+        if (*p == '\\' && quote != '\'' && p[1] != '\0')
+        {
+            p++;
+        }
+        else if (quote == '\0' && (*p == '\'' || *p == '"'))
+        {
+            quote = *p;
+        }
+        else if (*p == quote)
+        {
+            quote = '\0';
+        }
+    }
+    return quote == '\0';
+}
+
+/**
+ * @brief Releases everything a compiled script owns.
+ */
+static void script_free(script_cache_entry *entry)
+{
+    for (size_t i = 0; i < entry->count; i++)
+    {
+        script_command *command = &entry->commands[i];
+        release_string(command->line);
+        release_string(command->text);
+        // The words are in the same block as the array (or, for a script
+        // loaded from a snapshot, in the snapshot mapping).
+        free(command->args);
+    }
+    free(entry->commands);
+    release_string(entry->path);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/**
+ * @brief Compiles the text of a script into a list of commands.
+ *
+ * Blank lines and comment lines are dropped.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int script_compile(script_cache_entry *entry, const char *data, size_t length)
+{
+    size_t capacity = 16;
+    entry->count = 0;
+    entry->commands = malloc(capacity * sizeof(script_command));
+    if (entry->commands == NULL)
+    {
+        return -1;
+    }
+
+    const char *end = data + length;
+    while (data < end)
+    {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t line_length = newline ? (size_t)(newline - data) : (size_t)(end - data);
+        char *line = strndup(data, line_length);
+        data += line_length + 1;
+        if (line == NULL)
+        {
+            return -1;
+        }
+        size_t blank = strspn(line, " \t\r");
+        if (line[blank] == '\0' || line[blank] == '#')
+        {
+            free(line);
+            continue;
+        }
+
+        const char *rest = line;
+        int first = 1;
+        for (;;)
+        {
+            char separator;
+            size_t command_length = next_command_length(rest, &separator);
+            if (entry->count == capacity)
+            {
+                script_command *grown = realloc(entry->commands, 2 * capacity * sizeof(script_command));
+                if (grown == NULL)
+                {
+                    free(first ? line : NULL);
+                    return -1;
+                }
+                entry->commands = grown;
+                capacity *= 2;
+            }
+
+            script_command *command = &entry->commands[entry->count];
+            command->line = first ? line : NULL;
+            command->text = strndup(rest, command_length);
+            command->args = NULL;
+            command->separator = separator;
+            if (command->text == NULL)
+            {
+                free(first ? line : NULL);
+                return -1;
+            }
+            entry->count++;
+            first = 0;
+
+            if (is_static_command(command->text))
+            {
+                command->args = tokenize(command->text);
+            }
+
+            if (separator == '\0')
+            {
+                break;
+            }
+            rest += command_length + (separator == ';' ? 1 : 2);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs a compiled script.
+ *
+ * This is `execute_line()` applied to each line in turn, minus the reading
+ * and splitting, and minus the tokenizing for commands compiled to words.
+ * Aliases are the one thing compilation cannot settle, since they may be
+ * defined after the script was compiled: when any alias is defined, a line
+ * that turns out to contain one is run from its text instead.
+ *
+ * @return 0 if the script ran `exit`, 1 otherwise.
+ */
+static int script_run(const script_cache_entry *entry)
+{
+    int status = 1;
+    int run = 1;
+    for (size_t i = 0; i < entry->count && status; i++)
+    {
+        const script_command *command = &entry->commands[i];
+        if (command->line != NULL)
+        {
+            run = 1;
+            char *expanded = symbol_table.alias_count ? expand_aliases(command->line) : NULL;
+            if (expanded != NULL)
+            {
+                free(expanded);
+                status = execute_line(command->line);
+                while (i + 1 < entry->count && entry->commands[i + 1].line == NULL)
+                {
+                    i++;
+                }
+                continue;
+            }
+        }
+
+        if (run)
+        {
+            if (command->args != NULL)
+            {
+                // `execute_command()` cuts pipelines apart inside the array
+                // it is given, so it gets a copy of the compiled one.
+                size_t argc = 0;
+                while (command->args[argc] != NULL)
+                {
+                    argc++;
+                }
+                char **args = malloc((argc + 1) * sizeof(char *));
+                if (args == NULL)
+                {
+                    perror("malloc failed in source");
+                    return 1;
+                }
+                memcpy(args, command->args, (argc + 1) * sizeof(char *));
+                status = execute_command(args);
+                free(args);
+            }
+            else
+            {
+                char **args = parse_line(command->text);
+                if (args == NULL)
+                {
+                    last_status = 2;
+                }
+                else
+                {
+                    status = execute_command(args);
+                    free_args(args);
+                }
+            }
+        }
+
+        if (command->separator == '&')
+        {
+            run = (last_status == 0);
+        }
+        else if (command->separator == '|')
+        {
+            run = (last_status != 0);
+        }
+        else
+        {
+            run = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Finds the compiled form of a file, if it is cached and current.
+ */
+static script_cache_entry *script_cache_find(const struct stat *info)
+{
+    for (int i = 0; i < SCRIPT_CACHE_SIZE; i++)
+    {
+        script_cache_entry *entry = &script_cache[i];
+        if (entry->path != NULL && entry->device == info->st_dev && entry->inode == info->st_ino &&
+            entry->size == info->st_size && entry->mtime.tv_sec == info->st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == info->st_mtim.tv_nsec)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Picks a slot for a newly compiled script: an empty one, or else
+ * the least recently used one that is not running.
+ *
+ * @return The emptied slot, or NULL if every script in the cache is running.
+ */
+static script_cache_entry *script_cache_slot(void)
+{
+    script_cache_entry *victim = NULL;
+    for (int i = 0; i < SCRIPT_CACHE_SIZE; i++)
+    {
+        script_cache_entry *entry = &script_cache[i];
+        if (entry->path == NULL)
+        {
+            return entry;
+        }
+        if (!entry->active && (victim == NULL || entry->last_used < victim->last_used))
+        {
+            victim = entry;
+        }
+    }
+    if (victim != NULL)
+    {
+        script_free(victim);
+    }
+    return victim;
+}
+
+/**
+ * @brief Returns the compiled form of a script file, compiling it only if
+ * it is not in the cache.
+ *
+ * An unchanged file is recognised from a single `stat()` and served from
+ * its compiled form without being read again. A file that changed replaces
+ * its old entry (once that is no longer running).
+ *
+ * @param path The script file.
+ * @param scratch Used if every slot of the cache holds a running script;
+ *                the caller must then `script_free()` it when done.
+ * @return The compiled script, or NULL (with the error reported and
+ *         `last_status` set) if it could not be read.
+ */
+static script_cache_entry *script_load(const char *path, script_cache_entry *scratch)
+{
+    struct stat info;
+    if (stat(path, &info) == -1)
+    {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        last_status = 1;
+        return NULL;
+    }
+
+    shell_stats.script_lookups++;
+    script_cache_entry *entry = script_cache_find(&info);
+    if (entry != NULL)
+    {
+        shell_stats.script_hits++;
+    }
+    else
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        char *data = (fd == -1) ? NULL : malloc(info.st_size + 1);
+        ssize_t length = 0;
+        while (data != NULL && length < info.st_size)
+        {
+            ssize_t n = read(fd, data + length, info.st_size - length);
+            if (n <= 0)
+            {
+                if (n == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            length += n;
+        }
+        int error = errno;
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        if (data == NULL)
+        {
+            fprintf(stderr, "shell: %s: %s\n", path, strerror(fd == -1 ? error : ENOMEM));
+            last_status = 1;
+            return NULL;
+        }
+
+        // Forget any older version of the file that is not running.
+        for (int i = 0; i < SCRIPT_CACHE_SIZE; i++)
+        {
+            script_cache_entry *old = &script_cache[i];
+            if (old->path != NULL && !old->active && old->device == info.st_dev && old->inode == info.st_ino)
+            {
+                script_free(old);
+            }
+        }
+
+        // If every slot is busy running a script, run this one uncached.
+        entry = script_cache_slot();
+        if (entry == NULL)
+        {
+            entry = scratch;
+        }
+        entry->path = strdup(path);
+        entry->device = info.st_dev;
+        entry->inode = info.st_ino;
+        entry->mtime = info.st_mtim;
+        entry->size = info.st_size;
+        if (entry->path == NULL || script_compile(entry, data, length) == -1)
+        {
+            perror("shell: source");
+            script_free(entry);
+            free(data);
+            last_status = 1;
+            return NULL;
+        }
+        free(data);
+    }
+    entry->last_used = ++script_cache_clock;
+    return entry;
+}
+
+/**
+ * @brief Runs a script file from the script cache.
+ *
+ * @param path The file to run.
+ * @return 0 if the script ran `exit`, 1 otherwise (like `execute_line()`).
+ */
+int source_file(const char *path)
+{
+    script_cache_entry scratch = {0};
+    script_cache_entry *entry = script_load(path, &scratch);
+    if (entry == NULL)
+    {
+        return 1;
+    }
+
+    entry->active++;
+    int status = script_run(entry);
+    entry->active--;
+    if (entry == &scratch)
+    {
+        script_free(&scratch);
+    }
+    return status;
+}
+
+/**
+ * @brief Implements the `source` and `.` built-ins.
+ *
+ * @return 0 if the script ran `exit`, 1 otherwise (like `execute_line()`);
+ *         `last_status` holds the status of the script's last command.
+ */
+int builtin_source(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "usage: %s FILE\n", args[0]);
+        last_status = 2;
+        return 1;
+    }
+    last_status = 0;
+    return source_file(args[1]);
+}
+
+/* ========================================================================= */
+/* PARSE CACHE                                   */
+/* ========================================================================= */
+
+/**
+ * @brief One cached parse: the text of a command and the words it produced.
+ */
+typedef struct
+{
+    char *line;         // The command text, or NULL for an unused entry.
+    size_t line_length;
+    uint64_t hash;
+    char **args;        // The words, packed the way `tokenize()` returns them.
+    size_t count;       // The number of words.
+    size_t size;        // Bytes in the `args` block.
+    int newer;          // Neighbours in LRU order (entry indices, -1 at the ends).
+    int older;
+    int chain;          // The next entry in the same bucket, or -1.
+} parse_cache_entry;
+
+/**
+ * @brief Parses of commands without expansions, keyed by the command text.
+ *
+ * Entries are found through a chained hash table and kept on a list in
+ * order of use, so both a lookup and an eviction of the least recently
+ * used entry take constant time. Memory is bounded by PARSE_CACHE_SIZE
+ * entries of at most MAX_LINE_LENGTH bytes of text each.
+ */
+static struct
+{
+    parse_cache_entry entries[PARSE_CACHE_SIZE];
+    int buckets[PARSE_CACHE_SIZE]; // The first entry in each chain, or -1.
+    int newest;
+    int oldest;
+    int used;                      // Entries handed out so far.
+    int ready;
+} parse_cache;
+
+/**
+ * @brief Sets the bucket heads and list ends to -1 on first use.
+ */
+static void parse_cache_init(void)
+{
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++)
+    {
+        parse_cache.buckets[i] = -1;
+    }
+    parse_cache.newest = -1;
+    parse_cache.oldest = -1;
+    parse_cache.ready = 1;
+}
+
+/**
+ * @brief Takes an entry off the LRU list.
+ */
+static void parse_cache_unlink(int index)
+{
+    parse_cache_entry *entry = &parse_cache.entries[index];
+    if (entry->newer != -1)
+    {
+        parse_cache.entries[entry->newer].older = entry->older;
+    }
+    else
+    {
+        parse_cache.newest = entry->older;
+    }
+    if (entry->older != -1)
+    {
+        parse_cache.entries[entry->older].newer = entry->newer;
+    }
+    else
+    {
+        parse_cache.oldest = entry->newer;
+    }
+}
+
+/**
+ * @brief Puts an entry at the most recently used end of the LRU list.
+ */
+static void parse_cache_push(int index)
+{
+    parse_cache_entry *entry = &parse_cache.entries[index];
+    entry->newer = -1;
+    entry->older = parse_cache.newest;
+    if (parse_cache.newest != -1)
+    {
+        parse_cache.entries[parse_cache.newest].newer = index;
+    }
+    parse_cache.newest = index;
+    if (parse_cache.oldest == -1)
+    {
+        parse_cache.oldest = index;
+    }
+}
+
+/**
+ * @brief Returns the part of a command that identifies it in the cache:
+ * the text without surrounding blanks, which make no difference to the
+ * words (`a; b` and `a ;b` both run ` b` and `b`).
+ */
+static const char *parse_cache_key(const char *line, size_t *length)
+{
+    line += strspn(line, TOKEN_DELIMITERS);
+    size_t n = strlen(line);
+    while (n > 0 && strchr(TOKEN_DELIMITERS, line[n - 1]) != NULL)
+    {
+        n--;
+    }
+    *length = n;
+    return line;
+}
+
+/**
+ * @brief Copies a packed argument array.
+ *
+ * The block is copied in one go and the pointers are then moved to the
+ * copy of the text, except a program name that points at its interned
+ * copy (see `tokenize()`), which stays as it is.
+ *
+ * @return The copy, or NULL on allocation failure.
+ */
+static char **copy_args(char **args, size_t count, size_t size)
+{
+    char **copy = malloc(size);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    memcpy(copy, args, size);
+    const char *old_text = (const char *)(args + count + 1);
+    char *text = (char *)(copy + count + 1);
+    size_t offset = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0 || args[0] == old_text + 1)
+        {
+            copy[i] = text + offset;
+        }
+        offset += strlen(text + offset) + 2;
+    }
+    return copy;
+}
+
+/**
+ * @brief Returns a fresh copy of the cached parse of `line`, if there is one.
+ *
+ * Only commands without expansions are cached (`is_static_command()`), as
+ * only their words are the same every time. The caller owns the copy and
+ * frees it with `free_args()`.
+ *
+ * @return The words, or NULL if the line is not in the cache.
+ */
+char **parse_cache_get(const char *line)
+{
+    if (!is_static_command(line))
+    {
+        return NULL;
+    }
+    if (!parse_cache.ready)
+    {
+        parse_cache_init();
+    }
+    shell_stats.parse_lookups++;
+
+    size_t length;
+    line = parse_cache_key(line, &length);
+    uint64_t hash = hash_bytes(line, length);
+    for (int i = parse_cache.buckets[hash % PARSE_CACHE_SIZE]; i != -1; i = parse_cache.entries[i].chain)
+    {
+        parse_cache_entry *entry = &parse_cache.entries[i];
+        if (entry->hash == hash && entry->line_length == length && memcmp(entry->line, line, length) == 0)
+        {
+            char **args = copy_args(entry->args, entry->count, entry->size);
+            if (args != NULL)
+            {
+                shell_stats.parse_hits++;
+                parse_cache_unlink(i);
+                parse_cache_push(i);
+            }
+            return args;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds the parse of a command without expansions to the cache,
+ * evicting the least recently used entry if the cache is full.
+ *
+ * @param line The command text.
+ * @param args Its words, as returned by `tokenize()`; the cache keeps a copy.
+ */
+void parse_cache_put(const char *line, char **args)
+{
+    if (!is_static_command(line))
+    {
+        return;
+    }
+    if (!parse_cache.ready)
+    {
+        parse_cache_init();
+    }
+
+    size_t count = 0;
+    size_t size = sizeof(char *);
+    for (; args[count] != NULL; count++)
+    {
+        size += sizeof(char *) + strlen(args[count]) + 2;
+    }
+
+    size_t length;
+    line = parse_cache_key(line, &length);
+    char *text = strndup(line, length);
+    char **copy = copy_args(args, count, size);
+    if (text == NULL || copy == NULL)
+    {
+        free(text);
+        free(copy);
+        return;
+    }
+
+    int index;
+    if (parse_cache.used < PARSE_CACHE_SIZE)
+    {
+        index = parse_cache.used++;
+    }
+    else
+    {
+        // Evict the oldest entry and take it out of its bucket's chain.
+        index = parse_cache.oldest;
+        parse_cache_entry *victim = &parse_cache.entries[index];
+        int *link = &parse_cache.buckets[victim->hash % PARSE_CACHE_SIZE];
+        while (*link != index)
+        {
+            link = &parse_cache.entries[*link].chain;
+        }
+        *link = victim->chain;
+        parse_cache_unlink(index);
+        free(victim->line);
+        free(victim->args);
+    }
+
+    parse_cache_entry *entry = &parse_cache.entries[index];
+    entry->line = text;
+    entry->line_length = length;
+    entry->hash = hash_bytes(line, length);
+    entry->args = copy;
+    entry->count = count;
+    entry->size = size;
+    entry->chain = parse_cache.buckets[entry->hash % PARSE_CACHE_SIZE];
+    parse_cache.buckets[entry->hash % PARSE_CACHE_SIZE] = index;
+    parse_cache_push(index);
+}
+
+/* ========================================================================= */
+/* LINE EDITOR & SPECULATIVE RESOLUTION          */
+/* ========================================================================= */
+
+/*
+ * On a terminal the shell reads keystrokes itself instead of leaving line
+ * editing to the terminal driver. The editor is deliberately small (typing,
+ * Backspace, Ctrl+U, Ctrl+W, Ctrl+D, Enter), but it sees the command name
+ * while it is being typed. As soon as the name is complete, because a
+ * blank follows it or because the user paused, the shell looks it up in
+ * `PATH` and starts reading the program (and its ELF interpreter, or its
+ * `#!` interpreter) into the page cache in a background thread. By the
+ * time Enter is pressed, the `PATH` search is done and a cold binary is
+ * already in memory. Setting `SHELL_SPECULATE=0` turns this off.
+ */
+
+/**
+ * @brief How long the user must stop typing before a partly typed command
+ * name is resolved, in milliseconds.
+ */
+#define SPECULATE_PAUSE_MS 120
+
+/**
+ * @brief The terminal settings to put back after editing a line.
+ */
+static struct termios editor_saved_mode;
+
+/**
+ * @brief Reads a file into the page cache.
+ *
+ * @return The file's interpreter (from `PT_INTERP` for an ELF executable,
+ *         or from the `#!` line of a script), to be freed by the caller, or
+ *         NULL if it has none.
+ */
+static char *prefetch_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    readahead(fd, 0, info.st_size);
+
+    char *interpreter = NULL;
+    char head[256];
+    ssize_t n = pread(fd, head, sizeof(head) - 1, 0);
+    if (n > 2 && head[0] == '#' && head[1] == '!')
+    {
+        head[n] = '\0';
+        char *start = head + 2 + strspn(head + 2, " \t");
+        interpreter = strndup(start, strcspn(start, " \t\r\n"));
+    }
+    else if (n >= (ssize_t)sizeof(Elf64_Ehdr) && memcmp(head, ELFMAG, SELFMAG) == 0 &&
+             head[EI_CLASS] == ELFCLASS64)
+    {
+        Elf64_Ehdr header;
+        memcpy(&header, head, sizeof(header));
+        for (int i = 0; i < header.e_phnum && interpreter == NULL; i++)
+        {
+            Elf64_Phdr program;
+            off_t offset = header.e_phoff + (off_t)i * header.e_phentsize;
+            if (pread(fd, &program, sizeof(program), offset) != sizeof(program))
+            {
+                break;
+            }
+            if (program.p_type == PT_INTERP && program.p_filesz > 1 && program.p_filesz < PATH_MAX)
+            {
+                interpreter = malloc(program.p_filesz);
+                if (interpreter != NULL &&
+                    pread(fd, interpreter, program.p_filesz, program.p_offset) != (ssize_t)program.p_filesz)
+                {
+                    free(interpreter);
+                    interpreter = NULL;
+                }
+                else if (interpreter != NULL)
+                {
+                    interpreter[program.p_filesz - 1] = '\0';
+                }
+            }
+        }
+    }
+    close(fd);
+    return interpreter;
+}
+
+/**
+ * @brief Thread body: prefetches a program and then its interpreter.
+ *
+ * @param arg The program's path, which the thread frees.
+ */
+static void *prefetch_thread(void *arg)
+{
+    char *path = arg;
+    for (int depth = 0; path != NULL && depth < 3; depth++)
+    {
+        char *next = prefetch_file(path);
+        free(path);
+        path = next;
+    }
+    free(path);
+    return NULL;
+}
+
+/**
+ * @brief Resolves a command name that is being typed and starts reading
+ * the program into memory.
+ *
+ * Built-ins, aliases and names with a slash are left alone. A name that is
+ * not found is not remembered, exactly as for `command_path()`, so a half
+ * typed name costs a `PATH` search and nothing more.
+ */
+static void speculate_command(const char *name, size_t length)
+{
+    size_t value_length;
+    const char *setting = get_variable("SHELL_SPECULATE", 15, &value_length);
+    if ((setting != NULL && strcmp(setting, "0") == 0) || length == 0 || length >= PATH_MAX)
+    {
+        return;
+    }
+    char word[PATH_MAX];
+    memcpy(word, name, length);
+    word[length] = '\0';
+    if (strpbrk(word, "/$`'\"\\=") != NULL || is_builtin(word))
+    {
+        return;
+    }
+
+    symbol *entry = symbol_find(word, length);
+    if (entry != NULL && entry->alias != NULL)
+    {
+        return;
+    }
+    if (entry == NULL || entry->path == NULL)
+    {
+        char *path = search_path(word);
+        if (path != NULL && entry == NULL)
+        {
+            entry = intern(word, length, 1);
+        }
+        if (path == NULL || entry == NULL)
+        {
+            free(path);
+            return;
+        }
+        command_remember(entry, path);
+        shell_stats.speculative_resolutions++;
+    }
+    if (entry->prefetched)
+    {
+        return;
+    }
+
+    entry->prefetched = 1;
+    char *copy = strdup(entry->path);
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (copy != NULL && pthread_create(&thread, &attributes, prefetch_thread, copy) == 0)
+    {
+        shell_stats.prefetches++;
+    }
+    else
+    {
+        free(copy);
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * @brief Finds the command name in the line being edited.
+ *
+ * @param complete Set if a blank follows the name.
+ * @return The length of the name; `*start` is where it begins.
+ */
+static size_t editor_first_word(const char *line, size_t length, size_t *start, int *complete)
+{
+    size_t i = 0;
+    while (i < length && (line[i] == ' ' || line[i] == '\t'))
+    {
+        i++;
+    }
+    *start = i;
+    while (i < length && line[i] != ' ' && line[i] != '\t' && line[i] != ';' && line[i] != '|' &&
+           line[i] != '&')
+    {
+        i++;
+    }
+    *complete = (i < length);
+    return i - *start;
+}
+
+/**
+ * @brief Erases the last `count` characters shown on the terminal.
+ */
+static void editor_erase(size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        write_all(STDOUT_FILENO, "\b \b", 3);
+    }
+}
+
+/**
+ * @brief Switches the terminal to reading single keystrokes.
+ *
+ * Echo and line buffering are turned off, but signals stay on, so Ctrl+C
+ * and Ctrl+Z reach the event loop as before.
+ *
+ * @return 0 on success, -1 if the terminal cannot be switched.
+ */
+static int editor_raw_mode(void)
+{
+    if (tcgetattr(STDIN_FILENO, &editor_saved_mode) == -1)
+    {
+        return -1;
+    }
+    struct termios raw = editor_saved_mode;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+/**
+ * @brief Reads a line from the terminal, resolving the command name as it
+ * is typed.
+ *
+ * Keystrokes are read into `input_buffer`, so anything typed ahead (or
+ * pasted) after Enter is kept for the next line.
+ *
+ * @return The line, or NULL at end of input (Ctrl+D on an empty line).
+ */
+char *edit_line(void)
+{
+    if (editor_raw_mode() == -1)
+    {
+        return NULL;
+    }
+    fflush(stdout);
+
+    char line[MAX_LINE_LENGTH];
+    size_t length = 0;
+    unsigned long interrupts = event_loop.interrupts;
+    char speculated[MAX_LINE_LENGTH] = "";
+    int escape = 0;
+    int done = 0;
+    int end_of_file = 0;
+
+    while (!done)
+    {
+        if (input_buffer.start == input_buffer.end)
+        {
+            // While the command name is still being typed, wait only a
+            // little for the next key: a pause means the name is complete.
+            size_t start;
+            int complete;
+            size_t word = editor_first_word(line, length, &start, &complete);
+            int pending = word > 0 && (word != strlen(speculated) ||
+                                       memcmp(speculated, line + start, word) != 0);
+            int ready = wait_for_input(pending ? SPECULATE_PAUSE_MS : -1);
+            if (ready == -1)
+            {
+                memcpy(speculated, line + start, word);
+                speculated[word] = '\0';
+                speculate_command(line + start, word);
+                continue;
+            }
+            if (ready == 0)
+            {
+                end_of_file = 1;
+                break;
+            }
+            if (event_loop.interrupts != interrupts)
+            {
+                // Ctrl+C abandoned the line; the prompt is already shown.
+                interrupts = event_loop.interrupts;
+                length = 0;
+            }
+            ssize_t n = read(STDIN_FILENO, input_buffer.data, sizeof(input_buffer.data));
+            if (n == -1 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                end_of_file = 1;
+                break;
+            }
+            input_buffer.start = 0;
+            input_buffer.end = n;
+        }
+
+        unsigned char key = input_buffer.data[input_buffer.start++];
+        if (escape)
+        {
+            // Skip escape sequences such as the arrow keys: ESC [ ... final.
+            escape = (key == '[' || key == 'O' || (escape > 1 && key < 0x40)) ? escape + 1 : 0;
+            continue;
+        }
+        if (key == '\r' || key == '\n')
+        {
+            write_all(STDOUT_FILENO, "\n", 1);
+            done = 1;
+        }
+        else if (key == 4 && length == 0)
+        {
+            end_of_file = 1;
+            break;
+        }
+        else if (key == 127 || key == '\b')
+        {
+            // Remove a whole UTF-8 character, continuation bytes included.
+            while (length > 0 && ((unsigned char)line[length - 1] & 0xC0) == 0x80)
+            {
+                length--;
+            }
+            if (length > 0)
+            {
+                length--;
+                editor_erase(1);
+            }
+        }
+        else if (key == 21)
+        {
+            // Ctrl+U: erase the whole line.
+            editor_erase(length);
+            length = 0;
+        }
+        else if (key == 23)
+        {
+            // Ctrl+W: erase the word before the cursor.
+            size_t end = length;
+            while (length > 0 && line[length - 1] == ' ')
+            {
+                length--;
+            }
+            while (length > 0 && line[length - 1] != ' ')
+            {
+                length--;
+            }
+            editor_erase(end - length);
+        }
+        else if (key == 27)
+        {
+            escape = 1;
+        }
+        else if ((key >= 32 || key == '\t') && length < MAX_LINE_LENGTH - 1)
+        {
+            line[length++] = key == '\t' ? ' ' : key;
+            write_all(STDOUT_FILENO, line + length - 1, 1);
+
+            // A blank after the command name completes it.
+            size_t start;
+            int complete;
+            size_t word = editor_first_word(line, length, &start, &complete);
+            if (complete && (word != strlen(speculated) || memcmp(speculated, line + start, word) != 0))
+            {
+                memcpy(speculated, line + start, word);
+                speculated[word] = '\0';
+                speculate_command(line + start, word);
+            }
+        }
+    }
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor_saved_mode);
+    if (end_of_file && !done)
+    {
+        return NULL;
+    }
+    char *result = strndup(line, length);
+    if (result == NULL)
+    {
+        perror("malloc failed in edit_line");
+    }
+    return result;
+}
+
+/* ========================================================================= */
+/* SNAPSHOTS & STARTUP FILES                     */
+/* ========================================================================= */
+
+/*
+ * A snapshot is the shell's state (variables, arrays, aliases and the
+ * command hash table) written to a file by `snapshot save`. At startup the shell maps
+ * the snapshot instead of running its rc file, as long as the snapshot is
+ * at least as new as the rc file. The names and values are then used
+ * directly from the mapping, so loading costs one pass over the records
+ * to rebuild the hash tables, not one allocation and copy per string.
+ *
+ * The file is a header followed by a payload of records. All integers are
+ * in the byte order of the machine that wrote the file, and every string
+ * is followed by a NUL so that it can be used in place:
+ *
+ *     'S' u32 name_length u32 value_length name\0 value\0
+ *     'X' the same for a variable that is also in the environment
+ *     'I' u32 name_length u32 count name\0
+ *         count x (u32 index u32 length value\0)
+ *     'A' u32 name_length u32 count name\0
+ *         count x (u32 key_length u32 length u64 hash key\0 value\0)
+ *     'C' u32 4 u32 value_length PATH\0 value\0   (the PATH of the 'H' records)
+ *     'H' u32 name_length u32 path_length name\0 path\0
+ *     'L' u32 name_length u32 value_length name\0 value\0   (an alias)
+ *     'P' u32 path_length u32 count path\0
+ *         u64 device u64 inode i64 mtime_sec i64 mtime_nsec i64 size
+ *         count x (u8 flags u8 separator u32 text_length text\0
+ *                  [u32 line_length line\0]          if flags & 1
+ *                  [u32 argc argc x (u32 length+1 u8 unquoted word\0)]
+ *                                                    if flags & 2)
+ *     'E'
+ *
+ * A 'P' record is a script compiled by `source`, so that scripts sourced
+ * from the rc file stay compiled in a shell started from the snapshot. The
+ * 'H' records (the command hash) are only loaded if `PATH` is the same as
+ * in the 'C' record before them.
+ */
+
+#define SNAPSHOT_MAGIC "SHSNAP\r\n"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+/**
+ * @brief The fixed header at the start of a snapshot file.
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;       // SNAPSHOT_BYTE_ORDER as written by the saver.
+    uint64_t payload_length;
+    uint64_t checksum;         // `snapshot_checksum()` of the payload.
+    uint64_t variable_count;   // Lets the loader size the variable table once.
+} snapshot_header;
+
+/**
+ * @brief Checksums a snapshot payload.
+ *
+ * This is FNV-1a applied to whole 64-bit words rather than to bytes, which
+ * makes it several times faster than `hash_bytes()` on a large snapshot
+ * while still catching truncated or damaged files.
+ */
+static uint64_t snapshot_checksum(const char *data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+/**
+ * @brief A growable buffer the snapshot is assembled in before writing.
+ */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    int error;
+} snapshot_buffer;
+
+/**
+ * @brief Appends raw bytes to a snapshot buffer.
+ */
+static void snapshot_put(snapshot_buffer *out, const void *data, size_t length)
+{
+    if (out->error)
+    {
+        return;
+    }
+    if (out->length + length > out->capacity)
+    {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while (capacity < out->length + length)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(out->data, capacity);
+        if (grown == NULL)
+        {
+            out->error = 1;
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+}
+
+/**
+ * @brief Appends a 32-bit integer to a snapshot buffer.
+ */
+static void snapshot_put_u32(snapshot_buffer *out, size_t value)
+{
+    uint32_t word = (uint32_t)value;
+    snapshot_put(out, &word, sizeof(word));
+}
+
+/**
+ * @brief Appends a string and its terminating NUL to a snapshot buffer.
+ */
+static void snapshot_put_string(snapshot_buffer *out, const char *string, size_t length)
+{
+    snapshot_put(out, string, length);
+    snapshot_put(out, "", 1);
+}
+
+/**
+ * @brief Reads from a snapshot payload with bounds checking.
+ */
+typedef struct
+{
+    const char *position;
+    const char *end;
+} snapshot_reader;
+
+/**
+ * @brief Returns the next `length` bytes of the payload, or NULL if the
+ * payload is shorter than that.
+ */
+static const char *snapshot_take(snapshot_reader *in, size_t length)
+{
+    if ((size_t)(in->end - in->position) < length)
+    {
+        return NULL;
+    }
+    const char *data = in->position;
+    in->position += length;
+    return data;
+}
+
+/**
+ * @brief Reads a 32-bit integer from the payload.
+ *
+ * @return 0 on success, -1 if the payload is truncated.
+ */
+static int snapshot_u32(snapshot_reader *in, uint32_t *value)
+{
+    const char *data = snapshot_take(in, sizeof(*value));
+    if (data == NULL)
+    {
+        return -1;
+    }
+    memcpy(value, data, sizeof(*value));
+    return 0;
+}
+
+/**
+ * @brief Reads a NUL-terminated string of a known length from the payload.
+ *
+ * @return The string, or NULL if the payload is truncated or the string is
+ *         not terminated where it should be.
+ */
+static const char *snapshot_string(snapshot_reader *in, uint32_t length)
+{
+    const char *data = snapshot_take(in, (size_t)length + 1);
+    return (data != NULL && data[length] == '\0') ? data : NULL;
+}
+
+/**
+ * @brief Reads a 64-bit integer from the payload.
+ *
+ * @return 0 on success, -1 if the payload is truncated.
+ */
+static int snapshot_u64(snapshot_reader *in, uint64_t *value)
+{
+    const char *data = snapshot_take(in, sizeof(*value));
+    if (data == NULL)
+    {
+        return -1;
+    }
+    memcpy(value, data, sizeof(*value));
+    return 0;
+}
+
+/**
+ * @brief Appends a 64-bit integer to a snapshot buffer.
+ */
+static void snapshot_put_u64(snapshot_buffer *out, uint64_t value)
+{
+    snapshot_put(out, &value, sizeof(value));
+}
+
+/**
+ * @brief Reads the commands of a 'P' record into `entry`, or only checks
+ * them if `entry` is NULL.
+ *
+ * @return 0 on success, -1 if the record is damaged.
+ */
+static int snapshot_script(snapshot_reader *in, uint32_t count, script_cache_entry *entry)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *flags;
+        const char *separator;
+        uint32_t length;
+        const char *text;
+        const char *line = NULL;
+        char **args = NULL;
+        if ((flags = snapshot_take(in, 1)) == NULL || (separator = snapshot_take(in, 1)) == NULL ||
+            snapshot_u32(in, &length) == -1 || (text = snapshot_string(in, length)) == NULL)
+        {
+            return -1;
+        }
+        if ((*flags & 1) && (snapshot_u32(in, &length) == -1 || (line = snapshot_string(in, length)) == NULL))
+        {
+            return -1;
+        }
+        if (*flags & 2)
+        {
+            uint32_t argc;
+            if (snapshot_u32(in, &argc) == -1 || argc > (size_t)(in->end - in->position))
+            {
+                return -1;
+            }
+            args = (entry != NULL) ? malloc((argc + 1) * sizeof(char *)) : NULL;
+            for (uint32_t k = 0; k < argc; k++)
+            {
+                const char *word;
+                if (snapshot_u32(in, &length) == -1 || length == 0 ||
+                    (word = snapshot_string(in, length)) == NULL)
+                {
+                    free(args);
+                    return -1;
+                }
+                if (args != NULL)
+                {
+                    args[k] = (char *)word + 1;
+                }
+            }
+            if (args != NULL)
+            {
+                args[argc] = NULL;
+            }
+        }
+
+        if (entry != NULL)
+        {
+            // A command whose words could not be stored is simply run
+            // from its text.
+            script_command *command = &entry->commands[entry->count++];
+            command->line = (char *)line;
+            command->text = (char *)text;
+            command->args = args;
+            command->separator = *separator;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a variable whose name lives in the snapshot mapping.
+ *
+ * @return The new variable, or NULL if a variable of that name exists
+ *         already (or the table could not grow).
+ */
+static shell_variable *snapshot_variable(const char *name, uint32_t name_length)
+{
+    if ((variable_store.count + 1) * 4 > variable_store.capacity * 3 && grow_variable_store() == -1)
+    {
+        return NULL;
+    }
+    size_t mask = variable_store.capacity - 1;
+    size_t index = hash_bytes(name, name_length) & mask;
+    while (variable_store.slots[index].name != NULL)
+    {
+        shell_variable *variable = &variable_store.slots[index];
+        if (variable->name_length == name_length && memcmp(variable->name, name, name_length) == 0)
+        {
+            return NULL;
+        }
+        index = (index + 1) & mask;
+    }
+
+    shell_variable *variable = &variable_store.slots[index];
+    memset(variable, 0, sizeof(*variable));
+    variable->name = (char *)name;
+    variable->name_length = name_length;
+    variable->kind = VAR_SCALAR;
+    variable_store.count++;
+    return variable;
+}
+
+/**
+ * @brief Walks the records of a snapshot payload.
+ *
+ * The payload is walked twice: once with `apply` set to 0, which only
+ * checks that every record is well formed, and then with `apply` set to 1,
+ * which loads the records. A damaged file is therefore rejected before any
+ * of it has been loaded.
+ *
+ * @return 0 if the payload is well formed, -1 otherwise.
+ */
+static int snapshot_walk(const char *payload, size_t length, int apply)
+{
+    snapshot_reader in = {payload, payload + length};
+    int same_path = 0;
+    for (;;)
+    {
+        const char *type = snapshot_take(&in, 1);
+        uint32_t name_length;
+        uint32_t count;
+        const char *name;
+        if (type == NULL)
+        {
+            return -1;
+        }
+        if (*type == 'E')
+        {
+            return in.position == in.end ? 0 : -1;
+        }
+        if (snapshot_u32(&in, &name_length) == -1 || snapshot_u32(&in, &count) == -1 ||
+            (name = snapshot_string(&in, name_length)) == NULL)
+        {
+            return -1;
+        }
+
+        if (*type == 'P')
+        {
+            uint64_t fields[5];
+            for (int i = 0; i < 5; i++)
+            {
+                if (snapshot_u64(&in, &fields[i]) == -1)
+                {
+                    return -1;
+                }
+            }
+            script_cache_entry *entry = apply ? script_cache_slot() : NULL;
+            if (entry != NULL)
+            {
+                entry->commands = malloc((count ? count : 1) * sizeof(script_command));
+                if (entry->commands == NULL)
+                {
+                    entry = NULL;
+                }
+            }
+            if (entry != NULL)
+            {
+                entry->path = (char *)name;
+                entry->device = fields[0];
+                entry->inode = fields[1];
+                entry->mtime.tv_sec = fields[2];
+                entry->mtime.tv_nsec = fields[3];
+                entry->size = fields[4];
+            }
+            if (snapshot_script(&in, count, entry) == -1)
+            {
+                return -1;
+            }
+        }
+        else if (*type == 'S' || *type == 'X' || *type == 'C' || *type == 'H' || *type == 'L')
+        {
+            // For these records `count` is the length of the value.
+            const char *value = snapshot_string(&in, count);
+            if (value == NULL)
+            {
+                return -1;
+            }
+            if (!apply)
+            {
+                continue;
+            }
+            if (*type == 'C')
+            {
+                // A command found under another `PATH` may not be the one
+                // this shell would run.
+                size_t path_length;
+                const char *path = get_variable("PATH", 4, &path_length);
+                same_path = path != NULL ? (path_length == count && memcmp(path, value, count) == 0)
+                                         : count == 0;
+                continue;
+            }
+            if (*type == 'H')
+            {
+                if (!same_path)
+                {
+                    continue;
+                }
+                symbol *entry = intern(name, name_length, 0);
+                if (entry != NULL)
+                {
+                    command_remember(entry, (char *)value);
+                }
+                continue;
+            }
+            if (*type == 'L')
+            {
+                symbol *entry = intern(name, name_length, 0);
+                if (entry != NULL)
+                {
+                    symbol_set_alias(entry, (char *)value, count);
+                }
+                continue;
+            }
+            shell_variable *variable = snapshot_variable(name, name_length);
+            if (variable != NULL)
+            {
+                variable->value = (char *)value;
+                variable->length = count;
+                if (*type == 'X')
+                {
+                    setenv(name, value, 1);
+                }
+            }
+        }
+        else if (*type == 'I')
+        {
+            indexed_array *array = NULL;
+            if (apply)
+            {
+                shell_variable *variable = snapshot_variable(name, name_length);
+                if (variable != NULL && make_array(variable, VAR_INDEXED) == 0)
+                {
+                    array = variable->indexed;
+                }
+            }
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t index;
+                uint32_t value_length;
+                const char *value;
+                if (snapshot_u32(&in, &index) == -1 || snapshot_u32(&in, &value_length) == -1 ||
+                    (value = snapshot_string(&in, value_length)) == NULL || index >= MAX_ARRAY_INDEX)
+                {
+                    return -1;
+                }
+                if (array == NULL)
+                {
+                    continue;
+                }
+                if (index >= array->capacity)
+                {
+                    size_t capacity = array->capacity ? array->capacity : 8;
+                    while (capacity <= index)
+                    {
+                        capacity *= 2;
+                    }
+                    array_slot *slots = realloc(array->slots, capacity * sizeof(array_slot));
+                    if (slots == NULL)
+                    {
+                        continue;
+                    }
+                    memset(slots + array->capacity, 0, (capacity - array->capacity) * sizeof(array_slot));
+                    array->slots = slots;
+                    array->capacity = capacity;
+                }
+                array->count += (array->slots[index].value == NULL);
+                array->slots[index].value = (char *)value;
+                array->slots[index].length = value_length;
+                if (index >= array->size)
+                {
+                    array->size = index + 1;
+                }
+            }
+        }
+        else if (*type == 'A')
+        {
+            assoc_array *array = NULL;
+            if (apply)
+            {
+                shell_variable *variable = snapshot_variable(name, name_length);
+                if (variable != NULL && make_array(variable, VAR_ASSOC) == 0)
+                {
+                    array = variable->assoc;
+                    array->entries = malloc((count ? count : 1) * sizeof(assoc_entry));
+                    array->capacity = array->entries ? (count ? count : 1) : 0;
+                }
+            }
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t key_length;
+                uint32_t value_length;
+                const char *hash;
+                const char *key;
+                const char *value;
+                if (snapshot_u32(&in, &key_length) == -1 || snapshot_u32(&in, &value_length) == -1 ||
+                    (hash = snapshot_take(&in, sizeof(uint64_t))) == NULL ||
+                    (key = snapshot_string(&in, key_length)) == NULL ||
+                    (value = snapshot_string(&in, value_length)) == NULL)
+                {
+                    return -1;
+                }
+                if (array != NULL && array->size < array->capacity)
+                {
+                    // The key and its value are adjacent in the mapping,
+                    // just as `assoc_set()` lays them out on the heap.
+                    assoc_entry *entry = &array->entries[array->size++];
+                    entry->key = (char *)key;
+                    entry->key_length = key_length;
+                    entry->value = (char *)value;
+                    entry->length = value_length;
+                    memcpy(&entry->hash, hash, sizeof(uint64_t));
+                    array->count++;
+                }
+            }
+            if (array != NULL)
+            {
+                size_t index_capacity = 16;
+                while (index_capacity < 4 * (array->count + 1))
+                {
+                    index_capacity *= 2;
+                }
+                assoc_rebuild(array, index_capacity);
+            }
+        }
+        else
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Maps a snapshot file and loads its contents.
+ *
+ * @return 0 on success, -1 if the file cannot be used.
+ */
+static int snapshot_load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = info.st_size;
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    snapshot_header header;
+    memcpy(&header, base, sizeof(header));
+    const char *payload = base + sizeof(header);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER ||
+        header.payload_length != size - sizeof(header) ||
+        snapshot_checksum(payload, header.payload_length) != header.checksum ||
+        snapshot_walk(payload, header.payload_length, 0) == -1)
+    {
+        fprintf(stderr, "shell: snapshot %s is not usable, ignoring it\n", path);
+        munmap((void *)base, size);
+        return -1;
+    }
+
+    // Size the variable table for everything in the snapshot up front.
+    while ((variable_store.count + header.variable_count) * 4 > variable_store.capacity * 3 &&
+           variable_store.capacity < header.variable_count * 2)
+    {
+        if (grow_variable_store() == -1)
+        {
+            break;
+        }
+    }
+
+    // The mapping stays for the life of the shell: variables point into it.
+    snapshot_mapping.base = base;
+    snapshot_mapping.size = size;
+    snapshot_walk(payload, header.payload_length, 1);
+    return 0;
+}
+
+/**
+ * @brief Writes the shell's variables and command hash table to a file.
+ *
+ * The snapshot is written to a temporary file that is renamed over the
+ * target, so a shell starting at the same time never sees half a file.
+ *
+ * @return 0 on success, 1 on error.
+ */
+static int snapshot_save(const char *path)
+{
+    snapshot_buffer out = {0};
+    snapshot_header header = {0};
+    snapshot_put(&out, &header, sizeof(header));
+
+    for (size_t i = 0; i < variable_store.capacity; i++)
+    {
+        shell_variable *variable = &variable_store.slots[i];
+        if (variable->name == NULL)
+        {
+            continue;
+        }
+        header.variable_count++;
+        if (variable->kind == VAR_SCALAR)
+        {
+            snapshot_put(&out, getenv(variable->name) != NULL ? "X" : "S", 1);
+            snapshot_put_u32(&out, variable->name_length);
+            snapshot_put_u32(&out, variable->length);
+            snapshot_put_string(&out, variable->name, variable->name_length);
+            snapshot_put_string(&out, variable->value ? variable->value : "", variable->length);
+        }
+        else if (variable->kind == VAR_INDEXED)
+        {
+            indexed_array *array = variable->indexed;
+            snapshot_put(&out, "I", 1);
+            snapshot_put_u32(&out, variable->name_length);
+            snapshot_put_u32(&out, array->count);
+            snapshot_put_string(&out, variable->name, variable->name_length);
+            for (size_t k = 0; k < array->size; k++)
+            {
+                if (array->slots[k].value != NULL)
+                {
+                    snapshot_put_u32(&out, k);
+                    snapshot_put_u32(&out, array->slots[k].length);
+                    snapshot_put_string(&out, array->slots[k].value, array->slots[k].length);
+                }
+            }
+        }
+        else
+        {
+            assoc_array *array = variable->assoc;
+            snapshot_put(&out, "A", 1);
+            snapshot_put_u32(&out, variable->name_length);
+            snapshot_put_u32(&out, array->count);
+            snapshot_put_string(&out, variable->name, variable->name_length);
+            for (size_t k = 0; k < array->size; k++)
+            {
+                assoc_entry *entry = &array->entries[k];
+                if (entry->key != NULL)
+                {
+                    snapshot_put_u32(&out, entry->key_length);
+                    snapshot_put_u32(&out, entry->length);
+                    snapshot_put(&out, &entry->hash, sizeof(entry->hash));
+                    snapshot_put_string(&out, entry->key, entry->key_length);
+                    snapshot_put_string(&out, entry->value, entry->length);
+                }
+            }
+        }
+    }
+
+    // The command hash holds for the `PATH` it was filled under.
+    size_t search_length;
+    const char *search = get_variable("PATH", 4, &search_length);
+    if (search == NULL)
+    {
+        search = "";
+        search_length = 0;
+    }
+    snapshot_put(&out, "C", 1);
+    snapshot_put_u32(&out, 4);
+    snapshot_put_u32(&out, search_length);
+    snapshot_put_string(&out, "PATH", 4);
+    snapshot_put_string(&out, search, search_length);
+
+    for (size_t i = 0; i < symbol_table.capacity; i++)
+    {
+        symbol *entry = symbol_table.slots[i];
+        if (entry != NULL && entry->path != NULL)
+        {
+            size_t path_length = strlen(entry->path);
+            snapshot_put(&out, "H", 1);
+            snapshot_put_u32(&out, entry->length);
+            snapshot_put_u32(&out, path_length);
+            snapshot_put_string(&out, entry->text, entry->length);
+            snapshot_put_string(&out, entry->path, path_length);
+        }
+        if (entry != NULL && entry->alias != NULL)
+        {
+            snapshot_put(&out, "L", 1);
+            snapshot_put_u32(&out, entry->length);
+            snapshot_put_u32(&out, entry->alias_length);
+            snapshot_put_string(&out, entry->text, entry->length);
+            snapshot_put_string(&out, entry->alias, entry->alias_length);
+        }
+    }
+    for (int i = 0; i < SCRIPT_CACHE_SIZE; i++)
+    {
+        script_cache_entry *entry = &script_cache[i];
+        if (entry->path == NULL)
+        {
+            continue;
+        }
+        snapshot_put(&out, "P", 1);
+        snapshot_put_u32(&out, strlen(entry->path));
+        snapshot_put_u32(&out, entry->count);
+        snapshot_put_string(&out, entry->path, strlen(entry->path));
+        snapshot_put_u64(&out, entry->device);
+        snapshot_put_u64(&out, entry->inode);
+        snapshot_put_u64(&out, entry->mtime.tv_sec);
+        snapshot_put_u64(&out, entry->mtime.tv_nsec);
+        snapshot_put_u64(&out, entry->size);
+        for (size_t k = 0; k < entry->count; k++)
+        {
+            script_command *command = &entry->commands[k];
+            char flags = (command->line != NULL) | ((command->args != NULL) << 1);
+            snapshot_put(&out, &flags, 1);
+            snapshot_put(&out, &command->separator, 1);
+            snapshot_put_u32(&out, strlen(command->text));
+            snapshot_put_string(&out, command->text, strlen(command->text));
+            if (command->line != NULL)
+            {
+                snapshot_put_u32(&out, strlen(command->line));
+                snapshot_put_string(&out, command->line, strlen(command->line));
+            }
+            if (command->args != NULL)
+            {
+                size_t argc = 0;
+                while (command->args[argc] != NULL)
+                {
+                    argc++;
+                }
+                snapshot_put_u32(&out, argc);
+                for (char **word = command->args; *word != NULL; word++)
+                {
+                    // Each word is stored with the byte `word_is_unquoted()`
+                    // reads in front of it. An interned program name has no
+                    // such byte, and is never an operator.
+                    size_t length = strlen(*word);
+                    symbol *interned = (word == command->args) ? symbol_find(*word, length) : NULL;
+                    char unquoted = (interned != NULL && interned->text == *word) ? 0 : (*word)[-1];
+                    snapshot_put_u32(&out, length + 1);
+                    snapshot_put(&out, &unquoted, 1);
+                    snapshot_put_string(&out, *word, length);
+                }
+            }
+        }
+    }
+    snapshot_put(&out, "E", 1);
+
+    if (out.error)
+    {
+        fprintf(stderr, "shell: snapshot: out of memory\n");
+        free(out.data);
+        return 1;
+    }
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.payload_length = out.length - sizeof(header);
+    header.checksum = snapshot_checksum(out.data + sizeof(header), header.payload_length);
+    memcpy(out.data, &header, sizeof(header));
+
+    size_t path_length = strlen(path);
+    char *temporary = malloc(path_length + 16);
+    if (temporary == NULL)
+    {
+        free(out.data);
+        return 1;
+    }
+    snprintf(temporary, path_length + 16, "%s.%ld", path, (long)getpid());
+
+    int status = 0;
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || write_all(fd, out.data, out.length) == -1 || close(fd) == -1 ||
+        rename(temporary, path) == -1)
+    {
+        fprintf(stderr, "shell: snapshot: %s: %s\n", path, strerror(errno));
+        unlink(temporary);
+        status = 1;
+    }
+    free(temporary);
+    free(out.data);
+    return status;
+}
+
+/**
+ * @brief Builds the path of a startup file: the value of the environment
+ * variable `variable` if set, otherwise `name` in the home directory.
+ *
+ * @return 1 if a path was produced, 0 otherwise.
+ */
+static int startup_path(const char *variable, const char *name, char *buffer, size_t size)
+{
+    const char *path = getenv(variable);
+    if (path != NULL && *path != '\0')
+    {
+        return snprintf(buffer, size, "%s", path) < (int)size;
+    }
+    const char *home = getenv("HOME");
+    return home != NULL && snprintf(buffer, size, "%s/%s", home, name) < (int)size;
+}
+
+/**
+ * @brief Implements the `snapshot` built-in.
+ *
+ * `snapshot save [FILE]` writes the current state to FILE, by default
+ * `$SHELL_SNAPSHOT` or `~/.shell_snapshot`. `snapshot` alone tells whether
+ * the shell started from a snapshot.
+ *
+ * @return 0 on success, 1 on error, 2 on usage errors.
+ */
+int builtin_snapshot(char **args)
+{
+    if (args[1] == NULL)
+    {
+        if (snapshot_mapping.base == NULL)
+        {
+            printf("snapshot: none loaded\n");
+        }
+        else
+        {
+            printf("snapshot: loaded %zu bytes\n", snapshot_mapping.size);
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "save") != 0 || (args[2] != NULL && args[3] != NULL))
+    {
+        fprintf(stderr, "usage: snapshot [save [FILE]]\n");
+        return 2;
+    }
+
+    char path[PATH_MAX];
+    if (args[2] != NULL)
+    {
+        snprintf(path, sizeof(path), "%s", args[2]);
+    }
+    else if (!startup_path("SHELL_SNAPSHOT", ".shell_snapshot", path, sizeof(path)))
+    {
+        fprintf(stderr, "shell: snapshot: no file given and HOME is not set\n");
+        return 1;
+    }
+    return snapshot_save(path);
+}
+
+/**
+ * @brief Sets up the shell's state at startup, from the snapshot if it is
+ * at least as new as the rc file and from the rc file otherwise.
+ *
+ * The rc file is `$SHELLRC` or `~/.shellrc`; the snapshot is
+ * `$SHELL_SNAPSHOT` or `~/.shell_snapshot`.
+ *
+ * @return 0 if the rc file ran `exit`, 1 otherwise.
+ */
+int load_startup_state(void)
+{
+    char rc_path[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    struct stat rc_info;
+    struct stat snapshot_info;
+
+    int have_rc = startup_path("SHELLRC", ".shellrc", rc_path, sizeof(rc_path)) &&
+                  stat(rc_path, &rc_info) == 0;
+    if (startup_path("SHELL_SNAPSHOT", ".shell_snapshot", snapshot_path, sizeof(snapshot_path)) &&
+        stat(snapshot_path, &snapshot_info) == 0 &&
+        (!have_rc || snapshot_info.st_mtim.tv_sec > rc_info.st_mtim.tv_sec ||
+         (snapshot_info.st_mtim.tv_sec == rc_info.st_mtim.tv_sec &&
+          snapshot_info.st_mtim.tv_nsec >= rc_info.st_mtim.tv_nsec)) &&
+        snapshot_load(snapshot_path) == 0)
+    {
+        return 1;
+    }
+    return have_rc ? source_file(rc_path) : 1;
+}
+
+/* ========================================================================= */
+/* TOKENIZER & PARAMETER EXPANSION               */
+/* ========================================================================= */
+
+/**
+ * @brief The state of the tokenizer while it walks over a command line.
+ *
+ * All words are assembled one after another in the single buffer `word`,
+ * each ending in a NUL, and `offsets` records where each one starts; the
+ * pointer array is only built at the end, once the buffer stops moving.
+ * Each word is preceded by a byte that says how much of its start was
+ * plain, unquoted text (see `word_is_unquoted()`).
+ * Expansions append straight from the variable store into `word`, so the
+ * slicing done by `${NAME#pat}` and friends never makes a temporary copy.
+ */
+typedef struct
+{
+    size_t *offsets;         // Where each finished word starts in `word`.
+    size_t count;            // The number of finished words.
+    size_t offsets_capacity; // The capacity of `offsets`.
+    char *word;              // The finished words, then the current one.
+    size_t start;            // Where the current word starts in `word`.
+    size_t length;           // Bytes used in `word`.
+    size_t capacity;         // Bytes allocated for `word`.
+    size_t unquoted;         // Leading bytes of the current word written as plain text.
+    int in_word;          // Set once the current word exists, even if empty ("").
+    int in_array;         // Set between `NAME=(` and the closing `)`.
+    int in_test;          // Set in `[[ ... ]]`, whose expansions are not split.
+    int pattern;          // PATTERN_* for the word after `==`, `!=` or `=~` in `[[ ]]`.
+    int error;            // Set on a syntax or allocation error.
+} tokenizer;
+
+/**
+ * @brief The case conversions of `${NAME^}`, `${NAME^^}`, `${NAME,}` and `${NAME,,}`.
+ */
+enum
+{
+    CASE_NONE,
+    CASE_UPPER_FIRST,
+    CASE_UPPER_ALL,
+    CASE_LOWER_FIRST,
+    CASE_LOWER_ALL
+};
+
+/**
+ * @brief What the word after an operator of `[[ ... ]]` is matched as.
+ *
+ * The quoted parts of such a word are escaped as they are appended, so
+ * that they match literally: `[[ $f == "a*" ]]` wants the text `a*`.
+ */
+enum
+{
+    PATTERN_NONE,
+    PATTERN_GLOB, // After `==`, `!=` or `=`.
+    PATTERN_REGEX // After `=~`.
+};
+
+/**
+ * @brief The element types a glob pattern is compiled into.
+ */
+enum
+{
+    GLOB_LITERAL, // Matches exactly `ch`.
+    GLOB_ANY,     // `?`: matches any single character.
+    GLOB_STAR,    // `*`: matches any run of characters.
+    GLOB_CLASS    // `[...]`: matches any character in `set`.
+};
+
+/**
+ * @brief One compiled element of a glob pattern.
+ */
+typedef struct
+{
+    unsigned char type;
+    unsigned char ch;
+    unsigned char set[32]; // A 256-bit membership bitmap for GLOB_CLASS.
+} glob_element;
+
+/**
+ * @brief A glob pattern compiled into a list of elements.
+ *
+ * Patterns without any wildcard are also kept as a plain `literal`, which
+ * lets the matcher fall back to `memcmp()` and `memmem()`.
+ */
+typedef struct
+{
+    char *source;           // The pattern text as written, used as the cache key.
+    size_t source_length;
+    glob_element *elements;
+    int count;
+    char *literal;          // The unescaped text if there are no wildcards, else NULL.
+} compiled_glob;
+
+/**
+ * @brief Cache of compiled glob patterns, indexed by a hash of their text.
+ *
+ * Each command line is parsed again every time it runs, so compiling the
+ * same pattern once and keeping it here is what makes repeated expansions
+ * like `${file%.*}` cheap.
+ */
+static compiled_glob glob_cache[GLOB_CACHE_SIZE];
+
+/**
+ * @brief Makes room for `extra` more bytes in the current word.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int tok_reserve(tokenizer *t, size_t extra)
+{
+    if (t->length + extra + 1 <= t->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = t->capacity ? t->capacity : 64;
+    while (capacity < t->length + extra + 1)
+    {
+        capacity *= 2;
+    }
+    char *word = realloc(t->word, capacity);
+    if (word == NULL)
+    {
+        perror("realloc failed in tokenizer");
+        t->error = 1;
+        return -1;
+    }
+    t->word = word;
+    t->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Appends literal text to the current word.
+ *
+ * Appending even zero bytes starts a word; that is how `''` becomes an
+ * empty argument.
+ */
+static void tok_append(tokenizer *t, const char *data, size_t length)
+{
+    if (tok_reserve(t, length) == -1)
+    {
+        return;
+    }
+    memcpy(t->word + t->length, data, length);
+    t->length += length;
+    t->in_word = 1;
+}
+
+/**
+ * @brief Finishes the current word: terminates it and records its offset.
+ */
+static void tok_end_word(tokenizer *t)
+{
+    if (!t->in_word || t->error)
+    {
+        return;
+    }
+    if (t->count == t->offsets_capacity)
+    {
+        size_t capacity = t->offsets_capacity ? t->offsets_capacity * 2 : 16;
+        size_t *offsets = realloc(t->offsets, capacity * sizeof(size_t));
+        if (offsets == NULL)
+        {
+            perror("realloc failed in tokenizer");
+            t->error = 1;
+            return;
+        }
+        t->offsets = offsets;
+        t->offsets_capacity = capacity;
+    }
+    if (tok_reserve(t, 1) == -1)
+    {
+        return;
+    }
+
+    t->word[t->start - 1] = (t->unquoted < UCHAR_MAX) ? t->unquoted : UCHAR_MAX;
+    t->word[t->length++] = '\0';
+
+    // An unquoted `[[` starts a conditional expression, in which the word
+    // after a matching operator is a pattern.
+    const char *word = t->word + t->start;
+    int plain = t->unquoted == t->length - 1 - t->start;
+    if (t->count == 0 && plain && strcmp(word, "[[") == 0)
+    {
+        t->in_test = 1;
+    }
+    t->pattern = PATTERN_NONE;
+    if (t->in_test && plain)
+    {
+        if (strcmp(word, "=~") == 0)
+        {
+            t->pattern = PATTERN_REGEX;
+        }
+        else if (strcmp(word, "==") == 0 || strcmp(word, "!=") == 0 || strcmp(word, "=") == 0)
+        {
+            t->pattern = PATTERN_GLOB;
+        }
+    }
+
+    t->offsets[t->count++] = t->start;
+    t->word[t->length++] = 0;
+    t->start = t->length;
+    t->unquoted = 0;
+    t->in_word = 0;
+}
+
+/**
+ * @brief Escapes the pattern characters appended to the current word since
+ * `from`, when the word is a pattern of `[[ ... ]]`.
+ */
+static void tok_quote_pattern(tokenizer *t, size_t from)
+{
+    if (t->pattern == PATTERN_NONE || t->error)
+    {
+        return;
+    }
+    const char *special = (t->pattern == PATTERN_REGEX) ? "\\.[]()*+?{}|^$" : "\\*?[]";
+    size_t extra = 0;
+    for (size_t i = from; i < t->length; i++)
+    {
+        extra += t->word[i] != '\0' && strchr(special, t->word[i]) != NULL;
+    }
+    if (extra == 0 || tok_reserve(t, extra) == -1)
+    {
+        return;
+    }
+
+    // Shift the text right from the end, putting a backslash in front of
+    // each special character on the way.
+    size_t i = t->length;
+    size_t j = t->length + extra;
+    while (i > from)
+    {
+        char c = t->word[--i];
+        t->word[--j] = c;
+        if (c != '\0' && strchr(special, c) != NULL)
+        {
+            t->word[--j] = '\\';
+        }
+    }
+    t->length += extra;
+}
+
+/**
+ * @brief Appends quoted text to the current word.
+ *
+ * The same as `tok_append()`, except in a pattern of `[[ ... ]]`, where
+ * quoted text matches literally.
+ */
+static void tok_append_quoted(tokenizer *t, const char *data, size_t length)
+{
+    size_t from = t->length;
+    tok_append(t, data, length);
+    tok_quote_pattern(t, from);
+}
+
+/**
+ * @brief Checks whether the first `length` bytes of a word returned by
+ * `tokenize()` were written as plain text, outside quotes and expansions.
+ */
+int word_is_unquoted(const char *word, size_t length)
+{
+    return (unsigned char)word[-1] >= length;
+}
+
+/**
+ * @brief Appends text with backslash escapes removed.
+ *
+ * Used for the literal parts inside `${...}`, such as the replacement in
+ * `${NAME/pat/rep}` or the default in `${NAME:-word}`.
+ */
+static void tok_append_unescaped(tokenizer *t, const char *data, size_t length)
+{
+    t->in_word = 1;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (data[i] == '\\' && i + 1 < length)
+        {
+            i++;
+        }
+        tok_append(t, data + i, 1);
+    }
+}
+
+/**
+ * @brief Appends the result of an expansion to the current word.
+ *
+ * Outside double quotes the result is split on whitespace into separate
+ * words, as in other shells, except between `[[` and `]]`. The optional
+ * case conversion is applied in place, on the bytes just copied into the
+ * word.
+ *
+ * @param t The tokenizer.
+ * @param data The expanded text (usually a slice of a variable's value).
+ * @param length The length of `data`.
+ * @param quoted Non-zero if the expansion appeared inside double quotes.
+ * @param case_mode One of the CASE_* constants.
+ */
+static void tok_append_expansion(tokenizer *t, const char *data, size_t length,
+                                 int quoted, int case_mode)
+{
+    int split = !quoted && !t->in_test;
+    size_t i = 0;
+    while (i < length && !t->error)
+    {
+        if (split && data[i] != '\0' && strchr(TOKEN_DELIMITERS, data[i]) != NULL)
+        {
+            tok_end_word(t);
+            i++;
+            continue;
+        }
+
+        size_t end = i;
+        while (end < length &&
+               (!split || data[end] == '\0' || strchr(TOKEN_DELIMITERS, data[end]) == NULL))
+        {
+            end++;
+        }
+
+        size_t start = t->length;
+        tok_append(t, data + i, end - i);
+        if (t->error)
+        {
+            return;
+        }
+
+        char *p = t->word + start;
+        size_t n = end - i;
+        switch (case_mode)
+        {
+        case CASE_UPPER_FIRST:
+            if (i == 0 && n > 0)
+            {
+                p[0] = toupper((unsigned char)p[0]);
+            }
+            break;
+        case CASE_LOWER_FIRST:
+            if (i == 0 && n > 0)
+            {
+                p[0] = tolower((unsigned char)p[0]);
+            }
+            break;
+        case CASE_UPPER_ALL:
+            for (size_t k = 0; k < n; k++)
+            {
+                p[k] = toupper((unsigned char)p[k]);
+            }
+            break;
+        case CASE_LOWER_ALL:
+            for (size_t k = 0; k < n; k++)
+            {
+                p[k] = tolower((unsigned char)p[k]);
+            }
+            break;
+        }
+        if (quoted)
+        {
+            tok_quote_pattern(t, start);
+        }
+        i = end;
+    }
+}
+
+/**
+ * @brief Compiles a glob pattern, or fetches it from the cache.
+ *
+ * Supports `*`, `?`, bracket expressions (`[a-z]`, `[!0-9]`) and backslash
+ * escapes. An unterminated `[` is taken literally.
+ *
+ * @return The compiled pattern, or NULL on allocation failure.
+ */
+static compiled_glob *compile_glob(const char *pattern, size_t length)
+{
+    compiled_glob *glob = &glob_cache[hash_bytes(pattern, length) & (GLOB_CACHE_SIZE - 1)];
+    if (glob->source != NULL && glob->source_length == length &&
+        memcmp(glob->source, pattern, length) == 0)
+    {
+        return glob;
+    }
+
+    // Evict whatever pattern occupied this slot before.
+    free(glob->source);
+    free(glob->elements);
+    free(glob->literal);
+    memset(glob, 0, sizeof(*glob));
+
+    glob_element *elements = calloc(length + 1, sizeof(glob_element));
+    char *source = malloc(length + 1);
+    if (elements == NULL || source == NULL)
+    {
+        perror("malloc failed in compile_glob");
+        free(elements);
+        free(source);
+        return NULL;
+    }
+    memcpy(source, pattern, length);
+    source[length] = '\0';
+
+    int count = 0;
+    int wildcards = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        glob_element *element = &elements[count];
+        char c = pattern[i];
+
+        if (c == '*')
+        {
+            // Consecutive stars match the same as one.
+            wildcards = 1;
+            if (count == 0 || elements[count - 1].type != GLOB_STAR)
+            {
+                element->type = GLOB_STAR;
+                count++;
+            }
+            continue;
+        }
+        if (c == '?')
+        {
+            wildcards = 1;
+            element->type = GLOB_ANY;
+            count++;
+            continue;
+        }
+        if (c == '[')
+        {
+            // Find the closing bracket. A `]` right after `[` or `[!` is a
+            // member of the set, not the end of it.
+            size_t j = i + 1;
+            int negate = 0;
+            if (j < length && (pattern[j] == '!' || pattern[j] == '^'))
+            {
+                negate = 1;
+                j++;
+            }
+            size_t first = j;
+            if (j < length && pattern[j] == ']')
+            {
+                j++;
+            }
+            while (j < length && pattern[j] != ']')
+            {
+                j++;
+            }
+            if (j < length)
+            {
+                wildcards = 1;
+                element->type = GLOB_CLASS;
+                for (size_t k = first; k < j; k++)
+                {
+                    unsigned char low = pattern[k];
+                    unsigned char high = low;
+                    if (k + 2 < j && pattern[k + 1] == '-')
+                    {
+                        high = pattern[k + 2];
+                        k += 2;
+                    }
+                    for (unsigned int ch = low; ch <= high; ch++)
+                    {
+                        element->set[ch >> 3] |= 1 << (ch & 7);
+                    }
+                }
+                if (negate)
+                {
+                    for (int k = 0; k < 32; k++)
+                    {
+                        element->set[k] = ~element->set[k];
+                    }
+                }
+                count++;
+                i = j;
+                continue;
+            }
+        }
+        if (c == '\\' && i + 1 < length)
+        {
+            c = pattern[++i];
+        }
+        element->type = GLOB_LITERAL;
+        element->ch = c;
+        count++;
+    }
+
+    glob->source = source;
+    glob->source_length = length;
+    glob->elements = elements;
+    glob->count = count;
+
+    if (!wildcards)
+    {
+        glob->literal = malloc(count + 1);
+        if (glob->literal != NULL)
+        {
+            for (int k = 0; k < count; k++)
+            {
+                glob->literal[k] = elements[k].ch;
+            }
+            glob->literal[count] = '\0';
+        }
+    }
+    return glob;
+}
+
+/**
+ * @brief Checks whether a compiled glob matches a whole string.
+ *
+ * Every element except `*` consumes exactly one character, so it is enough
+ * to remember the most recent star and retry from one character further
+ * each time the rest of the pattern fails. No recursion is needed.
+ */
+static int glob_match(const compiled_glob *glob, const char *s, size_t length)
+{
+    if (glob->literal != NULL)
+    {
+        return (size_t)glob->count == length && memcmp(glob->literal, s, length) == 0;
+    }
+
+    int p = 0;
+    size_t i = 0;
+    int star = -1;
+    size_t star_i = 0;
+
+    while (i < length)
+    {
+        if (p < glob->count)
+        {
+            const glob_element *element = &glob->elements[p];
+            unsigned char ch = s[i];
+
+            if (element->type == GLOB_STAR)
+            {
+                star = p++;
+                star_i = i;
+                continue;
+            }
+            if (element->type == GLOB_ANY ||
+                (element->type == GLOB_LITERAL && element->ch == ch) ||
+                (element->type == GLOB_CLASS && (element->set[ch >> 3] & (1 << (ch & 7)))))
+            {
+                p++;
+                i++;
+                continue;
+            }
+        }
+        if (star == -1)
+        {
+            return 0;
+        }
+        // Let the last star absorb one more character and try again.
+        p = star + 1;
+        i = ++star_i;
+    }
+
+    while (p < glob->count && glob->elements[p].type == GLOB_STAR)
+    {
+        p++;
+    }
+    return p == glob->count;
+}
+
+/**
+ * @brief Finds the end of a `${...}` expansion.
+ *
+ * @param p Points just after the opening `${`.
+ * @return A pointer to the closing `}`, or NULL if there is none.
+ */
+static const char *find_brace_end(const char *p)
+{
+    // Nested references, as in `${a[${i}]}`, have their own braces.
+    int depth = 0;
+    for (; *p != '\0'; p++)
+    {
+        if (*p == '\\' && p[1] != '\0')
+        {
+            p++;
+        }
+        else if (*p == '$' && p[1] == '{')
+        {
+            depth++;
+            p++;
+        }
+        else if (*p == '}' && depth-- == 0)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Expands `${NAME#pat}`, `${NAME##pat}`, `${NAME%pat}` and `${NAME%%pat}`.
+ *
+ * @param suffix Non-zero for `%` (remove from the end), zero for `#`.
+ * @param longest Non-zero for the doubled operators.
+ */
+static void expand_trim(tokenizer *t, const char *value, size_t length,
+                        const char *pattern, size_t pattern_length,
+                        int suffix, int longest, int quoted)
+{
+    compiled_glob *glob = compile_glob(pattern, pattern_length);
+    if (glob == NULL)
+    {
+        t->error = 1;
+        return;
+    }
+
+    // Try the candidate split points from shortest to longest match (or
+    // the other way around) and keep the first one that matches.
+    for (size_t step = 0; step <= length; step++)
+    {
+        size_t k = longest ? length - step : step;
+        if (!suffix && glob_match(glob, value, k))
+        {
+            tok_append_expansion(t, value + k, length - k, quoted, CASE_NONE);
+            return;
+        }
+        if (suffix && glob_match(glob, value + length - k, k))
+        {
+            tok_append_expansion(t, value, length - k, quoted, CASE_NONE);
+            return;
+        }
+    }
+    tok_append_expansion(t, value, length, quoted, CASE_NONE);
+}
+
+/**
+ * @brief Expands `${NAME/pat/rep}` and its variants.
+ *
+ * `//` replaces every match, `/#` only a match at the start and `/%` only a
+ * match at the end. Each match is the longest one starting at its position.
+ * Unchanged stretches of the value are appended straight from the variable.
+ */
+static void expand_replace(tokenizer *t, const char *value, size_t length,
+                           const char *pattern, size_t pattern_length,
+                           const char *replacement, size_t replacement_length,
+                           char mode, int quoted)
+{
+    compiled_glob *glob = compile_glob(pattern, pattern_length);
+    if (glob == NULL)
+    {
+        t->error = 1;
+        return;
+    }
+
+    size_t copied = 0;
+    size_t start = 0;
+    while (start < length)
+    {
+        size_t match_end = 0;
+        int found = 0;
+
+        int literal_search = glob->literal != NULL && mode != '%';
+        if (literal_search)
+        {
+            // A pattern without wildcards can use a plain substring search.
+            if (glob->count > 0)
+            {
+                const char *hit = memmem(value + start, length - start, glob->literal, glob->count);
+                if (hit != NULL && (mode != '#' || hit == value))
+                {
+                    start = hit - value;
+                    match_end = start + glob->count;
+                    found = 1;
+                }
+            }
+        }
+        else
+        {
+            size_t lowest = (mode == '%') ? length : start + 1;
+            for (size_t end = length; end >= lowest && end > start; end--)
+            {
+                if (glob_match(glob, value + start, end - start))
+                {
+                    match_end = end;
+                    found = 1;
+                    break;
+                }
+            }
+        }
+
+        if (found)
+        {
+            tok_append_expansion(t, value + copied, start - copied, quoted, CASE_NONE);
+            tok_append_unescaped(t, replacement, replacement_length);
+            copied = start = match_end;
+            if (mode != '/')
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (mode == '#' || literal_search)
+        {
+            break;
+        }
+        start++;
+    }
+    tok_append_expansion(t, value + copied, length - copied, quoted, CASE_NONE);
+}
+
+/**
+ * @brief Expands `${NAME:offset}` and `${NAME:offset:length}`.
+ *
+ * A negative offset counts from the end of the value (write it as
+ * `${NAME: -2}` so it is not mistaken for `${NAME:-word}`). A negative
+ * length leaves that many characters off the end.
+ *
+ * @return 0 on success, -1 if the numbers could not be parsed.
+ */
+static int expand_substring(tokenizer *t, const char *value, size_t length,
+                            const char *spec, const char *close, int quoted)
+{
+    char *end;
+    long offset = strtol(spec, &end, 10);
+    if (end == spec)
+    {
+        return -1;
+    }
+    long count = (long)length;
+    if (*end == ':')
+    {
+        const char *count_spec = end + 1;
+        count = strtol(count_spec, &end, 10);
+        if (end == count_spec)
+        {
+            return -1;
+        }
+    }
+    while (end < close && (*end == ' ' || *end == '\t'))
+    {
+        end++;
+    }
+    if (end != close)
+    {
+        return -1;
+    }
+
+    if (offset < 0)
+    {
+        offset = (long)length + offset;
+        if (offset < 0)
+        {
+            // Out of range; bash expands to nothing.
+            return 0;
+        }
+    }
+    if ((size_t)offset > length)
+    {
+        offset = (long)length;
+    }
+
+    long available = (long)length - offset;
+    if (count < 0)
+    {
+        count = available + count;
+        if (count < 0)
+        {
+            return -1;
+        }
+    }
+    if (count > available)
+    {
+        count = available;
+    }
+
+    tok_append_expansion(t, value + offset, count, quoted, CASE_NONE);
+    return 0;
+}
+
+static const char *expand_parameter(tokenizer *t, const char *p, int quoted);
+
+/**
+ * @brief Expands the `$` references inside an operand of `${...}`: a
+ * subscript, a pattern, a replacement or an offset.
+ *
+ * Operands are short, so they are expanded into a fresh buffer rather than
+ * straight into the word. Backslash escapes are kept for the pattern
+ * compiler and `tok_append_unescaped()` to remove.
+ *
+ * @return The expanded operand (to be freed by the caller), or NULL on error.
+ */
+static char *expand_operand(const char *text, size_t length, size_t *expanded_length)
+{
+    tokenizer operand = {0};
+    const char *end = text + length;
+    tok_reserve(&operand, length);
+    while (text != NULL && text < end && !operand.error)
+    {
+        if (*text == '\\' && text + 1 < end)
+        {
+            tok_append(&operand, text, 2);
+            text += 2;
+        }
+        else if (*text == '$')
+        {
+            text = expand_parameter(&operand, text, 1);
+        }
+        else
+        {
+            tok_append(&operand, text, 1);
+            text++;
+        }
+    }
+    if (text == NULL || operand.error)
+    {
+        free(operand.word);
+        return NULL;
+    }
+    operand.word[operand.length] = '\0';
+    *expanded_length = operand.length;
+    return operand.word;
+}
+
+/**
+ * @brief Expands `${a[@]}`, `${a[*]}`, `${#a[@]}` and `${!a[@]}`.
+ *
+ * With `@` every element becomes a word of its own; inside double quotes
+ * they are not split any further, so `"${files[@]}"` hands each element to
+ * `execvp` as exactly one argument without ever joining and re-splitting.
+ * With `*` inside double quotes the elements are joined with spaces into
+ * a single word. Text before and after the expansion in the same word
+ * sticks to the first and last element respectively.
+ *
+ * @param t The tokenizer.
+ * @param variable The variable, or NULL if it is not set.
+ * @param name The variable name, used for environment fallback.
+ * @param name_length The length of `name`.
+ * @param want_length Non-zero for `${#a[@]}` (the number of elements).
+ * @param want_keys Non-zero for `${!a[@]}` (the indexes or keys).
+ * @param join Non-zero for `*` rather than `@`.
+ * @param quoted Non-zero inside double quotes.
+ */
+static void expand_list(tokenizer *t, shell_variable *variable, const char *name,
+                        size_t name_length, int want_length, int want_keys, int join, int quoted)
+{
+    char number[32];
+
+    if (variable == NULL || variable->kind == VAR_SCALAR)
+    {
+        // A scalar (or environment variable) is a one-element array.
+        size_t length = 0;
+        const char *value = get_variable(name, name_length, &length);
+        int n = (value != NULL);
+        if (want_length)
+        {
+            int digits = snprintf(number, sizeof(number), "%d", n);
+            tok_append_expansion(t, number, digits, quoted, CASE_NONE);
+        }
+        else if (n)
+        {
+            tok_append_expansion(t, want_keys ? "0" : value, want_keys ? 1 : length,
+                                 quoted, CASE_NONE);
+        }
+        return;
+    }
+
+    if (want_length)
+    {
+        size_t count = (variable->kind == VAR_INDEXED) ? variable->indexed->count
+                                                       : variable->assoc->count;
+        int digits = snprintf(number, sizeof(number), "%zu", count);
+        tok_append_expansion(t, number, digits, quoted, CASE_NONE);
+        return;
+    }
+
+    size_t total = (variable->kind == VAR_INDEXED) ? variable->indexed->size
+                                                   : variable->assoc->size;
+    int emitted = 0;
+    for (size_t i = 0; i < total && !t->error; i++)
+    {
+        const char *value;
+        size_t length;
+
+        if (variable->kind == VAR_INDEXED)
+        {
+            const array_slot *slot = &variable->indexed->slots[i];
+            if (slot->value == NULL)
+            {
+                continue;
+            }
+            if (want_keys)
+            {
+                length = snprintf(number, sizeof(number), "%zu", i);
+                value = number;
+            }
+            else
+            {
+                value = slot->value;
+                length = slot->length;
+            }
+        }
+        else
+        {
+            const assoc_entry *entry = &variable->assoc->entries[i];
+            if (entry->key == NULL)
+            {
+                continue;
+            }
+            value = want_keys ? entry->key : entry->value;
+            length = want_keys ? entry->key_length : entry->length;
+        }
+
+        if (emitted > 0)
+        {
+            if (join && quoted)
+            {
+                tok_append(t, " ", 1);
+            }
+            else
+            {
+                // Close the previous element's word, even if it is empty.
+                t->in_word = t->in_word || quoted;
+                tok_end_word(t);
+            }
+        }
+        tok_append_expansion(t, value, length, quoted, CASE_NONE);
+        if (quoted)
+        {
+            t->in_word = 1;
+        }
+        emitted++;
+    }
+
+    // `"${empty[@]}"` expands to no words at all, not to one empty word.
+    if (emitted == 0 && quoted && !join && t->length == t->start)
+    {
+        t->in_word = 0;
+    }
+}
+
+/**
+ * @brief Expands one `${...}` expression.
+ *
+ * @param t The tokenizer.
+ * @param p Points just after the opening `${`.
+ * @param quoted Non-zero if the expansion is inside double quotes.
+ * @return A pointer just past the closing `}`, or NULL on error.
+ */
+static const char *expand_braced(tokenizer *t, const char *p, int quoted)
+{
+    const char *close = find_brace_end(p);
+    if (close == NULL)
+    {
+        fprintf(stderr, "shell: missing '}' in parameter expansion\n");
+        t->error = 1;
+        return NULL;
+    }
+
+    int want_length = 0;
+    int want_keys = 0;
+    if (*p == '#' && is_name_start(p[1]))
+    {
+        want_length = 1;
+        p++;
+    }
+    else if (*p == '!' && is_name_start(p[1]))
+    {
+        want_keys = 1;
+        p++;
+    }
+
+    const char *name = p;
+    while (is_name_char(*p))
+    {
+        p++;
+    }
+    if (p == name)
+    {
+        goto bad_substitution;
+    }
+    size_t name_length = p - name;
+
+    // An optional subscript, as in `${a[3]}`, `${m[$key]}` or `${a[@]}`.
+    const char *subscript = NULL;
+    size_t subscript_length = 0;
+    char *expanded_subscript = NULL;
+    if (*p == '[')
+    {
+        const char *subscript_end = memchr(p, ']', close - p);
+        if (subscript_end == NULL)
+        {
+            goto bad_substitution;
+        }
+        subscript = p + 1;
+        subscript_length = subscript_end - subscript;
+        p = subscript_end + 1;
+
+        if (subscript_length == 1 && (*subscript == '@' || *subscript == '*'))
+        {
+            if (p != close)
+            {
+                goto bad_substitution;
+            }
+            expand_list(t, find_variable(name, name_length, 0), name, name_length,
+                        want_length, want_keys, *subscript == '*', quoted);
+            return t->error ? NULL : close + 1;
+        }
+
+        if (memchr(subscript, '$', subscript_length) != NULL)
+        {
+            expanded_subscript = expand_operand(subscript, subscript_length, &subscript_length);
+            if (expanded_subscript == NULL)
+            {
+                t->error = 1;
+                return NULL;
+            }
+            subscript = expanded_subscript;
+        }
+    }
+    if (want_keys || (want_length && p != close))
+    {
+        free(expanded_subscript);
+        goto bad_substitution;
+    }
+
+    size_t length = 0;
+    const char *value;
+    if (subscript != NULL)
+    {
+        shell_variable *variable = find_variable(name, name_length, 0);
+        value = (variable == NULL) ? NULL
+                                   : get_element(variable, subscript, subscript_length, &length);
+    }
+    else
+    {
+        value = get_variable(name, name_length, &length);
+    }
+    free(expanded_subscript);
+    if (value == NULL)
+    {
+        value = "";
+        length = 0;
+    }
+
+    if (want_length)
+    {
+        char number[32];
+        int n = snprintf(number, sizeof(number), "%zu", length);
+        tok_append_expansion(t, number, n, quoted, CASE_NONE);
+        return close + 1;
+    }
+
+    const char *op = p;
+    if (op == close)
+    {
+        tok_append_expansion(t, value, length, quoted, CASE_NONE);
+        return close + 1;
+    }
+
+    // The operands are expanded before they are used, so `${d#$h/}` trims
+    // the value of `h`; the glob cache then sees the expanded pattern.
+    char *expanded = NULL;
+    char *expanded_replacement = NULL;
+    switch (*op)
+    {
+    case '#':
+    case '%':
+    {
+        int longest = op[1] == op[0];
+        const char *pattern = op + 1 + longest;
+        size_t pattern_length = close - pattern;
+        if (memchr(pattern, '$', pattern_length) != NULL)
+        {
+            pattern = expanded = expand_operand(pattern, pattern_length, &pattern_length);
+            if (pattern == NULL)
+            {
+                t->error = 1;
+                break;
+            }
+        }
+        expand_trim(t, value, length, pattern, pattern_length, *op == '%', longest, quoted);
+        break;
+    }
+    case '/':
+    {
+        // The mode character follows the first slash: `/` for all, `#` for
+        // prefix, `%` for suffix. A plain `${NAME/pat/rep}` replaces once.
+        char mode = 0;
+        const char *pattern = op + 1;
+        if (*pattern == '/' || *pattern == '#' || *pattern == '%')
+        {
+            mode = *pattern++;
+        }
+        const char *separator = pattern;
+        while (separator < close && *separator != '/')
+        {
+            if (*separator == '\\' && separator + 1 < close)
+            {
+                separator++;
+            }
+            separator++;
+        }
+        const char *replacement = (separator < close) ? separator + 1 : close;
+        size_t pattern_length = separator - pattern;
+        size_t replacement_length = close - replacement;
+        if (memchr(pattern, '$', pattern_length) != NULL)
+        {
+            pattern = expanded = expand_operand(pattern, pattern_length, &pattern_length);
+        }
+        if (pattern != NULL && memchr(replacement, '$', replacement_length) != NULL)
+        {
+            replacement = expanded_replacement =
+                expand_operand(replacement, replacement_length, &replacement_length);
+        }
+        if (pattern == NULL || replacement == NULL)
+        {
+            t->error = 1;
+            break;
+        }
+        expand_replace(t, value, length, pattern, pattern_length,
+                       replacement, replacement_length, mode ? mode : '1', quoted);
+        break;
+    }
+    case ':':
+        if (op[1] == '-')
+        {
+            // `${NAME:-word}`: use `word` if NAME is unset or empty.
+            const char *word = op + 2;
+            size_t word_length = close - word;
+            if (length == 0 && memchr(word, '$', word_length) != NULL)
+            {
+                word = expanded = expand_operand(word, word_length, &word_length);
+                if (word == NULL)
+                {
+                    t->error = 1;
+                    break;
+                }
+            }
+            if (length == 0)
+            {
+                tok_append_unescaped(t, word, word_length);
+            }
+            else
+            {
+                tok_append_expansion(t, value, length, quoted, CASE_NONE);
+            }
+            break;
+        }
+    {
+        const char *spec = op + 1;
+        size_t spec_length = close - spec;
+        if (memchr(spec, '$', spec_length) != NULL)
+        {
+            spec = expanded = expand_operand(spec, spec_length, &spec_length);
+            if (spec == NULL)
+            {
+                t->error = 1;
+                break;
+            }
+        }
+        if (expand_substring(t, value, length, spec, spec + spec_length, quoted) == -1)
+        {
+            free(expanded);
+            goto bad_substitution;
+        }
+        break;
+    }
+    case '^':
+    case ',':
+    {
+        int doubled = op[1] == op[0];
+        if (op + 1 + doubled != close)
+        {
+            goto bad_substitution;
+        }
+        int mode = (*op == '^') ? (doubled ? CASE_UPPER_ALL : CASE_UPPER_FIRST)
+                                : (doubled ? CASE_LOWER_ALL : CASE_LOWER_FIRST);
+        tok_append_expansion(t, value, length, quoted, mode);
+        break;
+    }
+    default:
+        goto bad_substitution;
+    }
+    free(expanded);
+    free(expanded_replacement);
+
+    return t->error ? NULL : close + 1;
+
+bad_substitution:
+    fprintf(stderr, "shell: bad substitution\n");
+    t->error = 1;
+    return NULL;
+}
+
+/**
+ * @brief Expands a `$` reference.
+ *
+ * @param t The tokenizer.
+ * @param p Points at the `$`.
+ * @param quoted Non-zero if the reference is inside double quotes.
+ * @return A pointer just past the reference, or NULL on error.
+ */
+static const char *expand_parameter(tokenizer *t, const char *p, int quoted)
+{
+    p++;
+
+    // In `[[ ... ]]` an empty expansion is still an operand, as in
+    // `[[ $e == "" ]]`.
+    if (t->in_test)
+    {
+        t->in_word = 1;
+    }
+
+    if (*p == '{')
+    {
+        return expand_braced(t, p + 1, quoted);
+    }
+
+    if (*p == '$' || *p == '?')
+    {
+        char number[32];
+        int n = snprintf(number, sizeof(number), "%ld",
+                         *p == '$' ? (long)getpid() : (long)last_status);
+        tok_append_expansion(t, number, n, quoted, CASE_NONE);
+        return p + 1;
+    }
+
+    if (is_name_start(*p))
+    {
+        const char *name = p;
+        while (is_name_char(*p))
+        {
+            p++;
+        }
+        size_t length;
+        const char *value = get_variable(name, p - name, &length);
+        if (value != NULL)
+        {
+            tok_append_expansion(t, value, length, quoted, CASE_NONE);
+        }
+        return p;
+    }
+
+    // A `$` that does not start a reference is just a dollar sign.
+    tok_append(t, "$", 1);
+    return p;
+}
+
+/**
+ * @brief Returns the length of an array literal opener such as `a=(`.
+ *
+ * @return The length of `NAME=(` or `NAME+=(` at `p`, or 0 if there is none.
+ */
+static size_t array_literal_length(const char *p)
+{
+    size_t i = 0;
+    while (is_name_char(p[i]))
+    {
+        i++;
+    }
+    if (p[i] == '+')
+    {
+        i++;
+    }
+    return (p[i] == '=' && p[i + 1] == '(') ? i + 2 : 0;
+}
+
+/**
+ * @brief Splits a command line into words and performs expansions.
+ *
+ * The rules follow the usual shell conventions:
+ * - Unquoted spaces, tabs and newlines separate words.
+ * - `'...'` preserves everything literally.
+ * - `"..."` preserves everything except `$` expansions and the escapes
+ *   `\$`, `\"`, `\\` and `` \` ``.
+ * - An unquoted backslash makes the next character literal.
+ * - An unquoted `#` at the start of a word begins a comment.
+ * - `NAME=(` starts an array literal that runs up to the next unquoted `)`.
+ *
+ * @return The words and the pointers to them in one block, or NULL on error.
+ */
+char **tokenize(const char *line)
+{
+    tokenizer t = {0};
+
+    // Make room for the byte in front of the first word.
+    if (tok_reserve(&t, 1) == 0)
+    {
+        t.word[0] = 0;
+        t.length = t.start = 1;
+    }
+
+    const char *p = line;
+    size_t array_start;
+    while (p != NULL && *p != '\0' && !t.error)
+    {
+        char c = *p;
+
+        if (strchr(TOKEN_DELIMITERS, c) != NULL)
+        {
+            tok_end_word(&t);
+            p++;
+        }
+        else if (c == '#' && !t.in_word)
+        {
+            break;
+        }
+        else if (!t.in_word && !t.in_array && is_name_start(c) &&
+                 (array_start = array_literal_length(p)) > 0)
+        {
+            // `NAME=(` or `NAME+=(` opens an array literal. It is passed on
+            // as a word of its own; the elements follow as normal words.
+            tok_append(&t, p, array_start);
+            tok_end_word(&t);
+            t.in_array = 1;
+            p += array_start;
+        }
+        else if (c == ')' && t.in_array)
+        {
+            tok_end_word(&t);
+            tok_append(&t, ")", 1);
+            tok_end_word(&t);
+            t.in_array = 0;
+            p++;
+        }
+        else if (c == '\\')
+        {
+            if (t.pattern != PATTERN_NONE && p[1] != '\0')
+            {
+                // In the pattern of `[[ str == pat ]]` or `[[ str =~ re ]]`
+                // a backslash is meant for the matcher (as in `\.txt$`),
+                // so keep it.
+                tok_append(&t, p, 2);
+                p += 2;
+            }
+            else if (p[1] != '\0')
+            {
+                tok_append(&t, p + 1, 1);
+                p += 2;
+            }
+            else
+            {
+                p++;
+            }
+        }
+        else if (c == '\'')
+        {
+            const char *end = strchr(p + 1, '\'');
+            if (end == NULL)
+            {
+                fprintf(stderr, "shell: unterminated quote\n");
+                t.error = 1;
+                break;
+            }
+            tok_append_quoted(&t, p + 1, end - (p + 1));
+            p = end + 1;
+        }
+        else if (c == '"')
+        {
+            t.in_word = 1;
+            p++;
+            while (p != NULL && *p != '\0' && *p != '"' && !t.error)
+            {
+                if (*p == '\\' && p[1] != '\0' && strchr("$\"\\`", p[1]) != NULL)
+                {
+                    tok_append_quoted(&t, p + 1, 1);
+                    p += 2;
+                }
+                else if (*p == '$')
+                {
+                    p = expand_parameter(&t, p, 1);
+                }
+                else
+                {
+                    tok_append_quoted(&t, p, 1);
+                    p++;
+                }
+            }
+            if (p == NULL || t.error)
+            {
+                break;
+            }
+            if (*p != '"')
+            {
+                fprintf(stderr, "shell: unterminated quote\n");
+                t.error = 1;
+                break;
+            }
+            p++;
+        }
+        else if (c == '$')
+        {
+            p = expand_parameter(&t, p, 0);
+        }
+        else
+        {
+            // Copy a run of ordinary characters in one go.
+            size_t run = strcspn(p, t.in_array ? " \t\n\\'\"$)" : " \t\n\\'\"$");
+            if (t.unquoted == t.length - t.start)
+            {
+                t.unquoted += run;
+            }
+            tok_append(&t, p, run);
+            p += run;
+        }
+    }
+
+    if (!t.error && t.in_array)
+    {
+        fprintf(stderr, "shell: unterminated array assignment\n");
+        t.error = 1;
+    }
+    if (!t.error)
+    {
+        tok_end_word(&t);
+    }
+
+    // Pack the pointer array and the words into one block.
+    size_t table = (t.count + 1) * sizeof(char *);
+    char **args = t.error ? NULL : malloc(table + t.length);
+    if (args != NULL)
+    {
+        char *text = (char *)args + table;
+        memcpy(text, t.word, t.length);
+        for (size_t i = 0; i < t.count; i++)
+        {
+            args[i] = text + t.offsets[i];
+        }
+        args[t.count] = NULL;
+
+        // A program name the shell has interned (one it found in `PATH`,
+        // say) is replaced by the interned copy, which later lookups in
+        // the table of interned strings recognise by its address. The
+        // copy has no byte for `word_is_unquoted()` in front of it, so a
+        // word that could be an operator keeps its own.
+        symbol *program = (t.count > 0 && strpbrk(args[0], "<>|") == NULL)
+                              ? symbol_find(args[0], strlen(args[0]))
+                              : NULL;
+        if (program != NULL)
+        {
+            args[0] = (char *)program->text;
+        }
+    }
+    else if (!t.error)
+    {
+        perror("malloc failed in tokenizer");
+    }
+    free(t.word);
+    free(t.offsets);
+    return args;
+}
+
+/* ========================================================================= */
+/* ALIASES                                       */
+/* ========================================================================= */
+
+/**
+ * @brief How deeply aliases may expand into other aliases.
+ */
+#define MAX_ALIAS_DEPTH 64
+
+/**
+ * @brief The most alias expansions performed on one command line.
+ *
+ * This bounds definitions such as `alias a='b; b' b='c; c' ...`, whose
+ * expansion doubles in size with every level.
+ */
+#define MAX_ALIAS_EXPANSIONS 1024
+
+/**
+ * @brief Text of a command line produced by alias expansion, with one
+ * entry per alias whose text is still being scanned.
+ *
+ * An alias is not expanded again inside its own text, which is what stops
+ * `alias ls='ls -F'` from recursing. Each symbol carries an `alias_active`
+ * flag that is set while the scan is inside its replacement text; this is
+ * the visited set of the expansion, checked and updated in O(1).
+ */
+typedef struct
+{
+    symbol *entry;
+    size_t end;          // Offset just past the alias's replacement text.
+    int trailing_blank;  // The value ends in a blank: check the next word too.
+} alias_region;
+
+/**
+ * @brief Checks whether a word is a valid alias name.
+ */
+static int is_alias_name(const char *name, size_t length)
+{
+    return length > 0 && strcspn(name, " \t\n;&|()<>'\"\\$`=/") >= length;
+}
+
+/**
+ * @brief Expands aliases at every command position of a line.
+ *
+ * The first word of each command (at the start of the line and after `;`,
+ * `&&`, `||`, `|` and `&`) is looked up in the symbol table. If it names
+ * an alias, the alias text replaces it and scanning continues inside that
+ * text, so the replacement can itself start with an alias, contain several
+ * commands, or end in a blank to have the following word checked as well.
+ * Quoted words and words with expansions are never aliases.
+ *
+ * @param line The command line.
+ * @return The expanded line (to be freed by the caller), or NULL if the
+ *         line contains no aliases.
+ */
+char *expand_aliases(const char *line)
+{
+    if (symbol_table.alias_count == 0)
+    {
+        return NULL;
+    }
+
+    // Most lines contain no alias, so the copy is only made once one is found.
+    char *buffer = NULL;
+    const char *text = line;
+    size_t length = strlen(line);
+    size_t capacity = 0;
+
+    alias_region regions[MAX_ALIAS_DEPTH];
+    int depth = 0;
+    int expansions = 0;
+    int command_position = 1;
+    size_t pos = 0;
+
+    while (pos < length)
+    {
+        // Leave the replacement texts the scan has moved past.
+        while (depth > 0 && pos >= regions[depth - 1].end)
+        {
+            depth--;
+            regions[depth].entry->alias_active = 0;
+            if (regions[depth].trailing_blank)
+            {
+                command_position = 1;
+            }
+        }
+
+        char c = text[pos];
+        if (c == ' ' || c == '\t' || c == '\n')
+        {
+            pos++;
+            continue;
+        }
+        if (c == ';' || c == '&' || c == '|' || c == '(' || c == ')')
+        {
+            command_position = 1;
+            pos++;
+            continue;
+        }
+        if (c == '#')
+        {
+            break;
+        }
+
+        // Find the end of the word, noting whether it is a plain one.
+        size_t end = pos;
+        int plain = 1;
+        while (end < length && strchr(" \t\n;&|()", text[end]) == NULL)
+        {
+            char d = text[end];
+            if (d == '\'' || d == '"')
+            {
+                const char *close = text + end + 1;
+                while (*close != '\0' && *close != d)
+                {
+                    close += (d == '"' && *close == '\\' && close[1] != '\0') ? 2 : 1;
+                }
+                end = (*close == d) ? (size_t)(close - text) + 1 : length;
+                plain = 0;
+            }
+            else if (d == '\\')
+            {
+                end = (end + 2 < length) ? end + 2 : length;
+                plain = 0;
+            }
+            else if (d == '$' && text[end + 1] == '{')
+            {
+                const char *close = find_brace_end(text + end + 2);
+                end = close ? (size_t)(close - text) + 1 : length;
+                plain = 0;
+            }
+            else
+            {
+                plain &= (d != '$' && d != '`');
+                end++;
+            }
+        }
+
+        if (command_position && plain)
+        {
+            // Inside `[[ ... ]]`, `&&` and `||` do not start commands.
+            if (end - pos == 2 && memcmp(text + pos, "[[", 2) == 0)
+            {
+                const char *close = strstr(text + end, "]]");
+                pos = close ? (size_t)(close - text) + 2 : length;
+                command_position = 0;
+                continue;
+            }
+
+            symbol *entry = symbol_find(text + pos, end - pos);
+            if (entry != NULL && entry->alias != NULL && !entry->alias_active &&
+                depth < MAX_ALIAS_DEPTH && expansions < MAX_ALIAS_EXPANSIONS)
+            {
+                size_t word_length = end - pos;
+                size_t new_length = length - word_length + entry->alias_length;
+                if (new_length + 1 > capacity)
+                {
+                    capacity = 2 * (new_length + 1);
+                    char *grown = realloc(buffer, capacity);
+                    if (grown == NULL)
+                    {
+                        perror("realloc failed in alias expansion");
+                        break;
+                    }
+                    if (buffer == NULL)
+                    {
+                        memcpy(grown, line, length + 1);
+                    }
+                    buffer = grown;
+                    text = buffer;
+                }
+                memmove(buffer + pos + entry->alias_length, buffer + end, length - end + 1);
+                memcpy(buffer + pos, entry->alias, entry->alias_length);
+                length = new_length;
+
+                // Every open region contains `pos`, so each of them grows.
+                for (int i = 0; i < depth; i++)
+                {
+                    regions[i].end += entry->alias_length - word_length;
+                }
+                regions[depth].entry = entry;
+                regions[depth].end = pos + entry->alias_length;
+                regions[depth].trailing_blank = entry->alias_length > 0 &&
+                    (entry->alias[entry->alias_length - 1] == ' ' || entry->alias[entry->alias_length - 1] == '\t');
+                depth++;
+                entry->alias_active = 1;
+                expansions++;
+                continue;
+            }
+
+            // Assignments before the command name leave it in command position.
+            if (memchr(text + pos, '=', end - pos) != NULL && is_name_start(text[pos]))
+            {
+                pos = end;
+                continue;
+            }
+        }
+
+        command_position = 0;
+        pos = (end > pos) ? end : pos + 1;
+    }
+
+    while (depth > 0)
+    {
+        regions[--depth].entry->alias_active = 0;
+    }
+    return buffer;
+}
+
+/**
+ * @brief Prints one alias in a form that can be read back in.
+ */
+static void print_alias(const symbol *entry)
+{
+    printf("alias %s='", entry->text);
+    for (size_t i = 0; i < entry->alias_length; i++)
+    {
+        if (entry->alias[i] == '\'')
+        {
+            fputs("'\\''", stdout);
+        }
+        else
+        {
+            putchar(entry->alias[i]);
+        }
+    }
+    printf("'\n");
+}
+
+/**
+ * @brief Orders symbols by name, for listing aliases.
+ */
+static int compare_symbols(const void *a, const void *b)
+{
+    return strcmp((*(symbol *const *)a)->text, (*(symbol *const *)b)->text);
+}
+
+/**
+ * @brief Implements the `alias` built-in.
+ *
+ * `alias NAME=VALUE...` defines aliases, `alias NAME...` prints them and
+ * `alias` alone lists every alias in name order.
+ *
+ * @return 0 on success, 1 if a name is not an alias or not valid.
+ */
+int builtin_alias(char **args)
+{
+    if (args[1] == NULL)
+    {
+        symbol **list = malloc((symbol_table.alias_count ? symbol_table.alias_count : 1) * sizeof(symbol *));
+        if (list == NULL)
+        {
+            perror("malloc failed in alias");
+            return 1;
+        }
+        size_t count = 0;
+        for (size_t i = 0; i < symbol_table.capacity; i++)
+        {
+            if (symbol_table.slots[i] != NULL && symbol_table.slots[i]->alias != NULL)
+            {
+                list[count++] = symbol_table.slots[i];
+            }
+        }
+        qsort(list, count, sizeof(symbol *), compare_symbols);
+        for (size_t i = 0; i < count; i++)
+        {
+            print_alias(list[i]);
+        }
+        free(list);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        const char *equals = strchr(args[i], '=');
+        size_t name_length = equals ? (size_t)(equals - args[i]) : strlen(args[i]);
+        if (equals == NULL)
+        {
+            symbol *entry = symbol_find(args[i], name_length);
+            if (entry == NULL || entry->alias == NULL)
+            {
+                fprintf(stderr, "shell: alias: %s: not found\n", args[i]);
+                status = 1;
+                continue;
+            }
+            print_alias(entry);
+            continue;
+        }
+        if (!is_alias_name(args[i], name_length))
+        {
+            fprintf(stderr, "shell: alias: `%.*s': invalid alias name\n", (int)name_length, args[i]);
+            status = 1;
+            continue;
+        }
+
+        symbol *entry = intern(args[i], name_length, 1);
+        char *value = strdup(equals + 1);
+        if (entry == NULL || value == NULL)
+        {
+            free(value);
+            return 1;
+        }
+        symbol_set_alias(entry, value, strlen(value));
+    }
+    return status;
+}
+
+/**
+ * @brief Implements the `unalias` built-in.
+ *
+ * `unalias NAME...` removes aliases and `unalias -a` removes all of them.
+ *
+ * @return 0 on success, 1 if a name is not an alias.
+ */
+int builtin_unalias(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "usage: unalias [-a] NAME...\n");
+        return 2;
+    }
+    if (strcmp(args[1], "-a") == 0)
+    {
+        for (size_t i = 0; i < symbol_table.capacity; i++)
+        {
+            if (symbol_table.slots[i] != NULL)
+            {
+                symbol_clear_alias(symbol_table.slots[i]);
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        symbol *entry = symbol_find(args[i], strlen(args[i]));
+        if (entry == NULL || entry->alias == NULL)
+        {
+            fprintf(stderr, "shell: unalias: %s: not found\n", args[i]);
+            status = 1;
+            continue;
+        }
+        symbol_clear_alias(entry);
+    }
+    return status;
+}
+
+/* ========================================================================= */
+/* REGEX CACHE                                   */
+/* ========================================================================= */
+
+/**
+ * @brief One compiled regular expression in the regex cache.
+ */
+typedef struct
+{
+    char *pattern;           // The pattern text, or NULL for an empty slot.
+    uint64_t hash;           // Hash of the pattern text and flags.
+    int cflags;              // The flags it was compiled with.
+    regex_t regex;           // The compiled expression.
+    unsigned long last_used; // Value of `regex_cache_clock` at the last hit.
+} regex_cache_entry;
+
+/**
+ * @brief The compiled regular expressions, least recently used first out.
+ *
+ * With only REGEX_CACHE_SIZE entries, a linear scan comparing the stored
+ * hashes is as fast as any index structure, and finding the least recently
+ * used entry is a by-product of the same scan.
+ */
+static regex_cache_entry regex_cache[REGEX_CACHE_SIZE];
+
+/**
+ * @brief A counter that orders cache accesses for the LRU policy.
+ */
+static unsigned long regex_cache_clock;
+
+/**
+ * @brief Returns a compiled regular expression from the regex cache.
+ *
+ * On a miss, the pattern is compiled into an empty slot or, if the cache is
+ * full, into the slot of the least recently used expression. `[[ =~ ]]` in
+ * a loop therefore compiles its pattern only on the first iteration.
+ *
+ * @return The compiled expression, or NULL if it does not compile.
+ */
+regex_t *regex_cache_get(const char *pattern, int cflags, const char *who)
+{
+    uint64_t hash = hash_bytes(pattern, strlen(pattern)) ^ (uint64_t)cflags;
+    regex_cache_entry *victim = NULL;
+
+    shell_stats.regex_lookups++;
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++)
+    {
+        regex_cache_entry *entry = &regex_cache[i];
+        if (entry->pattern == NULL)
+        {
+            if (victim == NULL || victim->pattern != NULL)
+            {
+                victim = entry;
+            }
+            continue;
+        }
+        if (entry->hash == hash && entry->cflags == cflags && strcmp(entry->pattern, pattern) == 0)
+        {
+            shell_stats.regex_hits++;
+            entry->last_used = ++regex_cache_clock;
+            return &entry->regex;
+        }
+        if (victim == NULL || (victim->pattern != NULL && entry->last_used < victim->last_used))
+        {
+            victim = entry;
+        }
+    }
+
+    // Evict the chosen slot and compile the new pattern into it.
+    if (victim->pattern != NULL)
+    {
+        regfree(&victim->regex);
+        free(victim->pattern);
+        victim->pattern = NULL;
+    }
+
+    int error = regcomp(&victim->regex, pattern, cflags);
+    if (error != 0)
+    {
+        char message[256];
+        regerror(error, &victim->regex, message, sizeof(message));
+        fprintf(stderr, "shell: %s: %s\n", who, message);
+        return NULL;
+    }
+
+    victim->pattern = strdup(pattern);
+    if (victim->pattern == NULL)
+    {
+        perror("strdup failed in regex cache");
+        regfree(&victim->regex);
+        return NULL;
+    }
+    victim->hash = hash;
+    victim->cflags = cflags;
+    victim->last_used = ++regex_cache_clock;
+    return &victim->regex;
+}
+
+/* ========================================================================= */
+/* CONDITIONAL EXPRESSIONS                       */
+/* ========================================================================= */
+
+/**
+ * @brief The state of the `[[ ... ]]` expression parser.
+ *
+ * The expression is evaluated while it is parsed, by recursive descent over
+ * the words between `[[` and `]]`.
+ */
+typedef struct
+{
+    char **args; // The words of the command.
+    int pos;     // The next word to look at.
+    int end;     // The position of the closing `]]`.
+    int error;   // Set on a syntax error or an invalid regex.
+} test_parser;
+
+static int test_or(test_parser *tp);
+
+/**
+ * @brief Checks whether a word of the expression is an operator, that is,
+ * written unquoted: `[[ "!" ]]` tests a string.
+ */
+static int test_operator(const char *word)
+{
+    return word_is_unquoted(word, strlen(word));
+}
+
+/**
+ * @brief Returns the current word if it is the operator `word`, advancing
+ * past it.
+ */
+static int test_accept(test_parser *tp, const char *word)
+{
+    if (tp->pos < tp->end && strcmp(tp->args[tp->pos], word) == 0 &&
+        test_operator(tp->args[tp->pos]))
+    {
+        tp->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses an integer operand of `-eq` and friends.
+ */
+static long test_integer(test_parser *tp, const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0')
+    {
+        fprintf(stderr, "shell: [[: %s: integer expression expected\n", text);
+        tp->error = 1;
+    }
+    return value;
+}
+
+/**
+ * @brief Evaluates `str =~ re`, filling `BASH_REMATCH` on a match.
+ *
+ * Element 0 of `BASH_REMATCH` is the whole match and element N is the text
+ * of the Nth parenthesised group. A failed match leaves it empty.
+ */
+static int test_regex(test_parser *tp, const char *text, const char *pattern)
+{
+    regex_t *regex = regex_cache_get(pattern, REG_EXTENDED, "[[");
+    if (regex == NULL)
+    {
+        tp->error = 1;
+        return 0;
+    }
+
+    regmatch_t matches[10];
+    size_t groups = regex->re_nsub + 1;
+    if (groups > sizeof(matches) / sizeof(matches[0]))
+    {
+        groups = sizeof(matches) / sizeof(matches[0]);
+    }
+    int matched = regexec(regex, text, groups, matches, 0) == 0;
+
+    shell_variable *rematch = find_variable("BASH_REMATCH", 12, 1);
+    if (rematch != NULL && (rematch->kind == VAR_INDEXED || make_array(rematch, VAR_INDEXED) == 0))
+    {
+        indexed_clear(rematch->indexed);
+        for (size_t i = 0; matched && i < groups; i++)
+        {
+            if (matches[i].rm_so == -1)
+            {
+                indexed_set(rematch->indexed, i, "", 0);
+                continue;
+            }
+            indexed_set(rematch->indexed, i, text + matches[i].rm_so,
+                        matches[i].rm_eo - matches[i].rm_so);
+        }
+    }
+    return matched;
+}
+
+/**
+ * @brief Parses and evaluates a primary: a unary test, a binary test or a string.
+ */
+static int test_primary(test_parser *tp)
+{
+    if (tp->pos >= tp->end)
+    {
+        fprintf(stderr, "shell: [[: unexpected end of expression\n");
+        tp->error = 1;
+        return 0;
+    }
+
+    if (test_accept(tp, "("))
+    {
+        int result = test_or(tp);
+        if (!test_accept(tp, ")"))
+        {
+            fprintf(stderr, "shell: [[: expected ')'\n");
+            tp->error = 1;
+        }
+        return result;
+    }
+
+    const char *left = tp->args[tp->pos];
+
+    // Binary operators: `left OP right`.
+    if (tp->pos + 2 < tp->end && test_operator(tp->args[tp->pos + 1]))
+    {
+        const char *op = tp->args[tp->pos + 1];
+        const char *right = tp->args[tp->pos + 2];
+        int known = 1;
+        int result = 0;
+
+        if (strcmp(op, "==") == 0 || strcmp(op, "=") == 0 || strcmp(op, "!=") == 0)
+        {
+            // The right-hand side is a glob pattern, as in `[[ $f == *.c ]]`.
+            compiled_glob *glob = compile_glob(right, strlen(right));
+            result = glob != NULL && glob_match(glob, left, strlen(left));
+            if (op[0] == '!')
+            {
+                result = !result;
+            }
+        }
+        else if (strcmp(op, "=~") == 0)
+        {
+            result = test_regex(tp, left, right);
+        }
+        else if (strcmp(op, "<") == 0)
+        {
+            result = strcmp(left, right) < 0;
+        }
+        else if (strcmp(op, ">") == 0)
+        {
+            result = strcmp(left, right) > 0;
+        }
+        else if (op[0] == '-' && strlen(op) == 3)
+        {
+            long a = test_integer(tp, left);
+            long b = test_integer(tp, right);
+            if (strcmp(op, "-eq") == 0)
+                result = a == b;
+            else if (strcmp(op, "-ne") == 0)
+                result = a != b;
+            else if (strcmp(op, "-lt") == 0)
+                result = a < b;
+            else if (strcmp(op, "-le") == 0)
+                result = a <= b;
+            else if (strcmp(op, "-gt") == 0)
+                result = a > b;
+            else if (strcmp(op, "-ge") == 0)
+                result = a >= b;
+            else
+                known = 0;
+        }
+        else
+        {
+            known = 0;
+        }
+
+        if (known)
+        {
+            tp->pos += 3;
+            return result;
+        }
+    }
+
+    // Unary operators: `-OP operand`.
+    if (left[0] == '-' && left[1] != '\0' && left[2] == '\0' && tp->pos + 1 < tp->end &&
+        test_operator(left))
+    {
+        const char *operand = tp->args[tp->pos + 1];
+        struct stat info;
+        int known = 1;
+        int result = 0;
+
+        switch (left[1])
+        {
+        case 'n':
+            result = operand[0] != '\0';
+            break;
+        case 'z':
+            result = operand[0] == '\0';
+            break;
+        case 'e':
+            result = stat(operand, &info) == 0;
+            break;
+        case 'f':
+            result = stat(operand, &info) == 0 && S_ISREG(info.st_mode);
+            break;
+        case 'd':
+            result = stat(operand, &info) == 0 && S_ISDIR(info.st_mode);
+            break;
+        case 's':
+            result = stat(operand, &info) == 0 && info.st_size > 0;
+            break;
+        case 'L':
+        case 'h':
+            result = lstat(operand, &info) == 0 && S_ISLNK(info.st_mode);
+            break;
+        case 'r':
+            result = access(operand, R_OK) == 0;
+            break;
+        case 'w':
+            result = access(operand, W_OK) == 0;
+            break;
+        case 'x':
+            result = access(operand, X_OK) == 0;
+            break;
+        default:
+            known = 0;
+        }
+
+        if (known)
+        {
+            tp->pos += 2;
+            return result;
+        }
+    }
+
+    // A lone string is true if it is not empty.
+    tp->pos++;
+    return left[0] != '\0';
+}
+
+/**
+ * @brief Parses and evaluates `! expr` or a primary.
+ */
+static int test_not(test_parser *tp)
+{
+    if (test_accept(tp, "!"))
+    {
+        return !test_not(tp);
+    }
+    return test_primary(tp);
+}
+
+/**
+ * @brief Parses and evaluates `expr && expr ...`.
+ */
+static int test_and(test_parser *tp)
+{
+    int result = test_not(tp);
+    while (!tp->error && test_accept(tp, "&&"))
+    {
+        int right = test_not(tp);
+        result = result && right;
+    }
+    return result;
+}
+
+/**
+ * @brief Parses and evaluates `expr || expr ...`.
+ */
+static int test_or(test_parser *tp)
+{
+    int result = test_and(tp);
+    while (!tp->error && test_accept(tp, "||"))
+    {
+        int right = test_and(tp);
+        result = result || right;
+    }
+    return result;
+}
+
+/**
+ * @brief Implements the `[[ ... ]]` conditional expression built-in.
+ *
+ * Supported: string tests (`-n`, `-z`, `==`/`!=` against a glob pattern,
+ * `<`, `>`), regex matching with `=~`, integer comparisons (`-eq`, `-ne`,
+ * `-lt`, `-le`, `-gt`, `-ge`), file tests (`-e`, `-f`, `-d`, `-s`, `-L`,
+ * `-r`, `-w`, `-x`), and `!`, `&&`, `||` and parentheses to combine them.
+ *
+ * The tokenizer does not split expansions between `[[` and `]]`, keeps
+ * empty ones as operands, and escapes the quoted parts of a pattern, so
+ * that `[[ $f == "$prefix"* ]]` matches the prefix literally.
+ *
+ * @return 0 if the expression is true, 1 if false, 2 on an error.
+ */
+int builtin_test(char **args)
+{
+    int end = 0;
+    while (args[end] != NULL)
+    {
+        end++;
+    }
+    if (end < 2 || strcmp(args[end - 1], "]]") != 0)
+    {
+        fprintf(stderr, "shell: [[: missing ']]'\n");
+        return 2;
+    }
+
+    test_parser tp = {args, 1, end - 1, 0};
+    if (tp.pos == tp.end)
+    {
+        fprintf(stderr, "shell: [[: empty expression\n");
+        return 2;
+    }
+
+    int result = test_or(&tp);
+    if (!tp.error && tp.pos != tp.end)
+    {
+        fprintf(stderr, "shell: [[: unexpected '%s'\n", args[tp.pos]);
+        tp.error = 1;
+    }
+    return tp.error ? 2 : !result;
+}
+
+/* ========================================================================= */
+/* LINE FILTER BUILT-IN                          */
+/* ========================================================================= */
+
+/**
+ * @brief The compiled form of a `filter` invocation.
+ *
+ * Holds the parsed options and either the fixed string to look for or a
+ * pointer to the compiled regular expression.
+ */
+typedef struct
+{
+    const char *pattern; // The pattern text as given on the command line.
+    size_t pattern_len;  // Length of `pattern`, cached for the fixed search.
+    int fixed;           // Non-zero for `-F` (plain substring search).
+    int invert;          // Non-zero for `-v` (select non-matching lines).
+    int count_only;      // Non-zero for `-c` (print the number of matches).
+    regex_t *regex;      // The compiled pattern when `fixed` is zero.
+} line_filter;
+
+/**
+ * @brief A buffered writer used to emit matching lines.
+ *
+ * Matching lines are collected here and written with as few `write()`
+ * calls as possible. Once a write fails (typically with EPIPE because the
+ * next pipeline stage exited), `error` is set and all output stops.
+ */
+typedef struct
+{
+    char buffer[FILTER_BUFFER_SIZE];
+    size_t length;
+    int fd;
+    int error;
+    int interrupted; // Set by Ctrl+C, which stops the filter as an error does.
+} filter_output;
+
+/**
+ * @brief Writes a whole buffer to a file descriptor.
+ *
+ * `write()` may write fewer bytes than requested, or be interrupted by a
+ * signal. This helper keeps going until everything is written.
+ *
+ * @return 0 on success, -1 on error (with errno set).
+ */
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Flushes the buffered output of the filter.
+ */
+static void filter_flush(filter_output *out)
+{
+    if (out->length > 0 && !out->error)
+    {
+        if (write_all(out->fd, out->buffer, out->length) == -1)
+        {
+            out->error = 1;
+        }
+    }
+    out->length = 0;
+}
+
+/**
+ * @brief Appends one line (including its newline) to the filter output.
+ */
+static void filter_emit(filter_output *out, const char *line, size_t length)
+{
+    if (out->length + length > sizeof(out->buffer))
+    {
+        filter_flush(out);
+    }
+    if (length > sizeof(out->buffer))
+    {
+        // Too large to buffer; write it straight through.
+        if (!out->error && write_all(out->fd, line, length) == -1)
+        {
+            out->error = 1;
+        }
+        return;
+    }
+    memcpy(out->buffer + out->length, line, length);
+    out->length += length;
+}
+
+/**
+ * @brief Finds the first occurrence of a fixed string in a buffer.
+ *
+ * With SSE2 available, sixteen candidate positions are tested at once: a
+ * position can only start a match if the byte there equals the first byte
+ * of the needle *and* the byte `needle_len - 1` further on equals the last
+ * byte of the needle. Both conditions are checked with one vector compare
+ * each, and only the surviving candidates are verified with `memcmp()`.
+ * Checking two bytes rules out far more positions than `memchr()` on the
+ * first byte alone, which matters for common first letters.
+ *
+ * @return A pointer to the start of the match, or NULL if there is none.
+ */
+static const char *find_fixed(const char *haystack, size_t length,
+                              const char *needle, size_t needle_len)
+{
+    if (needle_len == 0)
+    {
+        return haystack;
+    }
+    if (length < needle_len)
+    {
+        return NULL;
+    }
+    if (needle_len == 1)
+    {
+        return memchr(haystack, needle[0], length);
+    }
+
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+    // Both loads must stay inside the buffer: the second one reads up to
+    // byte i + needle_len - 1 + 15.
+    for (; i + needle_len - 1 + 16 <= length; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0)
+            {
+                return haystack + i + bit;
+            }
+            // Clear the lowest set bit and try the next candidate.
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Scalar path for the tail of the buffer (or the whole buffer without
+    // SSE2): jump between occurrences of the first byte with `memchr()`.
+    while (i + needle_len <= length)
+    {
+        const char *candidate = memchr(haystack + i, needle[0], length - needle_len + 1 - i);
+        if (candidate == NULL)
+        {
+            return NULL;
+        }
+        i = candidate - haystack;
+        if (haystack[i + needle_len - 1] == needle[needle_len - 1] &&
+            memcmp(haystack + i + 1, needle + 1, needle_len - 2) == 0)
+        {
+            return candidate;
+        }
+        i++;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Filters a block of complete lines.
+ *
+ * `start` to `end` must hold only whole lines, each ending in a newline.
+ * For a fixed string without `-v`, the search runs across the whole block
+ * and only the lines that contain a hit are ever looked at. In every other
+ * mode the block is walked line by line.
+ *
+ * @return The number of lines selected.
+ */
+static long filter_block(line_filter *filter, char *start, char *end, filter_output *out)
+{
+    long selected = 0;
+    char *p = start;
+
+    if (filter->fixed && !filter->invert)
+    {
+        while (p < end && !out->error)
+        {
+            const char *match = find_fixed(p, end - p, filter->pattern, filter->pattern_len);
+            if (match == NULL)
+            {
+                break;
+            }
+            // `p` is always at a line start, so the line containing the
+            // match begins after the last newline before it.
+            const char *line_start = memrchr(p, '\n', match - p);
+            line_start = (line_start == NULL) ? p : line_start + 1;
+            char *line_end = memchr(match, '\n', end - match);
+            line_end = (line_end == NULL) ? end : line_end + 1;
+
+            if (!filter->count_only)
+            {
+                filter_emit(out, line_start, line_end - line_start);
+            }
+            selected++;
+            p = line_end;
+        }
+        return selected;
+    }
+
+    while (p < end && !out->error)
+    {
+        char *line_end = memchr(p, '\n', end - p);
+        if (line_end == NULL)
+        {
+            line_end = end - 1;
+        }
+
+        int matched;
+        if (filter->fixed)
+        {
+            matched = find_fixed(p, line_end - p, filter->pattern, filter->pattern_len) != NULL;
+        }
+        else
+        {
+            // `regexec()` needs a NUL-terminated string. The buffer is ours,
+            // so the newline can be swapped out for the duration of the call.
+            *line_end = '\0';
+            matched = regexec(filter->regex, p, 0, NULL, 0) == 0;
+            *line_end = '\n';
+        }
+
+        if (matched != filter->invert)
+        {
+            if (!filter->count_only)
+            {
+                filter_emit(out, p, line_end + 1 - p);
+            }
+            selected++;
+        }
+        p = line_end + 1;
+    }
+    return selected;
+}
+
+/**
+ * @brief Runs one input descriptor through the filter.
+ *
+ * Input is read in large blocks. Complete lines are filtered straight out
+ * of the read buffer; a trailing partial line is moved to the front and
+ * completed by the next read. A final line without a newline gets one.
+ * Ctrl+C stops it between reads, even while it waits for a terminal.
+ *
+ * @return The number of lines selected, or -1 on a read error.
+ */
+static long filter_stream(line_filter *filter, int in_fd, filter_output *out)
+{
+    size_t capacity = FILTER_BUFFER_SIZE;
+    size_t length = 0;
+    long selected = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL)
+    {
+        perror("malloc failed in filter");
+        return -1;
+    }
+
+    while (!out->error && !out->interrupted)
+    {
+        // A single line longer than the buffer forces it to grow.
+        if (length == capacity)
+        {
+            char *bigger = realloc(buffer, capacity * 2);
+            if (bigger == NULL)
+            {
+                perror("realloc failed in filter");
+                free(buffer);
+                return -1;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+
+        if (!event_wait_readable(in_fd))
+        {
+            out->interrupted = 1;
+            break;
+        }
+        ssize_t n = read(in_fd, buffer + length, capacity - length);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("shell: filter");
+            free(buffer);
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            // End of input. Terminate a dangling last line and filter it.
+            if (length > 0)
+            {
+                if (length == capacity)
+                {
+                    char *bigger = realloc(buffer, capacity + 1);
+                    if (bigger == NULL)
+                    {
+                        free(buffer);
+                        return -1;
+                    }
+                    buffer = bigger;
+                }
+                buffer[length++] = '\n';
+                selected += filter_block(filter, buffer, buffer + length, out);
+            }
+            break;
+        }
+
+        size_t scanned = length;
+        length += n;
+
+        // Only the newly read bytes can contain the last newline.
+        char *last_newline = memrchr(buffer + scanned, '\n', length - scanned);
+        if (last_newline == NULL)
+        {
+            continue;
+        }
+
+        char *complete_end = last_newline + 1;
+        selected += filter_block(filter, buffer, complete_end, out);
+
+        // Keep the partial line for the next round.
+        length = buffer + length - complete_end;
+        memmove(buffer, complete_end, length);
+    }
+
+    free(buffer);
+    return selected;
+}
+
+/**
+ * @brief Runs the `filter` built-in over a stream of lines.
+ *
+ * Usage: `filter [-F] [-E] [-i] [-v] [-c] pattern [file...]`
+ *
+ * - `-F` treats the pattern as a fixed string instead of a basic regex.
+ * - `-E` uses extended regular expression syntax.
+ * - `-i` ignores case (regex mode only).
+ * - `-v` selects the lines that do not match.
+ * - `-c` prints only the number of selected lines.
+ *
+ * The options mirror those of `grep`, so `grep -F needle` in a pipeline
+ * can be replaced with `filter -F needle` and stay in-process.
+ *
+ * @param args The `filter` command and its arguments.
+ * @param in_fd The file descriptor to read lines from when no file is named.
+ * @param out_fd The file descriptor to write matching lines to.
+ * @return The number of selected lines, -1 on error, or -2 if interrupted
+ *         by Ctrl+C.
+ */
+int run_filter(char **args, int in_fd, int out_fd)
+{
+    line_filter filter = {0};
+    int extended = 0;
+    int ignore_case = 0;
+    int i = 1;
+
+    // Parse the options. Flags may be combined, as in `-Fv`.
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        if (strcmp(args[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        for (const char *flag = args[i] + 1; *flag != '\0'; flag++)
+        {
+            switch (*flag)
+            {
+            case 'F':
+                filter.fixed = 1;
+                break;
+            case 'E':
+                extended = 1;
+                break;
+            case 'i':
+                ignore_case = 1;
+                break;
+            case 'v':
+                filter.invert = 1;
+                break;
+            case 'c':
+                filter.count_only = 1;
+                break;
+            default:
+                fprintf(stderr, "shell: filter: unknown option '-%c'\n", *flag);
+                return -1;
+            }
+        }
+    }
+
+    if (args[i] == NULL)
+    {
+        fprintf(stderr, "usage: filter [-FEivc] pattern [file...]\n");
+        return -1;
+    }
+
+    filter.pattern = args[i++];
+    filter.pattern_len = strlen(filter.pattern);
+
+    // The SIMD prefilter compares raw bytes, so it cannot ignore case.
+    if (filter.fixed && ignore_case)
+    {
+        fprintf(stderr, "shell: filter: -i with -F is not supported\n");
+        return -1;
+    }
+
+    if (!filter.fixed)
+    {
+        int cflags = REG_NOSUB | (extended ? REG_EXTENDED : 0) | (ignore_case ? REG_ICASE : 0);
+        filter.regex = regex_cache_get(filter.pattern, cflags, "filter");
+        if (filter.regex == NULL)
+        {
+            return -1;
+        }
+    }
+
+    filter_output *out = malloc(sizeof(filter_output));
+    if (out == NULL)
+    {
+        perror("malloc failed in filter");
+        return -1;
+    }
+    out->length = 0;
+    out->fd = out_fd;
+    out->error = 0;
+    out->interrupted = 0;
+
+    long selected = 0;
+    if (args[i] == NULL)
+    {
+        selected = filter_stream(&filter, in_fd, out);
+    }
+    else
+    {
+        for (; args[i] != NULL && !out->error && !out->interrupted; i++)
+        {
+            int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                fprintf(stderr, "shell: filter: %s: %s\n", args[i], strerror(errno));
+                continue;
+            }
+            long n = filter_stream(&filter, fd, out);
+            if (n > 0)
+            {
+                selected += n;
+            }
+            close(fd);
+        }
+    }
+
+    if (filter.count_only && selected >= 0 && !out->interrupted)
+    {
+        char line[32];
+        int length = snprintf(line, sizeof(line), "%ld\n", selected);
+        filter_emit(out, line, length);
+    }
+    filter_flush(out);
+    int interrupted = out->interrupted;
+    free(out);
+
+    return interrupted ? -2 : (int)selected;
+}
+
+/* ========================================================================= */
+/* UTILITY BUILT-INS                             */
+/* ========================================================================= */
+
+/**
+ * @brief Signal names understood by `kill`, without the `SIG` prefix.
+ */
+static const struct
+{
+    const char *name;
+    int number;
+} signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"ILL", SIGILL},
+    {"ABRT", SIGABRT}, {"FPE", SIGFPE},   {"KILL", SIGKILL}, {"SEGV", SIGSEGV},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"USR1", SIGUSR1},
+    {"USR2", SIGUSR2}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH}};
+
+/**
+ * @brief Set by the SIGINT handler installed while `sleep` runs.
+ */
+static volatile sig_atomic_t sleep_interrupted;
+
+/**
+ * @brief SIGINT handler used during `sleep`; it only records the signal.
+ */
+static void sleep_on_sigint(int signal_number)
+{
+    (void)signal_number;
+    sleep_interrupted = 1;
+}
+
+/**
+ * @brief Implements the `pwd` built-in.
+ *
+ * Options (`-L`, `-P`) are passed on to the external `pwd`.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int builtin_pwd(char **args)
+{
+    if (args[1] != NULL)
+    {
+        launch_process(args);
+        return last_status;
+    }
+    char *directory = getcwd(NULL, 0);
+    if (directory == NULL)
+    {
+        perror("shell: pwd");
+        return 1;
+    }
+    printf("%s\n", directory);
+    free(directory);
+    return 0;
+}
+
+/**
+ * @brief Implements the `basename` built-in.
+ *
+ * Prints the last component of a path, without trailing slashes. If a
+ * suffix is given and the component ends in it (without being equal to
+ * it), the suffix is removed as well. Options (`-a`, `-s`, `-z`) and
+ * anything but one name and a suffix are passed on to the external
+ * `basename`.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int builtin_basename(char **args)
+{
+    if (args[1] == NULL || args[1][0] == '-' || (args[2] != NULL && args[3] != NULL))
+    {
+        launch_process(args);
+        return last_status;
+    }
+
+    const char *path = args[1];
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/')
+    {
+        end--;
+    }
+    if (end == 1 && path[0] == '/')
+    {
+        printf("/\n");
+        return 0;
+    }
+
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/')
+    {
+        start--;
+    }
+
+    size_t length = end - start;
+    if (args[2] != NULL)
+    {
+        size_t suffix_length = strlen(args[2]);
+        if (suffix_length < length &&
+            memcmp(path + end - suffix_length, args[2], suffix_length) == 0)
+        {
+            length -= suffix_length;
+        }
+    }
+    printf("%.*s\n", (int)length, path + start);
+    return 0;
+}
+
+/**
+ * @brief Implements the `dirname` built-in.
+ *
+ * Prints each path with its last component removed, or `.` if the path
+ * has only one component. Options (`-z`) are passed on to the external
+ * `dirname`.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int builtin_dirname(char **args)
+{
+    if (args[1] == NULL || args[1][0] == '-')
+    {
+        launch_process(args);
+        return last_status;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        const char *path = args[i];
+        size_t end = strlen(path);
+
+        // Drop trailing slashes, then the last component, then the slashes
+        // that separated it from its parent.
+        while (end > 1 && path[end - 1] == '/')
+        {
+            end--;
+        }
+        while (end > 0 && path[end - 1] != '/')
+        {
+            end--;
+        }
+        if (end == 0)
+        {
+            printf(".\n");
+            continue;
+        }
+        while (end > 1 && path[end - 1] == '/')
+        {
+            end--;
+        }
+        printf("%.*s\n", (int)end, path);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a whole word as a decimal integer.
+ *
+ * @return 1 on success, 0 if the word is not an integer.
+ */
+static int parse_long(const char *text, long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return end != text && *end == '\0' && errno == 0;
+}
+
+/**
+ * @brief Implements the `seq` built-in.
+ *
+ * Usage: `seq [-s SEP] [FIRST [INCREMENT]] LAST`. Only integers are handled
+ * here; anything else (fractions, `-w`, `-f`) is passed on to the external
+ * `seq`. Numbers are formatted by hand into a large buffer that is written
+ * with few `write()` calls, so `seq 1 1000000` is not limited by stdio.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int builtin_seq(char **args)
+{
+    const char *separator = "\n";
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-s") == 0 && args[i + 1] != NULL)
+    {
+        separator = args[i + 1];
+        i += 2;
+    }
+
+    long numbers[3];
+    int count = 0;
+    for (; args[i] != NULL; i++)
+    {
+        if (count == 3 || !parse_long(args[i], &numbers[count]))
+        {
+            // Not a form we handle; let the real `seq` deal with it.
+            launch_process(args);
+            return last_status;
+        }
+        count++;
+    }
+    if (count == 0)
+    {
+        fprintf(stderr, "usage: seq [-s SEP] [FIRST [INCREMENT]] LAST\n");
+        return 1;
+    }
+
+    long first = (count > 1) ? numbers[0] : 1;
+    long step = (count == 3) ? numbers[1] : 1;
+    long last = numbers[count - 1];
+    if (step == 0)
+    {
+        fprintf(stderr, "shell: seq: invalid zero increment\n");
+        return 1;
+    }
+
+    filter_output *out = malloc(sizeof(filter_output));
+    if (out == NULL)
+    {
+        perror("malloc failed in seq");
+        return 1;
+    }
+    out->length = 0;
+    out->fd = STDOUT_FILENO;
+    out->error = 0;
+    fflush(stdout);
+
+    size_t separator_length = strlen(separator);
+    int emitted = 0;
+    for (long n = first; (step > 0 ? n <= last : n >= last) && !out->error; n += step)
+    {
+        if (emitted++ > 0)
+        {
+            filter_emit(out, separator, separator_length);
+        }
+
+        // Format the number backwards into a small buffer.
+        char digits[24];
+        char *p = digits + sizeof(digits);
+        unsigned long magnitude = (n < 0) ? -(unsigned long)n : (unsigned long)n;
+        do
+        {
+            *--p = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (n < 0)
+        {
+            *--p = '-';
+        }
+        filter_emit(out, p, digits + sizeof(digits) - p);
+
+        // Stop before the counter could overflow.
+        if ((step > 0 && n > LONG_MAX - step) || (step < 0 && n < LONG_MIN - step))
+        {
+            break;
+        }
+    }
+    if (emitted > 0)
+    {
+        filter_emit(out, "\n", 1);
+    }
+    filter_flush(out);
+    int status = out->error ? 1 : 0;
+    free(out);
+    return status;
+}
+
+/**
+ * @brief Implements the `sleep` built-in.
+ *
+ * Accepts one or more durations, each a number with an optional `s`, `m`,
+ * `h` or `d` suffix; they are added up. In the shell itself the sleep is a
+ * wait on the event loop for its timer or for Ctrl+C. Elsewhere (in a
+ * pipeline stage, say) SIGINT may be ignored, so for the duration of the
+ * sleep a handler is installed that merely records the signal.
+ * `clock_nanosleep()` then returns early with EINTR, and Ctrl+C ends the
+ * sleep just as it would end an external `sleep`.
+ * The deadline is absolute, so other signals do not stretch the sleep.
+ * Anything else (`infinity`, options) is passed on to the external `sleep`.
+ *
+ * @return 0 on success, 1 on error, 130 if interrupted by Ctrl+C.
+ */
+int builtin_sleep(char **args)
+{
+    if (args[1] == NULL)
+    {
+        launch_process(args);
+        return last_status;
+    }
+
+    double seconds = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char *end;
+        double value = strtod(args[i], &end);
+        double unit = 1;
+        if (*end == 'm')
+            unit = 60;
+        else if (*end == 'h')
+            unit = 3600;
+        else if (*end == 'd')
+            unit = 86400;
+        if (end == args[i] || !(value >= 0 && value < 1e9) ||
+            (*end != '\0' && (end[1] != '\0' || strchr("smhd", *end) == NULL)))
+        {
+            launch_process(args);
+            return last_status;
+        }
+        seconds += value * unit;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)seconds;
+    deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // In the shell, the event loop's timerfd and signalfd do the work.
+    int interrupted = event_sleep(&deadline);
+    if (interrupted != -1)
+    {
+        if (interrupted)
+        {
+            printf("\n");
+            return 130;
+        }
+        return 0;
+    }
+
+    // No SA_RESTART: the signal must interrupt the sleep.
+    struct sigaction action = {0};
+    struct sigaction previous;
+    action.sa_handler = sleep_on_sigint;
+    sigemptyset(&action.sa_mask);
+    sleep_interrupted = 0;
+    sigaction(SIGINT, &action, &previous);
+
+    int error;
+    do
+    {
+        error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    } while (error == EINTR && !sleep_interrupted);
+
+    sigaction(SIGINT, &previous, NULL);
+
+    if (sleep_interrupted)
+    {
+        printf("\n");
+        return 130;
+    }
+    return error == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Looks up a signal by name (with or without `SIG`) or number.
+ *
+ * @return The signal number, or -1 if it is not known.
+ */
+static int parse_signal(const char *text)
+{
+    long number;
+    if (parse_long(text, &number))
+    {
+        return (number >= 0 && number < NSIG) ? (int)number : -1;
+    }
+    if (strncasecmp(text, "SIG", 3) == 0)
+    {
+        text += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++)
+    {
+        if (strcasecmp(text, signal_names[i].name) == 0)
+        {
+            return signal_names[i].number;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Implements the `kill` built-in.
+ *
+ * Usage: `kill [-s SIGNAL | -SIGNAL] PID...` or `kill -l`. The signal
+ * defaults to SIGTERM. A negative PID after `--` signals a process group.
+ * Other options (`-l SIGNAL`, `-L`, ...) and signals not in the table are
+ * passed on to the external `kill`.
+ *
+ * @return 0 on success, 1 if any signal could not be sent.
+ */
+int builtin_kill(char **args)
+{
+    int signal_number = SIGTERM;
+    int i = 1;
+
+    if (args[i] != NULL && strcmp(args[i], "-l") == 0 && args[i + 1] == NULL)
+    {
+        for (size_t k = 0; k < sizeof(signal_names) / sizeof(signal_names[0]); k++)
+        {
+            printf("%2d) SIG%s\n", signal_names[k].number, signal_names[k].name);
+        }
+        return 0;
+    }
+
+    if (args[i] != NULL && strcmp(args[i], "-s") == 0 && args[i + 1] != NULL)
+    {
+        signal_number = parse_signal(args[i + 1]);
+        i += 2;
+    }
+    else if (args[i] != NULL && args[i][0] == '-' && strcmp(args[i], "--") != 0)
+    {
+        signal_number = parse_signal(args[i] + 1);
+        i++;
+    }
+    if (args[i] != NULL && strcmp(args[i], "--") == 0)
+    {
+        i++;
+    }
+
+    if (signal_number == -1)
+    {
+        launch_process(args);
+        return last_status;
+    }
+    if (args[i] == NULL)
+    {
+        fprintf(stderr, "usage: kill [-s SIGNAL | -SIGNAL] PID...\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (; args[i] != NULL; i++)
+    {
+        long pid;
+        if (!parse_long(args[i], &pid))
+        {
+            fprintf(stderr, "shell: kill: %s: arguments must be process IDs\n", args[i]);
+            status = 1;
+            continue;
+        }
+        if (kill((pid_t)pid, signal_number) == -1)
+        {
+            fprintf(stderr, "shell: kill: (%ld) - %s\n", pid, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Implements the `enable` built-in.
+ *
+ * @return 0 on success, 1 if a name is not a built-in.
+ */
+int builtin_enable(char **args)
+{
+    int disable = 0;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-n") == 0)
+    {
+        disable = 1;
+        i++;
+    }
+
+    if (args[i] == NULL)
+    {
+        for (int k = 0; k < (int)NUM_BUILTINS; k++)
+        {
+            if (!disable || builtin_disabled[k])
+            {
+                printf("enable %s%s\n", builtin_disabled[k] ? "-n " : "", builtin_commands[k]);
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (; args[i] != NULL; i++)
+    {
+        int found = 0;
+        for (int k = 0; k < (int)NUM_BUILTINS; k++)
+        {
+            if (strcmp(args[i], builtin_commands[k]) == 0)
+            {
+                found = 1;
+                // Disabling `enable` itself would make the change permanent.
+                if (strcmp(args[i], "enable") != 0)
+                {
+                    builtin_disabled[k] = disable;
+                }
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "shell: enable: %s: not a shell builtin\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* ========================================================================= */
+/* PAGE CACHE PREFETCH                           */
+/* ========================================================================= */
+
+/**
+ * @brief Most threads `prefetch` starts when `-j` is not given.
+ */
+#define PREFETCH_THREADS 8
+
+/**
+ * @brief How much `prefetch -l` locks into memory when `-m` is not given.
+ */
+#define PREFETCH_LOCK_LIMIT (64UL << 20)
+
+/**
+ * @brief How much of a file `prefetch` reads with each `read()`.
+ */
+#define PREFETCH_CHUNK (256UL << 10)
+
+/**
+ * @brief One file `prefetch` reads into memory, and what it found.
+ */
+typedef struct
+{
+    char *path;
+    size_t pages;     // Pages in the file.
+    size_t before;    // Pages that were already resident.
+    size_t after;     // Pages resident once the file was read.
+    char *map;        // Kept mapped for locking, otherwise NULL.
+    size_t length;
+    int error;        // errno of a failure, or 0.
+} prefetch_target;
+
+/**
+ * @brief The files of one `prefetch` run, shared by its threads.
+ */
+typedef struct
+{
+    prefetch_target *targets;
+    size_t count;
+    size_t capacity;
+    size_t next;      // The next target a thread should take.
+    int keep_mapped;  // Set for `-l`.
+} prefetch_job;
+
+/**
+ * @brief A mapping locked in memory by `prefetch -l`.
+ *
+ * Locks belong to mappings, so the mappings stay in the shell until
+ * `prefetch -u` (or the end of the shell) unlocks them.
+ */
+typedef struct
+{
+    char *map;
+    size_t length;
+} prefetch_lock;
+
+/**
+ * @brief Every mapping locked by `prefetch -l`.
+ */
+static struct
+{
+    prefetch_lock *locks;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+} prefetch_locked;
+
+/**
+ * @brief Adds a file to a prefetch job, taking ownership of `path`.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int prefetch_add(prefetch_job *job, char *path)
+{
+    if (path == NULL)
+    {
+        return -1;
+    }
+    if (job->count == job->capacity)
+    {
+        size_t capacity = job->capacity ? job->capacity * 2 : 16;
+        prefetch_target *grown = realloc(job->targets, capacity * sizeof(prefetch_target));
+        if (grown == NULL)
+        {
+            free(path);
+            return -1;
+        }
+        job->targets = grown;
+        job->capacity = capacity;
+    }
+    prefetch_target *target = &job->targets[job->count++];
+    memset(target, 0, sizeof(*target));
+    target->path = path;
+    return 0;
+}
+
+/**
+ * @brief Joins a directory and a name into a new path.
+ */
+static char *prefetch_join(const char *directory, const char *name)
+{
+    char *path;
+    if (directory[0] == '\0')
+    {
+        return strdup(name);
+    }
+    size_t length = strlen(directory);
+    const char *separator = directory[length - 1] == '/' ? "" : "/";
+    return asprintf(&path, "%s%s%s", directory, separator, name) == -1 ? NULL : path;
+}
+
+/**
+ * @brief Adds a file, or every file below a directory, to a prefetch job.
+ *
+ * Symbolic links to directories are not followed, so a link cycle cannot
+ * make the walk endless.
+ *
+ * @return 0 on success, -1 if the path does not exist.
+ */
+static int prefetch_add_tree(prefetch_job *job, const char *path, int follow)
+{
+    struct stat info;
+    if ((follow ? stat(path, &info) : lstat(path, &info)) == -1)
+    {
+        if (!follow || errno != ENOENT)
+        {
+            fprintf(stderr, "shell: prefetch: %s: %s\n", path, strerror(errno));
+        }
+        return -1;
+    }
+    if (S_ISREG(info.st_mode))
+    {
+        return prefetch_add(job, strdup(path));
+    }
+    if (S_ISLNK(info.st_mode))
+    {
+        // A link found inside a directory counts if it points to a file.
+        return (stat(path, &info) == 0 && S_ISREG(info.st_mode)) ? prefetch_add(job, strdup(path)) : 0;
+    }
+    if (!S_ISDIR(info.st_mode))
+    {
+        return 0;
+    }
+
+    DIR *directory = opendir(path);
+    if (directory == NULL)
+    {
+        fprintf(stderr, "shell: prefetch: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        char *child = prefetch_join(path, entry->d_name);
+        if (child != NULL)
+        {
+            prefetch_add_tree(job, child, 0);
+            free(child);
+        }
+    }
+    closedir(directory);
+    return 0;
+}
+
+/**
+ * @brief Compares two strings for `qsort()`.
+ */
+static int prefetch_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Expands a pathname pattern one component at a time and adds the
+ * matches to a prefetch job.
+ *
+ * Each component with wildcards is matched against a directory listing
+ * with the same compiled globs that parameter expansion uses (see
+ * `compile_glob()`); names starting with a dot only match a component that
+ * does too.
+ *
+ * @param directory The directory matched so far ("" for the start of a
+ *                  relative pattern).
+ * @param rest The rest of the pattern.
+ * @return The number of files added.
+ */
+static size_t prefetch_glob(prefetch_job *job, const char *directory, const char *rest)
+{
+    while (*rest == '/')
+    {
+        rest++;
+    }
+    if (*rest == '\0')
+    {
+        size_t before = job->count;
+        prefetch_add_tree(job, directory, 1);
+        return job->count - before;
+    }
+
+    size_t length = strcspn(rest, "/");
+    char *component = strndup(rest, length);
+    if (component == NULL)
+    {
+        return 0;
+    }
+    size_t count = 0;
+    if (strpbrk(component, "*?[") == NULL)
+    {
+        char *path = prefetch_join(directory, component);
+        if (path != NULL && access(path, F_OK) == 0)
+        {
+            count = prefetch_glob(job, path, rest + length);
+        }
+        free(path);
+        free(component);
+        return count;
+    }
+
+    // Collect the matches before descending: the recursion compiles other
+    // globs, which may take this one's slot in the glob cache.
+    DIR *listing = opendir(directory[0] ? directory : ".");
+    char **names = NULL;
+    size_t name_count = 0;
+    size_t name_capacity = 0;
+    compiled_glob *glob = listing ? compile_glob(component, length) : NULL;
+    struct dirent *entry;
+    while (glob != NULL && (entry = readdir(listing)) != NULL)
+    {
+        if ((entry->d_name[0] == '.' && component[0] != '.') ||
+            !glob_match(glob, entry->d_name, strlen(entry->d_name)))
+        {
+            continue;
+        }
+        if (name_count == name_capacity)
+        {
+            name_capacity = name_capacity ? name_capacity * 2 : 16;
+            char **grown = realloc(names, name_capacity * sizeof(char *));
+            if (grown == NULL)
+            {
+                break;
+            }
+            names = grown;
+        }
+        names[name_count] = strdup(entry->d_name);
+        name_count += names[name_count] != NULL;
+    }
+    if (listing != NULL)
+    {
+        closedir(listing);
+    }
+
+    qsort(names, name_count, sizeof(char *), prefetch_compare);
+    for (size_t i = 0; i < name_count; i++)
+    {
+        char *path = prefetch_join(directory, names[i]);
+        if (path != NULL)
+        {
+            count += prefetch_glob(job, path, rest + length);
+        }
+        free(path);
+        free(names[i]);
+    }
+    free(names);
+    free(component);
+    return count;
+}
+
+/**
+ * @brief Adds the programs a script runs to a prefetch job.
+ *
+ * The script comes from the script cache (so a later `source` of it does
+ * not read it again), and each command name, including every stage of a
+ * pipeline, is looked up through the command hash table. Commands with
+ * expansions are only known when they run, so they are skipped.
+ *
+ * @return 0 on success, -1 if the script cannot be read.
+ */
+static int prefetch_add_script(prefetch_job *job, const char *path)
+{
+    script_cache_entry scratch = {0};
+    script_cache_entry *entry = script_load(path, &scratch);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < entry->count; i++)
+    {
+        char **args = entry->commands[i].args;
+        for (size_t k = 0; args != NULL && args[k] != NULL; k++)
+        {
+            if (k > 0 && (strcmp(args[k - 1], "|") != 0 || !word_is_unquoted(args[k - 1], 1)))
+            {
+                continue;
+            }
+            const char *program = is_builtin(args[k]) ? NULL : command_path(args[k]);
+            if (program == NULL && strchr(args[k], '/') != NULL && access(args[k], X_OK) == 0)
+            {
+                program = args[k];
+            }
+            int seen = 0;
+            for (size_t j = 0; program != NULL && j < job->count && !seen; j++)
+            {
+                seen = strcmp(job->targets[j].path, program) == 0;
+            }
+            if (program != NULL && !seen)
+            {
+                prefetch_add(job, strdup(program));
+            }
+        }
+    }
+    if (entry == &scratch)
+    {
+        script_free(&scratch);
+    }
+    return 0;
+}
+
+/**
+ * @brief Counts the resident pages of a mapping with `mincore()`.
+ */
+static size_t prefetch_resident(char *map, size_t length, size_t pages, unsigned char *vector)
+{
+    if (mincore(map, length, vector) == -1)
+    {
+        return 0;
+    }
+    size_t resident = 0;
+    for (size_t i = 0; i < pages; i++)
+    {
+        resident += vector[i] & 1;
+    }
+    return resident;
+}
+
+/**
+ * @brief Reads one file into the page cache and measures its residency
+ * before and after.
+ *
+ * The file is read through to the end, so the "after" figure is what
+ * actually made it into memory; the kernel's readahead keeps the disk busy
+ * ahead of the reads. They go through the descriptor rather than by
+ * touching the mapping, which is only looked at: a page past the end of a
+ * file truncated meanwhile would raise SIGBUS, where `read()` just stops
+ * early.
+ */
+static void prefetch_one(prefetch_target *target, long page_size, int keep_mapped)
+{
+    int fd = open(target->path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        target->error = errno;
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    target->length = info.st_size;
+    target->pages = (target->length + page_size - 1) / page_size;
+    if (target->length == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    char *map = mmap(NULL, target->length, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *vector = malloc(target->pages);
+    size_t chunk = target->length < PREFETCH_CHUNK ? target->length : PREFETCH_CHUNK;
+    char *buffer = malloc(chunk);
+    if (map == MAP_FAILED || vector == NULL || buffer == NULL)
+    {
+        target->error = (map == MAP_FAILED) ? errno : ENOMEM;
+        if (map != MAP_FAILED)
+        {
+            munmap(map, target->length);
+        }
+        free(vector);
+        free(buffer);
+        close(fd);
+        return;
+    }
+
+    target->before = prefetch_resident(map, target->length, target->pages, vector);
+    if (target->before < target->pages)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        while (read(fd, buffer, chunk) > 0)
+        {
+        }
+    }
+    target->after = prefetch_resident(map, target->length, target->pages, vector);
+    close(fd);
+    free(buffer);
+    free(vector);
+
+    if (keep_mapped)
+    {
+        target->map = map;
+    }
+    else
+    {
+        munmap(map, target->length);
+    }
+}
+
+/**
+ * @brief Thread body: takes files off the job until none are left.
+ */
+static void *prefetch_worker(void *arg)
+{
+    prefetch_job *job = arg;
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count)
+        {
+            return NULL;
+        }
+        prefetch_one(&job->targets[i], page_size, job->keep_mapped);
+    }
+}
+
+/**
+ * @brief Unlocks and unmaps everything `prefetch -l` locked.
+ */
+static void prefetch_unlock_all(void)
+{
+    for (size_t i = 0; i < prefetch_locked.count; i++)
+    {
+        munlock(prefetch_locked.locks[i].map, prefetch_locked.locks[i].length);
+        munmap(prefetch_locked.locks[i].map, prefetch_locked.locks[i].length);
+    }
+    free(prefetch_locked.locks);
+    memset(&prefetch_locked, 0, sizeof(prefetch_locked));
+}
+
+/**
+ * @brief Parses a size such as `512K`, `64M` or `2G`.
+ *
+ * @return 0 on success, -1 if the text is not a size.
+ */
+static int prefetch_parse_size(const char *text, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    int shift = 0;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-' || value > (SIZE_MAX >> shift))
+    {
+        return -1;
+    }
+    *size = (size_t)value << shift;
+    return 0;
+}
+
+/**
+ * @brief Prints a number of pages as a percentage of a total.
+ */
+static void prefetch_report(const char *label, size_t pages, size_t total, long page_size)
+{
+    printf("%-14s %10.1f MiB  %5.1f%%\n", label, (double)pages * page_size / (1 << 20),
+           total ? 100.0 * pages / total : 100.0);
+}
+
+/**
+ * @brief Implements the `prefetch` built-in.
+ *
+ * `prefetch [-l] [-m SIZE] [-j THREADS] [-v] [-s SCRIPT]... TARGET...`
+ * reads files into the page cache ahead of the commands that need them.
+ * A TARGET is a file, a directory (read recursively), a pathname pattern
+ * (`*`, `?` and `[...]` in any component), or a command name, which is
+ * looked up in `PATH`.
+ * `-s SCRIPT` adds the programs a script runs. The files are read by
+ * several threads at once, and the number of their pages that were
+ * resident before and after is reported, as `mincore()` sees it.
+ *
+ * `-l` also locks the files in memory, up to `-m SIZE` in all (64M by
+ * default, and never more than `RLIMIT_MEMLOCK` allows); `prefetch -u`
+ * unlocks them. `-v` reports each file.
+ *
+ * @return 0 on success, 1 if a file could not be read, 2 on usage errors.
+ */
+int builtin_prefetch(char **args)
+{
+    prefetch_job job = {0};
+    int lock = 0;
+    int verbose = 0;
+    int threads = 0;
+    long count;
+    size_t limit = PREFETCH_LOCK_LIMIT;
+    int status = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        const char *option = args[i];
+        if (strcmp(option, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(option, "-l") == 0)
+        {
+            lock = 1;
+        }
+        else if (strcmp(option, "-v") == 0)
+        {
+            verbose = 1;
+        }
+        else if (strcmp(option, "-u") == 0)
+        {
+            printf("unlocked %.1f MiB in %zu files\n", (double)prefetch_locked.bytes / (1 << 20),
+                   prefetch_locked.count);
+            prefetch_unlock_all();
+        }
+        else if (args[i + 1] != NULL && strcmp(option, "-j") == 0 && parse_long(args[i + 1], &count) &&
+                 count >= 1 && count <= INT_MAX)
+        {
+            threads = (int)count;
+            i++;
+        }
+        else if (args[i + 1] != NULL && strcmp(option, "-m") == 0 && prefetch_parse_size(args[i + 1], &limit) == 0)
+        {
+            i++;
+        }
+        else if (args[i + 1] != NULL && strcmp(option, "-s") == 0)
+        {
+            if (prefetch_add_script(&job, args[++i]) == -1)
+            {
+                status = 1;
+            }
+        }
+        else
+        {
+            if (args[i + 1] != NULL && strcmp(option, "-j") == 0)
+            {
+                fprintf(stderr, "shell: prefetch: invalid thread count '%s'\n", args[i + 1]);
+            }
+            fprintf(stderr, "usage: prefetch [-luv] [-m SIZE] [-j THREADS] [-s SCRIPT]... [FILE|PATTERN|COMMAND]...\n");
+            for (size_t k = 0; k < job.count; k++)
+            {
+                free(job.targets[k].path);
+            }
+            free(job.targets);
+            return 2;
+        }
+    }
+
+    for (; args[i] != NULL; i++)
+    {
+        const char *target = args[i];
+        if (strpbrk(target, "*?[") != NULL)
+        {
+            if (prefetch_glob(&job, target[0] == '/' ? "/" : "", target) == 0)
+            {
+                fprintf(stderr, "shell: prefetch: %s: no matches\n", target);
+                status = 1;
+            }
+        }
+        else if (prefetch_add_tree(&job, target, 1) == -1)
+        {
+            // Not a file here: try it as a command name.
+            const char *program = strchr(target, '/') == NULL ? command_path(target) : NULL;
+            if (program == NULL || prefetch_add(&job, strdup(program)) == -1)
+            {
+                fprintf(stderr, "shell: prefetch: %s: %s\n", target,
+                        strchr(target, '/') ? strerror(ENOENT) : "not found");
+                status = 1;
+            }
+        }
+    }
+    if (job.count == 0)
+    {
+        free(job.targets);
+        return status;
+    }
+
+    // Read the files in parallel; the shell's own thread takes a share too.
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > PREFETCH_THREADS ? PREFETCH_THREADS : (cpus > 0 ? cpus : 1);
+    }
+    if ((size_t)threads > job.count)
+    {
+        threads = job.count;
+    }
+    job.keep_mapped = lock;
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    while (workers != NULL && started < threads - 1 &&
+           pthread_create(&workers[started], NULL, prefetch_worker, &job) == 0)
+    {
+        started++;
+    }
+    prefetch_worker(&job);
+    for (int k = 0; k < started; k++)
+    {
+        pthread_join(workers[k], NULL);
+    }
+    free(workers);
+
+    // Lock in the order given until the limit is reached.
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t pages = 0;
+    size_t before = 0;
+    size_t after = 0;
+    size_t locked = 0;
+    for (size_t k = 0; k < job.count; k++)
+    {
+        prefetch_target *target = &job.targets[k];
+        if (target->map != NULL)
+        {
+            size_t bytes = target->pages * page_size;
+            int fits = prefetch_locked.bytes + bytes <= limit;
+            prefetch_lock *grown = NULL;
+            if (fits && prefetch_locked.count == prefetch_locked.capacity)
+            {
+                size_t capacity = prefetch_locked.capacity ? prefetch_locked.capacity * 2 : 16;
+                grown = realloc(prefetch_locked.locks, capacity * sizeof(prefetch_lock));
+                if (grown != NULL)
+                {
+                    prefetch_locked.locks = grown;
+                    prefetch_locked.capacity = capacity;
+                }
+            }
+            if (fits && prefetch_locked.count < prefetch_locked.capacity &&
+                mlock(target->map, target->length) == 0)
+            {
+                prefetch_locked.locks[prefetch_locked.count++] = (prefetch_lock){target->map, target->length};
+                prefetch_locked.bytes += bytes;
+                locked += bytes;
+            }
+            else
+            {
+                if (fits)
+                {
+                    fprintf(stderr, "shell: prefetch: cannot lock %s: %s\n", target->path, strerror(errno));
+                }
+                munmap(target->map, target->length);
+            }
+        }
+        if (target->error != 0)
+        {
+            fprintf(stderr, "shell: prefetch: %s: %s\n", target->path, strerror(target->error));
+            status = 1;
+        }
+        else if (verbose)
+        {
+            printf("%5.1f%% -> %5.1f%%  %s\n", target->pages ? 100.0 * target->before / target->pages : 100.0,
+                   target->pages ? 100.0 * target->after / target->pages : 100.0, target->path);
+        }
+        pages += target->pages;
+        before += target->before;
+        after += target->after;
+        free(target->path);
+    }
+
+    printf("%-14s %10zu files, %.1f MiB\n", "prefetch", job.count, (double)pages * page_size / (1 << 20));
+    prefetch_report("cached before", before, pages, page_size);
+    prefetch_report("cached after", after, pages, page_size);
+    if (lock)
+    {
+        printf("%-14s %10.1f MiB (%.1f MiB in all, limit %.1f MiB)\n", "locked", (double)locked / (1 << 20),
+               (double)prefetch_locked.bytes / (1 << 20), (double)limit / (1 << 20));
+    }
+    free(job.targets);
+    return status;
+}
+
+/* ========================================================================= */
+/* BULK COPY (cp AND mv)                         */
+/* ========================================================================= */
+
+/*
+ * `cp` and `mv` are built in because copying a tree of many small files
+ * with the external `cp` spends most of its time waiting on one system call
+ * after another: open, stat, create, read, write, close, for every file in
+ * turn. The built-in first walks the source tree (creating directories as
+ * it goes), then copies the files many at a time through io_uring. Each
+ * small file takes two trips through the ring, and one `io_uring_enter()`
+ * carries the trips of all the files in flight:
+ *
+ *     statx + (open, read, close source)  ->  (create, write, close target)
+ *
+ * Files larger than COPY_BUFFER_SIZE are copied by a pool of `CP_THREADS`
+ * threads with `copy_file_range()` instead, and so is everything where
+ * io_uring is not available (old kernels, seccomp filters) or with
+ * `CP_QUEUE_DEPTH=0`. Options the built-ins do not know (such as `-a` or
+ * `-p`) make them run the external program.
+ */
+
+/**
+ * @brief Files the io_uring engine copies at once when `CP_QUEUE_DEPTH` is
+ * not set.
+ */
+#define COPY_QUEUE_DEPTH 32
+
+/**
+ * @brief Size of each io_uring slot's buffer, and so the largest file the
+ * io_uring engine copies.
+ *
+ * Going through the ring means reading every byte into the shell and
+ * writing it out again, which only pays for small files; the kernel copies
+ * large ones faster by itself, with `copy_file_range()`.
+ */
+#define COPY_BUFFER_SIZE (128 * 1024)
+
+/**
+ * @brief One file to copy.
+ */
+typedef struct
+{
+    char *source;
+    char *target;
+    int large;   // Set by the io_uring engine for files it leaves to threads.
+} copy_file;
+
+/**
+ * @brief A directory whose final mode is set once its contents are copied.
+ *
+ * Directories are created writable by the owner, so that a read-only
+ * directory can still be filled.
+ */
+typedef struct
+{
+    char *path;
+    mode_t mode;
+} copy_directory;
+
+/**
+ * @brief Everything one `cp` or one cross-filesystem `mv` copies.
+ */
+typedef struct
+{
+    const char *name;           // "cp" or "mv", for messages.
+    copy_file *files;
+    size_t count;
+    size_t capacity;
+    copy_directory *directories;
+    size_t directory_count;
+    size_t directory_capacity;
+    size_t next;                // The next file a thread should take.
+    int large_only;             // Threads copy only files marked large.
+    int errors;
+    dev_t top_device;           // The target directory being filled, so
+    ino_t top_inode;            // that `cp -r a a/b` does not recurse forever.
+} copy_job;
+
+/**
+ * @brief Reports a copy error and counts it (from any thread).
+ */
+static void copy_error(copy_job *job, const char *path, int error)
+{
+    fprintf(stderr, "shell: %s: %s: %s\n", job->name, path, strerror(error));
+    __atomic_fetch_add(&job->errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds a file to a copy job, taking ownership of both paths.
+ */
+static void copy_add(copy_job *job, char *source, char *target)
+{
+    if (source != NULL && target != NULL && job->count == job->capacity)
+    {
+        size_t capacity = job->capacity ? job->capacity * 2 : 64;
+        copy_file *grown = realloc(job->files, capacity * sizeof(copy_file));
+        if (grown != NULL)
+        {
+            job->files = grown;
+            job->capacity = capacity;
+        }
+    }
+    if (source == NULL || target == NULL || job->count == job->capacity)
+    {
+        copy_error(job, source ? source : "copy", ENOMEM);
+        free(source);
+        free(target);
+        return;
+    }
+    job->files[job->count++] = (copy_file){source, target, 0};
+}
+
+/**
+ * @brief Adds a source path (file, symbolic link or directory tree) to a
+ * copy job.
+ *
+ * Directories are created and symbolic links recreated right away; regular
+ * files are only listed, to be copied by `copy_run()`. Inside a directory
+ * the entry type from `readdir()` is trusted, so the walk does not `stat()`
+ * the files themselves.
+ *
+ * @param type The `d_type` of the entry, or DT_UNKNOWN to look it up.
+ * @param follow Non-zero to follow a symbolic link (for `cp` without `-r`).
+ */
+static void copy_plan(copy_job *job, const char *source, const char *target, unsigned char type,
+                      int recursive, int follow)
+{
+    struct stat info;
+    if (type == DT_UNKNOWN || type == DT_DIR)
+    {
+        if ((follow ? stat(source, &info) : lstat(source, &info)) == -1)
+        {
+            copy_error(job, source, errno);
+            return;
+        }
+        type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISLNK(info.st_mode) ? DT_LNK : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    if (type == DT_REG)
+    {
+        copy_add(job, strdup(source), strdup(target));
+    }
+    else if (type == DT_LNK)
+    {
+        char link[PATH_MAX];
+        ssize_t length = readlink(source, link, sizeof(link) - 1);
+        if (length == -1)
+        {
+            copy_error(job, source, errno);
+            return;
+        }
+        link[length] = '\0';
+        unlink(target);
+        if (symlink(link, target) == -1)
+        {
+            copy_error(job, target, errno);
+        }
+    }
+    else if (type == DT_DIR)
+    {
+        if (!recursive)
+        {
+            fprintf(stderr, "shell: %s: -r not specified; omitting directory '%s'\n", job->name, source);
+            job->errors++;
+            return;
+        }
+        if (info.st_dev == job->top_device && info.st_ino == job->top_inode)
+        {
+            fprintf(stderr, "shell: %s: cannot copy a directory, '%s', into itself\n", job->name, source);
+            job->errors++;
+            return;
+        }
+        if (mkdir(target, (info.st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST)
+        {
+            copy_error(job, target, errno);
+            return;
+        }
+        if (job->top_inode == 0)
+        {
+            struct stat created;
+            if (stat(target, &created) == 0)
+            {
+                job->top_device = created.st_dev;
+                job->top_inode = created.st_ino;
+            }
+        }
+        if ((info.st_mode & S_IRWXU) != S_IRWXU && job->directory_count == job->directory_capacity)
+        {
+            size_t capacity = job->directory_capacity ? job->directory_capacity * 2 : 16;
+            copy_directory *grown = realloc(job->directories, capacity * sizeof(copy_directory));
+            if (grown != NULL)
+            {
+                job->directories = grown;
+                job->directory_capacity = capacity;
+            }
+        }
+        if ((info.st_mode & S_IRWXU) != S_IRWXU && job->directory_count < job->directory_capacity)
+        {
+            job->directories[job->directory_count++] = (copy_directory){strdup(target), info.st_mode & 07777};
+        }
+
+        DIR *directory = opendir(source);
+        if (directory == NULL)
+        {
+            copy_error(job, source, errno);
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            {
+                continue;
+            }
+            char *child_source = prefetch_join(source, entry->d_name);
+            char *child_target = prefetch_join(target, entry->d_name);
+            if (child_source != NULL && child_target != NULL)
+            {
+                copy_plan(job, child_source, child_target, entry->d_type, recursive, 0);
+            }
+            free(child_source);
+            free(child_target);
+        }
+        closedir(directory);
+    }
+    else
+    {
+        fprintf(stderr, "shell: %s: %s: not a regular file or directory\n", job->name, source);
+        job->errors++;
+    }
+}
+
+/**
+ * @brief A minimal io_uring: the mapped submission and completion rings.
+ *
+ * The shell talks to the kernel with the raw system calls, so it does not
+ * depend on liburing.
+ */
+typedef struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_length;
+    void *cq_map;
+    size_t cq_map_length;
+    size_t sqes_length;
+    unsigned queued;   // Entries added since the last `io_uring_enter()`.
+} uring;
+
+/**
+ * @brief Releases an io_uring set up by `uring_setup()`.
+ */
+static void uring_close(uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_length);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    {
+        munmap(ring->cq_map, ring->cq_map_length);
+    }
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+    {
+        munmap(ring->sq_map, ring->sq_map_length);
+    }
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+    }
+}
+
+/**
+ * @brief Creates an io_uring with room for `entries` submissions.
+ *
+ * @return 0 on success, -1 if io_uring is not available.
+ */
+static int uring_setup(uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+    {
+        return -1;
+    }
+
+    ring->sq_map_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_length > ring->sq_map_length)
+    {
+        ring->sq_map_length = ring->cq_map_length;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map
+                          : mmap(NULL, ring->cq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        uring_close(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Takes the next free submission entry, cleared, for one operation.
+ *
+ * The ring is sized so that it cannot fill up between two calls of
+ * `uring_submit()`.
+ */
+static struct io_uring_sqe *uring_sqe(uring *ring, int opcode, int fd, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+/**
+ * @brief Submits the queued entries and waits for at least one completion.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int uring_submit(uring *ring)
+{
+    for (;;)
+    {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0)
+        {
+            ring->queued -= n;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief What each operation of a file's chains is, kept in the low bits of
+ * its user data (the slot number is in the bits above).
+ */
+enum
+{
+    COPY_STATX,  // Reading the source's mode and size.
+    COPY_OPEN,   // Opening the source, or creating the target.
+    COPY_DATA,   // Reading the source, or writing the target.
+    COPY_CLOSE,  // Closing the file.
+    COPY_OPS = 4
+};
+
+/**
+ * @brief One file being copied by the io_uring engine.
+ */
+typedef struct
+{
+    size_t file;
+    int writing;          // 0 while reading the source, 1 while writing the target.
+    int pending;          // Operations in flight.
+    int result[COPY_OPS]; // What each operation of the current chain returned.
+    struct statx info;
+    char *buffer;
+} copy_slot;
+
+/**
+ * @brief Queues one chain: open a file into the slot's direct descriptor,
+ * read or write the buffer, close the file.
+ *
+ * The operations are hard-linked, so they run in order but a failure does
+ * not cancel the rest; in particular the close always runs. Direct
+ * descriptors are never in the process's file table, so `O_CLOEXEC` is
+ * neither needed nor allowed.
+ */
+static void copy_slot_chain(uring *ring, copy_slot *slot, int index, const char *path, int flags, mode_t mode,
+                            int opcode, unsigned length)
+{
+    uint64_t tag = (uint64_t)index * COPY_OPS;
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, tag + COPY_OPEN);
+    sqe->addr = (uintptr_t)path;
+    sqe->open_flags = flags;
+    sqe->len = mode;
+    sqe->file_index = index + 1;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = uring_sqe(ring, opcode, index, tag + COPY_DATA);
+    sqe->addr = (uintptr_t)slot->buffer;
+    sqe->len = length;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    // With `file_index` the kernel wants the descriptor left at 0; the
+    // ring is only used once `uring_direct_supported()` has shown that it
+    // will not be read as standard input.
+    sqe = uring_sqe(ring, IORING_OP_CLOSE, 0, tag + COPY_CLOSE);
+    sqe->file_index = index + 1;
+    slot->pending += 3;
+}
+
+/**
+ * @brief Starts copying the next file of the job in a slot: reads its
+ * status and, in parallel, its contents.
+ */
+static void copy_slot_start(uring *ring, copy_job *job, copy_slot *slot, int index)
+{
+    slot->file = job->next++;
+    slot->writing = 0;
+    slot->pending = 0;
+    const char *source = job->files[slot->file].source;
+
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_STATX, AT_FDCWD, (uint64_t)index * COPY_OPS + COPY_STATX);
+    sqe->addr = (uintptr_t)source;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE;
+    sqe->off = (uintptr_t)&slot->info;
+    slot->pending++;
+    copy_slot_chain(ring, slot, index, source, O_RDONLY, 0, IORING_OP_READ, COPY_BUFFER_SIZE);
+}
+
+/**
+ * @brief Handles a slot whose chains have all completed.
+ *
+ * After the source has been read, the target is written; after that the
+ * file is done. A file that did not fit in the buffer is left to the
+ * threads (see `copy_run()`).
+ *
+ * @return 1 if the slot is free for the next file, 0 if it is still busy.
+ */
+static int copy_slot_finish(uring *ring, copy_job *job, copy_slot *slot, int index)
+{
+    copy_file *file = &job->files[slot->file];
+    const int *result = slot->result;
+    if (!slot->writing)
+    {
+        int error = result[COPY_STATX] < 0 ? -result[COPY_STATX]
+                  : result[COPY_OPEN] < 0  ? -result[COPY_OPEN]
+                  : result[COPY_DATA] < 0  ? -result[COPY_DATA]
+                  : !S_ISREG(slot->info.stx_mode) ? EINVAL : 0;
+        if (error != 0)
+        {
+            copy_error(job, file->source, error);
+            return 1;
+        }
+        if (slot->info.stx_size > COPY_BUFFER_SIZE || result[COPY_DATA] == COPY_BUFFER_SIZE)
+        {
+            file->large = 1;
+            job->large_only = 1;
+            return 1;
+        }
+        slot->writing = 1;
+        copy_slot_chain(ring, slot, index, file->target, O_WRONLY | O_CREAT | O_TRUNC,
+                        slot->info.stx_mode & 07777, IORING_OP_WRITE, result[COPY_DATA]);
+        // The write must cover what was read; remember how much that was.
+        slot->result[COPY_STATX] = result[COPY_DATA];
+        return 0;
+    }
+
+    int error = result[COPY_OPEN] < 0    ? -result[COPY_OPEN]
+              : result[COPY_DATA] < 0    ? -result[COPY_DATA]
+              : result[COPY_DATA] != result[COPY_STATX] ? EIO
+              : result[COPY_CLOSE] < 0   ? -result[COPY_CLOSE] : 0;
+    if (error != 0)
+    {
+        copy_error(job, file->target, error);
+    }
+    return 1;
+}
+
+/**
+ * @brief Takes the result of the one operation in flight on a ring.
+ *
+ * @return The operation's result, or -errno if the ring failed.
+ */
+static int uring_wait_one(uring *ring)
+{
+    if (uring_submit(ring) == -1)
+    {
+        return -errno;
+    }
+    unsigned head = *ring->cq_head;
+    int result = ring->cqes[head & ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+/**
+ * @brief Checks that the kernel can do what the copy engine asks of a ring
+ * whose table of direct descriptors is registered.
+ *
+ * Opening and closing direct descriptors (`file_index`) came in Linux
+ * 5.15, after the operations themselves. An older kernel ignores the
+ * field: it hands back ordinary descriptors, fails every read through the
+ * table, and takes the close's descriptor 0 for standard input. So the
+ * probe first asks which operations are supported and then opens `/` into
+ * the first slot, which must come back as 0 rather than a descriptor; only
+ * then is a close by `file_index` queued.
+ *
+ * @return 1 if direct descriptors work, 0 if not.
+ */
+static int uring_direct_supported(uring *ring)
+{
+    static const int needed[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+                                 IORING_OP_CLOSE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+    {
+        free(probe);
+        return 0;
+    }
+    int supported = 1;
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++)
+    {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            supported = 0;
+        }
+    }
+    free(probe);
+    if (!supported)
+    {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, 0);
+    sqe->addr = (uintptr_t)"/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    int result = uring_wait_one(ring);
+    if (result > 0)
+    {
+        // An ordinary descriptor: `file_index` was ignored.
+        close(result);
+        return 0;
+    }
+    if (result < 0)
+    {
+        return 0;
+    }
+    sqe = uring_sqe(ring, IORING_OP_CLOSE, 0, 0);
+    sqe->file_index = 1;
+    return uring_wait_one(ring) == 0;
+}
+
+/**
+ * @brief Copies the files of a job through io_uring, `depth` at a time.
+ *
+ * Each file takes two rounds through the ring. First its status is read,
+ * and in parallel a chain opens it, reads it into the slot's buffer and
+ * closes it; then a second chain creates the target, writes the buffer and
+ * closes it. The files are opened as io_uring direct descriptors (one per
+ * slot and chain), which is what lets the read in a chain use the file the
+ * open in the same chain has not returned yet; kernels without them are
+ * found out by `uring_direct_supported()` before anything is queued.
+ * Files that turn out not to fit in the buffer are only marked `large`,
+ * for the threads.
+ *
+ * @return 0 when done, -1 if io_uring (or its direct descriptors) is not
+ *         available, in which case nothing was copied.
+ */
+static int copy_with_uring(copy_job *job, int depth)
+{
+    uring ring;
+    if ((size_t)depth > job->count)
+    {
+        depth = job->count;
+    }
+    unsigned entries = 1;
+    while (entries < COPY_OPS * (unsigned)depth)
+    {
+        entries *= 2;
+    }
+    copy_slot *slots = calloc(depth, sizeof(copy_slot));
+    char *buffers = malloc((size_t)depth * COPY_BUFFER_SIZE);
+    int *descriptors = malloc(depth * sizeof(int));
+    if (slots == NULL || buffers == NULL || descriptors == NULL || uring_setup(&ring, entries) == -1)
+    {
+        free(slots);
+        free(buffers);
+        free(descriptors);
+        return -1;
+    }
+    // An empty table of direct descriptors: one per slot.
+    for (int i = 0; i < depth; i++)
+    {
+        descriptors[i] = -1;
+    }
+    int registered = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, descriptors, depth);
+    free(descriptors);
+    if (registered == -1 || !uring_direct_supported(&ring))
+    {
+        uring_close(&ring);
+        free(slots);
+        free(buffers);
+        return -1;
+    }
+
+    int active = 0;
+    for (int i = 0; i < depth; i++)
+    {
+        slots[i].buffer = buffers + (size_t)i * COPY_BUFFER_SIZE;
+        if (job->next < job->count)
+        {
+            copy_slot_start(&ring, job, &slots[i], i);
+            active++;
+        }
+    }
+
+    while (active > 0)
+    {
+        if (uring_submit(&ring) == -1)
+        {
+            copy_error(job, "io_uring", errno);
+            break;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            int i = cqe->user_data / COPY_OPS;
+            copy_slot *slot = &slots[i];
+            slot->result[cqe->user_data % COPY_OPS] = cqe->res;
+            if (--slot->pending == 0 && copy_slot_finish(&ring, job, slot, i))
+            {
+                active--;
+                if (job->next < job->count)
+                {
+                    copy_slot_start(&ring, job, slot, i);
+                    active++;
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_close(&ring);
+    free(buffers);
+    free(slots);
+    return 0;
+}
+
+/**
+ * @brief Copies one file with ordinary system calls.
+ *
+ * `copy_file_range()` lets the kernel copy without the data passing
+ * through the shell (and share extents on filesystems that can); where it
+ * is not supported, a plain read and write loop does the job.
+ */
+static void copy_one(copy_job *job, const copy_file *file)
+{
+    int in = open(file->source, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (in == -1 || fstat(in, &info) == -1)
+    {
+        copy_error(job, file->source, errno);
+        if (in != -1)
+        {
+            close(in);
+        }
+        return;
+    }
+    int out = open(file->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777);
+    if (out == -1)
+    {
+        copy_error(job, file->target, errno);
+        close(in);
+        return;
+    }
+
+    int use_range = 1;
+    for (;;)
+    {
+        ssize_t n = use_range ? copy_file_range(in, NULL, out, NULL, 1 << 30, 0) : -1;
+        if (n == -1 && use_range && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            use_range = 0;
+        }
+        if (!use_range)
+        {
+            char buffer[65536];
+            n = read(in, buffer, sizeof(buffer));
+            if (n > 0 && write_all(out, buffer, n) == -1)
+            {
+                copy_error(job, file->target, errno);
+                break;
+            }
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n == -1)
+            {
+                copy_error(job, file->source, errno);
+            }
+            break;
+        }
+    }
+    close(in);
+    if (close(out) == -1)
+    {
+        copy_error(job, file->target, errno);
+    }
+}
+
+/**
+ * @brief Thread body of the fallback engine: copies files until none are
+ * left.
+ */
+static void *copy_worker(void *arg)
+{
+    copy_job *job = arg;
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count)
+        {
+            return NULL;
+        }
+        if (!job->large_only || job->files[i].large)
+        {
+            copy_one(job, &job->files[i]);
+        }
+    }
+}
+
+/**
+ * @brief Reads a positive number from a shell variable.
+ *
+ * @return The number, `fallback` if the variable is unset, or -1 if it is
+ *         not a number.
+ */
+static long copy_setting(const char *name, long fallback)
+{
+    size_t length;
+    const char *value = get_variable(name, strlen(name), &length);
+    long number;
+    if (value == NULL || value[0] == '\0')
+    {
+        return fallback;
+    }
+    return parse_long(value, &number) && number >= 0 ? number : -1;
+}
+
+/**
+ * @brief Copies the listed files of a job, then gives directories their
+ * final modes, and frees the job.
+ *
+ * @return The number of errors, including those found while planning.
+ */
+static int copy_run(copy_job *job)
+{
+    long depth = copy_setting("CP_QUEUE_DEPTH", COPY_QUEUE_DEPTH);
+    long threads = copy_setting("CP_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+    if (depth < 0 || threads < 0)
+    {
+        fprintf(stderr, "shell: %s: CP_QUEUE_DEPTH and CP_THREADS must be numbers\n", job->name);
+        depth = COPY_QUEUE_DEPTH;
+        threads = 1;
+    }
+
+    int uring = job->count > 0 && depth > 0 && copy_with_uring(job, depth > 4096 ? 4096 : depth) == 0;
+    if (job->count > 0 && (!uring || job->large_only))
+    {
+        // Without io_uring the threads copy everything; after it, only the
+        // large files the ring passed over.
+        job->next = 0;
+        if (threads < 1)
+        {
+            threads = 1;
+        }
+        if ((size_t)threads > job->count)
+        {
+            threads = job->count;
+        }
+        pthread_t *workers = calloc(threads, sizeof(pthread_t));
+        int started = 0;
+        while (workers != NULL && started < threads - 1 &&
+               pthread_create(&workers[started], NULL, copy_worker, job) == 0)
+        {
+            started++;
+        }
+        copy_worker(job);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+    }
+
+    // Deepest directories were listed last; restore modes from the inside out.
+    for (size_t i = job->directory_count; i-- > 0;)
+    {
+        if (job->directories[i].path != NULL && chmod(job->directories[i].path, job->directories[i].mode) == -1)
+        {
+            copy_error(job, job->directories[i].path, errno);
+        }
+        free(job->directories[i].path);
+    }
+    for (size_t i = 0; i < job->count; i++)
+    {
+        free(job->files[i].source);
+        free(job->files[i].target);
+    }
+    free(job->files);
+    free(job->directories);
+    int errors = job->errors;
+    memset(job, 0, sizeof(*job));
+    return errors;
+}
+
+/**
+ * @brief Works out where a source goes: into `destination` if that is a
+ * directory, otherwise to `destination` itself.
+ *
+ * @return The target path (to be freed), or NULL on allocation failure.
+ */
+static char *copy_target(const char *source, const char *destination, int into)
+{
+    if (!into)
+    {
+        return strdup(destination);
+    }
+    // The last component of the source, ignoring trailing slashes.
+    size_t end = strlen(source);
+    while (end > 1 && source[end - 1] == '/')
+    {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && source[start - 1] != '/')
+    {
+        start--;
+    }
+    char *name = strndup(source + start, end - start);
+    char *target = name ? prefetch_join(destination, name) : NULL;
+    free(name);
+    return target;
+}
+
+/**
+ * @brief Removes a file or a whole directory tree (for `mv` across
+ * filesystems).
+ *
+ * @return 0 on success, -1 on failure (reported).
+ */
+static int remove_tree(const char *path)
+{
+    struct stat info;
+    if (lstat(path, &info) == -1)
+    {
+        return -1;
+    }
+    if (S_ISDIR(info.st_mode))
+    {
+        DIR *directory = opendir(path);
+        struct dirent *entry;
+        while (directory != NULL && (entry = readdir(directory)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                char *child = prefetch_join(path, entry->d_name);
+                if (child != NULL)
+                {
+                    remove_tree(child);
+                }
+                free(child);
+            }
+        }
+        if (directory != NULL)
+        {
+            closedir(directory);
+        }
+    }
+    if (remove(path) == -1)
+    {
+        fprintf(stderr, "shell: mv: cannot remove '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses the options of `cp` or `mv`.
+ *
+ * @param allowed The option letters the built-in understands.
+ * @param recursive Set if `-r` or `-R` was given.
+ * @return The index of the first operand, or -1 if an option is not
+ *         understood (and the external program should run instead).
+ */
+static int copy_options(char **args, const char *allowed, int *recursive)
+{
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        if (strcmp(args[i], "--") == 0)
+        {
+            return i + 1;
+        }
+        for (const char *option = args[i] + 1; *option != '\0'; option++)
+        {
+            if (strchr(allowed, *option) == NULL)
+            {
+                return -1;
+            }
+            if (*option == 'r' || *option == 'R')
+            {
+                *recursive = 1;
+            }
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief Implements the `cp` built-in.
+ *
+ * `cp [-rRf] SOURCE... DESTINATION` copies files (and with `-r`, directory
+ * trees) as described at the top of this section, keeping file modes and
+ * copying symbolic links inside trees as links. Other options run the
+ * external `cp`.
+ *
+ * @return 0 on success, 1 if anything could not be copied.
+ */
+int builtin_cp(char **args)
+{
+    int recursive = 0;
+    int first = copy_options(args, "rRf", &recursive);
+    if (first == -1)
+    {
+        // An option we do not handle; let the real `cp` deal with it.
+        launch_process(args);
+        return last_status;
+    }
+    int count = 0;
+    while (args[first + count] != NULL)
+    {
+        count++;
+    }
+    if (count < 2)
+    {
+        fprintf(stderr, "usage: cp [-rRf] SOURCE... DESTINATION\n");
+        return 1;
+    }
+
+    const char *destination = args[first + count - 1];
+    struct stat info;
+    int into = stat(destination, &info) == 0 && S_ISDIR(info.st_mode);
+    if (!into && count > 2)
+    {
+        fprintf(stderr, "shell: cp: target '%s' is not a directory\n", destination);
+        return 1;
+    }
+
+    copy_job job = {.name = "cp"};
+    for (int i = first; i < first + count - 1; i++)
+    {
+        char *target = copy_target(args[i], destination, into);
+        struct stat source_info;
+        struct stat target_info;
+        if (target != NULL && stat(args[i], &source_info) == 0 && stat(target, &target_info) == 0 &&
+            source_info.st_dev == target_info.st_dev && source_info.st_ino == target_info.st_ino)
+        {
+            fprintf(stderr, "shell: cp: '%s' and '%s' are the same file\n", args[i], target);
+            job.errors++;
+        }
+        else if (target != NULL)
+        {
+            job.top_device = 0;
+            job.top_inode = 0;
+            copy_plan(&job, args[i], target, DT_UNKNOWN, recursive, !recursive);
+        }
+        free(target);
+    }
+    return copy_run(&job) ? 1 : 0;
+}
+
+/**
+ * @brief Implements the `mv` built-in.
+ *
+ * `mv [-f] SOURCE... DESTINATION` renames files and directories. A source
+ * on another filesystem is copied the way `cp -r` copies it and then
+ * removed, unless anything in it could not be copied.
+ *
+ * @return 0 on success, 1 if anything could not be moved.
+ */
+int builtin_mv(char **args)
+{
+    int recursive = 0;
+    int first = copy_options(args, "f", &recursive);
+    if (first == -1)
+    {
+        launch_process(args);
+        return last_status;
+    }
+    int count = 0;
+    while (args[first + count] != NULL)
+    {
+        count++;
+    }
+    if (count < 2)
+    {
+        fprintf(stderr, "usage: mv [-f] SOURCE... DESTINATION\n");
+        return 1;
+    }
+
+    const char *destination = args[first + count - 1];
+    struct stat info;
+    int into = stat(destination, &info) == 0 && S_ISDIR(info.st_mode);
+    if (!into && count > 2)
+    {
+        fprintf(stderr, "shell: mv: target '%s' is not a directory\n", destination);
+        return 1;
+    }
+
+    int status = 0;
+    for (int i = first; i < first + count - 1; i++)
+    {
+        char *target = copy_target(args[i], destination, into);
+        if (target == NULL)
+        {
+            perror("malloc failed in mv");
+            return 1;
+        }
+        if (rename(args[i], target) == -1)
+        {
+            if (errno != EXDEV)
+            {
+                fprintf(stderr, "shell: mv: cannot move '%s' to '%s': %s\n", args[i], target, strerror(errno));
+                status = 1;
+            }
+            else
+            {
+                copy_job job = {.name = "mv"};
+                copy_plan(&job, args[i], target, DT_UNKNOWN, 1, 0);
+                if (copy_run(&job) != 0 || remove_tree(args[i]) == -1)
+                {
+                    status = 1;
+                }
+            }
+        }
+        free(target);
+    }
+    return status;
+}
+
+/* ========================================================================= */
+/* PARALLEL EXECUTION & REMOTE AGENTS            */
+/* ========================================================================= */
+
+/*
+ * `parallel` reads one command line per task and runs the tasks
+ * concurrently, either as local child processes or on remote agents.
+ *
+ * An agent is this same shell started as `shell --agent ADDRESS`. It
+ * accepts connections on a TCP or UNIX socket, checks a shared token and
+ * then runs every task it is sent in a child process, streaming the task's
+ * output back as it is produced. All coordinators share the agent's slots:
+ * tasks beyond them wait in one queue per coordinator, and the agent picks
+ * the next by priority and then by weighted fair queuing between the
+ * coordinators (see `agent_schedule()`), so that one coordinator's flood
+ * of tasks cannot starve the others. Coordinator and agent exchange frames
+ * of the form
+ *
+ *     KIND ID ARG LENGTH\n<LENGTH bytes of payload>
+ *
+ * with these kinds:
+ *
+ *     AUTH 0 w n   coordinator -> agent, payload is the token; w = weight
+ *     OK 0 slots 0 agent -> coordinator, authenticated; slots = concurrency
+ *     DENY 0 0 0   agent -> coordinator, wrong token
+ *     TASK id p n  coordinator -> agent, payload is a command line; p = priority
+ *     OUT id fd n  agent -> coordinator, output of task `id` on fd 1 or 2
+ *     DONE id st 0 agent -> coordinator, task `id` exited with status `st`
+ *     STAT 0 0 0   coordinator -> agent, asks for the agent's queues
+ *     STAT 0 0 n   agent -> coordinator, payload is a report of them
+ *
+ * The coordinator splits the tasks into one queue per agent, in proportion
+ * to the agents' slots, and keeps each agent's slots busy from its own
+ * queue. When an agent's queue runs dry it steals half of the longest
+ * remaining queue from its tail, so fast agents end up running more of the
+ * work without any agent having to ask. If an agent disconnects, its
+ * unfinished tasks go back into its queue and are stolen by the others.
+ */
+
+/**
+ * @brief Longest frame header, including the newline.
+ */
+#define FRAME_HEADER_MAX 64
+
+/**
+ * @brief Largest frame payload accepted from the other side.
+ */
+#define FRAME_PAYLOAD_MAX (1 << 26)
+
+/**
+ * @brief A decoded frame. `data` points into the reader's buffer and stays
+ * valid until the next call to `frame_fill()`.
+ */
+typedef struct
+{
+    char kind[8];
+    long id;
+    long arg;
+    size_t length;
+    const char *data;
+} agent_frame;
+
+/**
+ * @brief Buffered input of a frame stream. Bytes before `start` have been
+ * consumed, bytes from `start` to `length` are still to be decoded.
+ */
+typedef struct
+{
+    char *buffer;
+    size_t start;
+    size_t length;
+    size_t capacity;
+} frame_reader;
+
+/**
+ * @brief A task running on an agent: its child and the read ends of its
+ * stdout and stderr pipes (-1 once closed).
+ */
+typedef struct
+{
+    long id;
+    pid_t pid;
+    int fds[2];
+    size_t client; // The coordinator that sent it.
+} agent_task;
+
+/**
+ * @brief The coordinator's view of one agent.
+ */
+typedef struct
+{
+    const char *address;
+    int fd;
+    int slots;         // Tasks the agent runs at once.
+    int in_flight;     // Tasks sent but not yet finished.
+    int alive;
+    long priority;     // Sent with every task.
+    frame_reader reader;
+    int *queue;        // Pending task indices live in queue[head..tail).
+    size_t head;
+    size_t tail;
+    size_t queue_capacity;
+    unsigned long ran;
+    unsigned long stolen;
+} remote_agent;
+
+/**
+ * @brief Sends a whole buffer on a socket, without raising SIGPIPE if the
+ * other side has gone away.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int send_all(int fd, const char *data, size_t length, int flags)
+{
+    while (length > 0)
+    {
+        ssize_t written = send(fd, data, length, MSG_NOSIGNAL | flags);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one frame.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int send_frame(int fd, const char *kind, long id, long arg, const char *data, size_t length)
+{
+    char header[FRAME_HEADER_MAX];
+    int header_length = snprintf(header, sizeof(header), "%s %ld %ld %zu\n", kind, id, arg, length);
+
+    // MSG_MORE lets the header and the payload leave in the same packet.
+    if (send_all(fd, header, header_length, length > 0 ? MSG_MORE : 0) == -1)
+    {
+        return -1;
+    }
+    return send_all(fd, data, length, 0);
+}
+
+/**
+ * @brief Reads whatever is available on `fd` into the reader's buffer.
+ *
+ * @return The number of bytes read, 0 at end of file, -1 on error.
+ */
+static ssize_t frame_fill(frame_reader *reader, int fd)
+{
+    // Drop the frames already decoded before reading more.
+    if (reader->start > 0)
+    {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->length - reader->start);
+        reader->length -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->capacity - reader->length < FILTER_BUFFER_SIZE)
+    {
+        size_t capacity = reader->length + 2 * FILTER_BUFFER_SIZE;
+        char *buffer = realloc(reader->buffer, capacity);
+        if (buffer == NULL)
+        {
+            return -1;
+        }
+        reader->buffer = buffer;
+        reader->capacity = capacity;
+    }
+
+    ssize_t count;
+    do
+    {
+        count = read(fd, reader->buffer + reader->length, reader->capacity - reader->length);
+    } while (count == -1 && errno == EINTR);
+    if (count > 0)
+    {
+        reader->length += count;
+    }
+    return count;
+}
+
+/**
+ * @brief Decodes the next complete frame in the reader's buffer.
+ *
+ * @return 1 if a frame was decoded, 0 if more input is needed, -1 if the
+ *         stream is malformed.
+ */
+static int frame_next(frame_reader *reader, agent_frame *frame)
+{
+    size_t available = reader->length - reader->start;
+    if (available == 0)
+    {
+        return 0;
+    }
+
+    const char *begin = reader->buffer + reader->start;
+    const char *newline = memchr(begin, '\n', available < FRAME_HEADER_MAX ? available : FRAME_HEADER_MAX);
+    if (newline == NULL)
+    {
+        return available >= FRAME_HEADER_MAX ? -1 : 0;
+    }
+
+    char header[FRAME_HEADER_MAX];
+    size_t header_length = newline - begin + 1;
+    memcpy(header, begin, header_length - 1);
+    header[header_length - 1] = '\0';
+    if (sscanf(header, "%7s %ld %ld %zu", frame->kind, &frame->id, &frame->arg, &frame->length) != 4 ||
+        frame->length > FRAME_PAYLOAD_MAX)
+    {
+        return -1;
+    }
+    if (frame->length > available - header_length)
+    {
+        return 0;
+    }
+
+    frame->data = newline + 1;
+    reader->start += header_length + frame->length;
+    return 1;
+}
+
+/**
+ * @brief Blocks until a complete frame has arrived.
+ *
+ * @return 1 if a frame was decoded, -1 on error or end of file.
+ */
+static int frame_wait(frame_reader *reader, int fd, agent_frame *frame)
+{
+    int ready;
+    while ((ready = frame_next(reader, frame)) == 0)
+    {
+        if (frame_fill(reader, fd) <= 0)
+        {
+            return -1;
+        }
+    }
+    return ready;
+}
+
+/**
+ * @brief Opens a socket for an agent address, either listening on it or
+ * connected to it.
+ *
+ * Addresses are `unix:PATH`, `tcp:HOST:PORT`, `tcp:PORT` or plain
+ * `HOST:PORT`. A TCP address without a host means the loopback interface.
+ *
+ * @return The socket, or -1 on error (with `errno` set).
+ */
+static int agent_socket(const char *address, int listening)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un local = {0};
+        const char *path = address + 5;
+        if (strlen(path) >= sizeof(local.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            return -1;
+        }
+
+        // Remove the socket left behind by an earlier agent, but never
+        // anything that is not a socket.
+        struct stat info;
+        if (listening && stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+        {
+            unlink(path);
+        }
+
+        int result = listening ? bind(fd, (struct sockaddr *)&local, sizeof(local))
+                               : connect(fd, (struct sockaddr *)&local, sizeof(local));
+        if (result == -1 || (listening && listen(fd, SOMAXCONN) == -1))
+        {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        return fd;
+    }
+
+    const char *spec = (strncmp(address, "tcp:", 4) == 0) ? address + 4 : address;
+    const char *colon = strrchr(spec, ':');
+    char host[256] = "127.0.0.1";
+    const char *port = spec;
+    if (colon != NULL)
+    {
+        size_t host_length = colon - spec;
+        if (host_length >= sizeof(host))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(host, spec, host_length);
+        host[host_length] = '\0';
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {0};
+    struct addrinfo *list;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    int error = getaddrinfo(host, port, &hints, &list);
+    if (error != 0)
+    {
+        errno = (error == EAI_SYSTEM) ? errno : EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = list; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        int one = 1;
+        if (listening)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            {
+                break;
+            }
+        }
+        else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            // Frames are small and latency matters more than packet count.
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/**
+ * @brief Compares the token sent by a coordinator with the agent's own,
+ * taking the same time wherever the first difference is.
+ */
+static int token_matches(const char *expected, const char *given, size_t given_length)
+{
+    size_t expected_length = strlen(expected);
+    unsigned char difference = (expected_length != given_length || expected_length == 0);
+    for (size_t i = 0; i < given_length && expected_length > 0; i++)
+    {
+        difference |= (unsigned char)(given[i] ^ expected[i % expected_length]);
+    }
+    return difference == 0;
+}
+
+/**
+ * @brief Highest weight a coordinator may claim in its AUTH frame.
+ */
+#define AGENT_WEIGHT_MAX 64
+
+/**
+ * @brief How long a send to a coordinator may block before the agent gives
+ * up on it, in seconds. Every coordinator is served by the same process,
+ * so one that stops reading must not hold up the others.
+ */
+#define AGENT_SEND_TIMEOUT 10
+
+/**
+ * @brief A task that has arrived at the agent but not yet started.
+ */
+typedef struct
+{
+    long id;
+    long priority;
+    long long queued; // When it arrived, in monotonic milliseconds.
+    char *line;
+} agent_job;
+
+/**
+ * @brief One coordinator connected to the agent.
+ *
+ * Its waiting tasks are kept highest priority first, in order of arrival
+ * within a priority. `virtual_time` is its weighted fair queuing tag: the
+ * share of the agent it has used so far, in tasks divided by its weight.
+ */
+typedef struct
+{
+    int fd;                   // -1 once the coordinator has gone.
+    int authenticated;
+    int weight;
+    int running;              // Its tasks now running.
+    unsigned long number;     // Counts connections from 1, for reports.
+    double virtual_time;
+    frame_reader reader;
+    agent_job *queue;
+    size_t queued;
+    size_t queue_capacity;
+    unsigned long ran;        // Tasks started.
+    long long wait_total;     // Milliseconds its started tasks spent waiting.
+    long long wait_max;
+} agent_client;
+
+/**
+ * @brief Everything the agent is serving: the coordinators, the tasks that
+ * are running and the scheduler's virtual clock.
+ */
+typedef struct
+{
+    const char *token;
+    int slots;                // The most tasks running at once, for all coordinators.
+    agent_client *clients;
+    size_t client_count;
+    agent_task *tasks;
+    size_t task_count;
+    size_t task_capacity;
+    double virtual_time;      // The tag of the task started last.
+    unsigned long connections;
+    char *chunk;
+} agent_state;
+
+/**
+ * @brief Starts one task on an agent: a child of the agent that runs the
+ * command line with its output going into two pipes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int agent_start_task(agent_task *task, long id, const char *line)
+{
+    int out[2];
+    int err[2];
+    if (pipe2(out, O_CLOEXEC) == -1)
+    {
+        return -1;
+    }
+    if (pipe2(err, O_CLOEXEC) == -1)
+    {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Own process group, so that the whole task can be signalled.
+        setpgid(0, 0);
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd != -1)
+        {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        // The listener, the other coordinators' sockets and the other
+        // tasks' pipes must not outlive the agent in a built-in.
+        close_inherited_fds("agent task");
+
+        execute_line((char *)line);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_status);
+    }
+
+    close(out[1]);
+    close(err[1]);
+    if (pid == -1)
+    {
+        close(out[0]);
+        close(err[0]);
+        return -1;
+    }
+    setpgid(pid, pid);
+    task->id = id;
+    task->pid = pid;
+    task->fds[0] = out[0];
+    task->fds[1] = err[0];
+    return 0;
+}
+
+/**
+ * @brief Forgets a coordinator that has gone: its waiting tasks are
+ * dropped and its running ones are terminated, since nobody wants their
+ * results any more. The slot is reused once those have exited.
+ */
+static void agent_drop(agent_state *state, agent_client *client)
+{
+    if (client->fd == -1)
+    {
+        return;
+    }
+    close(client->fd);
+    client->fd = -1;
+    for (size_t i = 0; i < client->queued; i++)
+    {
+        free(client->queue[i].line);
+    }
+    client->queued = 0;
+    for (size_t i = 0; i < state->task_count; i++)
+    {
+        if (&state->clients[state->tasks[i].client] == client)
+        {
+            kill(-state->tasks[i].pid, SIGTERM);
+        }
+    }
+    if (client->ran > 0)
+    {
+        fprintf(stderr, "shell: agent: coordinator %lu left after %lu tasks, waiting %lld ms on average, %lld at most\n",
+                client->number, client->ran, client->ran ? client->wait_total / (long long)client->ran : 0,
+                client->wait_max);
+    }
+}
+
+/**
+ * @brief Sends a frame to a coordinator, dropping the coordinator if it
+ * cannot take it.
+ */
+static void agent_send(agent_state *state, agent_client *client, const char *kind, long id, long arg,
+                       const char *data, size_t length)
+{
+    if (client->fd != -1 && send_frame(client->fd, kind, id, arg, data, length) == -1)
+    {
+        agent_drop(state, client);
+    }
+}
+
+/**
+ * @brief Adds an arrived task to its coordinator's queue, after the tasks
+ * of the same or higher priority.
+ *
+ * @return 0 on success, -1 if memory ran out.
+ */
+static int agent_enqueue(agent_state *state, agent_client *client, const agent_frame *frame)
+{
+    if (client->queued == client->queue_capacity)
+    {
+        size_t capacity = client->queue_capacity ? 2 * client->queue_capacity : 16;
+        agent_job *grown = realloc(client->queue, capacity * sizeof(agent_job));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        client->queue = grown;
+        client->queue_capacity = capacity;
+    }
+    char *line = strndup(frame->data, frame->length);
+    if (line == NULL)
+    {
+        return -1;
+    }
+
+    // A coordinator that has been idle starts at the current virtual time,
+    // so it cannot save up a share while it had nothing to run.
+    if (client->queued == 0 && client->running == 0 && client->virtual_time < state->virtual_time)
+    {
+        client->virtual_time = state->virtual_time;
+    }
+    size_t at = client->queued;
+    while (at > 0 && client->queue[at - 1].priority < frame->arg)
+    {
+        at--;
+    }
+    memmove(&client->queue[at + 1], &client->queue[at], (client->queued - at) * sizeof(agent_job));
+    client->queue[at].id = frame->id;
+    client->queue[at].priority = frame->arg;
+    client->queue[at].queued = monotonic_ms();
+    client->queue[at].line = line;
+    client->queued++;
+    return 0;
+}
+
+/**
+ * @brief Starts waiting tasks while there are free slots.
+ *
+ * The next task is the first waiting one of the coordinator whose first
+ * task has the highest priority; between coordinators at the same
+ * priority, the one with the smallest virtual time goes first. Starting a
+ * task advances its coordinator's virtual time by 1/weight, so that over
+ * time each busy coordinator gets slots in proportion to its weight
+ * however many tasks it has sent.
+ */
+static void agent_schedule(agent_state *state)
+{
+    while ((int)state->task_count < state->slots)
+    {
+        agent_client *chosen = NULL;
+        for (size_t c = 0; c < state->client_count; c++)
+        {
+            agent_client *client = &state->clients[c];
+            if (client->queued == 0)
+            {
+                continue;
+            }
+            if (chosen == NULL || client->queue[0].priority > chosen->queue[0].priority ||
+                (client->queue[0].priority == chosen->queue[0].priority &&
+                 client->virtual_time < chosen->virtual_time))
+            {
+                chosen = client;
+            }
+        }
+        if (chosen == NULL)
+        {
+            return;
+        }
+
+        agent_job job = chosen->queue[0];
+        memmove(&chosen->queue[0], &chosen->queue[1], --chosen->queued * sizeof(agent_job));
+        state->virtual_time = chosen->virtual_time;
+        chosen->virtual_time += 1.0 / chosen->weight;
+
+        if (state->task_count == state->task_capacity)
+        {
+            size_t capacity = state->task_capacity ? 2 * state->task_capacity : 16;
+            agent_task *grown = realloc(state->tasks, capacity * sizeof(agent_task));
+            if (grown != NULL)
+            {
+                state->tasks = grown;
+                state->task_capacity = capacity;
+            }
+        }
+        agent_task *task = &state->tasks[state->task_count];
+        if (state->task_count == state->task_capacity || agent_start_task(task, job.id, job.line) == -1)
+        {
+            const char *message = "shell: agent: cannot start task\n";
+            agent_send(state, chosen, "OUT", job.id, 2, message, strlen(message));
+            agent_send(state, chosen, "DONE", job.id, 126, NULL, 0);
+            free(job.line);
+            continue;
+        }
+        free(job.line);
+        task->client = chosen - state->clients;
+        state->task_count++;
+        chosen->running++;
+        chosen->ran++;
+        long long waited = monotonic_ms() - job.queued;
+        chosen->wait_total += waited;
+        chosen->wait_max = waited > chosen->wait_max ? waited : chosen->wait_max;
+    }
+}
+
+/**
+ * @brief Answers a STAT frame with the agent's queue depths and wait
+ * times, one line for the agent and one per coordinator.
+ */
+static void agent_report(agent_state *state, agent_client *client)
+{
+    long long now = monotonic_ms();
+    size_t queued = 0;
+    for (size_t c = 0; c < state->client_count; c++)
+    {
+        queued += state->clients[c].queued;
+    }
+    char *text = NULL;
+    size_t length = 0;
+    FILE *report = open_memstream(&text, &length);
+    if (report == NULL)
+    {
+        agent_send(state, client, "STAT", 0, 0, NULL, 0);
+        return;
+    }
+    fprintf(report, "agent: %zu/%d running, %zu waiting\n", state->task_count, state->slots, queued);
+    for (size_t c = 0; c < state->client_count; c++)
+    {
+        agent_client *other = &state->clients[c];
+        if (other->fd == -1 || !other->authenticated)
+        {
+            continue;
+        }
+        long long oldest = 0;
+        for (size_t i = 0; i < other->queued; i++)
+        {
+            oldest = now - other->queue[i].queued > oldest ? now - other->queue[i].queued : oldest;
+        }
+        fprintf(report,
+                "coordinator %lu%s: weight %d, %d running, %zu waiting (oldest %lld ms), %lu started, "
+                "waited %lld ms on average, %lld at most\n",
+                other->number, other == client ? " (this one)" : "", other->weight, other->running, other->queued,
+                oldest, other->ran, other->ran ? other->wait_total / (long long)other->ran : 0, other->wait_max);
+    }
+    fclose(report);
+    agent_send(state, client, "STAT", 0, 0, text, length);
+    free(text);
+}
+
+/**
+ * @brief Handles whatever a coordinator has sent.
+ */
+static void agent_receive(agent_state *state, agent_client *client)
+{
+    if (frame_fill(&client->reader, client->fd) <= 0)
+    {
+        agent_drop(state, client);
+        return;
+    }
+
+    agent_frame frame;
+    int ready;
+    while (client->fd != -1 && (ready = frame_next(&client->reader, &frame)) == 1)
+    {
+        if (!client->authenticated)
+        {
+            if (strcmp(frame.kind, "AUTH") != 0 || !token_matches(state->token, frame.data, frame.length))
+            {
+                send_frame(client->fd, "DENY", 0, 0, NULL, 0);
+                agent_drop(state, client);
+                return;
+            }
+            client->authenticated = 1;
+            client->weight = frame.arg < 1 ? 1 : frame.arg > AGENT_WEIGHT_MAX ? AGENT_WEIGHT_MAX : (int)frame.arg;
+            agent_send(state, client, "OK", 0, state->slots, NULL, 0);
+        }
+        else if (strcmp(frame.kind, "TASK") == 0 && agent_enqueue(state, client, &frame) == -1)
+        {
+            agent_send(state, client, "DONE", frame.id, 126, NULL, 0);
+        }
+        else if (strcmp(frame.kind, "STAT") == 0)
+        {
+            agent_report(state, client);
+        }
+    }
+    if (ready == -1)
+    {
+        agent_drop(state, client);
+    }
+}
+
+/**
+ * @brief Passes on the output of a running task and, once both of its
+ * pipes are closed, reaps it and reports its status.
+ *
+ * @return 1 if the task has finished, 0 if not.
+ */
+static int agent_collect(agent_state *state, agent_task *task, const short *revents)
+{
+    agent_client *client = &state->clients[task->client];
+    for (int j = 0; j < 2; j++)
+    {
+        if (task->fds[j] == -1 || revents[j] == 0)
+        {
+            continue;
+        }
+        ssize_t n = read(task->fds[j], state->chunk, FILTER_BUFFER_SIZE);
+        if (n > 0)
+        {
+            agent_send(state, client, "OUT", task->id, j + 1, state->chunk, n);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            close(task->fds[j]);
+            task->fds[j] = -1;
+        }
+    }
+    if (task->fds[0] != -1 || task->fds[1] != -1)
+    {
+        return 0;
+    }
+
+    int status;
+    while (waitpid(task->pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+    agent_send(state, client, "DONE", task->id, decode_wait_status(status), NULL, 0);
+    client->running--;
+    return 1;
+}
+
+/**
+ * @brief Runs the shell as a remote execution agent.
+ *
+ * Listens on `address` and serves every coordinator from this one process,
+ * so that they share the agent's slots. Tasks wait in one queue per
+ * coordinator and are started by `agent_schedule()` as slots come free.
+ * This never returns unless the socket cannot be set up or `accept()`
+ * fails.
+ *
+ * @param address Where to listen, e.g. `tcp:7001` or `unix:/tmp/agent.sock`.
+ * @param token The secret that coordinators must present.
+ * @param slots How many tasks may run here at once, for all coordinators.
+ * @return 1 on error.
+ */
+int run_agent(const char *address, const char *token, int slots)
+{
+    int listener = agent_socket(address, 1);
+    agent_state state = {.token = token, .slots = slots, .chunk = malloc(FILTER_BUFFER_SIZE)};
+    if (listener == -1 || state.chunk == NULL)
+    {
+        fprintf(stderr, "shell: agent: %s: %s\n", address, strerror(listener == -1 ? errno : ENOMEM));
+        return 1;
+    }
+    signal(SIGINT, SIG_DFL);
+    fprintf(stderr, "shell: agent listening on %s (%d slots)\n", address, slots);
+
+    struct pollfd *fds = NULL;
+    size_t fds_capacity = 0;
+    for (;;)
+    {
+        agent_schedule(&state);
+
+        // Free the slots of coordinators that have gone and whose tasks
+        // have all exited; a slot in use keeps its index for its tasks.
+        while (state.client_count > 0 && state.clients[state.client_count - 1].fd == -1 &&
+               state.clients[state.client_count - 1].running == 0)
+        {
+            agent_client *client = &state.clients[--state.client_count];
+            free(client->queue);
+            free(client->reader.buffer);
+        }
+
+        size_t needed = 1 + state.client_count + 2 * state.task_count;
+        if (needed > fds_capacity)
+        {
+            struct pollfd *grown = realloc(fds, 2 * needed * sizeof(struct pollfd));
+            if (grown == NULL)
+            {
+                perror("shell: agent");
+                return 1;
+            }
+            fds = grown;
+            fds_capacity = 2 * needed;
+        }
+        // Gone coordinators and closed pipes stay in the array as negative
+        // fds, which poll() ignores, so positions map back to their owners.
+        nfds_t nfds = 0;
+        fds[nfds].fd = listener;
+        fds[nfds++].events = POLLIN;
+        for (size_t c = 0; c < state.client_count; c++)
+        {
+            fds[nfds].fd = state.clients[c].fd;
+            fds[nfds++].events = POLLIN;
+        }
+        for (size_t i = 0; i < state.task_count; i++)
+        {
+            for (int j = 0; j < 2; j++)
+            {
+                fds[nfds].fd = state.tasks[i].fds[j];
+                fds[nfds++].events = POLLIN;
+            }
+        }
+        if (poll(fds, nfds, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("shell: agent: poll");
+            return 1;
+        }
+
+        // Output first, so that a coordinator that went away in the
+        // meantime is still told about tasks that had finished.
+        size_t kept = 0;
+        for (size_t i = 0; i < state.task_count; i++)
+        {
+            short revents[2] = {fds[1 + state.client_count + 2 * i].revents,
+                                fds[2 + state.client_count + 2 * i].revents};
+            if (!agent_collect(&state, &state.tasks[i], revents))
+            {
+                state.tasks[kept++] = state.tasks[i];
+            }
+        }
+        state.task_count = kept;
+
+        for (size_t c = 0; c < state.client_count; c++)
+        {
+            if (state.clients[c].fd != -1 && fds[1 + c].revents != 0)
+            {
+                agent_receive(&state, &state.clients[c]);
+            }
+        }
+
+        if (fds[0].revents != 0)
+        {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                {
+                    continue;
+                }
+                perror("shell: agent: accept");
+                return 1;
+            }
+            int one = 1;
+            struct timeval timeout = {AGENT_SEND_TIMEOUT, 0};
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            // Reuse the slot of a coordinator that has gone, if any.
+            size_t c = 0;
+            while (c < state.client_count && (state.clients[c].fd != -1 || state.clients[c].running > 0))
+            {
+                c++;
+            }
+            if (c == state.client_count)
+            {
+                agent_client *grown = realloc(state.clients, (c + 1) * sizeof(agent_client));
+                if (grown == NULL)
+                {
+                    close(fd);
+                    continue;
+                }
+                state.clients = grown;
+                state.client_count++;
+            }
+            else
+            {
+                free(state.clients[c].queue);
+                free(state.clients[c].reader.buffer);
+            }
+            memset(&state.clients[c], 0, sizeof(agent_client));
+            state.clients[c].fd = fd;
+            state.clients[c].number = ++state.connections;
+            state.clients[c].virtual_time = state.virtual_time;
+        }
+    }
+}
+
+/**
+ * @brief Prints the queues of a running agent (`shell --agent-status
+ * ADDRESS`), as the agent reports them in answer to a STAT frame.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int agent_status(const char *address, const char *token)
+{
+    frame_reader reader = {0};
+    agent_frame frame;
+    int fd = agent_socket(address, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "shell: agent: %s: %s\n", address, strerror(errno));
+        return 1;
+    }
+    int result = 1;
+    if (send_frame(fd, "AUTH", 0, 0, token, strlen(token)) == -1 || frame_wait(&reader, fd, &frame) != 1 ||
+        strcmp(frame.kind, "OK") != 0)
+    {
+        fprintf(stderr, "shell: agent: %s: authentication failed\n", address);
+    }
+    else if (send_frame(fd, "STAT", 0, 0, NULL, 0) == 0 && frame_wait(&reader, fd, &frame) == 1 &&
+             strcmp(frame.kind, "STAT") == 0)
+    {
+        fwrite(frame.data, 1, frame.length, stdout);
+        result = 0;
+    }
+    close(fd);
+    free(reader.buffer);
+    return result;
+}
+
+/**
+ * @brief Adds a task to the tail of an agent's queue, first moving the
+ * queue back to the start of its array if it has reached the end.
+ */
+static void queue_push(remote_agent *agent, int task)
+{
+    if (agent->tail == agent->queue_capacity)
+    {
+        memmove(agent->queue, agent->queue + agent->head, (agent->tail - agent->head) * sizeof(int));
+        agent->tail -= agent->head;
+        agent->head = 0;
+    }
+    agent->queue[agent->tail++] = task;
+}
+
+/**
+ * @brief Moves half of the longest other queue (from its tail) into the
+ * queue of `thief`.
+ *
+ * @return The number of tasks stolen; 0 if every other queue is empty.
+ */
+static size_t parallel_steal(remote_agent *agents, int count, remote_agent *thief)
+{
+    remote_agent *victim = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        remote_agent *agent = &agents[i];
+        if (agent != thief && agent->tail > agent->head &&
+            (victim == NULL || agent->tail - agent->head > victim->tail - victim->head))
+        {
+            victim = agent;
+        }
+    }
+    if (victim == NULL)
+    {
+        return 0;
+    }
+
+    // Taking from the tail leaves the victim the tasks it is about to run.
+    size_t take = (victim->tail - victim->head + 1) / 2;
+    for (size_t i = 0; i < take; i++)
+    {
+        int task = victim->queue[--victim->tail];
+        queue_push(thief, task);
+    }
+    thief->stolen += take;
+    return take;
+}
+
+/**
+ * @brief Marks an agent as lost and puts its unfinished tasks back into its
+ * queue, where the remaining agents will steal them.
+ */
+static void agent_lost(remote_agent *agent, int index, int *owner, size_t task_count)
+{
+    fprintf(stderr, "shell: parallel: lost agent %s\n", agent->address);
+    close(agent->fd);
+    agent->fd = -1;
+    agent->alive = 0;
+    agent->in_flight = 0;
+    for (size_t i = 0; i < task_count; i++)
+    {
+        if (owner[i] == index)
+        {
+            owner[i] = -1;
+            queue_push(agent, (int)i);
+        }
+    }
+}
+
+/**
+ * @brief Sends tasks to an agent until all its slots are busy, stealing
+ * from other queues once its own is empty.
+ */
+static void agent_dispatch(remote_agent *agents, int count, int index, char **tasks, int *owner,
+                           size_t task_count)
+{
+    remote_agent *agent = &agents[index];
+    while (agent->alive && agent->in_flight < agent->slots)
+    {
+        if (agent->head == agent->tail && parallel_steal(agents, count, agent) == 0)
+        {
+            return;
+        }
+        int task = agent->queue[agent->head++];
+        if (send_frame(agent->fd, "TASK", task, agent->priority, tasks[task], strlen(tasks[task])) == -1)
+        {
+            agent->queue[--agent->head] = task;
+            agent_lost(agent, index, owner, task_count);
+            return;
+        }
+        owner[task] = index;
+        agent->in_flight++;
+    }
+}
+
+/**
+ * @brief Longest stderr line a tagged task can write in one piece; a longer
+ * line is passed on in pieces of this size, each with its own tag.
+ */
+#define TAG_LINE_MAX 4096
+
+/**
+ * @brief The stderr of one task while its lines are being tagged.
+ *
+ * Bytes are gathered until a newline, so that each line goes out whole in
+ * one write(), however the task's writes were split.
+ */
+typedef struct
+{
+    int fd;     // The read end of a local task's pipe, or -1 if the slot is free.
+    int task;   // The task's line number, counting from 1.
+    size_t used; // Bytes of an unfinished line in `line`.
+    char line[TAG_LINE_MAX];
+} tagged_stream;
+
+/**
+ * @brief Writes one line of a task's stderr with its tag, as
+ * `[job N HH:MM:SS.mmm] line`.
+ *
+ * The tag, the line and its newline go out in a single write(), so lines
+ * from different tasks never interleave, on a terminal or in a log opened
+ * with O_APPEND.
+ */
+static void tag_write(int out, int task, const char *text, size_t length)
+{
+    char buffer[64 + TAG_LINE_MAX + 1];
+    struct timespec now;
+    struct tm when;
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &when);
+    int prefix = snprintf(buffer, 64, "[job %d %02d:%02d:%02d.%03ld] ", task, when.tm_hour, when.tm_min,
+                          when.tm_sec, now.tv_nsec / 1000000);
+    memcpy(buffer + prefix, text, length);
+    buffer[prefix + length] = '\n';
+    write_all(out, buffer, prefix + length + 1);
+}
+
+/**
+ * @brief Adds output to a tagged stream and writes every line it completes.
+ */
+static void tag_feed(tagged_stream *stream, int out, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        const char *newline = memchr(data, '\n', length);
+        size_t take = newline ? (size_t)(newline - data) : length;
+        if (take > TAG_LINE_MAX - stream->used)
+        {
+            take = TAG_LINE_MAX - stream->used;
+            newline = NULL;
+        }
+        memcpy(stream->line + stream->used, data, take);
+        stream->used += take;
+        data += take;
+        length -= take;
+        if (newline != NULL)
+        {
+            data++;
+            length--;
+        }
+        if (newline != NULL || stream->used == TAG_LINE_MAX)
+        {
+            tag_write(out, stream->task, stream->line, stream->used);
+            stream->used = 0;
+        }
+    }
+}
+
+/**
+ * @brief Writes out a stream's unfinished last line, if it has one.
+ */
+static void tag_flush(tagged_stream *stream, int out)
+{
+    if (stream->used > 0)
+    {
+        tag_write(out, stream->task, stream->line, stream->used);
+        stream->used = 0;
+    }
+}
+
+/**
+ * @brief Reads whatever a local task's stderr pipe holds and tags it.
+ *
+ * At end of file the last line is flushed and the pipe is taken out of the
+ * epoll set and closed, which frees the slot.
+ *
+ * @param epoll_fd The set the pipe was added to by `tag_open()`.
+ * @return 1 if the pipe is still open, 0 if it has been closed.
+ */
+static int tag_drain(tagged_stream *stream, int out, int epoll_fd)
+{
+    char buffer[TAG_LINE_MAX];
+    ssize_t n;
+    while ((n = read(stream->fd, buffer, sizeof(buffer))) > 0)
+    {
+        tag_feed(stream, out, buffer, n);
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return 1;
+    }
+    tag_flush(stream, out);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+    close(stream->fd);
+    stream->fd = -1;
+    return 0;
+}
+
+/**
+ * @brief Gives a task about to be started a stderr pipe in a free slot.
+ *
+ * The read end is non-blocking and is added to the epoll set, so that the
+ * shell drains it between reaping children; no helper process is needed.
+ *
+ * @param epoll_fd The set to add the read end to.
+ * @param write_end Receives the end to make the task's stderr.
+ * @return The slot, or -1 if none is free or the pipe cannot be set up (the
+ *         task then writes to the shell's stderr untagged).
+ */
+static int tag_open(tagged_stream *streams, int slots, int task, int epoll_fd, int *write_end)
+{
+    int slot = 0;
+    while (slot < slots && streams[slot].fd != -1)
+    {
+        slot++;
+    }
+    int ends[2];
+    if (slot == slots || pipe2(ends, O_CLOEXEC) == -1)
+    {
+        return -1;
+    }
+    if (fcntl(ends[0], F_SETFL, O_NONBLOCK) == -1 || event_add_to(epoll_fd, ends[0], EVENT_STREAM, slot) == -1)
+    {
+        close(ends[0]);
+        close(ends[1]);
+        return -1;
+    }
+    streams[slot].fd = ends[0];
+    streams[slot].task = task;
+    streams[slot].used = 0;
+    *write_end = ends[1];
+    return slot;
+}
+
+/**
+ * @brief How often `parallel -j auto` reconsiders how many tasks to run,
+ * in milliseconds.
+ */
+#define PARALLEL_ADAPT_INTERVAL 500
+
+/**
+ * @brief Share of the interval (as a fraction) that some task may spend
+ * stalled on each resource, by PSI, before `parallel -j auto` backs off.
+ * Memory stalls mean reclaim or swapping and are worst, so they get the
+ * least slack; CPU pressure is expected once every CPU is busy.
+ */
+#define PRESSURE_CPU_LIMIT 0.25
+#define PRESSURE_MEMORY_LIMIT 0.05
+#define PRESSURE_IO_LIMIT 0.30
+
+/**
+ * @brief Fewest tasks that must finish in each of two intervals before
+ * their completion rates are compared; fewer say more about the tasks'
+ * lengths than about the system.
+ */
+#define PARALLEL_ADAPT_SAMPLE 4
+
+/**
+ * @brief The state of an adaptive `parallel -j`.
+ *
+ * The number of tasks in flight follows an AIMD rule: it grows by one per
+ * interval while every slot is busy, shrinks to three quarters when the
+ * system reports pressure, and takes back a step that made the completion
+ * rate drop.
+ */
+typedef struct
+{
+    int minimum;            // Never fewer tasks than this in flight.
+    int maximum;            // Nor more than this.
+    int verbose;            // Report each change on stderr.
+    int limit;              // The current number of tasks allowed in flight.
+    int grew;               // Whether the last change was an increase.
+    long long next_sample;  // When to reconsider, in monotonic milliseconds.
+    long long last_sample;  // When `stalls` and `completed` were taken.
+    long long stalls[3];    // Cumulative PSI stall times (cpu, memory, io), in µs.
+    unsigned long completed; // Tasks finished since the last sample.
+    unsigned long previous; // Tasks finished in the interval before.
+    double rate;            // Tasks finished per second over that interval.
+} parallel_adapt;
+
+/**
+ * @brief Reads the cumulative "some" stall time of a resource from
+ * `/proc/pressure`.
+ *
+ * @param resource "cpu", "memory" or "io".
+ * @return The stall time in microseconds, or -1 if PSI is not available.
+ */
+static long long psi_total(const char *resource)
+{
+    char path[64];
+    char buffer[256];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0)
+    {
+        return -1;
+    }
+    buffer[n] = '\0';
+    const char *total = strstr(buffer, "total=");
+    if (strncmp(buffer, "some ", 5) != 0 || total == NULL)
+    {
+        return -1;
+    }
+    return strtoll(total + 6, NULL, 10);
+}
+
+/**
+ * @brief Starts an adaptive `parallel` between `minimum` and `maximum`
+ * tasks, at the minimum.
+ */
+static void parallel_adapt_init(parallel_adapt *adapt, int minimum, int maximum, int verbose)
+{
+    static const char *const resources[] = {"cpu", "memory", "io"};
+    memset(adapt, 0, sizeof(*adapt));
+    adapt->minimum = minimum;
+    adapt->maximum = maximum;
+    adapt->verbose = verbose;
+    adapt->limit = minimum;
+    adapt->last_sample = monotonic_ms();
+    adapt->next_sample = adapt->last_sample + PARALLEL_ADAPT_INTERVAL;
+    for (int r = 0; r < 3; r++)
+    {
+        adapt->stalls[r] = psi_total(resources[r]);
+    }
+}
+
+/**
+ * @brief Reconsiders the number of tasks in flight once an interval has
+ * passed.
+ *
+ * @param saturated Whether every slot is busy with tasks still waiting.
+ */
+static void parallel_adapt_sample(parallel_adapt *adapt, int saturated)
+{
+    static const char *const resources[] = {"cpu", "memory", "io"};
+    static const double limits[] = {PRESSURE_CPU_LIMIT, PRESSURE_MEMORY_LIMIT, PRESSURE_IO_LIMIT};
+    long long now = monotonic_ms();
+    if (now < adapt->next_sample)
+    {
+        return;
+    }
+    double elapsed = (double)(now - adapt->last_sample);
+    double pressure[3] = {0, 0, 0};
+    const char *stalled = NULL;
+    for (int r = 0; r < 3; r++)
+    {
+        long long total = psi_total(resources[r]);
+        if (total >= 0 && adapt->stalls[r] >= 0)
+        {
+            pressure[r] = (total - adapt->stalls[r]) / (elapsed * 1000);
+        }
+        adapt->stalls[r] = total;
+        if (stalled == NULL && pressure[r] > limits[r])
+        {
+            stalled = resources[r];
+        }
+    }
+    double rate = adapt->completed * 1000.0 / elapsed;
+
+    int limit = adapt->limit;
+    const char *reason = NULL;
+    char why[64];
+    if (stalled != NULL)
+    {
+        limit = limit * 3 / 4 < limit - 1 ? limit * 3 / 4 : limit - 1;
+        snprintf(why, sizeof(why), "%s pressure", stalled);
+        reason = why;
+    }
+    else if (adapt->grew && adapt->previous >= PARALLEL_ADAPT_SAMPLE && adapt->completed >= PARALLEL_ADAPT_SAMPLE &&
+             rate < adapt->rate * 0.9)
+    {
+        limit--;
+        reason = "throughput fell";
+    }
+    else if (saturated)
+    {
+        limit++;
+        reason = "all slots busy";
+    }
+    limit = limit < adapt->minimum ? adapt->minimum : limit > adapt->maximum ? adapt->maximum : limit;
+
+    if (limit != adapt->limit && adapt->verbose)
+    {
+        fprintf(stderr, "parallel: %d -> %d tasks: %s (cpu %.0f%%, memory %.0f%%, io %.0f%%, %.1f tasks/s)\n",
+                adapt->limit, limit, reason, pressure[0] * 100, pressure[1] * 100, pressure[2] * 100, rate);
+    }
+    adapt->grew = limit > adapt->limit;
+    adapt->limit = limit;
+    adapt->rate = rate;
+    adapt->previous = adapt->completed;
+    adapt->completed = 0;
+    adapt->last_sample = now;
+    adapt->next_sample = now + PARALLEL_ADAPT_INTERVAL;
+}
+
+/**
+ * @brief Records the exit of one of `parallel_local()`'s children.
+ *
+ * @param pids The children started so far; the one found is cleared.
+ * @param started The number of entries in `pids`.
+ * @return 1 if `pid` was one of them, 0 if not.
+ */
+static int parallel_reap(pid_t *pids, size_t started, pid_t pid, int wait_status, const int *indices, int *status)
+{
+    for (size_t i = 0; i < started; i++)
+    {
+        if (pids[i] == pid)
+        {
+            status[indices[i]] = decode_wait_status(wait_status);
+            pids[i] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs tasks as local child processes, at most `jobs` at a time.
+ *
+ * With a `tag_fd` each task's stderr goes to a pipe of the shell's instead,
+ * and the shell waits in the event loop for both the pipes and SIGCHLD,
+ * passing each complete line on to `tag_fd` with the task's tag. A task's
+ * slot is only reused once its pipe has been drained to the end.
+ *
+ * With an `adapt` the number of children running at once varies between
+ * its bounds (see `parallel_adapt_sample()`); the shell then also waits in
+ * the event loop, waking at least once an interval to sample.
+ *
+ * The wait uses an epoll set of its own holding only the signalfd and the
+ * stderr pipes, so that nothing else the shell watches (such as standard
+ * input at end of file) can keep waking it for nothing.
+ *
+ * @param tasks All task lines.
+ * @param indices Which of them to run.
+ * @param count The number of entries in `indices`.
+ * @param jobs The maximum number of children running at once.
+ * @param status Receives the exit status of each task run.
+ * @param tag_fd Where to write tagged stderr lines, or -1 to leave the
+ *        tasks' stderr alone.
+ * @param adapt The adaptive limit, or NULL to run `jobs` at a time.
+ */
+static void parallel_local(char **tasks, const int *indices, size_t count, int jobs, int *status, int tag_fd,
+                           parallel_adapt *adapt)
+{
+    pid_t *pids = calloc(count ? count : 1, sizeof(pid_t));
+    if (pids == NULL)
+    {
+        perror("malloc failed in parallel");
+        return;
+    }
+
+    int epoll_fd = -1;
+    if (event_loop.epoll_fd != -1 && (tag_fd != -1 || adapt != NULL) &&
+        ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+         event_add_to(epoll_fd, event_loop.signal_fd, EVENT_SIGNAL, 0) == -1))
+    {
+        perror("shell: parallel");
+        if (epoll_fd != -1)
+        {
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+    }
+
+    // Tagging needs the event loop; without it stderr passes through.
+    tagged_stream *streams = NULL;
+    if (tag_fd != -1 && epoll_fd != -1 && (streams = malloc(jobs * sizeof(tagged_stream))) == NULL)
+    {
+        perror("malloc failed in parallel");
+    }
+    for (int slot = 0; streams != NULL && slot < jobs; slot++)
+    {
+        streams[slot].fd = -1;
+    }
+    if (epoll_fd == -1)
+    {
+        adapt = NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    size_t next = 0;
+    int running = 0;
+    int open_streams = 0;
+    while (next < count || running > 0 || open_streams > 0)
+    {
+        int limit = adapt != NULL ? adapt->limit : jobs;
+        while (running < limit && next < count && (streams == NULL || open_streams < jobs))
+        {
+            int write_end = -1;
+            if (streams != NULL && tag_open(streams, jobs, indices[next] + 1, epoll_fd, &write_end) != -1)
+            {
+                open_streams++;
+            }
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                event_loop_child();
+                if (epoll_fd != -1)
+                {
+                    close(epoll_fd);
+                }
+                if (write_end != -1)
+                {
+                    dup2(write_end, STDERR_FILENO);
+                    close(write_end);
+                }
+                execute_line(tasks[indices[next]]);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(last_status);
+            }
+            if (write_end != -1)
+            {
+                close(write_end);
+            }
+            if (pid == -1)
+            {
+                perror("shell: parallel: fork");
+                status[indices[next++]] = 126;
+                continue;
+            }
+            pids[next++] = pid;
+            running++;
+        }
+
+        int wait_status;
+        pid_t pid;
+        if (streams == NULL && adapt == NULL)
+        {
+            if (running == 0)
+            {
+                continue;
+            }
+            pid = waitpid(-1, &wait_status, 0);
+            if (pid == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            running -= parallel_reap(pids, next, pid, wait_status, indices, status);
+            continue;
+        }
+
+        // SIGCHLD arrives through the signalfd, so one wait covers both
+        // output and exits; whatever has exited is then reaped.
+        int timeout = -1;
+        if (adapt != NULL)
+        {
+            // Sample between launching and waiting, when a full set of
+            // slots shows as busy.
+            parallel_adapt_sample(adapt, running >= adapt->limit && next < count);
+            if (running < adapt->limit && next < count)
+            {
+                // The limit grew: start the next task now rather than
+                // when something happens to wake the wait.
+                continue;
+            }
+            long long left = adapt->next_sample - monotonic_ms();
+            timeout = left < 0 ? 0 : (int)left;
+        }
+        struct epoll_event ready[EVENT_BATCH];
+        int n = event_next_in(epoll_fd, ready, timeout);
+        if (n == -1)
+        {
+            break;
+        }
+        for (int k = 0; k < n; k++)
+        {
+            int kind = ready[k].data.u64 & 0xff;
+            if (kind == EVENT_SIGNAL)
+            {
+                event_signals();
+            }
+            else if (kind == EVENT_STREAM && tag_drain(&streams[ready[k].data.u64 >> 8], tag_fd, epoll_fd) == 0)
+            {
+                open_streams--;
+            }
+        }
+        while (running > 0 && (pid = waitpid(-1, &wait_status, WNOHANG)) > 0)
+        {
+            int reaped = parallel_reap(pids, next, pid, wait_status, indices, status);
+            running -= reaped;
+            if (adapt != NULL)
+            {
+                adapt->completed += reaped;
+            }
+        }
+    }
+
+    for (int slot = 0; streams != NULL && slot < jobs; slot++)
+    {
+        if (streams[slot].fd != -1)
+        {
+            tag_drain(&streams[slot], tag_fd, epoll_fd);
+        }
+    }
+    if (epoll_fd != -1)
+    {
+        close(epoll_fd);
+    }
+    free(streams);
+    free(pids);
+}
+
+/**
+ * @brief Runs tasks on remote agents until they are all done or every
+ * agent has been lost.
+ *
+ * With a `tag_fd` the stderr the agents send back is tagged line by line
+ * as in `parallel_local()`; a task's partial line is kept only while the
+ * task is running.
+ *
+ * @param leftover Receives the indices of the tasks that did not run.
+ * @param tag_fd Where to write tagged stderr lines, or -1.
+ * @return The number of entries stored in `leftover`.
+ */
+static size_t parallel_remote(remote_agent *agents, int count, char **tasks, size_t task_count,
+                              int *status, int *leftover, int tag_fd)
+{
+    int *owner = malloc(task_count * sizeof(int));
+    struct pollfd *fds = malloc(count * sizeof(struct pollfd));
+    char *done = calloc(task_count, 1);
+    tagged_stream **streams = (tag_fd == -1) ? NULL : calloc(task_count, sizeof(tagged_stream *));
+    if (owner == NULL || fds == NULL || done == NULL || (tag_fd != -1 && streams == NULL))
+    {
+        perror("malloc failed in parallel");
+        free(owner);
+        free(fds);
+        free(done);
+        free(streams);
+        for (size_t i = 0; i < task_count; i++)
+        {
+            leftover[i] = (int)i;
+        }
+        return task_count;
+    }
+
+    // Deal the tasks out in proportion to the agents' slots: each task goes
+    // to the agent with the fewest queued tasks per slot.
+    for (size_t i = 0; i < task_count; i++)
+    {
+        owner[i] = -1;
+        remote_agent *best = NULL;
+        for (int a = 0; a < count; a++)
+        {
+            remote_agent *agent = &agents[a];
+            if (agent->alive && (best == NULL || (agent->tail + 1) * best->slots < (best->tail + 1) * agent->slots))
+            {
+                best = agent;
+            }
+        }
+        queue_push(best, (int)i);
+    }
+
+    size_t completed = 0;
+    while (completed < task_count)
+    {
+        int alive = 0;
+        for (int a = 0; a < count; a++)
+        {
+            agent_dispatch(agents, count, a, tasks, owner, task_count);
+            alive += agents[a].alive;
+        }
+        if (alive == 0)
+        {
+            break;
+        }
+
+        for (int a = 0; a < count; a++)
+        {
+            fds[a].fd = agents[a].alive ? agents[a].fd : -1;
+            fds[a].events = POLLIN;
+        }
+        if (poll(fds, count, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("shell: parallel: poll");
+            break;
+        }
+
+        for (int a = 0; a < count; a++)
+        {
+            remote_agent *agent = &agents[a];
+            if (!agent->alive || fds[a].revents == 0)
+            {
+                continue;
+            }
+            if (frame_fill(&agent->reader, agent->fd) <= 0)
+            {
+                agent_lost(agent, a, owner, task_count);
+                continue;
+            }
+
+            // Stream output through as soon as it arrives.
+            agent_frame frame;
+            int ready;
+            while ((ready = frame_next(&agent->reader, &frame)) == 1)
+            {
+                if (frame.id < 0 || (size_t)frame.id >= task_count || owner[frame.id] != a)
+                {
+                    continue;
+                }
+                tagged_stream **stream = (streams != NULL) ? &streams[frame.id] : NULL;
+                if (strcmp(frame.kind, "OUT") == 0 && frame.arg == 2 && stream != NULL &&
+                    (*stream != NULL || (*stream = calloc(1, sizeof(tagged_stream))) != NULL))
+                {
+                    (*stream)->task = frame.id + 1;
+                    tag_feed(*stream, tag_fd, frame.data, frame.length);
+                }
+                else if (strcmp(frame.kind, "OUT") == 0)
+                {
+                    write_all(frame.arg == 2 ? STDERR_FILENO : STDOUT_FILENO, frame.data, frame.length);
+                }
+                else if (strcmp(frame.kind, "DONE") == 0)
+                {
+                    if (stream != NULL && *stream != NULL)
+                    {
+                        tag_flush(*stream, tag_fd);
+                        free(*stream);
+                        *stream = NULL;
+                    }
+                    status[frame.id] = (int)frame.arg;
+                    done[frame.id] = 1;
+                    owner[frame.id] = -1;
+                    agent->in_flight--;
+                    agent->ran++;
+                    completed++;
+                }
+            }
+            if (ready == -1)
+            {
+                agent_lost(agent, a, owner, task_count);
+            }
+        }
+    }
+
+    // Whatever is left belongs to agents that are all gone.
+    size_t left = 0;
+    for (size_t i = 0; i < task_count && completed < task_count; i++)
+    {
+        if (!done[i])
+        {
+            leftover[left++] = (int)i;
+        }
+    }
+
+    // Tasks that were cut off with their agent keep what they had written.
+    for (size_t i = 0; streams != NULL && i < task_count; i++)
+    {
+        if (streams[i] != NULL)
+        {
+            tag_flush(streams[i], tag_fd);
+            free(streams[i]);
+        }
+    }
+    free(owner);
+    free(fds);
+    free(done);
+    free(streams);
+    return left;
+}
+
+/**
+ * @brief Reads task lines from a file descriptor, one task per non-empty
+ * line.
+ *
+ * The raw descriptor is read rather than `stdin`, whose buffer may still
+ * hold input meant for the shell itself.
+ *
+ * @return The tasks (NULL-terminated), or NULL on error.
+ */
+static char **parallel_read_tasks(int fd, size_t *count)
+{
+    size_t length = 0;
+    size_t capacity = FILTER_BUFFER_SIZE;
+    char *text = malloc(capacity + 1);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    for (;;)
+    {
+        if (length == capacity)
+        {
+            char *grown = realloc(text, capacity * 2 + 1);
+            if (grown == NULL)
+            {
+                free(text);
+                return NULL;
+            }
+            text = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, text + length, capacity - length);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        length += n;
+    }
+    text[length] = '\0';
+
+    size_t lines = 1;
+    for (size_t i = 0; i < length; i++)
+    {
+        lines += (text[i] == '\n');
+    }
+    // Like an argument list, the tasks are one block: the pointers, then
+    // the text they point into.
+    char **tasks = malloc((lines + 1) * sizeof(char *) + length + 1);
+    if (tasks == NULL)
+    {
+        free(text);
+        return NULL;
+    }
+    char *lines_text = (char *)(tasks + lines + 1);
+    memcpy(lines_text, text, length + 1);
+    free(text);
+
+    *count = 0;
+    char *saveptr;
+    for (char *line = strtok_r(lines_text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        size_t line_length = strlen(line);
+        if (line_length > 0 && line[line_length - 1] == '\r')
+        {
+            line[--line_length] = '\0';
+        }
+        if (line[strspn(line, " \t")] != '\0')
+        {
+            tasks[(*count)++] = line;
+        }
+    }
+    tasks[*count] = NULL;
+    return tasks;
+}
+
+/**
+ * @brief Implements the `parallel` built-in.
+ *
+ * Usage: `parallel [-j N|MIN:MAX|auto] [-a ADDRESS]... [-t TOKEN] [-w WEIGHT] [-p PRIORITY] [-f FILE] [-T]
+ * [-e LOG] [-v]`.
+ * Tasks are read from FILE, or else from standard input, so the usual form
+ * is `cat jobs | parallel -j 8`. Without agents (`-a`, or the
+ * comma-separated `SHELL_AGENTS` variable) the tasks run as up to N local
+ * children, N defaulting to the number of CPUs. With agents they run
+ * remotely, and any tasks left over when every agent has been lost run
+ * locally. `-T` tags the tasks' stderr: it is passed on in whole lines,
+ * each prefixed with the task's line number and the time, instead of
+ * interleaving at arbitrary bytes. `-e LOG` does the same but appends the
+ * lines to LOG. `-v` reports how many tasks each agent ran and stole.
+ *
+ * An agent shared with other coordinators gives this one a share of its
+ * slots in proportion to `-w WEIGHT` (1 by default), and runs its tasks
+ * ahead of those of lower `-p PRIORITY` (0 by default).
+ *
+ * `-j MIN:MAX` lets the number of local tasks in flight adapt between MIN
+ * and MAX to the pressure the system reports in `/proc/pressure` and to
+ * the rate at which tasks finish; `-j auto` is `-j 1:4N` for N CPUs. With
+ * `-v` each change is reported with its reason.
+ *
+ * @return 0 if every task succeeded, 1 if any failed, 2 on usage errors.
+ */
+int builtin_parallel(char **args)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long jobs = cpus;
+    long minimum = 0;
+    const char *addresses[MAX_ARGS];
+    int agent_count = 0;
+    const char *token = getenv("SHELL_AGENT_TOKEN");
+    const char *file = NULL;
+    const char *log = NULL;
+    int tag = 0;
+    int verbose = 0;
+    long weight = 1;
+    long priority = 0;
+    const char *usage = "usage: parallel [-j N|MIN:MAX|auto] [-a ADDRESS]... [-t TOKEN] [-w WEIGHT] "
+                        "[-p PRIORITY] [-f FILE] [-T] [-e LOG] [-v]\n";
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-v") == 0)
+        {
+            verbose = 1;
+        }
+        else if (strcmp(args[i], "-T") == 0)
+        {
+            tag = 1;
+        }
+        else if (args[i + 1] == NULL || args[i][0] != '-' || args[i][1] == '\0' || args[i][2] != '\0' ||
+                 strchr("jatwpfe", args[i][1]) == NULL)
+        {
+            fputs(usage, stderr);
+            return 2;
+        }
+        else if (args[i][1] == 'j')
+        {
+            // N, MIN:MAX or auto, with 1 <= MIN <= MAX.
+            const char *bound = args[++i];
+            const char *colon = strchr(bound, ':');
+            int valid;
+            minimum = 0;
+            if (strcmp(bound, "auto") == 0)
+            {
+                minimum = 1;
+                jobs = 4 * (cpus > 0 ? cpus : 1);
+                valid = 1;
+            }
+            else if (colon != NULL)
+            {
+                char low[32];
+                size_t length = colon - bound;
+                valid = length < sizeof(low);
+                if (valid)
+                {
+                    memcpy(low, bound, length);
+                    low[length] = '\0';
+                }
+                valid = valid && parse_long(low, &minimum) && parse_long(colon + 1, &jobs) &&
+                        minimum >= 1 && jobs >= minimum;
+            }
+            else
+            {
+                valid = parse_long(bound, &jobs) && jobs >= 1;
+            }
+            if (!valid)
+            {
+                fprintf(stderr, "shell: parallel: invalid job count '%s'\n", bound);
+                fputs(usage, stderr);
+                return 2;
+            }
+        }
+        else if (args[i][1] == 'a' && agent_count < MAX_ARGS)
+        {
+            addresses[agent_count++] = args[++i];
+        }
+        else if (args[i][1] == 't')
+        {
+            token = args[++i];
+        }
+        else if (args[i][1] == 'w' || args[i][1] == 'p')
+        {
+            // The agent serves weights from 1 to AGENT_WEIGHT_MAX; any
+            // priority will do.
+            long *value = (args[i][1] == 'w') ? &weight : &priority;
+            if (!parse_long(args[i + 1], value) ||
+                (value == &weight && (weight < 1 || weight > AGENT_WEIGHT_MAX)))
+            {
+                fprintf(stderr, "shell: parallel: invalid %s '%s'\n", value == &weight ? "weight" : "priority",
+                        args[i + 1]);
+                fputs(usage, stderr);
+                return 2;
+            }
+            i++;
+        }
+        else if (args[i][1] == 'f')
+        {
+            file = args[++i];
+        }
+        else if (args[i][1] == 'e')
+        {
+            log = args[++i];
+        }
+        else
+        {
+            i++;
+        }
+    }
+    if (jobs < 1)
+    {
+        jobs = 1;
+    }
+
+    // Fall back to the agents listed in the environment.
+    char *agent_list = NULL;
+    if (agent_count == 0 && getenv("SHELL_AGENTS") != NULL)
+    {
+        agent_list = strdup(getenv("SHELL_AGENTS"));
+        char *saveptr;
+        for (char *address = agent_list ? strtok_r(agent_list, ",", &saveptr) : NULL;
+             address != NULL && agent_count < MAX_ARGS; address = strtok_r(NULL, ",", &saveptr))
+        {
+            addresses[agent_count++] = address;
+        }
+    }
+    if (agent_count > 0 && (token == NULL || *token == '\0'))
+    {
+        fprintf(stderr, "shell: parallel: agents need a token (-t or SHELL_AGENT_TOKEN)\n");
+        free(agent_list);
+        return 2;
+    }
+
+    int tag_fd = tag ? STDERR_FILENO : -1;
+    if (log != NULL && (tag_fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1)
+    {
+        fprintf(stderr, "shell: parallel: %s: %s\n", log, strerror(errno));
+        free(agent_list);
+        return 2;
+    }
+    int input = STDIN_FILENO;
+    if (file != NULL && (input = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "shell: parallel: %s: %s\n", file, strerror(errno));
+        if (log != NULL)
+        {
+            close(tag_fd);
+        }
+        free(agent_list);
+        return 2;
+    }
+    size_t task_count = 0;
+    char **tasks = parallel_read_tasks(input, &task_count);
+    if (input != STDIN_FILENO)
+    {
+        close(input);
+    }
+    int *status = calloc(task_count ? task_count : 1, sizeof(int));
+    int *indices = malloc((task_count ? task_count : 1) * sizeof(int));
+    remote_agent *agents = calloc(agent_count ? agent_count : 1, sizeof(remote_agent));
+    if (tasks == NULL || status == NULL || indices == NULL || agents == NULL)
+    {
+        perror("malloc failed in parallel");
+        free_args(tasks);
+        free(status);
+        free(indices);
+        free(agents);
+        free(agent_list);
+        if (log != NULL)
+        {
+            close(tag_fd);
+        }
+        return 1;
+    }
+
+    // Connect to and authenticate with every agent; unreachable ones are
+    // reported and left out.
+    int connected = 0;
+    for (int a = 0; a < agent_count; a++)
+    {
+        remote_agent *agent = &agents[a];
+        agent_frame frame;
+        agent->address = addresses[a];
+        agent->queue = malloc((task_count ? task_count : 1) * sizeof(int));
+        agent->queue_capacity = task_count;
+        agent->fd = -1;
+        if (agent->queue != NULL)
+        {
+            agent->fd = agent_socket(agent->address, 0);
+        }
+        if (agent->queue == NULL)
+        {
+            perror("malloc failed in parallel");
+            continue;
+        }
+        if (agent->fd == -1)
+        {
+            fprintf(stderr, "shell: parallel: %s: %s\n", agent->address, strerror(errno));
+            continue;
+        }
+        agent->priority = priority;
+        if (send_frame(agent->fd, "AUTH", 0, weight, token, strlen(token)) == -1 ||
+            frame_wait(&agent->reader, agent->fd, &frame) != 1 || strcmp(frame.kind, "OK") != 0)
+        {
+            fprintf(stderr, "shell: parallel: %s: authentication failed\n", agent->address);
+            close(agent->fd);
+            agent->fd = -1;
+            continue;
+        }
+        agent->slots = (frame.arg >= 1 && frame.arg <= 4096) ? (int)frame.arg : 1;
+        agent->alive = 1;
+        connected++;
+    }
+
+    size_t local_count = task_count;
+    for (size_t i = 0; i < task_count; i++)
+    {
+        indices[i] = (int)i;
+    }
+    if (connected > 0)
+    {
+        local_count = parallel_remote(agents, agent_count, tasks, task_count, status, indices, tag_fd);
+        if (local_count > 0)
+        {
+            fprintf(stderr, "shell: parallel: running %zu remaining tasks locally\n", local_count);
+        }
+    }
+    parallel_adapt adapt;
+    if (minimum > 0)
+    {
+        parallel_adapt_init(&adapt, (int)minimum, (int)jobs, verbose);
+    }
+    parallel_local(tasks, indices, local_count, (int)jobs, status, tag_fd, minimum > 0 ? &adapt : NULL);
+
+    if (verbose)
+    {
+        for (int a = 0; a < agent_count; a++)
+        {
+            fprintf(stderr, "parallel: %s ran %lu tasks, stole %lu\n", agents[a].address, agents[a].ran,
+                    agents[a].stolen);
+        }
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < task_count; i++)
+    {
+        if (status[i] != 0)
+        {
+            result = 1;
+        }
+    }
+    for (int a = 0; a < agent_count; a++)
+    {
+        if (agents[a].fd != -1)
+        {
+            close(agents[a].fd);
+        }
+        free(agents[a].queue);
+        free(agents[a].reader.buffer);
+    }
+    if (log != NULL)
+    {
+        close(tag_fd);
+    }
+    free_args(tasks);
+    free(status);
+    free(indices);
+    free(agents);
+    free(agent_list);
+    return result;
+}
+
+/* ========================================================================= */
+/* STATISTICS                                    */
+/* ========================================================================= */
+
+/**
+ * @brief Prints one cache's counters as a line of the `stats` output.
+ */
+static void print_cache_stats(const char *name, unsigned long lookups, unsigned long hits)
+{
+    double rate = lookups ? 100.0 * hits / lookups : 0.0;
+    printf("%-14s %10lu lookups %10lu hits %6.1f%%\n", name, lookups, hits, rate);
+}
+
+/**
+ * @brief Implements the `stats` built-in.
+ *
+ * Each line shows one of the shell's internal caches with the number of
+ * lookups, how many of them were hits, and the resulting hit rate.
+ *
+ * @return 0 on success.
+ */
+int builtin_stats(char **args)
+{
+    (void)args;
+
+    int regex_entries = 0;
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++)
+    {
+        regex_entries += regex_cache[i].pattern != NULL;
+    }
+
+    print_cache_stats("regex cache", shell_stats.regex_lookups, shell_stats.regex_hits);
+    printf("%-14s %10d of %d entries in use\n", "", regex_entries, REGEX_CACHE_SIZE);
+    print_cache_stats("command hash", shell_stats.command_lookups, shell_stats.command_hits);
+    printf("%-14s %10zu commands remembered\n", "", symbol_table.command_count);
+
+    int script_entries = 0;
+    for (int i = 0; i < SCRIPT_CACHE_SIZE; i++)
+    {
+        script_entries += script_cache[i].path != NULL;
+    }
+
+    print_cache_stats("script cache", shell_stats.script_lookups, shell_stats.script_hits);
+    printf("%-14s %10d of %d entries in use\n", "", script_entries, SCRIPT_CACHE_SIZE);
+    print_cache_stats("parse cache", shell_stats.parse_lookups, shell_stats.parse_hits);
+    printf("%-14s %10d of %d entries in use\n", "", parse_cache.used, PARSE_CACHE_SIZE);
+    printf("%-14s %10lu commands resolved while typing, %lu programs read ahead\n", "speculation",
+           shell_stats.speculative_resolutions, shell_stats.prefetches);
+    printf("%-14s %10lu commands, %lu bytes passed through\n", "output capture", shell_stats.captures,
+           shell_stats.captured_bytes);
+    return 0;
+}
+
+// EOF (End of File) marker.